@@ -4,7 +4,9 @@ package io.actinis.kllama_cpp
 
 import io.actinis.kllama_cpp.data.model.CancellationToken
 import io.actinis.kllama_cpp.data.model.callback.ProgressCallback
+import io.actinis.kllama_cpp.data.model.callback.TokenBytesCallback
 import io.actinis.kllama_cpp.data.model.callback.TokenCallback
+import io.actinis.kllama_cpp.data.model.info.Embeddings
 import io.actinis.kllama_cpp.data.model.info.GenerationStats
 import io.actinis.kllama_cpp.data.model.info.MemoryInfo
 import io.actinis.kllama_cpp.data.model.info.ModelInfo
@@ -13,6 +15,7 @@ import io.actinis.kllama_cpp.data.model.message.MultimodalMessage
 import io.actinis.kllama_cpp.data.model.params.SamplingParams
 import io.actinis.kllama_cpp.data.model.params.SessionParams
 import io.actinis.kllama_cpp.data.model.result.KLlamaResult
+import kotlinx.coroutines.flow.Flow
 
 /**
  * The main wrapper class for the native KLlamaCpp library.
@@ -53,16 +56,112 @@ expect class KLlama {
         cancellationToken: CancellationToken? = null,
     ): KLlamaResult<String>
 
+    /**
+     * Generates a response like [generateResponse], streaming it as UTF-8 bytes in batches
+     * of tokens so that a single native-to-Kotlin call covers several tokens.
+     *
+     * @param tokenBytesCallback Receives the bytes of the tokens generated since the last call.
+     * @param batchTokens Number of tokens collected before the callback is invoked.
+     * @param batchIntervalMs Maximum time tokens are held back before the callback is invoked, 0 for no limit.
+     * @return A [KLlamaResult] containing the full generated response on success.
+     */
+    fun generateResponseStreaming(
+        conversation: List<MultimodalMessage>,
+        tokenBytesCallback: TokenBytesCallback,
+        sampling: SamplingParams = SamplingParams(),
+        batchTokens: Int = 8,
+        batchIntervalMs: Int = 50,
+        progressCallback: ProgressCallback? = null,
+        cancellationToken: CancellationToken? = null,
+    ): KLlamaResult<String>
+
+    /**
+     * Generates a response like [generateResponse] on the session's native worker threads, suspending
+     * instead of blocking the caller's thread. Requests beyond the session's parallel sequences wait in
+     * a native queue. Cancelling the coroutine stops the generation at its next token.
+     *
+     * @return A [KLlamaResult] containing the full generated response on success.
+     */
+    suspend fun generateResponseAsync(
+        conversation: List<MultimodalMessage>,
+        sampling: SamplingParams = SamplingParams(),
+    ): KLlamaResult<String>
+
+    /**
+     * The response as it is generated, on the session's native worker threads. A consumer that falls
+     * behind gets larger chunks, and on a single-sequence session it makes generation wait.
+     * Cancelling the collection stops the generation, errors are thrown as
+     * [io.actinis.kllama_cpp.data.model.result.KLlamaException].
+     *
+     * @param batchTokens Number of tokens collected before the collector is resumed.
+     * @param batchIntervalMs Maximum time tokens are held back before the collector is resumed, 0 for no limit.
+     */
+    fun generateResponseFlow(
+        conversation: List<MultimodalMessage>,
+        sampling: SamplingParams = SamplingParams(),
+        batchTokens: Int = 1,
+        batchIntervalMs: Int = 0,
+    ): Flow<String>
+
     fun isInitialized(): Boolean
     fun getModelInfo(): KLlamaResult<ModelInfo>
     fun getMemoryInfo(): KLlamaResult<MemoryInfo>
     fun getGenerationStats(): KLlamaResult<GenerationStats>
 
+    /**
+     * Snapshots the conversation held in the KV cache. After [restoreState], [generateResponse] with the
+     * same conversation only evaluates the messages added since, instead of the whole history.
+     * Not available with parallel sequences or while a response is being generated.
+     *
+     * @return A [KLlamaResult] containing the snapshot on success.
+     */
+    fun saveState(): KLlamaResult<ByteArray>
+
+    /**
+     * Saves the snapshot to a file, which [restoreStateFile] memory-maps back.
+     */
+    fun saveStateFile(path: String): KLlamaResult<Unit>
+
+    /**
+     * Replaces the KV cache with a snapshot taken with the same model and KV cache types.
+     */
+    fun restoreState(state: ByteArray): KLlamaResult<Unit>
+
+    fun restoreStateFile(path: String): KLlamaResult<Unit>
+
+    /**
+     * Embeds the texts in as few batches as fit, with a session initialized with
+     * [SessionParams.embeddings]. Each input must fit in [SessionParams.batch] tokens.
+     */
+    fun embed(texts: List<String>): KLlamaResult<Embeddings>
+
+    /**
+     * Scores how relevant each document is to the query, with a reranking model in an embeddings
+     * session. Higher is more relevant, the scores are the model's raw logits.
+     */
+    fun rerank(query: String, documents: List<String>): KLlamaResult<FloatArray>
+
     fun close()
 
     companion object {
         fun validateModel(modelPath: String): KLlamaResult<ModelInfo>
         fun validateMmproj(mmprojPath: String): KLlamaResult<Unit>
         fun validateImageData(imageData: ImageData): KLlamaResult<ByteArray>
+
+        /**
+         * Loads a model into the process-wide pool, where it stays loaded with no session using it,
+         * so that [initialize] with the same parameters starts without a cold load.
+         * Blocks until the model is loaded; run it on a background thread.
+         */
+        fun preloadModel(
+            params: SessionParams,
+            progressCallback: ProgressCallback? = null,
+            cancellationToken: CancellationToken? = null,
+        ): KLlamaResult<Unit>
+
+        /**
+         * Releases a pooled model. Sessions using it keep it loaded until they are freed.
+         */
+        fun evictModel(modelPath: String): Boolean
     }
 }
\ No newline at end of file
@@ -3,11 +3,43 @@
 package io.actinis.kllama_cpp.data.model
 
 import kotlin.concurrent.atomics.AtomicBoolean
+import kotlin.concurrent.atomics.AtomicReference
 import kotlin.concurrent.atomics.ExperimentalAtomicApi
 
 class CancellationToken(initialValue: Boolean = false) {
-    val cancelled = AtomicBoolean(initialValue)
-    fun cancel() = cancelled.store(true)
+    // Only written by cancel() and reset(), so that the listeners hear of every cancellation
+    private val cancelled = AtomicBoolean(initialValue)
+
+    // Told about cancel(), so that native code can watch its own flag instead of calling isCancelled()
+    private val listeners = AtomicReference(emptyList<() -> Unit>())
+
+    fun cancel() {
+        cancelled.store(true)
+        listeners.load().forEach { it() }
+    }
+
     fun isCancelled(): Boolean = cancelled.load()
     fun reset() = cancelled.store(false)
+
+    /** Calls [listener] on every [cancel], and right away when the token is already cancelled. */
+    internal fun addListener(listener: () -> Unit) {
+        while (true) {
+            val current = listeners.load()
+            if (listeners.compareAndSet(current, current + listener)) {
+                break
+            }
+        }
+        if (isCancelled()) {
+            listener()
+        }
+    }
+
+    internal fun removeListener(listener: () -> Unit) {
+        while (true) {
+            val current = listeners.load()
+            if (listeners.compareAndSet(current, current - listener)) {
+                break
+            }
+        }
+    }
 }
@@ -0,0 +1,7 @@
+package io.actinis.kllama_cpp.data.model.callback
+
+/**
+ * Receives the UTF-8 bytes of one or more generated tokens. A token may end in the middle
+ * of a multi-byte character, so decode with a streaming decoder rather than per call.
+ */
+typealias TokenBytesCallback = (utf8: ByteArray) -> Unit
@@ -0,0 +1,9 @@
+package io.actinis.kllama_cpp.data.model.info
+
+data class DeviceMemoryInfo(
+    val name: String,
+    val description: String,
+    val modelMemoryMB: Long,
+    val freeMemoryMB: Long,
+    val totalMemoryMB: Long,
+)
@@ -0,0 +1,13 @@
+package io.actinis.kllama_cpp.data.model.info
+
+/**
+ * Unit-length embeddings of the inputs of [io.actinis.kllama_cpp.KLlama.embed], one row of
+ * [dimensions] floats per input, in input order.
+ *
+ * @param buffer A direct `java.nio.FloatBuffer` in native byte order on the JVM, read in place.
+ */
+data class Embeddings(
+    val count: Int,
+    val dimensions: Int,
+    val buffer: Any,
+)
@@ -3,10 +3,41 @@ package io.actinis.kllama_cpp.data.model.info
 import io.actinis.kllama_cpp.data.model.GenerationState
 import io.actinis.kllama_cpp.data.model.params.SamplingParams
 
+/** What the last generation spent its time on. Phase times are in milliseconds. */
 data class GenerationStats(
     val tokensGenerated: Int,
     val tokensPerSecond: Int,
+    /** Seconds since the generation started, chat template application included. */
     val timeElapsed: Float,
+    val samplingMs: Float,
+    val samplingMsPerToken: Float,
+    val templateMs: Float,
+    /** Tokenization, with image decoding and preprocessing. */
+    val tokenizeMs: Float,
+    /** Vision encoder, with the decoding of its embeddings. */
+    val imageEncodeMs: Float,
+    /** Prompt positions evaluated. */
+    val promptTokens: Int,
+    /** Prompt positions reused from the KV cache or the prefix cache. */
+    val cachedPromptTokens: Int,
+    /** Prompt evaluation, without the images. */
+    val promptMs: Float,
+    /** Positions decoded while generating, drafted tokens included. */
+    val decodeTokens: Int,
+    /** Time inside the model while generating. */
+    val decodeMs: Float,
+    /** Time spent in the token callback. */
+    val callbackMs: Float,
+    val timeToFirstTokenMs: Float,
+    /**
+     * Counts of the gaps between tokens. Bucket `i` holds the gaps up to [INTER_TOKEN_BUCKETS_MS]`[i]`,
+     * the last one the slower gaps.
+     */
+    val interTokenHistogram: IntArray,
     val state: GenerationState,
     val defaultSampling: SamplingParams,
-)
\ No newline at end of file
+) {
+    companion object {
+        val INTER_TOKEN_BUCKETS_MS = floatArrayOf(5f, 10f, 20f, 30f, 50f, 75f, 100f, 150f, 200f, 300f, 500f, 1000f)
+    }
+}
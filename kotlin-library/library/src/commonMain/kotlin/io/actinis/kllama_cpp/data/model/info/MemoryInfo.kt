@@ -3,6 +3,11 @@ package io.actinis.kllama_cpp.data.model.info
 data class MemoryInfo(
     val modelMemoryMB: Long,
     val contextMemoryMB: Long,
+    val kvCacheMB: Long,
+    val kvCacheUsedMB: Long,
+    val visionMemoryMB: Long,
     val totalMemoryMB: Long,
+    val residentMemoryMB: Long,
     val availableMemoryMB: Long,
-)
\ No newline at end of file
+    val devices: List<DeviceMemoryInfo>,
+)
@@ -3,6 +3,7 @@ package io.actinis.kllama_cpp.data.model.info
 data class ModelInfo(
     val name: String,
     val architecture: String,
+    val quantization: String,
     val parameterCount: Long,
     val contextSize: Int,
     val supportsVision: Boolean,
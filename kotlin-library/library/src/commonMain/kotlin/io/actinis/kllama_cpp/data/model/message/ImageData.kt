@@ -1,7 +1,18 @@
 package io.actinis.kllama_cpp.data.model.message
 
+/**
+ * An image attached to a [MultimodalMessage].
+ *
+ * @param data Encoded image bytes (PNG, JPEG, BMP), or RGB pixels when [width] and [height] are set.
+ * @param width Width of pre-decoded RGB pixels (3 bytes per pixel), 0 for encoded images.
+ * @param height Height of pre-decoded RGB pixels, 0 for encoded images.
+ * @param buffer A direct `java.nio.ByteBuffer` read in place instead of [data], on the JVM only.
+ */
 data class ImageData(
-    val data: ByteArray,
+    val data: ByteArray = ByteArray(0),
+    val width: Int = 0,
+    val height: Int = 0,
+    val buffer: Any? = null,
 ) {
     override fun equals(other: Any?): Boolean {
         if (this === other) return true
@@ -10,11 +21,18 @@ data class ImageData(
         other as ImageData
 
         if (!data.contentEquals(other.data)) return false
+        if (width != other.width) return false
+        if (height != other.height) return false
+        if (buffer != other.buffer) return false
 
         return true
     }
 
     override fun hashCode(): Int {
-        return data.contentHashCode()
+        var result = data.contentHashCode()
+        result = 31 * result + width
+        result = 31 * result + height
+        result = 31 * result + (buffer?.hashCode() ?: 0)
+        return result
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,12 @@
+package io.actinis.kllama_cpp.data.model.params
+
+enum class KvCacheType {
+    F32,
+    F16,
+    BF16,
+    Q8_0,
+    Q4_0,
+    Q4_1,
+    Q5_0,
+    Q5_1,
+}
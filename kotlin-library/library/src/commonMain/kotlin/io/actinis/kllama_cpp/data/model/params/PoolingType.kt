@@ -0,0 +1,12 @@
+package io.actinis.kllama_cpp.data.model.params
+
+/** How an embeddings session reduces the outputs of an input to one vector. */
+enum class PoolingType {
+    /** What the model file declares. */
+    Model,
+    Mean,
+    Cls,
+    Last,
+    /** Relevance scores of query and document pairs, for reranking models. */
+    Rank,
+}
@@ -11,4 +11,18 @@ data class SamplingParams(
     val frequencyPenalty: Float = 0.0f,
     val presencePenalty: Float = 0.0f,
     val nPredict: Int = -1,
+    /** Seed of the final sampling step, read as unsigned. -1 draws a new one for every generation. */
+    val seed: Int = -1,
+    /** Generation ends before any of these, which are left out of the response. */
+    val stopSequences: List<String> = emptyList(),
+    /** GBNF grammar the output must follow, starting at the `root` rule. */
+    val grammar: String = "",
+    /** JSON schema the output must follow, instead of [grammar]. */
+    val jsonSchema: String = "",
+    /**
+     * Index into [SessionParams.loraAdapters] of the adapter to generate with, -1 for the base model alone.
+     * Switching adapters drops the KV cache, and batched requests on different adapters take turns.
+     */
+    val loraAdapter: Int = -1,
+    val loraScale: Float = 1.0f,
 )
\ No newline at end of file
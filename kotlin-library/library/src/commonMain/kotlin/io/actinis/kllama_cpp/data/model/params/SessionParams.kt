@@ -5,9 +5,53 @@ data class SessionParams(
     val mmprojPath: String = "",
     val contextSize: Int = 4096,
     val batch: Int = 4096,
+    val ubatch: Int = 512,
     val gpuLayers: Int = 0,
+    val mainGpu: Int = 0,
+    val splitMode: SplitMode = SplitMode.Layer,
+    val useMmap: Boolean = true,
+    val useMlock: Boolean = false,
+    val tensorOverrides: List<String> = emptyList(),
+    /** LoRA adapter files loaded once along with the model, picked per request by [SamplingParams.loraAdapter]. */
+    val loraAdapters: List<String> = emptyList(),
     val mmprojUseGpu: Boolean = false,
+    /**
+     * Encodes the next image of a prompt while the embeddings of the previous one are decoded.
+     * Overlaps best with [mmprojUseGpu]. Single sequence only.
+     */
+    val imagePipelining: Boolean = false,
     val threads: Int = 6,
+    val batchThreads: Int = 0,
+    val cpuAffinity: List<Int> = emptyList(),
+    val performanceCoresOnly: Boolean = false,
+    val threadPoll: Int = 50,
+    val sharedThreadPool: Boolean = false,
+    /** What llama.cpp logs: 0 warnings and errors, 1 adds info, 2 adds debug. Process-wide, the last session sets it. */
     val verbosity: Int = 1,
+    val cacheTypeK: KvCacheType = KvCacheType.F16,
+    val cacheTypeV: KvCacheType = KvCacheType.F16,
+    val flashAttention: Boolean = false,
+    val offloadKqv: Boolean = true,
+    val parallelSequences: Int = 1,
+    val prefillChunk: Int = 0,
+    val timeSlicedPrefill: Boolean = false,
+    val prefixCache: Boolean = false,
+    val prefixCacheDir: String = "",
+    /** Memory and [prefixCacheDir] budgets of the prefix snapshots, the least recently used are dropped first. */
+    val prefixCacheMB: Int = 512,
+    val prefixCacheDiskMB: Int = 2048,
+    val draftModelPath: String = "",
+    val ngramDraft: Boolean = false,
+    val draftMax: Int = 8,
+    val contextShift: Boolean = false,
+    val contextKeep: Int = -1,
+    val imageCacheMB: Int = 0,
+    /**
+     * Creates an embeddings-only context for [io.actinis.kllama_cpp.KLlama.embed] and
+     * [io.actinis.kllama_cpp.KLlama.rerank], which can't generate. Up to [parallelSequences]
+     * inputs are packed into each batch, 64 when it's 1.
+     */
+    val embeddings: Boolean = false,
+    val pooling: PoolingType = PoolingType.Model,
     val sampling: SamplingParams = SamplingParams(),
 )
\ No newline at end of file
@@ -0,0 +1,7 @@
+package io.actinis.kllama_cpp.data.model.params
+
+enum class SplitMode {
+    None,
+    Layer,
+    Row,
+}
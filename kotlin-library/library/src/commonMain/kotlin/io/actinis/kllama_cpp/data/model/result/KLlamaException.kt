@@ -0,0 +1,4 @@
+package io.actinis.kllama_cpp.data.model.result
+
+/** A [KLlamaResult.Error] thrown where no result can be returned, as from a flow. */
+class KLlamaException(val code: KLlamaError, message: String) : Exception(message)
@@ -5,7 +5,9 @@ package io.actinis.kllama_cpp
 import co.touchlab.kermit.Logger
 import io.actinis.kllama_cpp.data.model.CancellationToken
 import io.actinis.kllama_cpp.data.model.callback.ProgressCallback
+import io.actinis.kllama_cpp.data.model.callback.TokenBytesCallback
 import io.actinis.kllama_cpp.data.model.callback.TokenCallback
+import io.actinis.kllama_cpp.data.model.info.Embeddings
 import io.actinis.kllama_cpp.data.model.info.GenerationStats
 import io.actinis.kllama_cpp.data.model.info.MemoryInfo
 import io.actinis.kllama_cpp.data.model.info.ModelInfo
@@ -13,7 +15,12 @@ import io.actinis.kllama_cpp.data.model.message.ImageData
 import io.actinis.kllama_cpp.data.model.message.MultimodalMessage
 import io.actinis.kllama_cpp.data.model.params.SamplingParams
 import io.actinis.kllama_cpp.data.model.params.SessionParams
+import io.actinis.kllama_cpp.data.model.result.KLlamaError
+import io.actinis.kllama_cpp.data.model.result.KLlamaException
 import io.actinis.kllama_cpp.data.model.result.KLlamaResult
+import kotlinx.coroutines.channels.Channel
+import kotlinx.coroutines.flow.Flow
+import kotlinx.coroutines.flow.flow
 
 actual class KLlama {
 
@@ -35,11 +42,13 @@ actual class KLlama {
             freeMemory()
         }
         // The native method will create the C++ object and set nativeHandle
-        return initializeNative(
-            params,
-            progressCallback,
-            cancellationToken,
-        )
+        return NativeCancellation(cancellationToken).use { cancellation ->
+            initializeNative(
+                params,
+                progressCallback,
+                cancellation.nativeHandle,
+            )
+        }
     }
 
     actual fun generateResponse(
@@ -49,13 +58,92 @@ actual class KLlama {
         progressCallback: ProgressCallback?,
         cancellationToken: CancellationToken?,
     ): KLlamaResult<String> {
-        return generateResponseNative(
-            conversation.toTypedArray(),
-            sampling,
-            tokenCallback,
-            progressCallback,
-            cancellationToken,
-        )
+        return NativeCancellation(cancellationToken).use { cancellation ->
+            generateResponseNative(
+                conversation.toTypedArray(),
+                sampling,
+                tokenCallback,
+                progressCallback,
+                cancellation.nativeHandle,
+            )
+        }
+    }
+
+    actual fun generateResponseStreaming(
+        conversation: List<MultimodalMessage>,
+        tokenBytesCallback: TokenBytesCallback,
+        sampling: SamplingParams,
+        batchTokens: Int,
+        batchIntervalMs: Int,
+        progressCallback: ProgressCallback?,
+        cancellationToken: CancellationToken?,
+    ): KLlamaResult<String> {
+        return NativeCancellation(cancellationToken).use { cancellation ->
+            generateResponseStreamingNative(
+                conversation.toTypedArray(),
+                sampling,
+                tokenBytesCallback,
+                batchTokens,
+                batchIntervalMs,
+                progressCallback,
+                cancellation.nativeHandle,
+            )
+        }
+    }
+
+    actual suspend fun generateResponseAsync(
+        conversation: List<MultimodalMessage>,
+        sampling: SamplingParams,
+    ): KLlamaResult<String> {
+        return runJob(conversation, sampling, stream = false, batchTokens = 1, batchIntervalMs = 0) {}
+    }
+
+    actual fun generateResponseFlow(
+        conversation: List<MultimodalMessage>,
+        sampling: SamplingParams,
+        batchTokens: Int,
+        batchIntervalMs: Int,
+    ): Flow<String> = flow {
+        val result = runJob(conversation, sampling, stream = true, batchTokens, batchIntervalMs) { emit(it) }
+        if (result is KLlamaResult.Error) {
+            throw KLlamaException(result.code, result.message)
+        }
+    }
+
+    /**
+     * Submits a job to the native worker and drains it whenever the worker signals, so that no thread
+     * waits while it generates. The text of each poll ends on a whole character.
+     */
+    private suspend fun runJob(
+        conversation: List<MultimodalMessage>,
+        sampling: SamplingParams,
+        stream: Boolean,
+        batchTokens: Int,
+        batchIntervalMs: Int,
+        onText: suspend (String) -> Unit,
+    ): KLlamaResult<String> {
+        val ready = Channel<Unit>(Channel.CONFLATED)
+        val job = submitNative(conversation.toTypedArray(), sampling, stream, batchTokens, batchIntervalMs) {
+            ready.trySend(Unit)
+        }
+        if (job == 0L) {
+            return KLlamaResult.Error(KLlamaError.NotInitialized, "KLlama not initialized")
+        }
+        try {
+            while (true) {
+                // Read before polling, text generated before the job finished is then in this poll
+                val result = jobResultNative(job)
+                pollJobNative(job)?.let { onText(it.decodeToString()) }
+                if (result != null) {
+                    return result
+                }
+                ready.receive()
+            }
+        } finally {
+            // Does nothing once the job is finished, stops it when the coroutine was cancelled
+            cancelJobNative(job)
+            releaseJobNative(job)
+        }
     }
 
     actual fun isInitialized(): Boolean {
@@ -74,6 +162,30 @@ actual class KLlama {
         return getGenerationStatsNative()
     }
 
+    actual fun saveState(): KLlamaResult<ByteArray> {
+        return saveStateNative()
+    }
+
+    actual fun saveStateFile(path: String): KLlamaResult<Unit> {
+        return saveStateFileNative(path)
+    }
+
+    actual fun restoreState(state: ByteArray): KLlamaResult<Unit> {
+        return restoreStateNative(state)
+    }
+
+    actual fun restoreStateFile(path: String): KLlamaResult<Unit> {
+        return restoreStateFileNative(path)
+    }
+
+    actual fun embed(texts: List<String>): KLlamaResult<Embeddings> {
+        return embedNative(texts.toTypedArray())
+    }
+
+    actual fun rerank(query: String, documents: List<String>): KLlamaResult<FloatArray> {
+        return rerankNative(query, documents.toTypedArray())
+    }
+
     actual fun close() {
         if (nativeHandle != 0L) {
             freeMemory()
@@ -84,12 +196,32 @@ actual class KLlama {
     private external fun getModelInfoNative(): KLlamaResult<ModelInfo>
     private external fun getMemoryInfoNative(): KLlamaResult<MemoryInfo>
     private external fun getGenerationStatsNative(): KLlamaResult<GenerationStats>
+    private external fun saveStateNative(): KLlamaResult<ByteArray>
+    private external fun saveStateFileNative(path: String): KLlamaResult<Unit>
+    private external fun restoreStateNative(state: ByteArray): KLlamaResult<Unit>
+    private external fun restoreStateFileNative(path: String): KLlamaResult<Unit>
+    private external fun embedNative(texts: Array<String>): KLlamaResult<Embeddings>
+    private external fun rerankNative(query: String, documents: Array<String>): KLlamaResult<FloatArray>
     private external fun freeMemory()
 
+    private external fun submitNative(
+        conversation: Array<MultimodalMessage>,
+        sampling: SamplingParams,
+        stream: Boolean,
+        batchTokens: Int,
+        batchIntervalMs: Int,
+        onReady: () -> Unit,
+    ): Long
+
+    private external fun pollJobNative(job: Long): ByteArray?
+    private external fun jobResultNative(job: Long): KLlamaResult<String>?
+    private external fun cancelJobNative(job: Long)
+    private external fun releaseJobNative(job: Long)
+
     private external fun initializeNative(
         params: SessionParams,
         progressCallback: ProgressCallback?,
-        cancellationToken: CancellationToken?,
+        cancellationToken: Long,
     ): KLlamaResult<Unit>
 
     private external fun generateResponseNative(
@@ -97,7 +229,17 @@ actual class KLlama {
         sampling: SamplingParams,
         tokenCallback: TokenCallback?,
         progressCallback: ProgressCallback?,
-        cancellationToken: CancellationToken?,
+        cancellationToken: Long,
+    ): KLlamaResult<String>
+
+    private external fun generateResponseStreamingNative(
+        conversation: Array<MultimodalMessage>,
+        sampling: SamplingParams,
+        tokenBytesCallback: TokenBytesCallback,
+        batchTokens: Int,
+        batchIntervalMs: Int,
+        progressCallback: ProgressCallback?,
+        cancellationToken: Long,
     ): KLlamaResult<String>
 
     actual companion object {
@@ -115,9 +257,30 @@ actual class KLlama {
             return validateMmprojNative(mmprojPath)
         }
 
+        actual fun preloadModel(
+            params: SessionParams,
+            progressCallback: ProgressCallback?,
+            cancellationToken: CancellationToken?,
+        ): KLlamaResult<Unit> {
+            return NativeCancellation(cancellationToken).use { cancellation ->
+                preloadModelNative(params, progressCallback, cancellation.nativeHandle)
+            }
+        }
+
+        actual fun evictModel(modelPath: String): Boolean {
+            return evictModelNative(modelPath)
+        }
+
         external fun validateImageDataNative(imageData: ImageData): KLlamaResult<ByteArray>
         external fun validateModelNative(modelPath: String): KLlamaResult<ModelInfo>
         external fun validateMmprojNative(mmprojPath: String): KLlamaResult<Unit>
+        external fun preloadModelNative(
+            params: SessionParams,
+            progressCallback: ProgressCallback?,
+            cancellationToken: Long,
+        ): KLlamaResult<Unit>
+
+        external fun evictModelNative(modelPath: String): Boolean
 
         init {
             System.loadLibrary("kllama_cpp_jni")
@@ -0,0 +1,45 @@
+package io.actinis.kllama_cpp
+
+import io.actinis.kllama_cpp.data.model.CancellationToken
+
+/**
+ * A native cancellation flag mirroring [token] for the duration of one native call. Native code
+ * checks the flag, per loaded tensor and per decoded chunk, without calling back into the JVM.
+ */
+internal class NativeCancellation(private val token: CancellationToken?) : AutoCloseable {
+
+    // 0 once closed, guarded by this so that a late cancel() never reaches a released flag
+    private var handle: Long = if (token != null) createNative(token.isCancelled()) else 0L
+
+    private val listener: () -> Unit = {
+        synchronized(this) {
+            if (handle != 0L) {
+                cancelNative(handle)
+            }
+        }
+    }
+
+    init {
+        token?.addListener(listener)
+    }
+
+    /** What the native methods take as their cancellation token, 0 when there is none */
+    val nativeHandle: Long
+        get() = handle
+
+    override fun close() {
+        token?.removeListener(listener)
+        synchronized(this) {
+            if (handle != 0L) {
+                releaseNative(handle)
+                handle = 0L
+            }
+        }
+    }
+
+    companion object {
+        external fun createNative(cancelled: Boolean): Long
+        external fun cancelNative(token: Long)
+        external fun releaseNative(token: Long)
+    }
+}
@@ -0,0 +1,15 @@
+package io.actinis.kllama_cpp.data.model.info
+
+import java.nio.FloatBuffer
+
+/** The embeddings as the direct buffer they're held in. */
+val Embeddings.floatBuffer: FloatBuffer
+    get() = buffer as FloatBuffer
+
+/** Row [index], copied out of the buffer. */
+fun Embeddings.vector(index: Int): FloatArray {
+    require(index in 0 until count) { "Index $index out of $count embeddings" }
+    val vector = FloatArray(dimensions)
+    floatBuffer.duplicate().apply { position(index * dimensions) }.get(vector)
+    return vector
+}
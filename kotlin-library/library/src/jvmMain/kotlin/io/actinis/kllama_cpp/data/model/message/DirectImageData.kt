@@ -0,0 +1,16 @@
+package io.actinis.kllama_cpp.data.model.message
+
+import java.nio.ByteBuffer
+
+/**
+ * Creates an [ImageData] whose bytes, from the buffer's position to its limit, are read
+ * in place by the native side without being copied. Pass [width] and [height] when the
+ * buffer holds RGB pixels, so that decoding is skipped as well.
+ *
+ * The buffer must not be modified while a generation using it is running. generateResponseAsync and
+ * generateResponseFlow, which generate on a native thread of their own, take a copy of it instead.
+ */
+fun directImageData(buffer: ByteBuffer, width: Int = 0, height: Int = 0): ImageData {
+    require(buffer.isDirect) { "Buffer must be a direct ByteBuffer" }
+    return ImageData(width = width, height = height, buffer = buffer)
+}
@@ -11,7 +11,10 @@ else ()
     message(FATAL_ERROR "Failed to detect CPU architecture: CMAKE_SYSTEM_PROCESSOR=${CMAKE_SYSTEM_PROCESSOR}")
 endif ()
 
-if (ARCH_X86)
+if (KLLAMA_CPU_VARIANTS)
+    # The instruction sets are picked at runtime, nothing is enabled from the build host
+    message(STATUS "Building ggml CPU backend variants for ${CMAKE_SYSTEM_PROCESSOR}, chosen at runtime.")
+elseif (ARCH_X86)
     include(CheckCXXCompilerFlag)
     # Check for AVX2 support
     check_cxx_compiler_flag("-mavx2" COMPILER_SUPPORTS_AVX2)
@@ -1,4 +1,5 @@
-if(CMAKE_BUILD_TYPE STREQUAL "Release")
+# Android Gradle builds its release variants as RelWithDebInfo
+if(CMAKE_BUILD_TYPE MATCHES "^(Release|RelWithDebInfo|MinSizeRel)$")
     set(IS_RELEASE ON)
     set(IS_DEBUG OFF)
 
@@ -0,0 +1,544 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "KLlama.h"
+#include "KLlamaModel.h"
+#include "SystemMemory.h"
+#include "logging/logging.h"
+
+#define LOG_TAG "KLlamaCPPBench"
+
+using Clock = std::chrono::steady_clock;
+
+// One point of the sweep, everything that needs its own session
+struct BenchConfig {
+    int32_t batch;
+    int32_t threads;
+    KvCacheType kvType;
+    int32_t concurrency;
+};
+
+struct BenchOptions {
+    std::string modelPath;
+    std::string mmprojPath;
+    std::vector<int32_t> promptLengths{128, 512, 2048};
+    std::vector<int32_t> batchSizes{2048};
+    std::vector<int32_t> threadCounts{6};
+    std::vector<KvCacheType> kvTypes{KvCacheType::F16};
+    std::vector<int32_t> concurrencyLevels{1};
+    int32_t genTokens = 128;
+    int32_t repetitions = 3;
+    int32_t gpuLayers = -1;
+    int32_t images = 2;
+    bool flashAttention = false;
+    std::string outputPath = "kllama_bench.json";
+};
+
+// Timings of one generation
+struct RequestTimings {
+    double ttftMs = 0.0;
+    double decodeMs = 0.0; // First to last token
+    int32_t generatedTokens = 0;
+    std::vector<double> interTokenMs;
+};
+
+// A prompt length (or the multimodal scenario) measured over all repetitions
+struct ScenarioResult {
+    std::string scenario;
+    int32_t promptTokens = 0;
+    int32_t images = 0;
+    int32_t generatedTokens = 0;
+    double ttftMs = 0.0;
+    double prefillTps = 0.0;
+    double decodeTps = 0.0;
+    double interTokenP50Ms = 0.0;
+    double interTokenP99Ms = 0.0;
+};
+
+struct ConfigResult {
+    BenchConfig config;
+    double loadMs = 0.0;
+    size_t peakRssMB = 0;
+    std::vector<ScenarioResult> scenarios;
+    std::string error;
+};
+
+static const char *kvTypeName(const KvCacheType type) {
+    static constexpr const char *names[] = {"f32", "f16", "bf16", "q8_0", "q4_0", "q4_1", "q5_0", "q5_1"};
+    return names[static_cast<int>(type)];
+}
+
+static bool parseKvType(const std::string &name, KvCacheType &type) {
+    for (int i = 0; i <= static_cast<int>(KvCacheType::Q5_1); ++i) {
+        if (name == kvTypeName(static_cast<KvCacheType>(i))) {
+            type = static_cast<KvCacheType>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+static std::vector<std::string> splitList(const std::string &value) {
+    std::vector<std::string> items;
+    std::stringstream stream(value);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+static std::vector<int32_t> parseIntList(const std::string &value) {
+    std::vector<int32_t> values;
+    for (const auto &item: splitList(value)) {
+        values.push_back(std::stoi(item));
+    }
+    return values;
+}
+
+static double percentile(std::vector<double> values, const double fraction) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::ranges::sort(values);
+    const auto index = static_cast<size_t>(fraction * static_cast<double>(values.size() - 1) + 0.5);
+    return values[std::min(index, values.size() - 1)];
+}
+
+static double median(const std::vector<double> &values) {
+    return percentile(values, 0.5);
+}
+
+static double millisSince(const Clock::time_point start, const Clock::time_point end) {
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Conversation for a request of a repetition. They all differ, so that no prompt is reused from the KV cache.
+using ConversationBuilder = std::function<std::vector<MultimodalMessage>(int32_t request, int32_t repetition)>;
+
+// Text of about `tokens` tokens, starting with `tag`
+static std::string buildPrompt(const llama_vocab *vocab, const int32_t tokens, const std::string &tag,
+                               int32_t &actualTokens) {
+    static constexpr const char *sentence =
+            " The committee reviewed the quarterly figures, compared them with last year and wrote a short summary.";
+
+    std::string text = tag + " Summarize the following notes.";
+    std::vector<llama_token> buffer(static_cast<size_t>(tokens) + 64);
+    while (true) {
+        const auto count = llama_tokenize(vocab, text.c_str(), static_cast<int32_t>(text.size()), buffer.data(),
+                                          static_cast<int32_t>(buffer.size()), false, false);
+        if (count < 0 || count >= tokens) {
+            actualTokens = count < 0 ? -count : count;
+            return text;
+        }
+        text += sentence;
+    }
+}
+
+// Fixed synthetic RGB images, the same on every machine. `variant` shifts the pattern.
+static std::vector<std::vector<uint8_t> > buildImages(const int32_t count, const uint32_t size, const int32_t variant) {
+    std::vector<std::vector<uint8_t> > images(count);
+    for (int32_t i = 0; i < count; ++i) {
+        auto &pixels = images[i];
+        const auto shift = static_cast<uint32_t>(variant * 7);
+        pixels.resize(static_cast<size_t>(size) * size * 3);
+        for (uint32_t y = 0; y < size; ++y) {
+            for (uint32_t x = 0; x < size; ++x) {
+                auto *pixel = &pixels[(static_cast<size_t>(y) * size + x) * 3];
+                const bool checker = ((x / 32) + (y / 32) + static_cast<uint32_t>(i)) % 2 == 0;
+                pixel[0] = static_cast<uint8_t>((x + shift) * 255 / size);
+                pixel[1] = static_cast<uint8_t>((y + shift) * 255 / size);
+                pixel[2] = checker ? 200 : static_cast<uint8_t>(40 * i);
+            }
+        }
+    }
+    return images;
+}
+
+static RequestTimings timeGeneration(KLlama &kllama, const std::vector<MultimodalMessage> &conversation,
+                                     const SamplingParams &sampling, std::string &error) {
+    std::vector<Clock::time_point> tokenTimes;
+    tokenTimes.reserve(sampling.nPredict);
+
+    const auto start = Clock::now();
+    const auto result = kllama.generateResponse(conversation, sampling, [&](const std::string &) {
+        tokenTimes.push_back(Clock::now());
+    });
+
+    RequestTimings timings;
+    if (result.isError()) {
+        error = KLlama::errorToString(result.error) + ": " + result.errorMessage;
+        return timings;
+    }
+    if (tokenTimes.empty()) {
+        return timings;
+    }
+
+    timings.ttftMs = millisSince(start, tokenTimes.front());
+    timings.decodeMs = millisSince(tokenTimes.front(), tokenTimes.back());
+    timings.generatedTokens = static_cast<int32_t>(tokenTimes.size());
+    for (size_t i = 1; i < tokenTimes.size(); ++i) {
+        timings.interTokenMs.push_back(millisSince(tokenTimes[i - 1], tokenTimes[i]));
+    }
+    return timings;
+}
+
+// Runs `concurrency` requests at once, repeated, and reduces them to one result
+static ScenarioResult runScenario(KLlama &kllama, const ConversationBuilder &buildConversation,
+                                  const int32_t concurrency, const SamplingParams &sampling,
+                                  const int32_t repetitions, std::string &error) {
+    std::vector<double> ttfts;
+    std::vector<double> decodeRates;
+    std::vector<double> interTokenMs;
+    int32_t generated = 0;
+
+    for (int32_t repetition = 0; repetition < repetitions && error.empty(); ++repetition) {
+        // Every repetition prefills from scratch
+        kllama.reset();
+
+        std::vector<std::vector<MultimodalMessage> > conversations;
+        for (int32_t i = 0; i < concurrency; ++i) {
+            conversations.push_back(buildConversation(i, repetition));
+        }
+
+        std::vector<RequestTimings> timings(conversations.size());
+        std::vector<std::string> errors(conversations.size());
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < conversations.size(); ++i) {
+            workers.emplace_back([&, i] { timings[i] = timeGeneration(kllama, conversations[i], sampling, errors[i]); });
+        }
+        timings[0] = timeGeneration(kllama, conversations[0], sampling, errors[0]);
+        for (auto &worker: workers) {
+            worker.join();
+        }
+
+        // Decode rate of all sequences together
+        double decodeMs = 0.0;
+        int32_t decodedTokens = 0;
+        for (size_t i = 0; i < timings.size(); ++i) {
+            if (!errors[i].empty()) {
+                error = errors[i];
+            }
+            ttfts.push_back(timings[i].ttftMs);
+            decodeMs = std::max(decodeMs, timings[i].decodeMs);
+            decodedTokens += std::max(timings[i].generatedTokens - 1, 0);
+            generated += timings[i].generatedTokens;
+            interTokenMs.insert(interTokenMs.end(), timings[i].interTokenMs.begin(), timings[i].interTokenMs.end());
+        }
+        if (decodeMs > 0.0) {
+            decodeRates.push_back(decodedTokens * 1000.0 / decodeMs);
+        }
+    }
+
+    ScenarioResult result;
+    result.generatedTokens = repetitions > 0 ? generated / repetitions : 0;
+    result.ttftMs = median(ttfts);
+    result.decodeTps = median(decodeRates);
+    result.interTokenP50Ms = percentile(interTokenMs, 0.5);
+    result.interTokenP99Ms = percentile(interTokenMs, 0.99);
+    return result;
+}
+
+static ConfigResult runConfig(const BenchOptions &options, const BenchConfig &config) {
+    ConfigResult result;
+    result.config = config;
+
+    const auto maxPrompt = *std::ranges::max_element(options.promptLengths);
+
+    SessionParams params;
+    params.modelPath = options.modelPath;
+    params.mmprojPath = options.mmprojPath;
+    params.mmprojUseGpu = options.gpuLayers != 0;
+    params.gpuLayers = options.gpuLayers;
+    params.batch = config.batch;
+    params.ubatch = std::min(config.batch, 512);
+    params.threads = config.threads;
+    params.cacheTypeK = config.kvType;
+    params.cacheTypeV = config.kvType;
+    // A quantized V cache needs flash attention
+    params.flashAttention = options.flashAttention || config.kvType > KvCacheType::BF16;
+    params.parallelSequences = config.concurrency;
+    // Room for the longest prompt, the response and the chat template of every sequence
+    params.contextSize = config.concurrency * (maxPrompt + options.genTokens + 256);
+
+    resetPeakResidentMemory();
+
+    KLlama kllama;
+    const auto loadStart = Clock::now();
+    if (const auto init = kllama.initialize(params); init.isError()) {
+        result.error = KLlama::errorToString(init.error) + ": " + init.errorMessage;
+        return result;
+    }
+    result.loadMs = millisSince(loadStart, Clock::now());
+
+    const auto *vocab = llama_model_get_vocab(kllama.getSharedModel()->get());
+
+    SamplingParams sampling;
+    sampling.temperature = 0.0f; // Greedy, so that every run generates the same tokens
+    sampling.repeatPenalty = 1.0f;
+    sampling.nPredict = options.genTokens;
+
+    // The first generation pays for graph allocation and warm-up, keep it out of the numbers
+    {
+        int32_t ignored = 0;
+        std::string error;
+        auto warmUp = sampling;
+        warmUp.nPredict = 4;
+        timeGeneration(kllama, {{MessageRole::User, buildPrompt(vocab, 16, "Warm-up.", ignored), {}}}, warmUp, error);
+    }
+
+    for (const auto promptLength: options.promptLengths) {
+        int32_t promptTokens = 0;
+        const auto buildConversation = [&](const int32_t request, const int32_t repetition) {
+            const auto tag = "Request " + std::to_string(request) + " of run " + std::to_string(repetition) + ".";
+            return std::vector<MultimodalMessage>{
+                {MessageRole::User, buildPrompt(vocab, promptLength, tag, promptTokens), {}}
+            };
+        };
+
+        std::string error;
+        auto scenario = runScenario(kllama, buildConversation, config.concurrency, sampling, options.repetitions,
+                                    error);
+        if (!error.empty()) {
+            result.error = error;
+            return result;
+        }
+        scenario.scenario = "text";
+        scenario.promptTokens = promptTokens;
+        scenario.prefillTps = scenario.ttftMs > 0.0 ? promptTokens * config.concurrency * 1000.0 / scenario.ttftMs : 0.0;
+        LOG_INFO(LOG_TAG, "  %d prompt tokens: TTFT %.1f ms, prefill %.1f tok/s, decode %.1f tok/s, "
+                 "ITL p50 %.2f ms p99 %.2f ms", promptTokens, scenario.ttftMs, scenario.prefillTps,
+                 scenario.decodeTps, scenario.interTokenP50Ms, scenario.interTokenP99Ms);
+        result.scenarios.push_back(scenario);
+    }
+
+    if (!options.mmprojPath.empty() && options.images > 0) {
+        static constexpr uint32_t IMAGE_SIZE = 448;
+        // Borrowed by the messages, so kept for every request of every repetition
+        std::vector<std::vector<std::vector<uint8_t> > > pixels;
+        for (int32_t variant = 0; variant < config.concurrency * options.repetitions; ++variant) {
+            pixels.push_back(buildImages(options.images, IMAGE_SIZE, variant));
+        }
+        const auto buildConversation = [&](const int32_t request, const int32_t repetition) {
+            MultimodalMessage message{MessageRole::User, "Describe these images in detail.", {}};
+            for (const auto &image: pixels[repetition * config.concurrency + request]) {
+                message.images.push_back(ImageData::rgb(image, IMAGE_SIZE, IMAGE_SIZE));
+            }
+            return std::vector{message};
+        };
+
+        std::string error;
+        auto scenario = runScenario(kllama, buildConversation, config.concurrency, sampling, options.repetitions,
+                                    error);
+        if (!error.empty()) {
+            result.error = error;
+            return result;
+        }
+        scenario.scenario = "multimodal";
+        scenario.images = options.images;
+        LOG_INFO(LOG_TAG, "  %d images: TTFT %.1f ms, decode %.1f tok/s", options.images, scenario.ttftMs,
+                 scenario.decodeTps);
+        result.scenarios.push_back(scenario);
+    }
+
+    result.peakRssMB = peakResidentMemoryBytes() / (1024 * 1024);
+    return result;
+}
+
+static std::string jsonString(const std::string &value) {
+    std::string escaped = "\"";
+    for (const char c: value) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped + "\"";
+}
+
+static void writeJson(std::ostream &out, const BenchOptions &options, const std::vector<ConfigResult> &results) {
+    out << "{\n";
+    out << "  \"model\": " << jsonString(options.modelPath) << ",\n";
+    out << "  \"mmproj\": " << jsonString(options.mmprojPath) << ",\n";
+    out << "  \"gen_tokens\": " << options.genTokens << ",\n";
+    out << "  \"repetitions\": " << options.repetitions << ",\n";
+    out << "  \"configs\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const auto &result = results[i];
+        out << (i ? ",\n" : "\n") << "    {\n";
+        out << "      \"batch\": " << result.config.batch << ",\n";
+        out << "      \"threads\": " << result.config.threads << ",\n";
+        out << "      \"kv_type\": \"" << kvTypeName(result.config.kvType) << "\",\n";
+        out << "      \"concurrency\": " << result.config.concurrency << ",\n";
+        out << "      \"load_ms\": " << result.loadMs << ",\n";
+        out << "      \"peak_rss_mb\": " << result.peakRssMB << ",\n";
+        if (!result.error.empty()) {
+            out << "      \"error\": " << jsonString(result.error) << ",\n";
+        }
+        out << "      \"scenarios\": [";
+        for (size_t j = 0; j < result.scenarios.size(); ++j) {
+            const auto &scenario = result.scenarios[j];
+            out << (j ? ",\n" : "\n") << "        {";
+            out << "\"scenario\": \"" << scenario.scenario << "\", ";
+            out << "\"prompt_tokens\": " << scenario.promptTokens << ", ";
+            out << "\"images\": " << scenario.images << ", ";
+            out << "\"generated_tokens\": " << scenario.generatedTokens << ", ";
+            out << "\"ttft_ms\": " << scenario.ttftMs << ", ";
+            out << "\"prefill_tps\": " << scenario.prefillTps << ", ";
+            out << "\"decode_tps\": " << scenario.decodeTps << ", ";
+            out << "\"itl_p50_ms\": " << scenario.interTokenP50Ms << ", ";
+            out << "\"itl_p99_ms\": " << scenario.interTokenP99Ms << "}";
+        }
+        out << "\n      ]\n    }";
+    }
+    out << "\n  ]\n}\n";
+}
+
+void print_usage(int argc, char **argv) {
+    (void) argc;
+    printf("Usage: %s -m <model.gguf> [options]\n\n", argv[0]);
+    printf("Runs every combination of the lists below and writes the results as JSON.\n\n");
+    printf("Options:\n");
+    printf("  -m, --model <path>         Path to the GGUF language model file (required).\n");
+    printf("  --mmproj <path>            Multimodal projector, adds the multimodal scenario.\n");
+    printf("  --prompt-lengths <list>    Prompt lengths in tokens (default: 128,512,2048).\n");
+    printf("  --batch-sizes <list>       Logical batch sizes (default: 2048).\n");
+    printf("  --threads <list>           Thread counts (default: 6).\n");
+    printf("  --kv-types <list>          KV cache types: f32, f16, bf16, q8_0, q4_0, q4_1, q5_0, q5_1 (default: f16).\n");
+    printf("  --concurrency <list>       Simultaneous requests, batched in one session (default: 1).\n");
+    printf("  --gen-tokens <n>           Tokens generated per request (default: 128).\n");
+    printf("  --repetitions <n>          Runs per measurement (default: 3).\n");
+    printf("  --gpu-layers <n>           Layers to offload, -1 for all (default: -1).\n");
+    printf("  --images <n>               Images in the multimodal scenario (default: 2).\n");
+    printf("  --flash-attn               Enable flash attention.\n");
+    printf("  -o, --output <path>        JSON output file (default: kllama_bench.json).\n");
+    printf("  -h, --help                 Show this help message.\n");
+    printf("\nExample:\n");
+    printf("  %s -m model.gguf --prompt-lengths 256,4096 --threads 4,8 --kv-types f16,q8_0\n", argv[0]);
+}
+
+int main(int argc, char **argv) {
+    if (argc <= 1) {
+        print_usage(argc, argv);
+        return EXIT_FAILURE;
+    }
+
+    BenchOptions options;
+
+    // --- Argument Parsing ---
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            const bool hasValue = i + 1 < argc;
+            if (arg == "-h" || arg == "--help") {
+                print_usage(argc, argv);
+                return EXIT_SUCCESS;
+            }
+            if ((arg == "-m" || arg == "--model") && hasValue) {
+                options.modelPath = argv[++i];
+            } else if (arg == "--mmproj" && hasValue) {
+                options.mmprojPath = argv[++i];
+            } else if (arg == "--prompt-lengths" && hasValue) {
+                options.promptLengths = parseIntList(argv[++i]);
+            } else if (arg == "--batch-sizes" && hasValue) {
+                options.batchSizes = parseIntList(argv[++i]);
+            } else if (arg == "--threads" && hasValue) {
+                options.threadCounts = parseIntList(argv[++i]);
+            } else if (arg == "--kv-types" && hasValue) {
+                options.kvTypes.clear();
+                for (const auto &name: splitList(argv[++i])) {
+                    KvCacheType type{};
+                    if (!parseKvType(name, type)) {
+                        LOG_ERROR(LOG_TAG, "Unknown KV cache type: %s", name.c_str());
+                        return EXIT_FAILURE;
+                    }
+                    options.kvTypes.push_back(type);
+                }
+            } else if (arg == "--concurrency" && hasValue) {
+                options.concurrencyLevels = parseIntList(argv[++i]);
+            } else if (arg == "--gen-tokens" && hasValue) {
+                options.genTokens = std::stoi(argv[++i]);
+            } else if (arg == "--repetitions" && hasValue) {
+                options.repetitions = std::stoi(argv[++i]);
+            } else if (arg == "--gpu-layers" && hasValue) {
+                options.gpuLayers = std::stoi(argv[++i]);
+            } else if (arg == "--images" && hasValue) {
+                options.images = std::stoi(argv[++i]);
+            } else if (arg == "--flash-attn") {
+                options.flashAttention = true;
+            } else if ((arg == "-o" || arg == "--output") && hasValue) {
+                options.outputPath = argv[++i];
+            } else {
+                LOG_ERROR(LOG_TAG, "Unknown argument: %s", arg.c_str());
+                print_usage(argc, argv);
+                return EXIT_FAILURE;
+            }
+        }
+    } catch (const std::exception &e) {
+        LOG_ERROR(LOG_TAG, "Invalid argument: %s", e.what());
+        return EXIT_FAILURE;
+    }
+
+    // --- Argument Validation ---
+    if (options.modelPath.empty()) {
+        LOG_ERROR(LOG_TAG, "Missing required argument: --model is required.");
+        print_usage(argc, argv);
+        return EXIT_FAILURE;
+    }
+    if (options.promptLengths.empty() || options.batchSizes.empty() || options.threadCounts.empty() ||
+        options.kvTypes.empty() || options.concurrencyLevels.empty() || options.genTokens <= 0 ||
+        options.repetitions <= 0) {
+        LOG_ERROR(LOG_TAG, "Every list needs at least one value, token and repetition counts must be positive.");
+        return EXIT_FAILURE;
+    }
+
+    // --- Sweep ---
+    std::vector<ConfigResult> results;
+    for (const auto batch: options.batchSizes) {
+        for (const auto threads: options.threadCounts) {
+            for (const auto kvType: options.kvTypes) {
+                for (const auto concurrency: options.concurrencyLevels) {
+                    const BenchConfig config{batch, threads, kvType, concurrency};
+                    LOG_INFO(LOG_TAG, "Batch %d, %d threads, %s KV cache, %d concurrent", batch, threads,
+                             kvTypeName(kvType), concurrency);
+
+                    auto result = runConfig(options, config);
+                    if (!result.error.empty()) {
+                        LOG_ERROR(LOG_TAG, "  Failed: %s", result.error.c_str());
+                    } else {
+                        LOG_INFO(LOG_TAG, "  Loaded in %.0f ms, peak RSS %zu MB", result.loadMs, result.peakRssMB);
+                    }
+                    results.push_back(std::move(result));
+                }
+            }
+        }
+    }
+
+    std::ofstream output(options.outputPath);
+    if (!output) {
+        LOG_ERROR(LOG_TAG, "Can't write %s", options.outputPath.c_str());
+        return EXIT_FAILURE;
+    }
+    writeJson(output, options, results);
+    LOG_INFO(LOG_TAG, "Results written to %s", options.outputPath.c_str());
+
+    const bool failed = std::ranges::any_of(results, [](const ConfigResult &result) { return !result.error.empty(); });
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
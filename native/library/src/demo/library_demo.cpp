@@ -8,6 +8,7 @@
 #include <cctype>
 
 #include "KLlama.h"
+#include "Tracing.h"
 #include "logging/logging.h"
 
 #define LOG_TAG "KLlamaCPPDemo"
@@ -62,6 +63,7 @@ void print_usage(int argc, char **argv) {
     printf("  --repeat-last-n <n>        Last n tokens to apply repeat penalty (default: 64).\n");
     printf("  --max-tokens <n>           Maximum tokens to generate (default: unlimited).\n");
     printf("  --validate-model           Validate model file without full initialization.\n");
+    printf("  --trace <path>             Write a Chrome trace of the run (builds with KLLAMA_TRACING).\n");
     printf("  -h, --help                 Show this help message.\n");
     printf("\nExample:\n");
     printf("  %s -m model.gguf -p \"Hello, how are you?\"\n", argv[0]);
@@ -82,6 +84,7 @@ int main(int argc, char **argv) {
     std::string prompt;
     std::vector<std::string> image_paths;
     bool validateOnly = false;
+    std::string tracePath;
 
     // --- Argument Parsing ---
     for (int i = 1; i < argc; ++i) {
@@ -116,6 +119,8 @@ int main(int argc, char **argv) {
             if (i + 1 < argc) params.sampling.nPredict = std::stoi(argv[++i]);
         } else if (arg == "--validate-model") {
             validateOnly = true;
+        } else if (arg == "--trace") {
+            if (i + 1 < argc) tracePath = argv[++i];
         } else {
             LOG_ERROR(LOG_TAG, "Unknown argument: %s", arg.c_str());
             print_usage(argc, argv);
@@ -143,6 +148,7 @@ int main(int argc, char **argv) {
         const auto &info = modelValidation.value;
         LOG_INFO(LOG_TAG, "Model validation successful!");
         LOG_INFO(LOG_TAG, "  Name: %s", info.name.c_str());
+        LOG_INFO(LOG_TAG, "  Architecture: %s (%s)", info.architecture.c_str(), info.quantization.c_str());
         LOG_INFO(LOG_TAG, "  Parameters: %lld", info.parameterCount);
         LOG_INFO(LOG_TAG, "  Context size: %d", info.contextSize);
         LOG_INFO(LOG_TAG, "  Supports vision: %s", info.supportsVision ? "yes" : "no");
@@ -172,6 +178,12 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
+    if (!tracePath.empty()) {
+        if (auto traceResult = Tracing::start(tracePath); traceResult.isError()) {
+            LOG_WARN(LOG_TAG, "Tracing not started: %s", traceResult.errorMessage.c_str());
+        }
+    }
+
     // --- KLlama Initialization ---
     LOG_INFO(LOG_TAG, "Initializing KLlama with model: %s", params.modelPath.c_str());
     if (!params.mmprojPath.empty()) {
@@ -200,6 +212,7 @@ int main(int argc, char **argv) {
         const auto &info = modelInfoResult.value;
         LOG_INFO(LOG_TAG, "Model loaded successfully:");
         LOG_INFO(LOG_TAG, "  Name: %s", info.name.c_str());
+        LOG_INFO(LOG_TAG, "  Architecture: %s (%s)", info.architecture.c_str(), info.quantization.c_str());
         LOG_INFO(LOG_TAG, "  Parameters: %lld", info.parameterCount);
         LOG_INFO(LOG_TAG, "  Context size: %d", info.contextSize);
         LOG_INFO(LOG_TAG, "  Supports vision: %s", info.supportsVision ? "yes" : "no");
@@ -291,6 +304,14 @@ int main(int argc, char **argv) {
         LOG_INFO(LOG_TAG, "  Tokens generated: %d", stats.tokensGenerated);
         LOG_INFO(LOG_TAG, "  Time elapsed: %.2f seconds", stats.timeElapsed);
         LOG_INFO(LOG_TAG, "  Tokens per second: %d", stats.tokensPerSecond);
+        LOG_INFO(LOG_TAG, "  Sampling: %.2f ms (%.3f ms per token)", stats.samplingMs, stats.samplingMsPerToken);
+        LOG_INFO(LOG_TAG, "  Template: %.2f ms, tokenize: %.2f ms, image encode: %.2f ms", stats.templateMs,
+                 stats.tokenizeMs, stats.imageEncodeMs);
+        LOG_INFO(LOG_TAG, "  Prompt: %d tokens in %.2f ms, %d cached", stats.promptTokens, stats.promptMs,
+                 stats.cachedPromptTokens);
+        LOG_INFO(LOG_TAG, "  Decode: %d tokens in %.2f ms, callbacks: %.2f ms", stats.decodeTokens, stats.decodeMs,
+                 stats.callbackMs);
+        LOG_INFO(LOG_TAG, "  Time to first token: %.2f ms", stats.timeToFirstTokenMs);
     }
 
     // Display memory usage
@@ -300,10 +321,23 @@ int main(int argc, char **argv) {
         LOG_INFO(LOG_TAG, "Memory usage:");
         LOG_INFO(LOG_TAG, "  Model memory: %zu MB", memory.modelMemoryMB);
         LOG_INFO(LOG_TAG, "  Context memory: %zu MB", memory.contextMemoryMB);
+        LOG_INFO(LOG_TAG, "  KV cache: %zu MB (%zu MB used)", memory.kvCacheMB, memory.kvCacheUsedMB);
+        LOG_INFO(LOG_TAG, "  Vision memory: %zu MB", memory.visionMemoryMB);
         LOG_INFO(LOG_TAG, "  Total memory: %zu MB", memory.totalMemoryMB);
+        LOG_INFO(LOG_TAG, "  Resident: %zu MB, available: %zu MB", memory.residentMemoryMB, memory.availableMemoryMB);
+        for (const auto &device: memory.devices) {
+            LOG_INFO(LOG_TAG, "  %s: %zu MB weights, %zu / %zu MB free", device.name.c_str(), device.modelMemoryMB,
+                     device.freeMemoryMB, device.totalMemoryMB);
+        }
     }
 
     std::cout << "\n--- End of Response ---" << std::endl;
 
+    if (!tracePath.empty()) {
+        if (auto traceResult = Tracing::stop(); traceResult.isSuccess()) {
+            LOG_INFO(LOG_TAG, "Trace written to %s", tracePath.c_str());
+        }
+    }
+
     return EXIT_SUCCESS;
 }
\ No newline at end of file
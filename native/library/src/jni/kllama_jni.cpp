@@ -3,8 +3,18 @@
 #include <vector>
 #include <memory>
 #include <functional>
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <limits>
+#include <utility>
+#include <cstring>
 
 #include "KLlama.h"
+#include "GenerationWorker.h"
+#include "ModelPool.h"
+#include "Tracing.h"
+#include "Utils.h"
 #include "logging/logging.h"
 
 #define LOG_TAG "KLlamaJNI"
@@ -16,8 +26,207 @@ struct JniContext {
 
 static JniContext g_jni_context;
 
-// Attaches the current thread to the JVM and returns a JNIEnv*.
-// Must be matched with a call to detach_thread().
+// Kotlin enum constant names, in the C++ enum order
+static constexpr std::pair<KLlamaError, const char *> k_error_names[] = {
+    {KLlamaError::None, "None"},
+    {KLlamaError::ModelNotFound, "ModelNotFound"},
+    {KLlamaError::ModelLoadFailed, "ModelLoadFailed"},
+    {KLlamaError::ModelInvalid, "ModelInvalid"},
+    {KLlamaError::MmprojNotFound, "MmprojNotFound"},
+    {KLlamaError::MmprojLoadFailed, "MmprojLoadFailed"},
+    {KLlamaError::MmprojInvalid, "MmprojInvalid"},
+    {KLlamaError::ContextInitFailed, "ContextInitFailed"},
+    {KLlamaError::InsufficientMemory, "InsufficientMemory"},
+    {KLlamaError::TokenizationFailed, "TokenizationFailed"},
+    {KLlamaError::EvaluationFailed, "EvaluationFailed"},
+    {KLlamaError::SamplingFailed, "SamplingFailed"},
+    {KLlamaError::ImageProcessingFailed, "ImageProcessingFailed"},
+    {KLlamaError::InvalidParameters, "InvalidParameters"},
+    {KLlamaError::NotInitialized, "NotInitialized"},
+    {KLlamaError::AlreadyInitialized, "AlreadyInitialized"},
+    {KLlamaError::OperationCancelled, "OperationCancelled"},
+    {KLlamaError::UnknownError, "UnknownError"},
+};
+
+static constexpr const char *k_generation_state_names[] = {
+    "Idle", "Initializing", "TokenizingPrompt", "ProcessingImages", "Generating", "Finished", "Cancelled", "Error"
+};
+
+struct SamplingParamsFields {
+    jfieldID temperature, topP, topK, minP, typicalP, repeatPenalty, repeatLastN, frequencyPenalty, presencePenalty,
+            nPredict, seed, stopSequences, grammar, jsonSchema, loraAdapter, loraScale;
+};
+
+struct SessionParamsFields {
+    jfieldID modelPath, mmprojPath, contextSize, batch, ubatch, gpuLayers, mainGpu, splitMode, useMmap, useMlock,
+            tensorOverrides, loraAdapters, mmprojUseGpu, imagePipelining, threads, batchThreads, cpuAffinity, performanceCoresOnly,
+            threadPoll, sharedThreadPool, verbosity, cacheTypeK, cacheTypeV, flashAttention, offloadKqv,
+            parallelSequences, prefillChunk, timeSlicedPrefill, prefixCache, prefixCacheDir, prefixCacheMB,
+            prefixCacheDiskMB, draftModelPath, ngramDraft, draftMax, contextShift, contextKeep, imageCacheMB, embeddings,
+            pooling, sampling;
+};
+
+// Every class (as a global ref), method and field the bridge uses, resolved once in JNI_OnLoad
+struct JniCache {
+    std::vector<jobject> global_refs; // Released in JNI_OnUnload
+
+    jclass function0_cls = nullptr;
+    jmethodID function0_invoke = nullptr;
+    jclass function1_cls = nullptr;
+    jmethodID function1_invoke = nullptr;
+    jclass function2_cls = nullptr;
+    jmethodID function2_invoke = nullptr;
+    jclass float_cls = nullptr;
+    jmethodID float_value_of = nullptr;
+    jmethodID integer_int_value = nullptr;
+    jobject unit_instance = nullptr;
+    jclass array_list_cls = nullptr;
+    jmethodID array_list_ctor = nullptr;
+    jmethodID list_add = nullptr;
+    jmethodID list_size = nullptr;
+    jmethodID list_get = nullptr;
+    jmethodID enum_ordinal = nullptr;
+
+    jfieldID native_handle = nullptr;
+
+    jclass success_cls = nullptr;
+    jmethodID success_ctor = nullptr;
+    jclass error_cls = nullptr;
+    jmethodID error_ctor = nullptr;
+    jobject error_values[std::size(k_error_names)] = {};
+
+    jclass model_info_cls = nullptr;
+    jmethodID model_info_ctor = nullptr;
+    jclass memory_info_cls = nullptr;
+    jmethodID memory_info_ctor = nullptr;
+    jclass device_memory_info_cls = nullptr;
+    jmethodID device_memory_info_ctor = nullptr;
+    jclass generation_stats_cls = nullptr;
+    jmethodID generation_stats_ctor = nullptr;
+    jobject generation_state_values[std::size(k_generation_state_names)] = {};
+    jclass sampling_params_cls = nullptr;
+    jmethodID sampling_params_ctor = nullptr;
+    jclass embeddings_cls = nullptr;
+    jmethodID embeddings_ctor = nullptr;
+
+    SamplingParamsFields sampling_fields{};
+    SessionParamsFields session_fields{};
+
+    jmethodID message_get_role = nullptr;
+    jmethodID message_get_content = nullptr;
+    jmethodID message_get_images = nullptr;
+    jmethodID image_data_get_data = nullptr;
+    jmethodID image_data_get_width = nullptr;
+    jmethodID image_data_get_height = nullptr;
+    jmethodID image_data_get_buffer = nullptr;
+    jclass byte_buffer_cls = nullptr;
+    jmethodID buffer_position = nullptr;
+    jmethodID buffer_limit = nullptr;
+    jmethodID byte_buffer_allocate_direct = nullptr;
+    jmethodID byte_buffer_order = nullptr;
+    jmethodID byte_buffer_as_float_buffer = nullptr;
+    jobject native_byte_order = nullptr;
+};
+
+static JniCache g_jni_cache;
+
+// Resolves what JniCache holds. A failed lookup leaves a Java exception pending, which no other JNI call may run
+// with, so after the first one every lookup returns null without touching the JVM.
+class JniLookup {
+public:
+    explicit JniLookup(JNIEnv *env) : env(env) {
+    }
+
+    jclass find_class(const char *name) {
+        if (failed) return nullptr;
+        const auto local = env->FindClass(name);
+        if (!check(local, "class", name)) return nullptr;
+        const auto global = static_cast<jclass>(env->NewGlobalRef(local));
+        env->DeleteLocalRef(local);
+        g_jni_cache.global_refs.push_back(global);
+        return global;
+    }
+
+    jmethodID method(jclass cls, const char *name, const char *sig) {
+        if (failed) return nullptr;
+        const auto method = env->GetMethodID(cls, name, sig);
+        return check(method, "method", name) ? method : nullptr;
+    }
+
+    jmethodID static_method(jclass cls, const char *name, const char *sig) {
+        if (failed) return nullptr;
+        const auto method = env->GetStaticMethodID(cls, name, sig);
+        return check(method, "static method", name) ? method : nullptr;
+    }
+
+    jfieldID field(jclass cls, const char *name, const char *sig) {
+        if (failed) return nullptr;
+        const auto field = env->GetFieldID(cls, name, sig);
+        return check(field, "field", name) ? field : nullptr;
+    }
+
+    // The object in a static field, as a global ref
+    jobject static_object(jclass cls, const char *name, const char *sig) {
+        if (failed) return nullptr;
+        const auto field = env->GetStaticFieldID(cls, name, sig);
+        if (!check(field, "static field", name)) return nullptr;
+        return to_global(env->GetStaticObjectField(cls, field), name);
+    }
+
+    // What a static method without arguments returns, as a global ref
+    jobject call_static_object(jclass cls, jmethodID method, const char *name) {
+        if (failed) return nullptr;
+        return to_global(env->CallStaticObjectMethod(cls, method), name);
+    }
+
+    // Clears the exception of a failed lookup. True when everything was found.
+    bool finish() {
+        if (env->ExceptionCheck()) {
+            env->ExceptionDescribe();
+            env->ExceptionClear();
+            failed = true;
+        }
+        return !failed;
+    }
+
+private:
+    bool check(const void *found, const char *kind, const char *name) {
+        if (!found || env->ExceptionCheck()) {
+            LOG_ERROR(LOG_TAG, "Could not find %s: %s", kind, name);
+            failed = true;
+        }
+        return !failed;
+    }
+
+    jobject to_global(jobject local, const char *name) {
+        if (!check(local, "object", name)) return nullptr;
+        const auto global = env->NewGlobalRef(local);
+        env->DeleteLocalRef(local);
+        g_jni_cache.global_refs.push_back(global);
+        return global;
+    }
+
+    JNIEnv *env;
+    bool failed = false;
+};
+
+static bool init_jni_cache(JNIEnv *env);
+
+// Threads attached by attach_thread() stay attached until they exit, so that native
+// threads calling back into Kotlin don't pay for AttachCurrentThread on every token.
+struct ThreadAttachment {
+    bool attached = false;
+
+    ~ThreadAttachment() {
+        if (attached && g_jni_context.jvm) {
+            g_jni_context.jvm->DetachCurrentThread();
+        }
+    }
+};
+
+static thread_local ThreadAttachment t_attachment;
+
+// Returns the JNIEnv of the current thread, attaching it to the JVM if needed.
 static JNIEnv *attach_thread() {
     JNIEnv *env = nullptr;
     if (g_jni_context.jvm->GetEnv(reinterpret_cast<void **>(&env), JNI_VERSION_1_6) == JNI_EDETACHED) {
@@ -25,31 +234,17 @@ static JNIEnv *attach_thread() {
             LOG_ERROR(LOG_TAG, "Failed to attach current thread to JVM");
             return nullptr;
         }
+        t_attachment.attached = true;
     }
     return env;
 }
 
-// Detaches the current thread from the JVM.
-static void detach_thread() {
-    if (g_jni_context.jvm) {
-        // Check if attached before detaching to avoid errors
-        void *env_ptr;
-        if (g_jni_context.jvm->GetEnv(&env_ptr, JNI_VERSION_1_6) != JNI_EDETACHED) {
-            g_jni_context.jvm->DetachCurrentThread();
-        }
-    }
-}
-
 static KLlama *get_handle(JNIEnv *env, jobject thiz) {
-    const auto cls = env->GetObjectClass(thiz);
-    const auto fid = env->GetFieldID(cls, "nativeHandle", "J");
-    return reinterpret_cast<KLlama *>(env->GetLongField(thiz, fid));
+    return reinterpret_cast<KLlama *>(env->GetLongField(thiz, g_jni_cache.native_handle));
 }
 
 static void set_handle(JNIEnv *env, jobject thiz, KLlama *kllama) {
-    const auto cls = env->GetObjectClass(thiz);
-    const auto fid = env->GetFieldID(cls, "nativeHandle", "J");
-    env->SetLongField(thiz, fid, reinterpret_cast<jlong>(kllama));
+    env->SetLongField(thiz, g_jni_cache.native_handle, reinterpret_cast<jlong>(kllama));
 }
 
 class JniString {
@@ -83,6 +278,12 @@ jobject to_java_result(JNIEnv *env, const KLlamaResult<void> &result);
 
 jobject to_java_model_info(JNIEnv *env, const ModelInfo &info);
 
+jobject to_java_byte_array(JNIEnv *env, const std::vector<uint8_t> &data);
+
+jobject to_java_embeddings(JNIEnv *env, const std::vector<float> &data, jint count);
+
+jobject to_java_float_array(JNIEnv *env, const std::vector<float> &data);
+
 jobject to_java_memory_info(JNIEnv *env, const MemoryInfo &info);
 
 jobject to_java_generation_stats(JNIEnv *env, const GenerationStats &stats);
@@ -95,22 +296,17 @@ SessionParams from_java_session_params(JNIEnv *env, jobject j_params);
 
 std::vector<MultimodalMessage> from_java_multimodal_message_array(JNIEnv *env, jobjectArray j_conversation);
 
+std::vector<std::string> from_java_string_array(JNIEnv *env, jobjectArray j_strings);
+
+ImageData from_java_image_data(JNIEnv *env, jobject j_image_data);
+
 struct JniCallback {
     jobject callback_ref = nullptr;
     jmethodID invoke_method = nullptr;
 
-    JniCallback(JNIEnv *env, jobject callback, const char *class_name, const char *method_signature) {
+    JniCallback(JNIEnv *env, jobject callback, jmethodID invoke_method) : invoke_method(invoke_method) {
         if (callback) {
             callback_ref = env->NewGlobalRef(callback);
-            if (const auto cls = env->FindClass(class_name)) {
-                invoke_method = env->GetMethodID(cls, "invoke", method_signature);
-                if (!invoke_method) {
-                    LOG_ERROR(LOG_TAG, "Could not find invoke method with signature %s on class %s", method_signature,
-                              class_name);
-                }
-            } else {
-                LOG_ERROR(LOG_TAG, "Could not find class: %s", class_name);
-            }
         }
     }
 
@@ -118,7 +314,6 @@ struct JniCallback {
         if (callback_ref) {
             if (JNIEnv *env = attach_thread()) {
                 env->DeleteGlobalRef(callback_ref);
-                detach_thread();
             }
         }
     }
@@ -137,7 +332,6 @@ struct JniCallback {
             if (callback_ref) {
                 if (JNIEnv *env = attach_thread()) {
                     env->DeleteGlobalRef(callback_ref);
-                    detach_thread();
                 }
             }
             callback_ref = other.callback_ref;
@@ -148,45 +342,10 @@ struct JniCallback {
     }
 };
 
-// Wraps a Kotlin CancellationToken jobject for use in C++.
-class JniCancellationToken : public CancellationToken {
-public:
-    JniCancellationToken(JNIEnv *env, jobject j_token) {
-        if (!j_token) return;
-        j_token_ref = env->NewGlobalRef(j_token);
-        const auto cls = env->GetObjectClass(j_token_ref);
-        is_cancelled_method = env->GetMethodID(cls, "isCancelled", "()Z");
-    }
-
-    ~JniCancellationToken() {
-        if (j_token_ref) {
-            if (JNIEnv *env = attach_thread()) {
-                env->DeleteGlobalRef(j_token_ref);
-                detach_thread();
-            }
-        }
-    }
-
-    // FIX: Removed 'override' as the base CancellationToken::isCancelled is not virtual.
-    [[nodiscard]] bool isCancelled() const {
-        if (!j_token_ref || !is_cancelled_method) return false;
-        JNIEnv *env = attach_thread();
-        if (!env) return false;
-        const auto result = env->CallBooleanMethod(j_token_ref, is_cancelled_method);
-        detach_thread();
-        return result;
-    }
-
-private:
-    jobject j_token_ref = nullptr;
-    jmethodID is_cancelled_method = nullptr;
-};
-
 // Wraps a Kotlin ProgressCallback jobject.
 ProgressCallback create_progress_callback(JNIEnv *env, jobject j_callback) {
     if (!j_callback) return nullptr;
-    auto cb_wrapper = std::make_shared<JniCallback>(env, j_callback, "kotlin/jvm/functions/Function2",
-                                                    "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
+    auto cb_wrapper = std::make_shared<JniCallback>(env, j_callback, g_jni_cache.function2_invoke);
 
     return [cb_wrapper](float progress, const std::string &stage) {
         if (!cb_wrapper || !cb_wrapper->callback_ref || !cb_wrapper->invoke_method) return;
@@ -195,10 +354,8 @@ ProgressCallback create_progress_callback(JNIEnv *env, jobject j_callback) {
         if (!env) return;
 
         // Box the float primitive into a java.lang.Float object
-        const auto float_cls = env->FindClass("java/lang/Float");
-        const auto float_ctor = env->GetMethodID(float_cls, "<init>", "(F)V");
-        const auto j_progress = env->NewObject(float_cls, float_ctor, progress);
-
+        const auto j_progress = env->CallStaticObjectMethod(g_jni_cache.float_cls, g_jni_cache.float_value_of,
+                                                            progress);
         const auto j_stage = env->NewStringUTF(stage.c_str());
 
         // Call the invoke method
@@ -208,39 +365,198 @@ ProgressCallback create_progress_callback(JNIEnv *env, jobject j_callback) {
 
         env->DeleteLocalRef(j_stage);
         env->DeleteLocalRef(j_progress);
-        env->DeleteLocalRef(float_cls);
-        detach_thread();
     };
 }
 
-// Wraps a Kotlin TokenCallback jobject.
-TokenCallback create_token_callback(JNIEnv *env, jobject j_callback) {
-    if (!j_callback) return nullptr;
-    // Use the JniCallback RAII wrapper and correct method signature for Function1
-    auto cb_wrapper = std::make_shared<JniCallback>(env, j_callback, "kotlin/jvm/functions/Function1",
-                                                    "(Ljava/lang/Object;)Ljava/lang/Object;");
+// Clears what a Kotlin callback threw, which nothing on the native side can handle, and cancels the generation
+static bool cancel_on_exception(JNIEnv *env, CancellationToken *cancellation_token) {
+    if (!env->ExceptionCheck()) {
+        return false;
+    }
+    env->ExceptionDescribe();
+    env->ExceptionClear();
+    if (cancellation_token) {
+        cancellation_token->cancel();
+    }
+    return true;
+}
 
-    return [cb_wrapper](const std::string &token) {
-        if (!cb_wrapper || !cb_wrapper->callback_ref || !cb_wrapper->invoke_method) return;
+// A text that may end inside a UTF-8 character (a response cut by maxTokens or a stop sequence),
+// with that character's bytes replaced by U+FFFD, so that it can go to NewStringUTF
+static std::string with_complete_utf8(std::string text) {
+    if (const auto complete = completeUtf8Length(text); complete < text.size()) {
+        text.resize(complete);
+        text += "\xEF\xBF\xBD";
+    }
+    return text;
+}
+
+// Passes generated tokens on to a Kotlin TokenCallback, one string per whole character sequence.
+// Token pieces can end inside a UTF-8 character, whose bytes wait for the next piece.
+class JniTokenStream {
+public:
+    JniTokenStream(JNIEnv *env, jobject j_callback, CancellationToken *cancellation_token)
+        : callback(env, j_callback, g_jni_cache.function1_invoke),
+          cancellation_token(cancellation_token) {
+    }
+
+    void add(const std::string &piece) {
+        held += piece;
+        const auto complete = completeUtf8Length(held);
+        if (complete == 0) return;
+
+        send(held.substr(0, complete));
+        held.erase(0, complete);
+    }
+
+    // Sends what is held back once generation has ended, the unfinished character as U+FFFD
+    void flush() {
+        if (held.empty()) return;
+
+        send(with_complete_utf8(held));
+        held.clear();
+    }
+
+private:
+    void send(const std::string &text) {
+        if (!callback.callback_ref || !callback.invoke_method) return;
 
         JNIEnv *env = attach_thread();
         if (!env) return;
 
-        const auto j_token = env->NewStringUTF(token.c_str());
-        if (const auto result = env->CallObjectMethod(cb_wrapper->callback_ref, cb_wrapper->invoke_method, j_token)) {
+        TRACE_SCOPE("jni::tokenCallback");
+        const auto j_token = env->NewStringUTF(text.c_str());
+        if (const auto result = env->CallObjectMethod(callback.callback_ref, callback.invoke_method, j_token)) {
             env->DeleteLocalRef(result); // Clean up the returned Unit object
         }
+        cancel_on_exception(env, cancellation_token);
 
         env->DeleteLocalRef(j_token);
-        detach_thread();
+    }
+
+    JniCallback callback;
+    CancellationToken *cancellation_token;
+    std::string held;
+};
+
+// Collects the UTF-8 bytes of generated tokens and hands them to a Kotlin (ByteArray) -> Unit
+// every max_tokens tokens or max_delay_ms, so that one JNI crossing covers several tokens.
+class JniTokenBatcher {
+public:
+    JniTokenBatcher(JNIEnv *env, jobject j_callback, const int max_tokens, const int max_delay_ms,
+                    CancellationToken *cancellation_token)
+        : callback(env, j_callback, g_jni_cache.function1_invoke),
+          cancellation_token(cancellation_token),
+          max_tokens(std::max(max_tokens, 1)),
+          max_delay(std::chrono::milliseconds(std::max(max_delay_ms, 0))),
+          last_flush(std::chrono::steady_clock::now()) {
+    }
+
+    void add(const std::string &piece) {
+        pending += piece;
+        ++pending_tokens;
+
+        if (pending_tokens >= max_tokens ||
+            (max_delay.count() > 0 && std::chrono::steady_clock::now() - last_flush >= max_delay)) {
+            flush();
+        }
+    }
+
+    void flush() {
+        last_flush = std::chrono::steady_clock::now();
+        if (pending.empty() || !callback.callback_ref || !callback.invoke_method) {
+            return;
+        }
+
+        JNIEnv *env = attach_thread();
+        if (!env) return;
+
+        TRACE_SCOPE("jni::tokenBatch");
+        const auto j_bytes = env->NewByteArray(static_cast<jsize>(pending.size()));
+        env->SetByteArrayRegion(j_bytes, 0, static_cast<jsize>(pending.size()),
+                                reinterpret_cast<const jbyte *>(pending.data()));
+        if (const auto result = env->CallObjectMethod(callback.callback_ref, callback.invoke_method, j_bytes)) {
+            env->DeleteLocalRef(result);
+        }
+        cancel_on_exception(env, cancellation_token);
+        env->DeleteLocalRef(j_bytes);
+
+        pending.clear(); // Keeps the capacity
+        pending_tokens = 0;
+    }
+
+private:
+    JniCallback callback;
+    CancellationToken *cancellation_token;
+    int max_tokens;
+    std::chrono::milliseconds max_delay;
+    std::chrono::steady_clock::time_point last_flush;
+    std::string pending;
+    int pending_tokens = 0;
+};
+
+// Wraps a Kotlin () -> Unit, called on a worker thread when a submitted job has something to poll
+std::function<void()> create_ready_callback(JNIEnv *env, jobject j_callback) {
+    if (!j_callback) return nullptr;
+    auto cb_wrapper = std::make_shared<JniCallback>(env, j_callback, g_jni_cache.function0_invoke);
+
+    return [cb_wrapper] {
+        if (!cb_wrapper->callback_ref || !cb_wrapper->invoke_method) return;
+
+        JNIEnv *env = attach_thread();
+        if (!env) return;
+
+        if (const auto result = env->CallObjectMethod(cb_wrapper->callback_ref, cb_wrapper->invoke_method)) {
+            env->DeleteLocalRef(result);
+        }
+        // Nothing on the worker thread could handle it
+        if (env->ExceptionCheck()) {
+            env->ExceptionDescribe();
+            env->ExceptionClear();
+        }
     };
 }
 
+// Submitted jobs are handed to Kotlin as a heap-allocated shared_ptr, freed by releaseJobNative
+static std::shared_ptr<GenerationJob> &get_job(const jlong j_job) {
+    return *reinterpret_cast<std::shared_ptr<GenerationJob> *>(j_job);
+}
+
+// Owned by a Kotlin NativeCancellation, which sets it when its CancellationToken is cancelled,
+// so that native code checks an atomic instead of calling into the JVM. 0 = no token.
+static CancellationToken *get_cancellation_token(const jlong j_token) {
+    return reinterpret_cast<CancellationToken *>(j_token);
+}
+
 extern "C" JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM *vm, [[maybe_unused]] void *reserved) {
     g_jni_context.jvm = vm;
+
+    JNIEnv *env = nullptr;
+    if (vm->GetEnv(reinterpret_cast<void **>(&env), JNI_VERSION_1_6) != JNI_OK) {
+        return JNI_ERR;
+    }
+
+    if (!init_jni_cache(env)) {
+        LOG_ERROR(LOG_TAG, "Failed to resolve JNI classes and members");
+        return JNI_ERR;
+    }
+
     return JNI_VERSION_1_6;
 }
 
+extern "C" JNIEXPORT void JNICALL JNI_OnUnload(JavaVM *vm, [[maybe_unused]] void *reserved) {
+    JNIEnv *env = nullptr;
+    if (vm->GetEnv(reinterpret_cast<void **>(&env), JNI_VERSION_1_6) != JNI_OK) {
+        return;
+    }
+
+    for (const auto ref: g_jni_cache.global_refs) {
+        env->DeleteGlobalRef(ref);
+    }
+    g_jni_cache = {};
+    g_jni_context.jvm = nullptr;
+}
+
 extern "C" JNIEXPORT jobject JNICALL
 Java_io_actinis_kllama_1cpp_KLlama_00024Companion_validateModelNative(
     JNIEnv *env,
@@ -267,34 +583,43 @@ Java_io_actinis_kllama_1cpp_KLlama_00024Companion_validateMmprojNative(
 }
 
 extern "C" JNIEXPORT jobject JNICALL
-Java_io_actinis_kllama_1cpp_KLlama_00024Companion_validateImageDataNative(
+Java_io_actinis_kllama_1cpp_KLlama_00024Companion_preloadModelNative(
     JNIEnv *env,
     jobject,
-    jobject j_image_data
+    jobject j_params,
+    jobject j_progress_cb,
+    jlong j_cancel_token
 ) {
-    const auto image_data_cls = env->FindClass("io/actinis/kllama_cpp/data/model/message/ImageData");
-    const auto get_data = env->GetMethodID(image_data_cls, "getData", "()[B");
-    const auto j_data = reinterpret_cast<jbyteArray>(env->CallObjectMethod(j_image_data, get_data));
+    const auto params = from_java_session_params(env, j_params);
+    const auto progress_callback = create_progress_callback(env, j_progress_cb);
+    auto *cancellation_token = get_cancellation_token(j_cancel_token);
 
-    auto *data_ptr = env->GetByteArrayElements(j_data, nullptr);
-    const auto len = env->GetArrayLength(j_data);
-    ImageData image_data;
-    image_data.data.assign(reinterpret_cast<uint8_t *>(data_ptr), reinterpret_cast<uint8_t *>(data_ptr) + len);
-    env->ReleaseByteArrayElements(j_data, data_ptr, JNI_ABORT);
+    const auto result = ModelPool::load(params, progress_callback, cancellation_token);
+    return to_java_result(env, KLlamaResult<void>(result.error, result.errorMessage));
+}
+
+extern "C" JNIEXPORT jboolean JNICALL
+Java_io_actinis_kllama_1cpp_KLlama_00024Companion_evictModelNative(
+    JNIEnv *env,
+    jobject,
+    jstring j_model_path
+) {
+    const JniString model_path(env, j_model_path);
+    return ModelPool::evict(model_path.str());
+}
 
+extern "C" JNIEXPORT jobject JNICALL
+Java_io_actinis_kllama_1cpp_KLlama_00024Companion_validateImageDataNative(
+    JNIEnv *env,
+    jobject,
+    jobject j_image_data
+) {
+    const auto image_data = from_java_image_data(env, j_image_data);
     const auto result = KLlama::validateImageData(image_data);
 
     return to_java_result<std::vector<uint8_t> >(env, result, std::function(
                                                      [&](const std::vector<uint8_t> &data) {
-                                                         const auto j_byte_array = env->NewByteArray(
-                                                             static_cast<jsize>(data.size())
-                                                         );
-                                                         env->SetByteArrayRegion(
-                                                             j_byte_array,
-                                                             0,
-                                                             static_cast<jsize>(data.size()),
-                                                             reinterpret_cast<const jbyte *>(data.data()));
-                                                         return static_cast<jobject>(j_byte_array);
+                                                         return to_java_byte_array(env, data);
                                                      }));
 }
 
@@ -304,15 +629,15 @@ Java_io_actinis_kllama_1cpp_KLlama_initializeNative(
     jobject thiz,
     jobject j_params,
     jobject j_progress_cb,
-    jobject j_cancel_token
+    jlong j_cancel_token
 ) {
     const auto kllama = new KLlama();
 
     const auto params = from_java_session_params(env, j_params);
     const auto progress_callback = create_progress_callback(env, j_progress_cb);
-    const auto cancellation_token = std::make_unique<JniCancellationToken>(env, j_cancel_token);
+    auto *cancellation_token = get_cancellation_token(j_cancel_token);
 
-    const auto result = kllama->initialize(params, progress_callback, cancellation_token.get());
+    const auto result = kllama->initialize(params, progress_callback, cancellation_token);
 
     if (result.isSuccess()) {
         set_handle(env, thiz, kllama);
@@ -332,7 +657,56 @@ Java_io_actinis_kllama_1cpp_KLlama_generateResponseNative(
     jobject j_sampling,
     jobject j_token_cb,
     jobject j_progress_cb,
-    jobject j_cancel_token
+    jlong j_cancel_token
+) {
+    KLlama *kllama = get_handle(env, thiz);
+    if (!kllama) {
+        const KLlamaResult<std::string> not_init_res(KLlamaError::NotInitialized, "KLlama not initialized");
+        return to_java_result<std::string>(env, not_init_res, nullptr);
+    }
+
+    TRACE_SCOPE("jni::generateResponse");
+    const auto conversation = [&] {
+        TRACE_SCOPE("jni::readConversation");
+        return from_java_multimodal_message_array(env, j_conversation);
+    }();
+    const auto sampling = from_java_sampling_params(env, j_sampling);
+    const auto progress_callback = create_progress_callback(env, j_progress_cb);
+    // Cancelled when the token callback throws, also without a token from the caller
+    CancellationToken callback_token;
+    auto *cancellation_token = j_cancel_token ? get_cancellation_token(j_cancel_token) : &callback_token;
+
+    TokenCallback token_callback;
+    std::shared_ptr<JniTokenStream> stream;
+    if (j_token_cb) {
+        stream = std::make_shared<JniTokenStream>(env, j_token_cb, cancellation_token);
+        token_callback = [stream](const std::string &piece) { stream->add(piece); };
+    }
+
+    const auto result = kllama->generateResponse(conversation, sampling, token_callback, progress_callback,
+                                                 cancellation_token);
+    if (stream) {
+        stream->flush();
+    }
+
+    // Ends as the streamed text does
+    return to_java_result<std::string>(env, result, std::function<jobject(const std::string &)>(
+                                           [&](const std::string &value) {
+                                               return env->NewStringUTF(with_complete_utf8(value).c_str());
+                                           }));
+}
+
+extern "C" JNIEXPORT jobject JNICALL
+Java_io_actinis_kllama_1cpp_KLlama_generateResponseStreamingNative(
+    JNIEnv *env,
+    jobject thiz,
+    jobjectArray j_conversation,
+    jobject j_sampling,
+    jobject j_bytes_cb,
+    jint j_batch_tokens,
+    jint j_batch_interval_ms,
+    jobject j_progress_cb,
+    jlong j_cancel_token
 ) {
     KLlama *kllama = get_handle(env, thiz);
     if (!kllama) {
@@ -340,14 +714,30 @@ Java_io_actinis_kllama_1cpp_KLlama_generateResponseNative(
         return to_java_result<std::string>(env, not_init_res, nullptr);
     }
 
-    const auto conversation = from_java_multimodal_message_array(env, j_conversation);
+    TRACE_SCOPE("jni::generateResponse");
+    const auto conversation = [&] {
+        TRACE_SCOPE("jni::readConversation");
+        return from_java_multimodal_message_array(env, j_conversation);
+    }();
     const auto sampling = from_java_sampling_params(env, j_sampling);
-    const auto token_callback = create_token_callback(env, j_token_cb);
     const auto progress_callback = create_progress_callback(env, j_progress_cb);
-    const auto cancellation_token = std::make_unique<JniCancellationToken>(env, j_cancel_token);
+    // Cancelled when the bytes callback throws, also without a token from the caller
+    CancellationToken callback_token;
+    auto *cancellation_token = j_cancel_token ? get_cancellation_token(j_cancel_token) : &callback_token;
+
+    TokenCallback token_callback;
+    std::shared_ptr<JniTokenBatcher> batcher;
+    if (j_bytes_cb) {
+        batcher = std::make_shared<JniTokenBatcher>(env, j_bytes_cb, j_batch_tokens, j_batch_interval_ms,
+                                                    cancellation_token);
+        token_callback = [batcher](const std::string &piece) { batcher->add(piece); };
+    }
 
     const auto result = kllama->generateResponse(conversation, sampling, token_callback, progress_callback,
-                                                 cancellation_token.get());
+                                                 cancellation_token);
+    if (batcher) {
+        batcher->flush();
+    }
 
     return to_java_result<std::string>(env, result, std::function<jobject(const std::string &)>(
                                            [&](const std::string &value) {
@@ -355,6 +745,96 @@ Java_io_actinis_kllama_1cpp_KLlama_generateResponseNative(
                                            }));
 }
 
+extern "C" JNIEXPORT jlong JNICALL
+Java_io_actinis_kllama_1cpp_NativeCancellation_00024Companion_createNative(JNIEnv *, jobject, jboolean j_cancelled) {
+    auto *token = new CancellationToken();
+    if (j_cancelled) {
+        token->cancel();
+    }
+    return reinterpret_cast<jlong>(token);
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_io_actinis_kllama_1cpp_NativeCancellation_00024Companion_cancelNative(JNIEnv *, jobject, jlong j_token) {
+    get_cancellation_token(j_token)->cancel();
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_io_actinis_kllama_1cpp_NativeCancellation_00024Companion_releaseNative(JNIEnv *, jobject, jlong j_token) {
+    delete get_cancellation_token(j_token);
+}
+
+extern "C" JNIEXPORT jlong JNICALL
+Java_io_actinis_kllama_1cpp_KLlama_submitNative(
+    JNIEnv *env,
+    jobject thiz,
+    jobjectArray j_conversation,
+    jobject j_sampling,
+    jboolean j_stream,
+    jint j_batch_tokens,
+    jint j_batch_interval_ms,
+    jobject j_ready_cb
+) {
+    KLlama *kllama = get_handle(env, thiz);
+    if (!kllama) {
+        return 0;
+    }
+
+    TRACE_SCOPE("jni::submit");
+    GenerationRequest request;
+    request.conversation = from_java_multimodal_message_array(env, j_conversation);
+    // The job runs after this call returns, when nothing keeps direct buffers alive any more
+    for (auto &message: request.conversation) {
+        for (auto &image: message.images) {
+            image.own();
+        }
+    }
+    request.sampling = from_java_sampling_params(env, j_sampling);
+    request.stream = j_stream;
+    request.notifyTokens = std::max(j_batch_tokens, 1);
+    request.notifyIntervalMs = std::max(j_batch_interval_ms, 0);
+    request.onReady = create_ready_callback(env, j_ready_cb);
+
+    auto job = kllama->submit(std::move(request));
+    return reinterpret_cast<jlong>(new std::shared_ptr<GenerationJob>(std::move(job)));
+}
+
+extern "C" JNIEXPORT jbyteArray JNICALL
+Java_io_actinis_kllama_1cpp_KLlama_pollJobNative(JNIEnv *env, jobject, jlong j_job) {
+    // Reused by the polls made on this thread
+    thread_local std::string text;
+    text.clear();
+    get_job(j_job)->poll(text);
+    if (text.empty()) {
+        return nullptr;
+    }
+    const auto j_bytes = env->NewByteArray(static_cast<jsize>(text.size()));
+    env->SetByteArrayRegion(j_bytes, 0, static_cast<jsize>(text.size()), reinterpret_cast<const jbyte *>(text.data()));
+    return j_bytes;
+}
+
+extern "C" JNIEXPORT jobject JNICALL
+Java_io_actinis_kllama_1cpp_KLlama_jobResultNative(JNIEnv *env, jobject, jlong j_job) {
+    const auto result = get_job(j_job)->result();
+    if (!result) {
+        return nullptr;
+    }
+    return to_java_result<std::string>(env, *result, std::function<jobject(const std::string &)>(
+                                           [&](const std::string &value) {
+                                               return env->NewStringUTF(value.c_str());
+                                           }));
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_io_actinis_kllama_1cpp_KLlama_cancelJobNative(JNIEnv *, jobject, jlong j_job) {
+    get_job(j_job)->cancel();
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_io_actinis_kllama_1cpp_KLlama_releaseJobNative(JNIEnv *, jobject, jlong j_job) {
+    delete &get_job(j_job);
+}
+
 extern "C" JNIEXPORT jobject JNICALL
 Java_io_actinis_kllama_1cpp_KLlama_getModelInfoNative(JNIEnv *env, jobject thiz) {
     const KLlama *kllama = get_handle(env, thiz);
@@ -396,6 +876,100 @@ Java_io_actinis_kllama_1cpp_KLlama_getGenerationStatsNative(JNIEnv *env, jobject
                                                }));
 }
 
+extern "C" JNIEXPORT jobject JNICALL
+Java_io_actinis_kllama_1cpp_KLlama_saveStateNative(JNIEnv *env, jobject thiz) {
+    const KLlama *kllama = get_handle(env, thiz);
+    if (!kllama) {
+        const KLlamaResult<std::vector<uint8_t> > not_init_res(KLlamaError::NotInitialized, "KLlama not initialized");
+        return to_java_result<std::vector<uint8_t> >(env, not_init_res, nullptr);
+    }
+    const auto result = kllama->saveState();
+    return to_java_result<std::vector<uint8_t> >(env, result, std::function(
+                                                     [&](const std::vector<uint8_t> &data) {
+                                                         return to_java_byte_array(env, data);
+                                                     }));
+}
+
+extern "C" JNIEXPORT jobject JNICALL
+Java_io_actinis_kllama_1cpp_KLlama_saveStateFileNative(JNIEnv *env, jobject thiz, jstring j_path) {
+    const KLlama *kllama = get_handle(env, thiz);
+    if (!kllama) {
+        return to_java_result(env, KLlamaResult<void>(KLlamaError::NotInitialized, "KLlama not initialized"));
+    }
+    const JniString path(env, j_path);
+    return to_java_result(env, kllama->saveStateFile(path.str()));
+}
+
+extern "C" JNIEXPORT jobject JNICALL
+Java_io_actinis_kllama_1cpp_KLlama_restoreStateNative(JNIEnv *env, jobject thiz, jbyteArray j_data) {
+    KLlama *kllama = get_handle(env, thiz);
+    if (!kllama) {
+        return to_java_result(env, KLlamaResult<void>(KLlamaError::NotInitialized, "KLlama not initialized"));
+    }
+
+    // Pinned or copied by the VM, never written back
+    const auto length = static_cast<size_t>(env->GetArrayLength(j_data));
+    auto *bytes = env->GetByteArrayElements(j_data, nullptr);
+    if (!bytes) {
+        return to_java_result(env, KLlamaResult<void>(KLlamaError::InsufficientMemory, "Can't access the snapshot"));
+    }
+    const auto result = kllama->restoreState(std::span(reinterpret_cast<const uint8_t *>(bytes), length));
+    env->ReleaseByteArrayElements(j_data, bytes, JNI_ABORT);
+
+    return to_java_result(env, result);
+}
+
+extern "C" JNIEXPORT jobject JNICALL
+Java_io_actinis_kllama_1cpp_KLlama_restoreStateFileNative(JNIEnv *env, jobject thiz, jstring j_path) {
+    KLlama *kllama = get_handle(env, thiz);
+    if (!kllama) {
+        return to_java_result(env, KLlamaResult<void>(KLlamaError::NotInitialized, "KLlama not initialized"));
+    }
+    const JniString path(env, j_path);
+    return to_java_result(env, kllama->restoreStateFile(path.str()));
+}
+
+extern "C" JNIEXPORT jobject JNICALL
+Java_io_actinis_kllama_1cpp_KLlama_embedNative(JNIEnv *env, jobject thiz, jobjectArray j_texts) {
+    KLlama *kllama = get_handle(env, thiz);
+    if (!kllama) {
+        const KLlamaResult<std::vector<float> > not_init_res(KLlamaError::NotInitialized, "KLlama not initialized");
+        return to_java_result<std::vector<float> >(env, not_init_res, nullptr);
+    }
+    const auto texts = from_java_string_array(env, j_texts);
+    const auto result = kllama->embed(texts);
+    // A direct buffer is sized by a jint
+    if (result.isSuccess() &&
+        result.value.size() > static_cast<size_t>(std::numeric_limits<jint>::max()) / sizeof(float)) {
+        const KLlamaResult<std::vector<float> > too_large(
+            KLlamaError::InvalidParameters,
+            "Embeddings take " + std::to_string(result.value.size() * sizeof(float)) +
+            " bytes, more than a Java buffer holds, embed fewer texts at once");
+        return to_java_result<std::vector<float> >(env, too_large, nullptr);
+    }
+    return to_java_result<std::vector<float> >(env, result, std::function(
+                                                   [&](const std::vector<float> &data) {
+                                                       return to_java_embeddings(
+                                                           env, data, static_cast<jint>(texts.size()));
+                                                   }));
+}
+
+extern "C" JNIEXPORT jobject JNICALL
+Java_io_actinis_kllama_1cpp_KLlama_rerankNative(JNIEnv *env, jobject thiz, jstring j_query,
+                                                 jobjectArray j_documents) {
+    KLlama *kllama = get_handle(env, thiz);
+    if (!kllama) {
+        const KLlamaResult<std::vector<float> > not_init_res(KLlamaError::NotInitialized, "KLlama not initialized");
+        return to_java_result<std::vector<float> >(env, not_init_res, nullptr);
+    }
+    const JniString query(env, j_query);
+    const auto result = kllama->rerank(query.str(), from_java_string_array(env, j_documents));
+    return to_java_result<std::vector<float> >(env, result, std::function(
+                                                   [&](const std::vector<float> &scores) {
+                                                       return to_java_float_array(env, scores);
+                                                   }));
+}
+
 extern "C" JNIEXPORT void JNICALL
 Java_io_actinis_kllama_1cpp_KLlama_freeMemory(JNIEnv *env, jobject thiz) {
     if (const KLlama *kllama = get_handle(env, thiz)) {
@@ -409,27 +983,24 @@ Java_io_actinis_kllama_1cpp_KLlama_freeMemory(JNIEnv *env, jobject thiz) {
 template<typename T>
 jobject to_java_result(JNIEnv *env, const KLlamaResult<T> &result,
                        const std::function<jobject(const T &)> &value_converter) {
+    const auto &cache = g_jni_cache;
     if (result.isSuccess()) {
-        const auto success_cls = env->FindClass("io/actinis/kllama_cpp/data/model/result/KLlamaResult$Success");
-        const auto ctor = env->GetMethodID(success_cls, "<init>", "(Ljava/lang/Object;)V");
         const auto value_obj = value_converter ? value_converter(result.value) : nullptr;
-        const auto new_obj = env->NewObject(success_cls, ctor, value_obj);
+        const auto new_obj = env->NewObject(cache.success_cls, cache.success_ctor, value_obj);
         if (value_obj) env->DeleteLocalRef(value_obj);
         return new_obj;
     } else {
-        const auto error_cls = env->FindClass("io/actinis/kllama_cpp/data/model/result/KLlamaResult$Error");
-        const auto ctor = env->GetMethodID(error_cls, "<init>",
-                                           "(Lio/actinis/kllama_cpp/data/model/result/KLlamaError;Ljava/lang/String;)V");
-
-        const auto error_enum_cls = env->FindClass("io/actinis/kllama_cpp/data/model/result/KLlamaError");
-        const auto error_field = env->GetStaticFieldID(error_enum_cls, KLlama::errorToString(result.error).c_str(),
-                                                       "Lio/actinis/kllama_cpp/data/model/result/KLlamaError;");
-        const auto error_enum_val = env->GetStaticObjectField(error_enum_cls, error_field);
+        jobject error_enum_val = cache.error_values[std::size(k_error_names) - 1];
+        for (size_t i = 0; i < std::size(k_error_names); ++i) {
+            if (k_error_names[i].first == result.error) {
+                error_enum_val = cache.error_values[i];
+                break;
+            }
+        }
 
         const auto msg = env->NewStringUTF(result.errorMessage.c_str());
-        const auto new_obj = env->NewObject(error_cls, ctor, error_enum_val, msg);
+        const auto new_obj = env->NewObject(cache.error_cls, cache.error_ctor, error_enum_val, msg);
         env->DeleteLocalRef(msg);
-        env->DeleteLocalRef(error_enum_val);
         return new_obj;
     }
 }
@@ -438,14 +1009,7 @@ jobject to_java_result(JNIEnv *env, const KLlamaResult<T> &result,
 jobject to_java_result(JNIEnv *env, const KLlamaResult<void> &result) {
     if (result.isSuccess()) {
         // For void success, return a Success(Unit)
-        const auto success_cls = env->FindClass("io/actinis/kllama_cpp/data/model/result/KLlamaResult$Success");
-        const auto ctor = env->GetMethodID(success_cls, "<init>", "(Ljava/lang/Object;)V");
-        const auto unit_cls = env->FindClass("kotlin/Unit");
-        const auto instance_field = env->GetStaticFieldID(unit_cls, "INSTANCE", "Lkotlin/Unit;");
-        const auto unit_obj = env->GetStaticObjectField(unit_cls, instance_field);
-        const auto new_obj = env->NewObject(success_cls, ctor, unit_obj);
-        env->DeleteLocalRef(unit_obj);
-        return new_obj;
+        return env->NewObject(g_jni_cache.success_cls, g_jni_cache.success_ctor, g_jni_cache.unit_instance);
     }
     // For error, use the generic implementation
     return to_java_result<std::nullptr_t>(env, KLlamaResult<std::nullptr_t>(result.error, result.errorMessage),
@@ -455,179 +1019,291 @@ jobject to_java_result(JNIEnv *env, const KLlamaResult<void> &result) {
 // C++ to Java Converters
 
 jobject to_java_model_info(JNIEnv *env, const ModelInfo &info) {
-    const auto cls = env->FindClass("io/actinis/kllama_cpp/data/model/info/ModelInfo");
-    const auto ctor = env->GetMethodID(cls, "<init>", "(Ljava/lang/String;Ljava/lang/String;JIZLjava/util/List;)V");
+    const auto &cache = g_jni_cache;
 
     const auto name = env->NewStringUTF(info.name.c_str());
     const auto arch = env->NewStringUTF(info.architecture.c_str());
+    const auto quantization = env->NewStringUTF(info.quantization.c_str());
 
-    const auto list_cls = env->FindClass("java/util/ArrayList");
-    const auto list_ctor = env->GetMethodID(list_cls, "<init>", "()V");
-    const auto list_add = env->GetMethodID(list_cls, "add", "(Ljava/lang/Object;)Z");
-    const auto capabilities = env->NewObject(list_cls, list_ctor);
+    const auto capabilities = env->NewObject(cache.array_list_cls, cache.array_list_ctor);
     for (const auto &cap: info.capabilities) {
         const auto j_cap = env->NewStringUTF(cap.c_str());
-        env->CallBooleanMethod(capabilities, list_add, j_cap);
+        env->CallBooleanMethod(capabilities, cache.list_add, j_cap);
         env->DeleteLocalRef(j_cap);
     }
 
-    const auto new_obj = env->NewObject(cls, ctor, name, arch, info.parameterCount, info.contextSize,
-                                        info.supportsVision, capabilities);
+    const auto new_obj = env->NewObject(cache.model_info_cls, cache.model_info_ctor, name, arch, quantization,
+                                        info.parameterCount, info.contextSize, info.supportsVision, capabilities);
     env->DeleteLocalRef(name);
     env->DeleteLocalRef(arch);
+    env->DeleteLocalRef(quantization);
     env->DeleteLocalRef(capabilities);
     return new_obj;
 }
 
+jobject to_java_byte_array(JNIEnv *env, const std::vector<uint8_t> &data) {
+    const auto j_byte_array = env->NewByteArray(static_cast<jsize>(data.size()));
+    env->SetByteArrayRegion(j_byte_array, 0, static_cast<jsize>(data.size()),
+                            reinterpret_cast<const jbyte *>(data.data()));
+    return j_byte_array;
+}
+
+// Copied once into a direct buffer, which Kotlin reads, or hands on to other native code, in place
+jobject to_java_embeddings(JNIEnv *env, const std::vector<float> &data, const jint count) {
+    const auto &cache = g_jni_cache;
+    const auto bytes = static_cast<jint>(data.size() * sizeof(float));
+    const auto j_bytes = env->CallStaticObjectMethod(cache.byte_buffer_cls, cache.byte_buffer_allocate_direct, bytes);
+    if (!j_bytes) {
+        return nullptr;
+    }
+    if (!data.empty()) {
+        std::memcpy(env->GetDirectBufferAddress(j_bytes), data.data(), data.size() * sizeof(float));
+    }
+    const auto j_ordered = env->CallObjectMethod(j_bytes, cache.byte_buffer_order, cache.native_byte_order);
+    const auto j_floats = env->CallObjectMethod(j_bytes, cache.byte_buffer_as_float_buffer);
+    const auto dimensions = count > 0 ? static_cast<jint>(data.size() / count) : 0;
+    const auto new_obj = env->NewObject(cache.embeddings_cls, cache.embeddings_ctor, count, dimensions, j_floats);
+    env->DeleteLocalRef(j_floats);
+    env->DeleteLocalRef(j_ordered);
+    env->DeleteLocalRef(j_bytes);
+    return new_obj;
+}
+
+jobject to_java_float_array(JNIEnv *env, const std::vector<float> &data) {
+    const auto j_float_array = env->NewFloatArray(static_cast<jsize>(data.size()));
+    env->SetFloatArrayRegion(j_float_array, 0, static_cast<jsize>(data.size()), data.data());
+    return j_float_array;
+}
+
 jobject to_java_memory_info(JNIEnv *env, const MemoryInfo &info) {
-    const auto cls = env->FindClass("io/actinis/kllama_cpp/data/model/info/MemoryInfo");
-    const auto ctor = env->GetMethodID(cls, "<init>", "(JJJJ)V");
-    return env->NewObject(cls, ctor, static_cast<jlong>(info.modelMemoryMB), static_cast<jlong>(info.contextMemoryMB),
-                          static_cast<jlong>(info.totalMemoryMB), static_cast<jlong>(info.availableMemoryMB));
+    const auto &cache = g_jni_cache;
+
+    const auto devices = env->NewObject(cache.array_list_cls, cache.array_list_ctor);
+    for (const auto &device: info.devices) {
+        const auto name = env->NewStringUTF(device.name.c_str());
+        const auto description = env->NewStringUTF(device.description.c_str());
+        const auto j_device = env->NewObject(cache.device_memory_info_cls, cache.device_memory_info_ctor, name,
+                                             description, static_cast<jlong>(device.modelMemoryMB),
+                                             static_cast<jlong>(device.freeMemoryMB),
+                                             static_cast<jlong>(device.totalMemoryMB));
+        env->CallBooleanMethod(devices, cache.list_add, j_device);
+        env->DeleteLocalRef(j_device);
+        env->DeleteLocalRef(description);
+        env->DeleteLocalRef(name);
+    }
+
+    const auto new_obj = env->NewObject(cache.memory_info_cls, cache.memory_info_ctor,
+                                        static_cast<jlong>(info.modelMemoryMB),
+                                        static_cast<jlong>(info.contextMemoryMB),
+                                        static_cast<jlong>(info.kvCacheMB), static_cast<jlong>(info.kvCacheUsedMB),
+                                        static_cast<jlong>(info.visionMemoryMB),
+                                        static_cast<jlong>(info.totalMemoryMB),
+                                        static_cast<jlong>(info.residentMemoryMB),
+                                        static_cast<jlong>(info.availableMemoryMB), devices);
+    env->DeleteLocalRef(devices);
+    return new_obj;
 }
 
 jobject to_java_generation_stats(JNIEnv *env, const GenerationStats &stats) {
-    const auto cls = env->FindClass("io/actinis/kllama_cpp/data/model/info/GenerationStats");
-    const auto ctor = env->GetMethodID(cls, "<init>",
-                                       "(IIFLio/actinis/kllama_cpp/data/model/GenerationState;Lio/actinis/kllama_cpp/data/model/params/SamplingParams;)V");
-
-    const auto state_enum_cls = env->FindClass("io/actinis/kllama_cpp/data/model/GenerationState");
-    const char *state_name;
-    switch (stats.state) {
-        case GenerationState::Idle: state_name = "Idle";
-            break;
-        case GenerationState::Initializing: state_name = "Initializing";
-            break;
-        case GenerationState::TokenizingPrompt: state_name = "TokenizingPrompt";
-            break;
-        case GenerationState::ProcessingImages: state_name = "ProcessingImages";
-            break;
-        case GenerationState::Generating: state_name = "Generating";
-            break;
-        case GenerationState::Finished: state_name = "Finished";
-            break;
-        case GenerationState::Cancelled: state_name = "Cancelled";
-            break;
-        case GenerationState::Error: state_name = "Error";
-            break;
-        default: state_name = "Error";
-            break;
-    }
-    const auto state_field = env->GetStaticFieldID(state_enum_cls, state_name,
-                                                   "Lio/actinis/kllama_cpp/data/model/GenerationState;");
-    const auto state_enum_val = env->GetStaticObjectField(state_enum_cls, state_field);
+    const auto &cache = g_jni_cache;
+
+    auto state_index = static_cast<size_t>(stats.state);
+    if (state_index >= std::size(k_generation_state_names)) {
+        state_index = static_cast<size_t>(GenerationState::Error);
+    }
+    const auto state_enum_val = cache.generation_state_values[state_index];
 
     const auto sampling_params = to_java_sampling_params(env, stats.sampling);
 
-    const auto new_obj = env->NewObject(cls, ctor, stats.tokensGenerated, stats.tokensPerSecond, stats.timeElapsed,
+    // One copy into a primitive array, rather than a boxed list
+    const auto histogram_size = static_cast<jsize>(stats.interTokenHistogram.size());
+    const auto histogram = env->NewIntArray(histogram_size);
+    env->SetIntArrayRegion(histogram, 0, histogram_size,
+                           reinterpret_cast<const jint *>(stats.interTokenHistogram.data()));
+
+    const auto new_obj = env->NewObject(cache.generation_stats_cls, cache.generation_stats_ctor,
+                                        stats.tokensGenerated, stats.tokensPerSecond, stats.timeElapsed,
+                                        stats.samplingMs, stats.samplingMsPerToken, stats.templateMs,
+                                        stats.tokenizeMs, stats.imageEncodeMs, stats.promptTokens,
+                                        stats.cachedPromptTokens, stats.promptMs, stats.decodeTokens,
+                                        stats.decodeMs, stats.callbackMs, stats.timeToFirstTokenMs, histogram,
                                         state_enum_val, sampling_params);
-    env->DeleteLocalRef(state_enum_val);
+    env->DeleteLocalRef(histogram);
     env->DeleteLocalRef(sampling_params);
     return new_obj;
 }
 
 
+jobject to_java_string_list(JNIEnv *env, const std::vector<std::string> &values) {
+    const auto list = env->NewObject(g_jni_cache.array_list_cls, g_jni_cache.array_list_ctor);
+    for (const auto &value: values) {
+        const auto j_value = env->NewStringUTF(value.c_str());
+        env->CallBooleanMethod(list, g_jni_cache.list_add, j_value);
+        env->DeleteLocalRef(j_value);
+    }
+    return list;
+}
+
 jobject to_java_sampling_params(JNIEnv *env, const SamplingParams &params) {
-    const auto cls = env->FindClass("io/actinis/kllama_cpp/data/model/params/SamplingParams");
-    const auto ctor = env->GetMethodID(cls, "<init>", "(FFIFFIFFFI)V");
-    return env->NewObject(cls, ctor, params.temperature, params.topP, params.topK, params.minP, params.typicalP,
-                          params.repeatPenalty, params.repeatLastN, params.frequencyPenalty, params.presencePenalty,
-                          params.nPredict);
+    const auto stop_sequences = to_java_string_list(env, params.stopSequences);
+    const auto grammar = env->NewStringUTF(params.grammar.c_str());
+    const auto json_schema = env->NewStringUTF(params.jsonSchema.c_str());
+    const auto new_obj = env->NewObject(g_jni_cache.sampling_params_cls, g_jni_cache.sampling_params_ctor,
+                                        params.temperature, params.topP, params.topK, params.minP, params.typicalP,
+                                        params.repeatPenalty, params.repeatLastN, params.frequencyPenalty,
+                                        params.presencePenalty, params.nPredict, static_cast<jint>(params.seed),
+                                        stop_sequences, grammar, json_schema, params.loraAdapter, params.loraScale);
+    env->DeleteLocalRef(stop_sequences);
+    env->DeleteLocalRef(grammar);
+    env->DeleteLocalRef(json_schema);
+    return new_obj;
 }
 
 // Java to C++ Converters
 
-#define GET_FIELD(env, cls, obj, name, sig, jni_type) env->Get##jni_type##Field(obj, env->GetFieldID(cls, name, sig))
-#define GET_STRING_FIELD(env, cls, obj, name) (jstring)env->GetObjectField(obj, env->GetFieldID(cls, name, "Ljava/lang/String;"))
-#define GET_OBJ_FIELD(env, cls, obj, name, type) env->GetObjectField(obj, env->GetFieldID(cls, name, "L" type ";"))
+#define GET_FIELD(env, obj, fields, name, jni_type) env->Get##jni_type##Field(obj, (fields).name)
+#define GET_STRING_FIELD(env, obj, fields, name) (jstring)env->GetObjectField(obj, (fields).name)
+
+static jint get_enum_ordinal(JNIEnv *env, jobject obj, jfieldID field) {
+    const auto j_enum = env->GetObjectField(obj, field);
+    const auto ordinal = env->CallIntMethod(j_enum, g_jni_cache.enum_ordinal);
+    env->DeleteLocalRef(j_enum);
+    return ordinal;
+}
+
+static std::vector<std::string> get_string_list(JNIEnv *env, jobject obj, jfieldID field) {
+    const auto j_list = env->GetObjectField(obj, field);
+    const auto count = env->CallIntMethod(j_list, g_jni_cache.list_size);
+    std::vector<std::string> values;
+    values.reserve(count);
+    for (jint i = 0; i < count; ++i) {
+        const auto j_value = static_cast<jstring>(env->CallObjectMethod(j_list, g_jni_cache.list_get, i));
+        values.push_back(JniString(env, j_value).str());
+        env->DeleteLocalRef(j_value);
+    }
+    env->DeleteLocalRef(j_list);
+    return values;
+}
 
 SamplingParams from_java_sampling_params(JNIEnv *env, jobject j_params) {
-    const auto cls = env->GetObjectClass(j_params);
+    const auto &f = g_jni_cache.sampling_fields;
     SamplingParams p;
-    p.temperature = GET_FIELD(env, cls, j_params, "temperature", "F", Float);
-    p.topP = GET_FIELD(env, cls, j_params, "topP", "F", Float);
-    p.topK = GET_FIELD(env, cls, j_params, "topK", "I", Int);
-    p.minP = GET_FIELD(env, cls, j_params, "minP", "F", Float);
-    p.typicalP = GET_FIELD(env, cls, j_params, "typicalP", "F", Float);
-    p.repeatPenalty = GET_FIELD(env, cls, j_params, "repeatPenalty", "F", Float);
-    p.repeatLastN = GET_FIELD(env, cls, j_params, "repeatLastN", "I", Int);
-    p.frequencyPenalty = GET_FIELD(env, cls, j_params, "frequencyPenalty", "F", Float);
-    p.presencePenalty = GET_FIELD(env, cls, j_params, "presencePenalty", "F", Float);
-    p.nPredict = GET_FIELD(env, cls, j_params, "nPredict", "I", Int);
+    p.temperature = GET_FIELD(env, j_params, f, temperature, Float);
+    p.topP = GET_FIELD(env, j_params, f, topP, Float);
+    p.topK = GET_FIELD(env, j_params, f, topK, Int);
+    p.minP = GET_FIELD(env, j_params, f, minP, Float);
+    p.typicalP = GET_FIELD(env, j_params, f, typicalP, Float);
+    p.repeatPenalty = GET_FIELD(env, j_params, f, repeatPenalty, Float);
+    p.repeatLastN = GET_FIELD(env, j_params, f, repeatLastN, Int);
+    p.frequencyPenalty = GET_FIELD(env, j_params, f, frequencyPenalty, Float);
+    p.presencePenalty = GET_FIELD(env, j_params, f, presencePenalty, Float);
+    p.nPredict = GET_FIELD(env, j_params, f, nPredict, Int);
+    p.seed = static_cast<uint32_t>(GET_FIELD(env, j_params, f, seed, Int));
+    p.stopSequences = get_string_list(env, j_params, f.stopSequences);
+    p.grammar = JniString(env, GET_STRING_FIELD(env, j_params, f, grammar)).str();
+    p.jsonSchema = JniString(env, GET_STRING_FIELD(env, j_params, f, jsonSchema)).str();
+    p.loraAdapter = GET_FIELD(env, j_params, f, loraAdapter, Int);
+    p.loraScale = GET_FIELD(env, j_params, f, loraScale, Float);
     return p;
 }
 
 SessionParams from_java_session_params(JNIEnv *env, jobject j_params) {
-    const auto cls = env->GetObjectClass(j_params);
+    const auto &f = g_jni_cache.session_fields;
     SessionParams p;
-    p.modelPath = JniString(env, GET_STRING_FIELD(env, cls, j_params, "modelPath")).str();
-    p.mmprojPath = JniString(env, GET_STRING_FIELD(env, cls, j_params, "mmprojPath")).str();
-    p.contextSize = GET_FIELD(env, cls, j_params, "contextSize", "I", Int);
-    p.batch = GET_FIELD(env, cls, j_params, "batch", "I", Int);
-    p.gpuLayers = GET_FIELD(env, cls, j_params, "gpuLayers", "I", Int);
-    p.mmprojUseGpu = GET_FIELD(env, cls, j_params, "mmprojUseGpu", "Z", Boolean);
-    p.threads = GET_FIELD(env, cls, j_params, "threads", "I", Int);
-    p.verbosity = GET_FIELD(env, cls, j_params, "verbosity", "I", Int);
-
-    const auto j_sampling = GET_OBJ_FIELD(env, cls, j_params, "sampling",
-                                          "io/actinis/kllama_cpp/data/model/params/SamplingParams");
+    p.modelPath = JniString(env, GET_STRING_FIELD(env, j_params, f, modelPath)).str();
+    p.mmprojPath = JniString(env, GET_STRING_FIELD(env, j_params, f, mmprojPath)).str();
+    p.contextSize = GET_FIELD(env, j_params, f, contextSize, Int);
+    p.batch = GET_FIELD(env, j_params, f, batch, Int);
+    p.ubatch = GET_FIELD(env, j_params, f, ubatch, Int);
+    p.gpuLayers = GET_FIELD(env, j_params, f, gpuLayers, Int);
+    p.mainGpu = GET_FIELD(env, j_params, f, mainGpu, Int);
+    p.splitMode = static_cast<SplitMode>(get_enum_ordinal(env, j_params, f.splitMode));
+    p.useMmap = GET_FIELD(env, j_params, f, useMmap, Boolean);
+    p.useMlock = GET_FIELD(env, j_params, f, useMlock, Boolean);
+    p.tensorOverrides = get_string_list(env, j_params, f.tensorOverrides);
+    p.loraAdapters = get_string_list(env, j_params, f.loraAdapters);
+    p.mmprojUseGpu = GET_FIELD(env, j_params, f, mmprojUseGpu, Boolean);
+    p.imagePipelining = GET_FIELD(env, j_params, f, imagePipelining, Boolean);
+    p.threads = GET_FIELD(env, j_params, f, threads, Int);
+    p.batchThreads = GET_FIELD(env, j_params, f, batchThreads, Int);
+    const auto j_affinity = env->GetObjectField(j_params, f.cpuAffinity);
+    const auto affinity_count = env->CallIntMethod(j_affinity, g_jni_cache.list_size);
+    p.cpuAffinity.reserve(affinity_count);
+    for (jint i = 0; i < affinity_count; ++i) {
+        const auto j_cpu = env->CallObjectMethod(j_affinity, g_jni_cache.list_get, i);
+        p.cpuAffinity.push_back(env->CallIntMethod(j_cpu, g_jni_cache.integer_int_value));
+        env->DeleteLocalRef(j_cpu);
+    }
+    env->DeleteLocalRef(j_affinity);
+    p.performanceCoresOnly = GET_FIELD(env, j_params, f, performanceCoresOnly, Boolean);
+    p.threadPoll = GET_FIELD(env, j_params, f, threadPoll, Int);
+    p.sharedThreadPool = GET_FIELD(env, j_params, f, sharedThreadPool, Boolean);
+    p.verbosity = GET_FIELD(env, j_params, f, verbosity, Int);
+    p.cacheTypeK = static_cast<KvCacheType>(get_enum_ordinal(env, j_params, f.cacheTypeK));
+    p.cacheTypeV = static_cast<KvCacheType>(get_enum_ordinal(env, j_params, f.cacheTypeV));
+    p.flashAttention = GET_FIELD(env, j_params, f, flashAttention, Boolean);
+    p.offloadKqv = GET_FIELD(env, j_params, f, offloadKqv, Boolean);
+    p.parallelSequences = GET_FIELD(env, j_params, f, parallelSequences, Int);
+    p.prefillChunk = GET_FIELD(env, j_params, f, prefillChunk, Int);
+    p.timeSlicedPrefill = GET_FIELD(env, j_params, f, timeSlicedPrefill, Boolean);
+    p.prefixCache = GET_FIELD(env, j_params, f, prefixCache, Boolean);
+    p.prefixCacheDir = JniString(env, GET_STRING_FIELD(env, j_params, f, prefixCacheDir)).str();
+    p.prefixCacheMB = GET_FIELD(env, j_params, f, prefixCacheMB, Int);
+    p.prefixCacheDiskMB = GET_FIELD(env, j_params, f, prefixCacheDiskMB, Int);
+    p.draftModelPath = JniString(env, GET_STRING_FIELD(env, j_params, f, draftModelPath)).str();
+    p.ngramDraft = GET_FIELD(env, j_params, f, ngramDraft, Boolean);
+    p.draftMax = GET_FIELD(env, j_params, f, draftMax, Int);
+    p.contextShift = GET_FIELD(env, j_params, f, contextShift, Boolean);
+    p.contextKeep = GET_FIELD(env, j_params, f, contextKeep, Int);
+    p.imageCacheMB = GET_FIELD(env, j_params, f, imageCacheMB, Int);
+    p.embeddings = GET_FIELD(env, j_params, f, embeddings, Boolean);
+    p.pooling = static_cast<PoolingType>(get_enum_ordinal(env, j_params, f.pooling));
+
+    const auto j_sampling = env->GetObjectField(j_params, f.sampling);
     p.sampling = from_java_sampling_params(env, j_sampling);
     env->DeleteLocalRef(j_sampling);
     return p;
 }
 
+std::vector<std::string> from_java_string_array(JNIEnv *env, jobjectArray j_strings) {
+    std::vector<std::string> strings;
+    const auto count = env->GetArrayLength(j_strings);
+    strings.reserve(count);
+    for (jsize i = 0; i < count; ++i) {
+        const auto j_string = static_cast<jstring>(env->GetObjectArrayElement(j_strings, i));
+        strings.push_back(JniString(env, j_string).str());
+        env->DeleteLocalRef(j_string);
+    }
+    return strings;
+}
+
 std::vector<MultimodalMessage> from_java_multimodal_message_array(JNIEnv *env, jobjectArray j_conversation) {
+    const auto &cache = g_jni_cache;
     std::vector<MultimodalMessage> conversation;
     const auto count = env->GetArrayLength(j_conversation);
     conversation.reserve(count);
 
-    const auto msg_cls = env->FindClass("io/actinis/kllama_cpp/data/model/message/MultimodalMessage");
-    const auto get_role = env->GetMethodID(msg_cls, "getRole",
-                                           "()Lio/actinis/kllama_cpp/data/model/message/MessageRole;");
-    const auto get_content = env->GetMethodID(msg_cls, "getContent", "()Ljava/lang/String;");
-    const auto get_images = env->GetMethodID(msg_cls, "getImages", "()Ljava/util/List;");
-
-    const auto role_cls = env->FindClass("io/actinis/kllama_cpp/data/model/message/MessageRole");
-    const auto role_ordinal = env->GetMethodID(role_cls, "ordinal", "()I");
-
-    const auto list_cls = env->FindClass("java/util/List");
-    const auto list_size = env->GetMethodID(list_cls, "size", "()I");
-    const auto list_get = env->GetMethodID(list_cls, "get", "(I)Ljava/lang/Object;");
-
-    const auto image_data_cls = env->FindClass("io/actinis/kllama_cpp/data/model/message/ImageData");
-    const auto get_data = env->GetMethodID(image_data_cls, "getData", "()[B");
-
     for (jsize i = 0; i < count; ++i) {
         const auto j_msg = env->GetObjectArrayElement(j_conversation, i);
         MultimodalMessage msg;
 
         // Role
-        const auto j_role = env->CallObjectMethod(j_msg, get_role);
-        int role_idx = env->CallIntMethod(j_role, role_ordinal);
+        const auto j_role = env->CallObjectMethod(j_msg, cache.message_get_role);
+        int role_idx = env->CallIntMethod(j_role, cache.enum_ordinal);
         msg.role = static_cast<MessageRole>(role_idx);
         env->DeleteLocalRef(j_role);
 
         // Content
-        const auto j_content = reinterpret_cast<jstring>(env->CallObjectMethod(j_msg, get_content));
+        const auto j_content = reinterpret_cast<jstring>(env->CallObjectMethod(j_msg, cache.message_get_content));
         msg.content = JniString(env, j_content).str();
         env->DeleteLocalRef(j_content);
 
         // Images
-        const auto j_images_list = env->CallObjectMethod(j_msg, get_images);
-        const auto images_count = env->CallIntMethod(j_images_list, list_size);
+        const auto j_images_list = env->CallObjectMethod(j_msg, cache.message_get_images);
+        const auto images_count = env->CallIntMethod(j_images_list, cache.list_size);
         for (jint j = 0; j < images_count; ++j) {
-            const auto j_image_data = env->CallObjectMethod(j_images_list, list_get, j);
-            const auto j_data_array = reinterpret_cast<jbyteArray>(env->CallObjectMethod(j_image_data, get_data));
-
-            auto *data_ptr = env->GetByteArrayElements(j_data_array, nullptr);
-            const auto len = env->GetArrayLength(j_data_array);
-            ImageData image_data;
-            image_data.data.assign(reinterpret_cast<uint8_t *>(data_ptr), reinterpret_cast<uint8_t *>(data_ptr) + len);
-            env->ReleaseByteArrayElements(j_data_array, data_ptr, JNI_ABORT);
-
-            msg.images.push_back(std::move(image_data));
-
-            env->DeleteLocalRef(j_data_array);
+            const auto j_image_data = env->CallObjectMethod(j_images_list, cache.list_get, j);
+            msg.images.push_back(from_java_image_data(env, j_image_data));
             env->DeleteLocalRef(j_image_data);
         }
         env->DeleteLocalRef(j_images_list);
@@ -637,3 +1313,187 @@ std::vector<MultimodalMessage> from_java_multimodal_message_array(JNIEnv *env, j
     }
     return conversation;
 }
+
+// Direct buffers are borrowed in place, they stay alive as long as the Kotlin caller holds the conversation
+ImageData from_java_image_data(JNIEnv *env, jobject j_image_data) {
+    const auto &cache = g_jni_cache;
+    ImageData image_data;
+    image_data.width = static_cast<uint32_t>(std::max(env->CallIntMethod(j_image_data, cache.image_data_get_width), 0));
+    image_data.height = static_cast<uint32_t>(
+        std::max(env->CallIntMethod(j_image_data, cache.image_data_get_height), 0));
+
+    if (const auto j_buffer = env->CallObjectMethod(j_image_data, cache.image_data_get_buffer)) {
+        const auto *address = static_cast<uint8_t *>(env->GetDirectBufferAddress(j_buffer));
+        if (address && env->IsInstanceOf(j_buffer, cache.byte_buffer_cls)) {
+            const auto position = env->CallIntMethod(j_buffer, cache.buffer_position);
+            const auto limit = env->CallIntMethod(j_buffer, cache.buffer_limit);
+            image_data.view = std::span(address + position, static_cast<size_t>(std::max(limit - position, 0)));
+        } else {
+            LOG_WARN(LOG_TAG, "Image buffer is not a direct ByteBuffer, ignoring it");
+        }
+        env->DeleteLocalRef(j_buffer);
+        if (!image_data.view.empty()) {
+            return image_data;
+        }
+    }
+
+    const auto j_data = reinterpret_cast<jbyteArray>(env->CallObjectMethod(j_image_data, cache.image_data_get_data));
+    const auto len = env->GetArrayLength(j_data);
+    image_data.data.resize(len);
+    env->GetByteArrayRegion(j_data, 0, len, reinterpret_cast<jbyte *>(image_data.data.data()));
+    env->DeleteLocalRef(j_data);
+    return image_data;
+}
+
+static bool init_jni_cache(JNIEnv *env) {
+    auto &c = g_jni_cache;
+    JniLookup lookup(env);
+
+    c.function0_cls = lookup.find_class("kotlin/jvm/functions/Function0");
+    c.function1_cls = lookup.find_class("kotlin/jvm/functions/Function1");
+    c.function2_cls = lookup.find_class("kotlin/jvm/functions/Function2");
+    c.float_cls = lookup.find_class("java/lang/Float");
+    const auto integer_cls = lookup.find_class("java/lang/Integer");
+    const auto unit_cls = lookup.find_class("kotlin/Unit");
+    c.array_list_cls = lookup.find_class("java/util/ArrayList");
+    const auto list_cls = lookup.find_class("java/util/List");
+    const auto enum_cls = lookup.find_class("java/lang/Enum");
+    const auto kllama_cls = lookup.find_class("io/actinis/kllama_cpp/KLlama");
+    c.success_cls = lookup.find_class("io/actinis/kllama_cpp/data/model/result/KLlamaResult$Success");
+    c.error_cls = lookup.find_class("io/actinis/kllama_cpp/data/model/result/KLlamaResult$Error");
+    const auto error_enum_cls = lookup.find_class("io/actinis/kllama_cpp/data/model/result/KLlamaError");
+    c.model_info_cls = lookup.find_class("io/actinis/kllama_cpp/data/model/info/ModelInfo");
+    c.memory_info_cls = lookup.find_class("io/actinis/kllama_cpp/data/model/info/MemoryInfo");
+    c.device_memory_info_cls = lookup.find_class("io/actinis/kllama_cpp/data/model/info/DeviceMemoryInfo");
+    c.generation_stats_cls = lookup.find_class("io/actinis/kllama_cpp/data/model/info/GenerationStats");
+    const auto state_enum_cls = lookup.find_class("io/actinis/kllama_cpp/data/model/GenerationState");
+    c.sampling_params_cls = lookup.find_class("io/actinis/kllama_cpp/data/model/params/SamplingParams");
+    const auto session_params_cls = lookup.find_class("io/actinis/kllama_cpp/data/model/params/SessionParams");
+    const auto message_cls = lookup.find_class("io/actinis/kllama_cpp/data/model/message/MultimodalMessage");
+    const auto image_data_cls = lookup.find_class("io/actinis/kllama_cpp/data/model/message/ImageData");
+    c.byte_buffer_cls = lookup.find_class("java/nio/ByteBuffer");
+    const auto byte_order_cls = lookup.find_class("java/nio/ByteOrder");
+    c.embeddings_cls = lookup.find_class("io/actinis/kllama_cpp/data/model/info/Embeddings");
+
+    c.function0_invoke = lookup.method(c.function0_cls, "invoke", "()Ljava/lang/Object;");
+    c.function1_invoke = lookup.method(c.function1_cls, "invoke", "(Ljava/lang/Object;)Ljava/lang/Object;");
+    c.function2_invoke = lookup.method(c.function2_cls, "invoke",
+                                       "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
+    c.float_value_of = lookup.static_method(c.float_cls, "valueOf", "(F)Ljava/lang/Float;");
+    c.integer_int_value = lookup.method(integer_cls, "intValue", "()I");
+    c.unit_instance = lookup.static_object(unit_cls, "INSTANCE", "Lkotlin/Unit;");
+    c.array_list_ctor = lookup.method(c.array_list_cls, "<init>", "()V");
+    c.list_add = lookup.method(list_cls, "add", "(Ljava/lang/Object;)Z");
+    c.list_size = lookup.method(list_cls, "size", "()I");
+    c.list_get = lookup.method(list_cls, "get", "(I)Ljava/lang/Object;");
+    c.enum_ordinal = lookup.method(enum_cls, "ordinal", "()I");
+
+    c.native_handle = lookup.field(kllama_cls, "nativeHandle", "J");
+
+    c.success_ctor = lookup.method(c.success_cls, "<init>", "(Ljava/lang/Object;)V");
+    c.error_ctor = lookup.method(c.error_cls, "<init>",
+                                 "(Lio/actinis/kllama_cpp/data/model/result/KLlamaError;Ljava/lang/String;)V");
+    for (size_t i = 0; i < std::size(k_error_names); ++i) {
+        c.error_values[i] = lookup.static_object(error_enum_cls, k_error_names[i].second,
+                                                 "Lio/actinis/kllama_cpp/data/model/result/KLlamaError;");
+    }
+
+    c.model_info_ctor = lookup.method(c.model_info_cls, "<init>",
+                                      "(Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;JIZLjava/util/List;)V");
+    c.memory_info_ctor = lookup.method(c.memory_info_cls, "<init>", "(JJJJJJJJLjava/util/List;)V");
+    c.device_memory_info_ctor = lookup.method(c.device_memory_info_cls, "<init>",
+                                              "(Ljava/lang/String;Ljava/lang/String;JJJ)V");
+    c.generation_stats_ctor = lookup.method(
+        c.generation_stats_cls, "<init>",
+        "(IIFFFFFFIIFIFFF[ILio/actinis/kllama_cpp/data/model/GenerationState;Lio/actinis/kllama_cpp/data/model/params/SamplingParams;)V");
+    for (size_t i = 0; i < std::size(k_generation_state_names); ++i) {
+        c.generation_state_values[i] = lookup.static_object(state_enum_cls, k_generation_state_names[i],
+                                                            "Lio/actinis/kllama_cpp/data/model/GenerationState;");
+    }
+    c.sampling_params_ctor = lookup.method(c.sampling_params_cls, "<init>", "(FFIFFFIFFIILjava/util/List;Ljava/lang/String;Ljava/lang/String;IF)V");
+
+    const auto sampling = c.sampling_params_cls;
+    c.sampling_fields = {
+        lookup.field(sampling, "temperature", "F"),
+        lookup.field(sampling, "topP", "F"),
+        lookup.field(sampling, "topK", "I"),
+        lookup.field(sampling, "minP", "F"),
+        lookup.field(sampling, "typicalP", "F"),
+        lookup.field(sampling, "repeatPenalty", "F"),
+        lookup.field(sampling, "repeatLastN", "I"),
+        lookup.field(sampling, "frequencyPenalty", "F"),
+        lookup.field(sampling, "presencePenalty", "F"),
+        lookup.field(sampling, "nPredict", "I"),
+        lookup.field(sampling, "seed", "I"),
+        lookup.field(sampling, "stopSequences", "Ljava/util/List;"),
+        lookup.field(sampling, "grammar", "Ljava/lang/String;"),
+        lookup.field(sampling, "jsonSchema", "Ljava/lang/String;"),
+        lookup.field(sampling, "loraAdapter", "I"),
+        lookup.field(sampling, "loraScale", "F"),
+    };
+
+    const auto session = session_params_cls;
+    c.session_fields = {
+        lookup.field(session, "modelPath", "Ljava/lang/String;"),
+        lookup.field(session, "mmprojPath", "Ljava/lang/String;"),
+        lookup.field(session, "contextSize", "I"),
+        lookup.field(session, "batch", "I"),
+        lookup.field(session, "ubatch", "I"),
+        lookup.field(session, "gpuLayers", "I"),
+        lookup.field(session, "mainGpu", "I"),
+        lookup.field(session, "splitMode", "Lio/actinis/kllama_cpp/data/model/params/SplitMode;"),
+        lookup.field(session, "useMmap", "Z"),
+        lookup.field(session, "useMlock", "Z"),
+        lookup.field(session, "tensorOverrides", "Ljava/util/List;"),
+        lookup.field(session, "loraAdapters", "Ljava/util/List;"),
+        lookup.field(session, "mmprojUseGpu", "Z"),
+        lookup.field(session, "imagePipelining", "Z"),
+        lookup.field(session, "threads", "I"),
+        lookup.field(session, "batchThreads", "I"),
+        lookup.field(session, "cpuAffinity", "Ljava/util/List;"),
+        lookup.field(session, "performanceCoresOnly", "Z"),
+        lookup.field(session, "threadPoll", "I"),
+        lookup.field(session, "sharedThreadPool", "Z"),
+        lookup.field(session, "verbosity", "I"),
+        lookup.field(session, "cacheTypeK", "Lio/actinis/kllama_cpp/data/model/params/KvCacheType;"),
+        lookup.field(session, "cacheTypeV", "Lio/actinis/kllama_cpp/data/model/params/KvCacheType;"),
+        lookup.field(session, "flashAttention", "Z"),
+        lookup.field(session, "offloadKqv", "Z"),
+        lookup.field(session, "parallelSequences", "I"),
+        lookup.field(session, "prefillChunk", "I"),
+        lookup.field(session, "timeSlicedPrefill", "Z"),
+        lookup.field(session, "prefixCache", "Z"),
+        lookup.field(session, "prefixCacheDir", "Ljava/lang/String;"),
+        lookup.field(session, "prefixCacheMB", "I"),
+        lookup.field(session, "prefixCacheDiskMB", "I"),
+        lookup.field(session, "draftModelPath", "Ljava/lang/String;"),
+        lookup.field(session, "ngramDraft", "Z"),
+        lookup.field(session, "draftMax", "I"),
+        lookup.field(session, "contextShift", "Z"),
+        lookup.field(session, "contextKeep", "I"),
+        lookup.field(session, "imageCacheMB", "I"),
+        lookup.field(session, "embeddings", "Z"),
+        lookup.field(session, "pooling", "Lio/actinis/kllama_cpp/data/model/params/PoolingType;"),
+        lookup.field(session, "sampling", "Lio/actinis/kllama_cpp/data/model/params/SamplingParams;"),
+    };
+
+    c.message_get_role = lookup.method(message_cls, "getRole",
+                                       "()Lio/actinis/kllama_cpp/data/model/message/MessageRole;");
+    c.message_get_content = lookup.method(message_cls, "getContent", "()Ljava/lang/String;");
+    c.message_get_images = lookup.method(message_cls, "getImages", "()Ljava/util/List;");
+    c.image_data_get_data = lookup.method(image_data_cls, "getData", "()[B");
+    c.image_data_get_width = lookup.method(image_data_cls, "getWidth", "()I");
+    c.image_data_get_height = lookup.method(image_data_cls, "getHeight", "()I");
+    c.image_data_get_buffer = lookup.method(image_data_cls, "getBuffer", "()Ljava/lang/Object;");
+    c.buffer_position = lookup.method(c.byte_buffer_cls, "position", "()I");
+    c.buffer_limit = lookup.method(c.byte_buffer_cls, "limit", "()I");
+    c.byte_buffer_allocate_direct = lookup.static_method(c.byte_buffer_cls, "allocateDirect",
+                                                         "(I)Ljava/nio/ByteBuffer;");
+    c.byte_buffer_order = lookup.method(c.byte_buffer_cls, "order", "(Ljava/nio/ByteOrder;)Ljava/nio/ByteBuffer;");
+    c.byte_buffer_as_float_buffer = lookup.method(c.byte_buffer_cls, "asFloatBuffer", "()Ljava/nio/FloatBuffer;");
+    const auto native_order_method = lookup.static_method(byte_order_cls, "nativeOrder", "()Ljava/nio/ByteOrder;");
+    c.native_byte_order = lookup.call_static_object(byte_order_cls, native_order_method, "nativeOrder");
+    c.embeddings_ctor = lookup.method(c.embeddings_cls, "<init>", "(IILjava/lang/Object;)V");
+
+    return lookup.finish();
+}
@@ -0,0 +1,98 @@
+#include "Backends.h"
+
+#include <filesystem>
+#include <mutex>
+
+#include "ggml-backend.h"
+
+#include "LlamaLog.h"
+
+#include "logging/logging.h"
+
+#if defined(KLLAMA_BACKEND_DL) && KLLAMA_BACKEND_DL
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+#endif
+
+#define LOG_TAG "KLlamaBackends"
+
+#if defined(KLLAMA_BACKEND_DL) && KLLAMA_BACKEND_DL
+
+// The directory this library was loaded from, where the build puts the backend modules. ggml's own
+// default looks next to the executable, which for the JVM is the java binary.
+static std::filesystem::path libraryDirectory() {
+#if defined(_WIN32)
+    HMODULE module = nullptr;
+    if (!GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                            reinterpret_cast<LPCWSTR>(&libraryDirectory), &module)) {
+        return {};
+    }
+    wchar_t path[MAX_PATH];
+    const auto length = GetModuleFileNameW(module, path, MAX_PATH);
+    if (length == 0 || length == MAX_PATH) {
+        return {};
+    }
+    return std::filesystem::path(path).parent_path();
+#else
+    Dl_info info{};
+    if (!dladdr(reinterpret_cast<void *>(&libraryDirectory), &info) || !info.dli_fname) {
+        return {};
+    }
+    return std::filesystem::path(info.dli_fname).parent_path();
+#endif
+}
+
+#endif
+
+void Backends::load() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        // The loader logs which variants it tried and why they were rejected
+        LlamaLog::install();
+#if defined(KLLAMA_BACKEND_DL) && KLLAMA_BACKEND_DL
+        const auto directory = libraryDirectory();
+        std::error_code error;
+        if (!directory.empty() && std::filesystem::is_directory(directory, error)) {
+            ggml_backend_load_all_from_path(directory.string().c_str());
+        }
+        // Not extracted (Android libraries stored in the APK), or moved: fall back to ggml's search paths
+        if (!ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU)) {
+            LOG_WARN(LOG_TAG, "No CPU backend in '%s', trying the default search paths", directory.string().c_str());
+            ggml_backend_load_all();
+        }
+        if (!ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU)) {
+            LOG_ERROR(LOG_TAG, "No CPU backend could be loaded");
+            return;
+        }
+#endif
+        LOG_INFO(LOG_TAG, "Using %s", cpuDescription().c_str());
+    });
+}
+
+std::string Backends::cpuDescription() {
+    auto *cpu = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    if (!cpu) {
+        return "no CPU backend";
+    }
+    auto *registry = ggml_backend_dev_backend_reg(cpu);
+    std::string description = ggml_backend_reg_name(registry);
+
+    const auto getFeatures = reinterpret_cast<ggml_backend_get_features_t>(
+        ggml_backend_reg_get_proc_address(registry, "ggml_backend_get_features"));
+    if (!getFeatures) {
+        return description;
+    }
+    std::string features;
+    for (const auto *feature = getFeatures(registry); feature && feature->name; ++feature) {
+        // Build options are listed along with the ISA extensions, with values other than "1"
+        if (std::string(feature->value) != "1") {
+            continue;
+        }
+        features += features.empty() ? "" : " ";
+        features += feature->name;
+    }
+    return features.empty() ? description : description + " (" + features + ")";
+}
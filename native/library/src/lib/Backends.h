@@ -0,0 +1,19 @@
+#ifndef KLLAMA_BACKENDS_H
+#define KLLAMA_BACKENDS_H
+
+#include <string>
+
+// Makes ggml's backends available before anything enumerates devices. Statically linked backends
+// register themselves, so this only does work in KLLAMA_CPU_VARIANTS builds (KLLAMA_BACKEND_DL):
+// there the backends are shared modules next to this library, and ggml loads the CPU variant that
+// scores best on the features of the CPU it runs on.
+class Backends {
+public:
+    // Loads the backend modules, once per process
+    static void load();
+
+    // The CPU backend in use and the features it was built for, e.g. "CPU (AVX2 FMA F16C)"
+    static std::string cpuDescription();
+};
+
+#endif
@@ -0,0 +1,481 @@
+#include "BatchEngine.h"
+
+#include <algorithm>
+
+#include "mtmd-helper.h"
+
+#include "Tracing.h"
+#include "Utils.h"
+#include "logging/logging.h"
+
+#define LOG_TAG "KLlamaBatchEngine"
+
+BatchEngine::Job::~Job() {
+    if (request.sampler && request.samplerCache) {
+        request.samplerCache->put(request.sampling, request.sampler);
+    } else if (request.sampler) {
+        llama_sampler_free(request.sampler);
+    }
+}
+
+BatchEngine::BatchEngine(llama_context *context, mtmd_context *visionContext, const int32_t sequences,
+                         const int32_t prefillBudget, EmbeddingCache *imageCache, ComputePool *computePool,
+                         std::vector<llama_adapter_lora *> loraAdapters)
+    : context(context),
+      visionContext(visionContext),
+      imageCache(imageCache),
+      computePool(computePool),
+      loraAdapters(std::move(loraAdapters)),
+      vocab(llama_model_get_vocab(llama_get_model(context))),
+      batchSize(static_cast<int32_t>(llama_n_batch(context))),
+      prefillBudget(prefillBudget > 0 ? std::min(prefillBudget, batchSize) : batchSize),
+      // Sequences split the context between them unless the KV cache is unified
+      contextPerSequence(static_cast<llama_pos>(llama_n_ctx(context) / std::max<uint32_t>(llama_n_seq_max(context), 1))) {
+    batch = llama_batch_init(batchSize, 0, 1);
+
+    slots.resize(sequences);
+    for (int32_t i = 0; i < sequences; ++i) {
+        slots[i].seqId = i;
+    }
+
+    worker = std::thread(&BatchEngine::run, this);
+}
+
+BatchEngine::~BatchEngine() {
+    stop();
+    llama_batch_free(batch);
+}
+
+void BatchEngine::stop() {
+    {
+        std::lock_guard lock(mutex);
+        if (stopping) {
+            return;
+        }
+        stopping = true;
+    }
+    wakeUp.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+KLlamaResult<std::string> BatchEngine::generate(BatchRequest request) {
+    const auto job = std::make_shared<Job>();
+    job->request = std::move(request);
+    auto future = job->promise.get_future();
+
+    {
+        std::lock_guard lock(mutex);
+        if (stopping) {
+            return KLlamaResult<std::string>(KLlamaError::OperationCancelled, "Batch engine is stopped");
+        }
+        queue.push_back(job);
+    }
+    wakeUp.notify_one();
+
+    return future.get();
+}
+
+void BatchEngine::run() {
+    while (true) {
+        {
+            std::unique_lock lock(mutex);
+            wakeUp.wait(lock, [this] { return stopping || !queue.empty() || hasActiveSlots(); });
+            if (stopping) {
+                break;
+            }
+            admitPending();
+        }
+        step();
+    }
+
+    // Fail whatever is left
+    for (auto &slot: slots) {
+        if (slot.job) {
+            finish(slot, KLlamaResult<std::string>(KLlamaError::OperationCancelled, "Batch engine is stopped"));
+        }
+    }
+    std::lock_guard lock(mutex);
+    for (const auto &job: queue) {
+        job->promise.set_value(KLlamaResult<std::string>(KLlamaError::OperationCancelled,
+                                                         "Batch engine is stopped"));
+    }
+    queue.clear();
+}
+
+bool BatchEngine::switchLoraAdapter(const int32_t index, const float scale) {
+    llama_clear_adapter_lora(context);
+    auto *memory = llama_get_memory(context);
+    for (auto &slot: slots) {
+        if (!slot.cache.empty()) {
+            llama_memory_seq_rm(memory, slot.seqId, -1, -1);
+            slot.cache.clear();
+        }
+    }
+    activeLora = -1;
+    activeLoraScale = 0.0f;
+
+    if (index >= 0) {
+        if (index >= static_cast<int32_t>(loraAdapters.size()) ||
+            llama_set_adapter_lora(context, loraAdapters[index], scale) != 0) {
+            return false;
+        }
+    }
+    activeLora = index;
+    activeLoraScale = scale;
+    LOG_DEBUG(LOG_TAG, "LoRA adapter %d applied at scale %.2f", index, scale);
+    return true;
+}
+
+bool BatchEngine::hasActiveSlots() const {
+    return std::ranges::any_of(slots, [](const Slot &slot) { return slot.job != nullptr; });
+}
+
+void BatchEngine::admitPending() {
+    auto *memory = llama_get_memory(context);
+
+    while (!queue.empty()) {
+        const auto &job = queue.front();
+        if (job->request.cancellationToken && job->request.cancellationToken->isCancelled()) {
+            job->promise.set_value(KLlamaResult<std::string>(KLlamaError::OperationCancelled));
+            queue.pop_front();
+            continue;
+        }
+
+        if (job->request.prompt.units.empty()) {
+            job->promise.set_value(KLlamaResult<std::string>(KLlamaError::InvalidParameters, "Prompt is empty"));
+            queue.pop_front();
+            continue;
+        }
+
+        // Requests keep their order, one on another adapter waits for the running ones to finish
+        const auto &request = job->request;
+        if (request.loraAdapter != activeLora || request.loraScale != activeLoraScale) {
+            if (hasActiveSlots()) {
+                return;
+            }
+            if (!switchLoraAdapter(request.loraAdapter, request.loraScale)) {
+                job->promise.set_value(KLlamaResult<std::string>(KLlamaError::ContextInitFailed,
+                                                                 "Failed to apply LoRA adapter"));
+                queue.pop_front();
+                continue;
+            }
+        }
+
+        // Prefer the free sequence that already holds the longest part of the prompt
+        const auto &units = job->request.prompt.units;
+        Slot *best = nullptr;
+        size_t bestPrefix = 0;
+        for (auto &slot: slots) {
+            if (slot.job) {
+                continue;
+            }
+            const auto prefix = slot.cache.commonPrefix(units);
+            if (!best || prefix > bestPrefix) {
+                best = &slot;
+                bestPrefix = prefix;
+            }
+        }
+        if (!best) {
+            return;
+        }
+
+        // The last prompt token is always re-evaluated, so that there are fresh logits to sample from
+        if (bestPrefix > 0 && bestPrefix == units.size()) {
+            --bestPrefix;
+        }
+        if (!llama_memory_seq_rm(memory, best->seqId, best->cache.positionAt(bestPrefix), -1)) {
+            llama_memory_seq_rm(memory, best->seqId, -1, -1);
+            bestPrefix = 0;
+        }
+        best->cache.truncate(bestPrefix);
+
+        best->job = job;
+        best->promptPos = bestPrefix;
+        best->mediaIndex = static_cast<size_t>(std::count_if(
+            units.begin(), units.begin() + static_cast<std::ptrdiff_t>(bestPrefix),
+            [](const PromptUnit &unit) { return unit.isMedia(); }));
+        best->pendingToken = LLAMA_TOKEN_NULL;
+        best->tokenCount = 0;
+        best->stopMatcher = StopMatcher(job->request.sampling.stopSequences);
+        best->response.clear();
+
+        LOG_DEBUG(LOG_TAG, "Sequence %d admitted, reusing %zu of %zu prompt units", best->seqId, bestPrefix,
+                  units.size());
+
+        ++active;
+        queue.pop_front();
+    }
+}
+
+void BatchEngine::addToBatch(const llama_token token, const llama_pos pos, const llama_seq_id seqId,
+                             const bool logits) {
+    const auto i = batch.n_tokens;
+    batch.token[i] = token;
+    batch.pos[i] = pos;
+    batch.n_seq_id[i] = 1;
+    batch.seq_id[i][0] = seqId;
+    batch.logits[i] = logits;
+    batch.n_tokens++;
+}
+
+void BatchEngine::step() {
+    batch.n_tokens = 0;
+
+    // 1. The next token of every generating sequence
+    for (auto &slot: slots) {
+        slot.batchCount = 0;
+        slot.logitsIndex = -1;
+        if (!slot.job) {
+            continue;
+        }
+
+        if (slot.job->request.cancellationToken && slot.job->request.cancellationToken->isCancelled()) {
+            finish(slot, KLlamaResult<std::string>(KLlamaError::OperationCancelled));
+            continue;
+        }
+
+        // A full sequence ends its response, as a full context does without shifting
+        if (slot.pendingToken != LLAMA_TOKEN_NULL && slot.cache.nPast() + 1 > contextPerSequence) {
+            LOG_WARN(LOG_TAG, "Context of sequence %d is full, stopping generation after %d tokens", slot.seqId,
+                     slot.tokenCount);
+            finishResponse(slot);
+            continue;
+        }
+
+        if (slot.pendingToken != LLAMA_TOKEN_NULL && batch.n_tokens < batchSize) {
+            slot.batchStart = batch.n_tokens;
+            slot.batchCount = 1;
+            slot.logitsIndex = batch.n_tokens;
+            addToBatch(slot.pendingToken, slot.cache.nPast(), slot.seqId, true);
+        }
+    }
+
+    // 2. Prefill of newly admitted sequences fills the rest of the batch, up to the prefill budget
+    const auto prefillLimit = std::min(batchSize, batch.n_tokens + prefillBudget);
+    for (auto &slot: slots) {
+        if (!slot.job || slot.pendingToken != LLAMA_TOKEN_NULL) {
+            continue;
+        }
+        if (batch.n_tokens >= prefillLimit) {
+            break;
+        }
+
+        const auto &prompt = slot.job->request.prompt;
+
+        // Media chunks can't share a batch with other sequences, so they are evaluated on their own
+        while (slot.promptPos < prompt.units.size() && prompt.units[slot.promptPos].isMedia()) {
+            const auto &unit = prompt.units[slot.promptPos];
+            llama_pos newPast = 0;
+            const auto *chunk = prompt.mediaChunks[slot.mediaIndex];
+            const bool logitsLast = slot.promptPos + 1 == prompt.units.size();
+            int32_t mediaResult = -1;
+            if (visionContext) {
+                const auto computeLock = lockCompute();
+                TRACE_SCOPE("encodeImage");
+                mediaResult = imageCache
+                                  ? imageCache->evaluate(visionContext, context, chunk, unit.mediaHash,
+                                                         slot.cache.nPast(), slot.seqId, batchSize, logitsLast,
+                                                         &newPast)
+                                  : mtmd_helper_eval_chunk_single(visionContext, context, chunk, slot.cache.nPast(),
+                                                                  slot.seqId, batchSize, logitsLast, &newPast);
+            }
+            if (mediaResult) {
+                finish(slot, KLlamaResult<std::string>(KLlamaError::EvaluationFailed,
+                                                       "Failed to evaluate multimodal prompt"), false);
+                break;
+            }
+            slot.cache.append(unit);
+            slot.promptPos++;
+            slot.mediaIndex++;
+            reportPrefill(slot);
+        }
+        if (!slot.job) {
+            continue;
+        }
+
+        slot.batchStart = batch.n_tokens;
+        const auto startPos = slot.cache.nPast();
+        while (batch.n_tokens < prefillLimit && slot.promptPos < prompt.units.size() &&
+               !prompt.units[slot.promptPos].isMedia()) {
+            const bool isLast = slot.promptPos + 1 == prompt.units.size();
+            if (isLast) {
+                slot.logitsIndex = batch.n_tokens;
+            }
+            addToBatch(prompt.units[slot.promptPos].token, startPos + slot.batchCount, slot.seqId, isLast);
+            slot.batchCount++;
+            slot.promptPos++;
+        }
+
+        if (slot.promptPos == prompt.units.size() && slot.batchCount == 0) {
+            finish(slot, KLlamaResult<std::string>(KLlamaError::EvaluationFailed,
+                                                   "Prompt must end with text to sample from"), false);
+        }
+    }
+
+    if (batch.n_tokens == 0) {
+        return;
+    }
+
+    if (decodeBatch(0, batch.n_tokens)) {
+        for (auto &slot: slots) {
+            if (slot.job && slot.batchCount > 0) {
+                advance(slot);
+            }
+        }
+        return;
+    }
+
+    // Decode the sequences one at a time, so that only the one that doesn't fit fails
+    LOG_WARN(LOG_TAG, "Decode failed, retrying each sequence on its own");
+    auto *memory = llama_get_memory(context);
+    for (const auto &slot: slots) {
+        if (slot.job && slot.batchCount > 0) {
+            llama_memory_seq_rm(memory, slot.seqId, slot.cache.nPast(), -1);
+        }
+    }
+    for (auto &slot: slots) {
+        if (!slot.job || slot.batchCount == 0) {
+            continue;
+        }
+        if (!decodeBatch(slot.batchStart, slot.batchCount)) {
+            finish(slot, KLlamaResult<std::string>(KLlamaError::EvaluationFailed, "Failed to decode batch"), false);
+            continue;
+        }
+        // Logits now come from the slot's part of the batch alone
+        if (slot.logitsIndex >= 0) {
+            slot.logitsIndex -= slot.batchStart;
+        }
+        advance(slot);
+    }
+}
+
+void BatchEngine::advance(Slot &slot) {
+    for (int32_t i = 0; i < slot.batchCount; ++i) {
+        slot.cache.appendToken(batch.token[slot.batchStart + i]);
+    }
+    if (slot.pendingToken == LLAMA_TOKEN_NULL) {
+        reportPrefill(slot);
+    }
+    slot.pendingToken = LLAMA_TOKEN_NULL;
+
+    if (slot.logitsIndex >= 0) {
+        sampleSlot(slot);
+    }
+}
+
+std::unique_lock<std::mutex> BatchEngine::lockCompute() const {
+    return computePool ? computePool->lock() : std::unique_lock<std::mutex>();
+}
+
+bool BatchEngine::decodeBatch(const int32_t start, const int32_t count) {
+    const llama_batch view = {
+        count,
+        batch.token + start,
+        nullptr,
+        batch.pos + start,
+        batch.n_seq_id + start,
+        batch.seq_id + start,
+        batch.logits + start,
+    };
+
+    const auto computeLock = lockCompute();
+    TRACE_SCOPE("llama_decode");
+    if (llama_decode(context, view) == 0) {
+        return true;
+    }
+
+    // Out of KV space: drop what idle sequences keep around for prefix reuse and try once more
+    auto *memory = llama_get_memory(context);
+    bool evicted = false;
+    for (auto &slot: slots) {
+        if (!slot.job && !slot.cache.empty()) {
+            llama_memory_seq_rm(memory, slot.seqId, -1, -1);
+            slot.cache.clear();
+            evicted = true;
+        }
+    }
+
+    if (!evicted) {
+        return false;
+    }
+
+    LOG_WARN(LOG_TAG, "Decode failed, retrying after evicting idle sequences");
+    return llama_decode(context, view) == 0;
+}
+
+void BatchEngine::reportPrefill(const Slot &slot) {
+    const auto &request = slot.job->request;
+    if (!request.progressCallback) {
+        return;
+    }
+
+    const auto total = request.prompt.units.size();
+    const auto done = static_cast<float>(slot.promptPos) / static_cast<float>(total);
+    if (slot.promptPos == total) {
+        request.progressCallback(0.6f, "Generating response");
+    } else {
+        request.progressCallback(0.4f + 0.2f * done, "Evaluating prompt");
+    }
+}
+
+void BatchEngine::sampleSlot(Slot &slot) {
+    auto &request = slot.job->request;
+
+    llama_token id;
+    {
+        TRACE_SCOPE("sample");
+        id = llama_sampler_sample(request.sampler, context, slot.logitsIndex);
+    }
+    if (id == LLAMA_TOKEN_NULL) {
+        finish(slot, KLlamaResult<std::string>(KLlamaError::SamplingFailed, "Sampler returned null token"));
+        return;
+    }
+
+    if (llama_vocab_is_eog(vocab, id)) {
+        finishResponse(slot);
+        return;
+    }
+
+    tokenToPiece(vocab, id, slot.piece);
+    slot.stopMatcher.push(slot.piece);
+    emit(slot);
+
+    if (++slot.tokenCount >= request.maxTokens || slot.stopMatcher.matched()) {
+        finishResponse(slot);
+        return;
+    }
+
+    slot.pendingToken = id;
+}
+
+void BatchEngine::emit(Slot &slot) {
+    if (slot.piece.empty()) {
+        return;
+    }
+    slot.response += slot.piece;
+    if (slot.job->request.tokenCallback) {
+        TRACE_SCOPE("tokenCallback");
+        slot.job->request.tokenCallback(slot.piece);
+    }
+}
+
+void BatchEngine::finishResponse(Slot &slot) {
+    slot.stopMatcher.flush(slot.piece);
+    emit(slot);
+    finish(slot, KLlamaResult(std::move(slot.response)));
+}
+
+void BatchEngine::finish(Slot &slot, KLlamaResult<std::string> result, const bool keepCache) {
+    if (!keepCache) {
+        llama_memory_seq_rm(llama_get_memory(context), slot.seqId, -1, -1);
+        slot.cache.clear();
+    }
+
+    slot.job->promise.set_value(std::move(result));
+    slot.job.reset();
+    slot.pendingToken = LLAMA_TOKEN_NULL;
+    slot.response.clear();
+    --active;
+}
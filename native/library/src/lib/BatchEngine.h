@@ -0,0 +1,150 @@
+#ifndef KLLAMA_BATCH_ENGINE_H
+#define KLLAMA_BATCH_ENGINE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "llama.h"
+#include "mtmd.h"
+
+#include "ComputePool.h"
+#include "EmbeddingCache.h"
+#include "KLlama.h"
+#include "PreparedPrompt.h"
+#include "SamplerCache.h"
+#include "SequenceCache.h"
+#include "StopMatcher.h"
+
+struct BatchRequest {
+    PreparedPrompt prompt;
+    llama_sampler *sampler = nullptr; // Owned by the engine once submitted
+    SamplerCache *samplerCache = nullptr; // Where the sampler goes back to when done, it is freed when null
+    SamplingParams sampling; // What the sampler was built from
+    int32_t loraAdapter = -1; // Into the engine's adapters, -1 = none
+    float loraScale = 0.0f;
+    int32_t maxTokens = 0;
+    TokenCallback tokenCallback;
+    ProgressCallback progressCallback; // Reports prefill progress, invoked on the engine thread
+    CancellationToken *cancellationToken = nullptr;
+};
+
+// Continuous batching scheduler: keeps up to `sequences` generations live in one
+// llama_context and decodes the next token of each of them, plus prefill chunks
+// of newly admitted requests, in a single llama_decode per step. LoRA adapters apply to the whole
+// context, so only requests on the same adapter run together; the others wait for them to finish.
+class BatchEngine {
+public:
+    // prefillBudget caps the prompt tokens added to one step, 0 fills the whole batch
+    BatchEngine(llama_context *context, mtmd_context *visionContext, int32_t sequences, int32_t prefillBudget = 0,
+                EmbeddingCache *imageCache = nullptr, ComputePool *computePool = nullptr,
+                std::vector<llama_adapter_lora *> loraAdapters = {});
+
+    ~BatchEngine();
+
+    BatchEngine(const BatchEngine &) = delete;
+
+    BatchEngine &operator=(const BatchEngine &) = delete;
+
+    // Blocks until the request is finished. Safe to call from several threads at once;
+    // the token callback is invoked on the engine thread.
+    KLlamaResult<std::string> generate(BatchRequest request);
+
+    // Fails queued and running requests and joins the engine thread
+    void stop();
+
+    [[nodiscard]] int32_t activeSequences() const { return active.load(); }
+
+    // Positions one sequence can hold, prompts have to fit in it
+    [[nodiscard]] llama_pos sequenceContext() const { return contextPerSequence; }
+
+private:
+    struct Job {
+        BatchRequest request;
+        std::promise<KLlamaResult<std::string> > promise;
+
+        ~Job();
+    };
+
+    struct Slot {
+        llama_seq_id seqId = 0;
+        SequenceCache cache; // What this sequence holds in the KV cache, kept for prefix reuse
+        std::shared_ptr<Job> job; // null when the slot is free
+
+        size_t promptPos = 0; // Next prompt unit to evaluate
+        size_t mediaIndex = 0; // Next media chunk to evaluate
+        llama_token pendingToken = LLAMA_TOKEN_NULL; // Sampled but not yet decoded
+
+        int32_t batchStart = 0; // Tokens this slot put into the current batch
+        int32_t batchCount = 0;
+        int32_t logitsIndex = -1;
+
+        int32_t tokenCount = 0;
+        StopMatcher stopMatcher;
+        std::string response;
+        std::string piece; // Reused for every token
+    };
+
+    void run();
+
+    void admitPending();
+
+    // Applies another adapter, with no sequence running. The idle sequences' caches were computed without it.
+    bool switchLoraAdapter(int32_t index, float scale);
+
+    void step();
+
+    void addToBatch(llama_token token, llama_pos pos, llama_seq_id seqId, bool logits);
+
+    // Decodes `count` tokens of the batch from `start`
+    bool decodeBatch(int32_t start, int32_t count);
+
+    // Takes in what the slot put into the decoded batch and samples its next token
+    void advance(Slot &slot);
+
+    [[nodiscard]] std::unique_lock<std::mutex> lockCompute() const;
+
+    void sampleSlot(Slot &slot);
+
+    static void reportPrefill(const Slot &slot);
+
+    // Passes slot.piece on to the response and the token callback
+    static void emit(Slot &slot);
+
+    // Finishes with the response, including text held back by the stop matcher
+    void finishResponse(Slot &slot);
+
+    void finish(Slot &slot, KLlamaResult<std::string> result, bool keepCache = true);
+
+    [[nodiscard]] bool hasActiveSlots() const;
+
+    llama_context *context;
+    mtmd_context *visionContext;
+    EmbeddingCache *imageCache;
+    ComputePool *computePool;
+    std::vector<llama_adapter_lora *> loraAdapters;
+    int32_t activeLora = -1;
+    float activeLoraScale = 0.0f;
+    const llama_vocab *vocab;
+    int32_t batchSize;
+    int32_t prefillBudget;
+    llama_pos contextPerSequence;
+    llama_batch batch{};
+
+    std::vector<Slot> slots;
+    std::atomic<int32_t> active{0};
+
+    std::deque<std::shared_ptr<Job> > queue;
+    std::mutex mutex;
+    std::condition_variable wakeUp;
+    bool stopping = false;
+    std::thread worker;
+};
+
+#endif
@@ -0,0 +1,171 @@
+#include "ComputePool.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <thread>
+
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+
+#include "Backends.h"
+
+#include "logging/logging.h"
+
+#define LOG_TAG "KLlamaComputePool"
+
+// ggml's own default
+static constexpr int DEFAULT_POLL = 50;
+
+using ThreadPoolNew = decltype(ggml_threadpool_new);
+using ThreadPoolFree = decltype(ggml_threadpool_free);
+
+// Resolved through the CPU backend registry so that this also works with dynamically loaded backends
+static ThreadPoolNew *threadPoolNew = nullptr;
+static ThreadPoolFree *threadPoolFree = nullptr;
+
+static bool resolveThreadPoolFunctions() {
+    if (threadPoolNew && threadPoolFree) {
+        return true;
+    }
+    Backends::load();
+    auto *cpu = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    if (!cpu) {
+        return false;
+    }
+    auto *registry = ggml_backend_dev_backend_reg(cpu);
+    threadPoolNew = reinterpret_cast<ThreadPoolNew *>(
+        ggml_backend_reg_get_proc_address(registry, "ggml_threadpool_new"));
+    threadPoolFree = reinterpret_cast<ThreadPoolFree *>(
+        ggml_backend_reg_get_proc_address(registry, "ggml_threadpool_free"));
+    return threadPoolNew && threadPoolFree;
+}
+
+// Shared pools by their settings, kept weak so that the last session frees the threads
+static std::mutex registryMutex;
+static std::map<std::string, std::weak_ptr<ComputePool> > registry;
+
+// The little cores of big.LITTLE systems report a lower maximum frequency than the rest
+static std::vector<int> performanceCpus() {
+    std::vector<int> cpus;
+#if defined(__linux__)
+    const auto count = static_cast<int>(std::thread::hardware_concurrency());
+    std::vector<long> maxFrequencies(count, 0);
+    for (int cpu = 0; cpu < count; ++cpu) {
+        char path[96];
+        std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/cpuinfo_max_freq", cpu);
+        if (FILE *file = std::fopen(path, "r")) {
+            if (std::fscanf(file, "%ld", &maxFrequencies[cpu]) != 1) {
+                maxFrequencies[cpu] = 0;
+            }
+            std::fclose(file);
+        }
+    }
+
+    const auto [lowest, highest] = std::ranges::minmax(maxFrequencies);
+    if (highest == 0 || lowest == highest) {
+        return cpus; // Homogeneous or unknown, every core is a performance core
+    }
+    for (int cpu = 0; cpu < count; ++cpu) {
+        if (maxFrequencies[cpu] > lowest) {
+            cpus.push_back(cpu);
+        }
+    }
+#endif
+    return cpus;
+}
+
+std::vector<int> ComputePool::allowedCpus(const SessionParams &params) {
+    if (!params.cpuAffinity.empty()) {
+        return params.cpuAffinity;
+    }
+    if (params.performanceCoresOnly) {
+        return performanceCpus();
+    }
+    return {};
+}
+
+static ggml_threadpool_t createThreadPool(const int threads, const std::vector<int> &cpus, const int poll) {
+    auto poolParams = ggml_threadpool_params_default(threads);
+    poolParams.poll = static_cast<uint32_t>(poll);
+    if (!cpus.empty()) {
+        std::fill(std::begin(poolParams.cpumask), std::end(poolParams.cpumask), false);
+        for (const auto cpu: cpus) {
+            if (cpu >= 0 && cpu < GGML_MAX_N_THREADS) {
+                poolParams.cpumask[cpu] = true;
+            }
+        }
+    }
+    return threadPoolNew(&poolParams);
+}
+
+ComputePool::ComputePool(const bool shared, const ggml_threadpool_t decode, const ggml_threadpool_t batch)
+    : shared(shared), decode(decode), batch(batch) {
+}
+
+ComputePool::~ComputePool() {
+    if (batch) {
+        threadPoolFree(batch);
+    }
+    if (decode) {
+        threadPoolFree(decode);
+    }
+}
+
+std::unique_lock<std::mutex> ComputePool::lock() {
+    return shared ? std::unique_lock(computeMutex) : std::unique_lock<std::mutex>();
+}
+
+KLlamaResult<std::shared_ptr<ComputePool> > ComputePool::acquire(const SessionParams &params) {
+    using Result = KLlamaResult<std::shared_ptr<ComputePool> >;
+
+    const auto cpus = allowedCpus(params);
+    if (cpus.empty() && params.threadPoll == DEFAULT_POLL && !params.sharedThreadPool) {
+        return Result(nullptr);
+    }
+
+    const auto batchThreads = params.batchThreads > 0 ? params.batchThreads : params.threads;
+    std::string key = std::to_string(params.threads) + "/" + std::to_string(batchThreads) + "/" +
+                      std::to_string(params.threadPoll);
+    for (const auto cpu: cpus) {
+        key += "," + std::to_string(cpu);
+    }
+
+    std::lock_guard lock(registryMutex);
+    if (params.sharedThreadPool) {
+        if (const auto it = registry.find(key); it != registry.end()) {
+            if (auto existing = it->second.lock()) {
+                return Result(std::move(existing));
+            }
+            registry.erase(it);
+        }
+    }
+
+    if (!resolveThreadPoolFunctions()) {
+        return Result(KLlamaError::ContextInitFailed, "CPU backend doesn't provide threadpools");
+    }
+
+    auto *decode = createThreadPool(params.threads, cpus, params.threadPoll);
+    auto *batch = batchThreads != params.threads ? createThreadPool(batchThreads, cpus, params.threadPoll) : nullptr;
+    if (!decode || (batchThreads != params.threads && !batch)) {
+        if (decode) {
+            threadPoolFree(decode);
+        }
+        if (batch) {
+            threadPoolFree(batch);
+        }
+        return Result(KLlamaError::ContextInitFailed, "Failed to create compute threads");
+    }
+
+    // Can't use make_shared with the private constructor
+    std::shared_ptr<ComputePool> pool(new ComputePool(params.sharedThreadPool, decode, batch));
+    if (params.sharedThreadPool) {
+        registry[key] = pool;
+    }
+
+    LOG_DEBUG(LOG_TAG, "Compute threads created: %d decode, %d prefill, %zu allowed CPUs, poll %d%s",
+              params.threads, batchThreads, cpus.size(), params.threadPoll,
+              params.sharedThreadPool ? ", shared" : "");
+
+    return Result(std::move(pool));
+}
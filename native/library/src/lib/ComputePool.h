@@ -0,0 +1,45 @@
+#ifndef KLLAMA_COMPUTE_POOL_H
+#define KLLAMA_COMPUTE_POOL_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ggml.h"
+
+#include "KLlama.h"
+
+// The ggml threadpools a context computes on: one for decoding and one for prefill batches.
+// Sessions with the same thread settings can share a pool, in which case they take turns on it
+// (a ggml threadpool runs one graph at a time) instead of oversubscribing the cores.
+class ComputePool {
+public:
+    ~ComputePool();
+
+    ComputePool(const ComputePool &) = delete;
+
+    ComputePool &operator=(const ComputePool &) = delete;
+
+    // Returns null without error when the params leave threading to llama.cpp
+    static KLlamaResult<std::shared_ptr<ComputePool> > acquire(const SessionParams &params);
+
+    [[nodiscard]] ggml_threadpool_t decodePool() const { return decode; }
+    [[nodiscard]] ggml_threadpool_t batchPool() const { return batch ? batch : decode; }
+
+    // Held around every compute on a shared pool, a no-op otherwise
+    [[nodiscard]] std::unique_lock<std::mutex> lock();
+
+    // CPUs the params allow, empty = any
+    static std::vector<int> allowedCpus(const SessionParams &params);
+
+private:
+    ComputePool(bool shared, ggml_threadpool_t decode, ggml_threadpool_t batch);
+
+    bool shared;
+    ggml_threadpool_t decode;
+    ggml_threadpool_t batch; // null when prefill uses the decode pool
+    std::mutex computeMutex;
+};
+
+#endif
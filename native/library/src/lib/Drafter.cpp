@@ -0,0 +1,150 @@
+#include "Drafter.h"
+
+#include <algorithm>
+
+#include "KLlamaModel.h"
+#include "logging/logging.h"
+
+#define LOG_TAG "KLlamaDrafter"
+
+static constexpr size_t NGRAM_MAX = 4;
+static constexpr size_t NGRAM_MIN = 2;
+
+void NgramDrafter::propose(const std::vector<llama_token> &history, const int32_t maxTokens,
+                           std::vector<llama_token> &draft) {
+    draft.clear();
+    const auto size = history.size();
+
+    // Longer matches are more reliable, fall back to shorter ones
+    for (auto n = std::min(NGRAM_MAX, size - std::min(size, size_t{1})); n >= NGRAM_MIN; --n) {
+        const auto *gram = history.data() + size - n;
+        for (size_t start = size - n; start-- > 0;) {
+            if (!std::equal(gram, gram + n, history.data() + start)) {
+                continue;
+            }
+            for (auto i = start + n; i < size && draft.size() < static_cast<size_t>(maxTokens); ++i) {
+                if (history[i] == LLAMA_TOKEN_NULL) {
+                    break;
+                }
+                draft.push_back(history[i]);
+            }
+            return;
+        }
+    }
+}
+
+ModelDrafter::~ModelDrafter() {
+    if (batch.token) {
+        llama_batch_free(batch);
+    }
+    if (sampler) {
+        llama_sampler_free(sampler);
+    }
+    if (context) {
+        llama_free(context);
+    }
+}
+
+KLlamaResult<std::unique_ptr<ModelDrafter> > ModelDrafter::create(const SessionParams &params,
+                                                                  const llama_model *targetModel) {
+    using Result = KLlamaResult<std::unique_ptr<ModelDrafter> >;
+
+    auto draftParams = params;
+    draftParams.modelPath = params.draftModelPath;
+    auto modelResult = KLlamaModel::acquire(draftParams);
+    if (modelResult.isError()) {
+        return Result(modelResult.error, "Failed to load draft model: " + modelResult.errorMessage);
+    }
+
+    // Drafted tokens go straight into the target, the vocabularies must agree
+    const auto *targetVocab = llama_model_get_vocab(targetModel);
+    const auto *draftVocab = llama_model_get_vocab(modelResult.value->get());
+    if (llama_vocab_n_tokens(targetVocab) != llama_vocab_n_tokens(draftVocab) ||
+        llama_vocab_bos(targetVocab) != llama_vocab_bos(draftVocab) ||
+        llama_vocab_eos(targetVocab) != llama_vocab_eos(draftVocab)) {
+        return Result(KLlamaError::ModelInvalid, "Draft model vocabulary doesn't match the target model");
+    }
+
+    std::unique_ptr<ModelDrafter> drafter(new ModelDrafter());
+    drafter->model = std::move(modelResult.value);
+
+    auto contextParams = llama_context_default_params();
+    contextParams.n_ctx = params.contextSize;
+    contextParams.n_batch = params.batch;
+    contextParams.n_threads = params.threads;
+    contextParams.n_threads_batch = params.threads;
+
+    drafter->context = llama_init_from_model(drafter->model->get(), contextParams);
+    if (!drafter->context) {
+        return Result(KLlamaError::ContextInitFailed, "Failed to initialize draft context");
+    }
+
+    drafter->sampler = llama_sampler_init_greedy();
+    drafter->batchSize = static_cast<int32_t>(llama_n_batch(drafter->context));
+    drafter->batch = llama_batch_init(drafter->batchSize, 0, 1);
+
+    return Result(std::move(drafter));
+}
+
+void ModelDrafter::propose(const std::vector<llama_token> &history, const int32_t maxTokens,
+                           std::vector<llama_token> &draft) {
+    draft.clear();
+
+    // The draft model has no vision, it can't follow a sequence with media in it
+    if (history.empty() || std::ranges::find(history, LLAMA_TOKEN_NULL) != history.end()) {
+        return;
+    }
+
+    // Keep what the draft context shares with the history, the last token is always re-decoded for its logits
+    size_t common = 0;
+    while (common < cached.size() && common + 1 < history.size() && cached[common] == history[common]) {
+        ++common;
+    }
+    auto *memory = llama_get_memory(context);
+    if (!llama_memory_seq_rm(memory, 0, static_cast<llama_pos>(common), -1)) {
+        llama_memory_seq_rm(memory, 0, -1, -1);
+        common = 0;
+    }
+    cached.resize(common);
+
+    if (!decode(history.data() + common, static_cast<int32_t>(history.size() - common))) {
+        llama_memory_seq_rm(memory, 0, -1, -1);
+        cached.clear();
+        return;
+    }
+
+    const auto *vocab = llama_model_get_vocab(model->get());
+    while (static_cast<int32_t>(draft.size()) < maxTokens) {
+        const auto id = llama_sampler_sample(sampler, context, -1);
+        if (id == LLAMA_TOKEN_NULL || llama_vocab_is_eog(vocab, id)) {
+            break;
+        }
+        draft.push_back(id);
+
+        if (static_cast<int32_t>(draft.size()) == maxTokens || !decode(&id, 1)) {
+            break;
+        }
+    }
+}
+
+bool ModelDrafter::decode(const llama_token *tokens, const int32_t count) {
+    for (int32_t start = 0; start < count; start += batchSize) {
+        const auto chunkSize = std::min(batchSize, count - start);
+
+        batch.n_tokens = chunkSize;
+        for (int32_t i = 0; i < chunkSize; ++i) {
+            batch.token[i] = tokens[start + i];
+            batch.pos[i] = static_cast<llama_pos>(cached.size() + i);
+            batch.n_seq_id[i] = 1;
+            batch.seq_id[i][0] = 0;
+            batch.logits[i] = start + i + 1 == count;
+        }
+
+        if (llama_decode(context, batch)) {
+            LOG_WARN(LOG_TAG, "Draft decode failed");
+            return false;
+        }
+        cached.insert(cached.end(), tokens + start, tokens + start + chunkSize);
+    }
+    return true;
+}
@@ -0,0 +1,60 @@
+#ifndef KLLAMA_DRAFTER_H
+#define KLLAMA_DRAFTER_H
+
+#include <memory>
+#include <vector>
+
+#include "llama.h"
+
+#include "KLlama.h"
+
+class KLlamaModel;
+
+// Proposes the tokens likely to follow a sequence, for the target model to verify in one
+// batched decode (speculative decoding). Drafts only affect speed, never the output.
+class Drafter {
+public:
+    virtual ~Drafter() = default;
+
+    // history is everything in the target sequence, media chunks as LLAMA_TOKEN_NULL
+    virtual void propose(const std::vector<llama_token> &history, int32_t maxTokens,
+                         std::vector<llama_token> &draft) = 0;
+};
+
+// Prompt lookup: continues the latest earlier occurrence of the history's last n-gram.
+// Free to run and effective when the output quotes the input, as in summarization.
+class NgramDrafter final : public Drafter {
+public:
+    void propose(const std::vector<llama_token> &history, int32_t maxTokens,
+                 std::vector<llama_token> &draft) override;
+};
+
+// Greedy continuation from a small model sharing the target's vocabulary
+class ModelDrafter final : public Drafter {
+public:
+    ~ModelDrafter() override;
+
+    ModelDrafter(const ModelDrafter &) = delete;
+
+    ModelDrafter &operator=(const ModelDrafter &) = delete;
+
+    static KLlamaResult<std::unique_ptr<ModelDrafter> > create(const SessionParams &params,
+                                                              const llama_model *targetModel);
+
+    void propose(const std::vector<llama_token> &history, int32_t maxTokens,
+                 std::vector<llama_token> &draft) override;
+
+private:
+    ModelDrafter() = default;
+
+    bool decode(const llama_token *tokens, int32_t count);
+
+    std::shared_ptr<KLlamaModel> model;
+    llama_context *context = nullptr;
+    llama_sampler *sampler = nullptr;
+    llama_batch batch{};
+    int32_t batchSize = 0;
+    std::vector<llama_token> cached; // What the draft context holds
+};
+
+#endif
@@ -0,0 +1,116 @@
+#include "EmbeddingCache.h"
+
+#include <cstring>
+
+#include "mtmd-helper.h"
+
+#include "logging/logging.h"
+
+#define LOG_TAG "KLlamaEmbeddingCache"
+
+EmbeddingCache::EmbeddingCache(const size_t budgetBytes) : budget(budgetBytes) {
+}
+
+int32_t EmbeddingCache::evaluate(
+    mtmd_context *visionContext,
+    llama_context *context,
+    const mtmd_input_chunk *chunk,
+    const uint64_t hash,
+    const llama_pos nPast,
+    const llama_seq_id seqId,
+    const int32_t batchSize,
+    const bool logitsLast,
+    llama_pos *newPast
+) {
+    // Decoding precomputed embeddings never yields logits, a trailing image takes the regular path
+    if (hash == 0 || logitsLast || mtmd_input_chunk_get_type(chunk) != MTMD_INPUT_CHUNK_TYPE_IMAGE) {
+        return mtmd_helper_eval_chunk_single(visionContext, context, chunk, nPast, seqId, batchSize, logitsLast,
+                                             newPast);
+    }
+
+    const auto embedding = encode(visionContext, llama_get_model(context), chunk, hash);
+    if (!embedding) {
+        return -1;
+    }
+
+    // Only read, the helper just isn't const-correct
+    return mtmd_helper_decode_image_chunk(visionContext, context, chunk, embedding->data(), nPast, seqId, batchSize,
+                                          newPast);
+}
+
+EmbeddingCache::Embedding EmbeddingCache::encode(
+    mtmd_context *visionContext,
+    const llama_model *model,
+    const mtmd_input_chunk *chunk,
+    const uint64_t hash
+) {
+    if (auto embedding = find(hash)) {
+        LOG_DEBUG(LOG_TAG, "Reusing the embedding of image %016llx", static_cast<unsigned long long>(hash));
+        return embedding;
+    }
+
+    auto embedding = encodeChunk(visionContext, model, chunk);
+    if (embedding) {
+        insert(hash, embedding);
+    }
+    return embedding;
+}
+
+EmbeddingCache::Embedding EmbeddingCache::encodeChunk(
+    mtmd_context *visionContext,
+    const llama_model *model,
+    const mtmd_input_chunk *chunk
+) {
+    if (mtmd_encode_chunk(visionContext, chunk) != 0) {
+        return nullptr;
+    }
+
+    const auto size = mtmd_input_chunk_get_n_tokens(chunk) * static_cast<size_t>(llama_model_n_embd(model));
+    auto embedding = std::make_shared<std::vector<float> >(size);
+    std::memcpy(embedding->data(), mtmd_get_output_embd(visionContext), size * sizeof(float));
+    return embedding;
+}
+
+size_t EmbeddingCache::usedBytes() const {
+    std::lock_guard lock(mutex);
+    return used;
+}
+
+void EmbeddingCache::clear() {
+    std::lock_guard lock(mutex);
+    entries.clear();
+    index.clear();
+    used = 0;
+}
+
+EmbeddingCache::Embedding EmbeddingCache::find(const uint64_t hash) {
+    std::lock_guard lock(mutex);
+    const auto it = index.find(hash);
+    if (it == index.end()) {
+        return nullptr;
+    }
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->embedding;
+}
+
+void EmbeddingCache::insert(const uint64_t hash, Embedding embedding) {
+    const auto bytes = embedding->size() * sizeof(float);
+    if (bytes > budget) {
+        return;
+    }
+
+    std::lock_guard lock(mutex);
+    if (index.contains(hash)) {
+        return;
+    }
+
+    while (used + bytes > budget && !entries.empty()) {
+        used -= entries.back().embedding->size() * sizeof(float);
+        index.erase(entries.back().hash);
+        entries.pop_back();
+    }
+
+    entries.push_front({hash, std::move(embedding)});
+    index[hash] = entries.begin();
+    used += bytes;
+}
@@ -0,0 +1,58 @@
+#ifndef KLLAMA_EMBEDDING_CACHE_H
+#define KLLAMA_EMBEDDING_CACHE_H
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "llama.h"
+#include "mtmd.h"
+
+// LRU cache of encoded image embeddings keyed by image content hash, so that an image
+// sent again in a later turn skips the vision encoder. Shared by the engine thread
+// and the calling threads, hence locked.
+class EmbeddingCache {
+public:
+    explicit EmbeddingCache(size_t budgetBytes);
+
+    // Evaluates a media chunk into seqId like mtmd_helper_eval_chunk_single, encoding it only on a cache miss.
+    // Returns 0 on success.
+    int32_t evaluate(mtmd_context *visionContext, llama_context *context, const mtmd_input_chunk *chunk,
+                     uint64_t hash, llama_pos nPast, llama_seq_id seqId, int32_t batchSize, bool logitsLast,
+                     llama_pos *newPast);
+
+    using Embedding = std::shared_ptr<std::vector<float> >;
+
+    // The embedding of an image chunk, encoded only on a cache miss. Null when encoding fails.
+    Embedding encode(mtmd_context *visionContext, const llama_model *model, const mtmd_input_chunk *chunk,
+                     uint64_t hash);
+
+    // Runs the vision encoder on an image chunk and copies its output, which the next encode overwrites
+    static Embedding encodeChunk(mtmd_context *visionContext, const llama_model *model,
+                                 const mtmd_input_chunk *chunk);
+
+    [[nodiscard]] size_t usedBytes() const;
+
+    void clear();
+
+private:
+    struct Entry {
+        uint64_t hash;
+        Embedding embedding;
+    };
+
+    Embedding find(uint64_t hash);
+
+    void insert(uint64_t hash, Embedding embedding);
+
+    size_t budget;
+    size_t used = 0;
+    std::list<Entry> entries; // Most recently used first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+    mutable std::mutex mutex;
+};
+
+#endif
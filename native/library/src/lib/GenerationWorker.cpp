@@ -0,0 +1,174 @@
+#include "GenerationWorker.h"
+
+#include <algorithm>
+
+#include "Tracing.h"
+#include "Utils.h"
+#include "logging/logging.h"
+
+#define LOG_TAG "KLlamaGenerationWorker"
+
+GenerationJob::GenerationJob(GenerationRequest request, const bool backpressure)
+    : request(std::move(request)),
+      backpressure(backpressure),
+      lastNotify(std::chrono::steady_clock::now()) {
+}
+
+void GenerationJob::poll(std::string &text) {
+    {
+        std::lock_guard lock(mutex);
+        const auto length = finalResult ? pending.size() : completeUtf8Length(pending);
+        text.append(pending, 0, length);
+        pending.erase(0, length);
+        pendingTokens = 0;
+        notified = false;
+    }
+    drained.notify_all();
+}
+
+std::optional<KLlamaResult<std::string> > GenerationJob::result() const {
+    std::lock_guard lock(mutex);
+    return finalResult;
+}
+
+void GenerationJob::cancel() {
+    {
+        // Under the lock, so that a generation waiting for a poll can't miss it
+        std::lock_guard lock(mutex);
+        cancellationToken.cancel();
+    }
+    drained.notify_all();
+}
+
+void GenerationJob::append(const std::string &piece) {
+    std::unique_lock lock(mutex);
+    while (backpressure && pending.size() >= request.bufferBytes && !cancellationToken.isCancelled()) {
+        // A full buffer is ready to poll, whatever the notification thresholds say
+        if (!notified) {
+            notified = true;
+            lock.unlock();
+            notifyReady();
+            lock.lock();
+            continue;
+        }
+        TRACE_SCOPE("generationWorker::backpressure");
+        drained.wait(lock);
+    }
+
+    pending += piece;
+    ++pendingTokens;
+    if (notified) {
+        return;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    const auto interval = std::chrono::milliseconds(request.notifyIntervalMs);
+    if (pendingTokens >= request.notifyTokens || (interval.count() > 0 && now - lastNotify >= interval)) {
+        notified = true;
+        lastNotify = now;
+        lock.unlock();
+        notifyReady();
+    }
+}
+
+void GenerationJob::finish(KLlamaResult<std::string> result) {
+    {
+        std::lock_guard lock(mutex);
+        finalResult = std::move(result);
+    }
+    notifyReady();
+}
+
+void GenerationJob::notifyReady() const {
+    if (request.onReady) {
+        request.onReady();
+    }
+}
+
+GenerationWorker::GenerationWorker(KLlama &kllama, const int32_t threads, const bool backpressure)
+    : kllama(kllama),
+      threadCount(std::max(threads, 1)),
+      backpressure(backpressure) {
+}
+
+GenerationWorker::~GenerationWorker() {
+    stop();
+}
+
+std::shared_ptr<GenerationJob> GenerationWorker::submit(GenerationRequest request) {
+    // Not make_shared, the constructor is private
+    std::shared_ptr<GenerationJob> job(new GenerationJob(std::move(request), backpressure));
+    bool accepted = false;
+    {
+        std::lock_guard lock(mutex);
+        if (!stopping) {
+            queue.push_back(job);
+            accepted = true;
+            if (threads.empty()) {
+                for (int32_t i = 0; i < threadCount; ++i) {
+                    threads.emplace_back(&GenerationWorker::run, this);
+                }
+            }
+        }
+    }
+    if (!accepted) {
+        job->finish(KLlamaResult<std::string>(KLlamaError::OperationCancelled, "Session is closing"));
+        return job;
+    }
+    wakeUp.notify_one();
+    return job;
+}
+
+void GenerationWorker::stop() {
+    std::deque<std::shared_ptr<GenerationJob> > dropped;
+    {
+        std::lock_guard lock(mutex);
+        if (stopping) {
+            return;
+        }
+        stopping = true;
+        dropped.swap(queue);
+        for (const auto &job: running) {
+            job->cancel();
+        }
+    }
+    wakeUp.notify_all();
+    for (const auto &job: dropped) {
+        job->finish(KLlamaResult<std::string>(KLlamaError::OperationCancelled, "Session is closing"));
+    }
+    for (auto &thread: threads) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+}
+
+void GenerationWorker::run() {
+    while (true) {
+        std::shared_ptr<GenerationJob> job;
+        {
+            std::unique_lock lock(mutex);
+            wakeUp.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (stopping) {
+                return;
+            }
+            job = std::move(queue.front());
+            queue.pop_front();
+            running.push_back(job);
+        }
+
+        auto result = job->cancellationToken.isCancelled()
+                          ? KLlamaResult<std::string>(KLlamaError::OperationCancelled, "Generation was cancelled")
+                          : kllama.generateResponse(job->request.conversation, job->request.sampling,
+                                                    job->request.stream
+                                                        ? TokenCallback([&job](const std::string &piece) {
+                                                            job->append(piece);
+                                                        })
+                                                        : TokenCallback(),
+                                                    nullptr, &job->cancellationToken);
+        {
+            std::lock_guard lock(mutex);
+            running.erase(std::find(running.begin(), running.end(), job));
+        }
+        job->finish(std::move(result));
+    }
+}
@@ -0,0 +1,103 @@
+#ifndef KLLAMA_GENERATION_WORKER_H
+#define KLLAMA_GENERATION_WORKER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "KLlama.h"
+
+struct GenerationRequest {
+    std::vector<MultimodalMessage> conversation;
+    SamplingParams sampling;
+    // Keeps the generated text for GenerationJob::poll, without it only the final result is kept
+    bool stream = true;
+    // onReady is called once this many tokens are pending, or once notifyIntervalMs passed since the last call
+    int32_t notifyTokens = 1;
+    int32_t notifyIntervalMs = 0;
+    // Pending text above which generation waits for a poll. Only on single-sequence sessions, where
+    // waiting doesn't hold up other requests; batched sessions keep buffering.
+    size_t bufferBytes = 64 * 1024;
+    // Called on a worker thread when there is text to poll, and when the job finishes. At most once between two
+    // polls, so that a consumer that falls behind gets fewer, larger chunks. Must not block.
+    std::function<void()> onReady;
+};
+
+// A generation queued on a GenerationWorker. It doesn't refer to the session, so it may outlive it.
+class GenerationJob {
+public:
+    // Appends the text generated since the last poll. A character split across tokens waits for its last byte.
+    void poll(std::string &text);
+
+    // The final result, empty while the job is queued or running. Text may still be pending once it is set,
+    // read the result before the last poll so that none is missed.
+    [[nodiscard]] std::optional<KLlamaResult<std::string> > result() const;
+
+    // Stops the generation at its next token, or before it starts when it's still queued
+    void cancel();
+
+private:
+    friend class GenerationWorker;
+
+    GenerationJob(GenerationRequest request, bool backpressure);
+
+    void append(const std::string &piece);
+
+    void finish(KLlamaResult<std::string> result);
+
+    void notifyReady() const;
+
+    GenerationRequest request;
+    bool backpressure;
+    CancellationToken cancellationToken;
+
+    mutable std::mutex mutex;
+    std::condition_variable drained;
+    std::string pending;
+    int32_t pendingTokens = 0;
+    bool notified = false; // onReady was called and no poll came since
+    std::chrono::steady_clock::time_point lastNotify;
+    std::optional<KLlamaResult<std::string> > finalResult;
+};
+
+// Threads owned by a session that run submitted generations, so that callers don't block one thread
+// per request. With parallel sequences there is one thread per sequence, keeping the batch engine fed,
+// and the requests beyond that wait in the queue.
+class GenerationWorker {
+public:
+    GenerationWorker(KLlama &kllama, int32_t threads, bool backpressure);
+
+    ~GenerationWorker();
+
+    GenerationWorker(const GenerationWorker &) = delete;
+
+    GenerationWorker &operator=(const GenerationWorker &) = delete;
+
+    std::shared_ptr<GenerationJob> submit(GenerationRequest request);
+
+    // Cancels queued and running jobs and joins the threads
+    void stop();
+
+private:
+    void run();
+
+    KLlama &kllama;
+    int32_t threadCount;
+    bool backpressure;
+
+    std::deque<std::shared_ptr<GenerationJob> > queue;
+    std::mutex mutex;
+    std::condition_variable wakeUp;
+    bool stopping = false;
+    std::vector<std::shared_ptr<GenerationJob> > running;
+    std::vector<std::thread> threads; // Started with the first job
+};
+
+#endif
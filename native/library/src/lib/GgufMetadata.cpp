@@ -0,0 +1,86 @@
+#include "GgufMetadata.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <map>
+
+#include "gguf.h"
+
+static std::string stringValue(const gguf_context *gguf, const std::string &key) {
+    const auto id = gguf_find_key(gguf, key.c_str());
+    if (id < 0 || gguf_get_kv_type(gguf, id) != GGUF_TYPE_STRING) {
+        return "";
+    }
+    return gguf_get_val_str(gguf, id);
+}
+
+static int64_t integerValue(const gguf_context *gguf, const std::string &key) {
+    const auto id = gguf_find_key(gguf, key.c_str());
+    if (id < 0) {
+        return 0;
+    }
+    switch (gguf_get_kv_type(gguf, id)) {
+        case GGUF_TYPE_UINT32:
+            return gguf_get_val_u32(gguf, id);
+        case GGUF_TYPE_INT32:
+            return gguf_get_val_i32(gguf, id);
+        case GGUF_TYPE_UINT64:
+            return static_cast<int64_t>(gguf_get_val_u64(gguf, id));
+        default:
+            return 0;
+    }
+}
+
+static bool boolValue(const gguf_context *gguf, const std::string &key) {
+    const auto id = gguf_find_key(gguf, key.c_str());
+    return id >= 0 && gguf_get_kv_type(gguf, id) == GGUF_TYPE_BOOL && gguf_get_val_bool(gguf, id);
+}
+
+KLlamaResult<GgufMetadata> GgufMetadata::read(const std::string &path) {
+    // No ggml context: only the header, KV pairs and tensor infos are parsed
+    gguf_init_params initParams{};
+    initParams.no_alloc = true;
+    initParams.ctx = nullptr;
+
+    auto *gguf = gguf_init_from_file(path.c_str(), initParams);
+    if (!gguf) {
+        return KLlamaResult<GgufMetadata>(KLlamaError::ModelInvalid, "Not a valid GGUF file: " + path);
+    }
+
+    GgufMetadata metadata;
+    metadata.architecture = stringValue(gguf, "general.architecture");
+    metadata.name = stringValue(gguf, "general.name");
+    metadata.contextLength = static_cast<int32_t>(integerValue(gguf, metadata.architecture + ".context_length"));
+    metadata.hasVisionEncoder = boolValue(gguf, "clip.has_vision_encoder");
+    metadata.hasAudioEncoder = boolValue(gguf, "clip.has_audio_encoder");
+    metadata.projectorType = stringValue(gguf, "clip.projector_type");
+
+    // Parameters and the dominant type come from the tensor infos, where the data ends catches truncated downloads
+    std::map<ggml_type, size_t> bytesByType;
+    size_t dataEnd = 0;
+    for (int64_t i = 0; i < gguf_get_n_tensors(gguf); ++i) {
+        const auto type = gguf_get_tensor_type(gguf, i);
+        const auto bytes = gguf_get_tensor_size(gguf, i);
+        metadata.parameterCount += static_cast<int64_t>(bytes / ggml_type_size(type)) * ggml_blck_size(type);
+        bytesByType[type] += bytes;
+        dataEnd = std::max(dataEnd, gguf_get_tensor_offset(gguf, i) + bytes);
+    }
+    dataEnd += gguf_get_data_offset(gguf);
+    gguf_free(gguf);
+
+    std::error_code error;
+    if (const auto fileSize = std::filesystem::file_size(path, error); !error && dataEnd > fileSize) {
+        return KLlamaResult<GgufMetadata>(KLlamaError::ModelInvalid,
+                                          "GGUF file is truncated, tensor data ends past the end of the file");
+    }
+
+    size_t dominantBytes = 0;
+    for (const auto &[type, bytes]: bytesByType) {
+        if (bytes > dominantBytes) {
+            dominantBytes = bytes;
+            metadata.quantization = ggml_type_name(type);
+        }
+    }
+
+    return KLlamaResult(std::move(metadata));
+}
@@ -0,0 +1,24 @@
+#ifndef KLLAMA_GGUF_METADATA_H
+#define KLLAMA_GGUF_METADATA_H
+
+#include <cstdint>
+#include <string>
+
+#include "KLlama.h"
+
+// What the header and KV metadata of a GGUF file say about it. Reading it touches no tensor
+// data, so it takes milliseconds even for multi-GB models.
+struct GgufMetadata {
+    std::string architecture; // general.architecture, "clip" for projectors
+    std::string name; // general.name, may be empty
+    int64_t parameterCount = 0;
+    int32_t contextLength = 0; // Trained context, 0 when not stored
+    std::string quantization; // Type holding most of the weights, e.g. "q4_K"
+    bool hasVisionEncoder = false; // Projectors only
+    bool hasAudioEncoder = false;
+    std::string projectorType; // Projectors only
+
+    static KLlamaResult<GgufMetadata> read(const std::string &path);
+};
+
+#endif
@@ -0,0 +1,44 @@
+#include "GrammarSampler.h"
+
+#include <exception>
+
+#include <nlohmann/json.hpp>
+
+#include "json-schema-to-grammar.h"
+#ifdef LLAMA_USE_LLGUIDANCE
+#include "sampling.h"
+#endif
+
+#include "logging/logging.h"
+
+#define LOG_TAG "KLlamaGrammar"
+
+KLlamaResult<llama_sampler *> createGrammarSampler(const llama_vocab *vocab, const std::string &grammar,
+                                                   const std::string &jsonSchema) {
+    std::string gbnf = grammar;
+
+    if (!jsonSchema.empty()) {
+#ifdef LLAMA_USE_LLGUIDANCE
+        // Computes the token masks itself, far cheaper per token than a GBNF grammar over the whole vocabulary
+        if (auto *sampler = llama_sampler_init_llg(vocab, "json", jsonSchema.c_str())) {
+            return KLlamaResult(sampler);
+        }
+        return KLlamaResult<llama_sampler *>(KLlamaError::InvalidParameters, "Invalid JSON schema");
+#else
+        try {
+            gbnf = json_schema_to_grammar(nlohmann::ordered_json::parse(jsonSchema));
+        } catch (const std::exception &e) {
+            return KLlamaResult<llama_sampler *>(KLlamaError::InvalidParameters,
+                                                 std::string("Invalid JSON schema: ") + e.what());
+        }
+        LOG_DEBUG(LOG_TAG, "JSON schema converted to a %zu character grammar", gbnf.size());
+#endif
+    }
+
+    // Null when the grammar doesn't parse, llama.cpp logs why
+    auto *sampler = llama_sampler_init_grammar(vocab, gbnf.c_str(), "root");
+    if (!sampler) {
+        return KLlamaResult<llama_sampler *>(KLlamaError::InvalidParameters, "Invalid grammar");
+    }
+    return KLlamaResult(sampler);
+}
@@ -0,0 +1,15 @@
+#ifndef KLLAMA_GRAMMAR_SAMPLER_H
+#define KLLAMA_GRAMMAR_SAMPLER_H
+
+#include <string>
+
+#include "llama.h"
+
+#include "KLlama.h"
+
+// Sampler that masks out tokens the grammar doesn't allow, from either a GBNF grammar or a JSON schema.
+// JSON schemas go through llguidance when the build has it and are converted to GBNF otherwise.
+KLlamaResult<llama_sampler *> createGrammarSampler(const llama_vocab *vocab, const std::string &grammar,
+                                                   const std::string &jsonSchema);
+
+#endif
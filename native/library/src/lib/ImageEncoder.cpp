@@ -0,0 +1,85 @@
+#include "ImageEncoder.h"
+
+#include <algorithm>
+
+#include "Tracing.h"
+#include "logging/logging.h"
+
+#define LOG_TAG "KLlamaImageEncoder"
+
+ImageEncoder::ImageEncoder(
+    mtmd_context *visionContext,
+    const llama_model *model,
+    std::vector<Item> items,
+    EmbeddingCache *imageCache,
+    ComputePool *computePool,
+    const size_t lookahead
+) : visionContext(visionContext),
+    model(model),
+    items(std::move(items)),
+    imageCache(imageCache),
+    computePool(computePool),
+    lookahead(std::max<size_t>(lookahead, 1)),
+    thread(&ImageEncoder::run, this) {
+}
+
+ImageEncoder::~ImageEncoder() {
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    thread.join();
+}
+
+EmbeddingCache::Embedding ImageEncoder::next() {
+    std::unique_lock lock(mutex);
+    changed.wait(lock, [this] { return !encoded.empty() || failed || taken == items.size(); });
+    if (encoded.empty()) {
+        return nullptr;
+    }
+
+    auto embedding = std::move(encoded.front());
+    encoded.pop_front();
+    ++taken;
+    lock.unlock();
+    changed.notify_all();
+    return embedding;
+}
+
+void ImageEncoder::run() {
+    for (size_t i = 0; i < items.size(); ++i) {
+        {
+            std::unique_lock lock(mutex);
+            changed.wait(lock, [&] { return stopping || i - taken < lookahead; });
+            if (stopping) {
+                return;
+            }
+        }
+
+        EmbeddingCache::Embedding embedding;
+        {
+            const auto computeLock = computePool ? computePool->lock() : std::unique_lock<std::mutex>();
+            TRACE_SCOPE("encodeImage");
+            const auto &item = items[i];
+            embedding = imageCache
+                            ? imageCache->encode(visionContext, model, item.chunk, item.hash)
+                            : EmbeddingCache::encodeChunk(visionContext, model, item.chunk);
+        }
+
+        const bool encodedItem = embedding != nullptr;
+        {
+            std::lock_guard lock(mutex);
+            if (!encodedItem) {
+                LOG_ERROR(LOG_TAG, "Failed to encode image %zu of %zu", i + 1, items.size());
+                failed = true;
+            } else {
+                encoded.push_back(std::move(embedding));
+            }
+        }
+        changed.notify_all();
+        if (!encodedItem) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef KLLAMA_IMAGE_ENCODER_H
+#define KLLAMA_IMAGE_ENCODER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "llama.h"
+#include "mtmd.h"
+
+#include "ComputePool.h"
+#include "EmbeddingCache.h"
+
+// Runs the vision encoder over the image chunks of a prompt, in order, on a thread of its own, so that
+// image N+1 is encoded while the embeddings of image N are decoded into the context. At most `lookahead`
+// encoded images wait to be taken, which bounds the memory their embeddings hold.
+class ImageEncoder {
+public:
+    struct Item {
+        const mtmd_input_chunk *chunk;
+        uint64_t hash; // Key in the embedding cache, if any
+    };
+
+    // computePool is locked around each encode, pass null when the projector doesn't compute on the CPU
+    ImageEncoder(mtmd_context *visionContext, const llama_model *model, std::vector<Item> items,
+                 EmbeddingCache *imageCache, ComputePool *computePool, size_t lookahead = 2);
+
+    // Stops after the encode in progress
+    ~ImageEncoder();
+
+    ImageEncoder(const ImageEncoder &) = delete;
+
+    ImageEncoder &operator=(const ImageEncoder &) = delete;
+
+    // Blocks until the next item is encoded, null when encoding it failed
+    EmbeddingCache::Embedding next();
+
+private:
+    void run();
+
+    mtmd_context *visionContext;
+    const llama_model *model;
+    std::vector<Item> items;
+    EmbeddingCache *imageCache;
+    ComputePool *computePool;
+    size_t lookahead;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<EmbeddingCache::Embedding> encoded;
+    size_t taken = 0;
+    bool failed = false;
+    bool stopping = false;
+    std::thread thread;
+};
+
+#endif
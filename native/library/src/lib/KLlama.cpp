@@ -1,26 +1,247 @@
 #include "KLlama.h"
+#include "BatchEngine.h"
+#include "ComputePool.h"
+#include "Drafter.h"
+#include "EmbeddingCache.h"
+#include "GenerationWorker.h"
+#include "GgufMetadata.h"
+#include "GrammarSampler.h"
+#include "ImageEncoder.h"
+#include "KLlamaModel.h"
+#include "LlamaLog.h"
+#include "PrefixCache.h"
+#include "PromptBuilder.h"
+#include "SamplerCache.h"
+#include "SessionSnapshot.h"
+#include "StopMatcher.h"
+#include "SystemMemory.h"
+#include "Tracing.h"
 
 #include <iostream>
 #include <utility>
 #include <vector>
 #include <random>
 #include <chrono>
-#include <fstream>
 #include <filesystem>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cstdlib>
 
+#include "ggml-backend.h"
 #include "llama.h"
 #include "mtmd.h"
 #include "mtmd-helper.h"
 
-static std::string tokenToString(const llama_model *model, const llama_token token) {
-    std::vector<char> buf(32, 0);
-    const auto *vocab = llama_model_get_vocab(model);
-    const auto n = llama_token_to_piece(vocab, token, buf.data(), static_cast<int32_t>(buf.size()), 0, true);
-    if (n < 0) {
-        buf.resize(-n);
-        llama_token_to_piece(vocab, token, buf.data(), static_cast<int32_t>(buf.size()), 0, true);
+#include "Utils.h"
+#include "logging/logging.h"
+
+#define LOG_TAG "KLlama"
+
+static constexpr int32_t DEFAULT_MAX_TOKENS = 4096;
+// Shorter system prompts are cheaper to prefill than to snapshot
+static constexpr size_t MIN_SHARED_PREFIX = 64;
+
+// Inputs packed into one batch by an embeddings context, unless parallelSequences asks for more
+static constexpr uint32_t DEFAULT_EMBEDDING_SEQUENCES = 64;
+
+static bool isGenerationActive(const GenerationState state) {
+    switch (state) {
+        case GenerationState::Initializing:
+        case GenerationState::TokenizingPrompt:
+        case GenerationState::ProcessingImages:
+        case GenerationState::Generating:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static std::vector<llama_token> sharedPrefixTokens(const PreparedPrompt &prompt) {
+    std::vector<llama_token> tokens;
+    tokens.reserve(prompt.sharedPrefix);
+    for (size_t i = 0; i < prompt.sharedPrefix; ++i) {
+        tokens.push_back(prompt.units[i].token);
+    }
+    return tokens;
+}
+
+// Snapshots are only valid for the model file and KV layout they were taken with
+static ggml_type toGgmlType(const KvCacheType type) {
+    switch (type) {
+        case KvCacheType::F32:
+            return GGML_TYPE_F32;
+        case KvCacheType::BF16:
+            return GGML_TYPE_BF16;
+        case KvCacheType::Q8_0:
+            return GGML_TYPE_Q8_0;
+        case KvCacheType::Q4_0:
+            return GGML_TYPE_Q4_0;
+        case KvCacheType::Q4_1:
+            return GGML_TYPE_Q4_1;
+        case KvCacheType::Q5_0:
+            return GGML_TYPE_Q5_0;
+        case KvCacheType::Q5_1:
+            return GGML_TYPE_Q5_1;
+        case KvCacheType::F16:
+        default:
+            return GGML_TYPE_F16;
+    }
+}
+
+static enum llama_pooling_type toLlamaPooling(const PoolingType type) {
+    switch (type) {
+        case PoolingType::Mean:
+            return LLAMA_POOLING_TYPE_MEAN;
+        case PoolingType::Cls:
+            return LLAMA_POOLING_TYPE_CLS;
+        case PoolingType::Last:
+            return LLAMA_POOLING_TYPE_LAST;
+        case PoolingType::Rank:
+            return LLAMA_POOLING_TYPE_RANK;
+        case PoolingType::Model:
+        default:
+            return LLAMA_POOLING_TYPE_UNSPECIFIED;
+    }
+}
+
+static bool isQuantized(const KvCacheType type) {
+    return type != KvCacheType::F32 && type != KvCacheType::F16 && type != KvCacheType::BF16;
+}
+
+// An integer from the model's GGUF metadata under `{arch}.{name}`, `fallback` when it has none
+static int64_t archMetadata(const llama_model *model, const char *name, const int64_t fallback) {
+    char value[128];
+    if (llama_model_meta_val_str(model, "general.architecture", value, sizeof(value)) < 0) {
+        return fallback;
+    }
+    const auto key = std::string(value) + "." + name;
+    if (llama_model_meta_val_str(model, key.c_str(), value, sizeof(value)) < 0) {
+        return fallback;
+    }
+    char *end = nullptr;
+    const auto parsed = std::strtoll(value, &end, 10);
+    return end != value && parsed > 0 ? parsed : fallback;
+}
+
+// Estimated bytes of one KV cell, the K and V rows of every layer. Head sizes come from the model's
+// metadata, as not every model has head_dim = n_embd / n_head. Layers without attention are counted as
+// well, so hybrid models come out high, and recurrent models, whose state isn't per cell, as 0.
+static size_t kvCellBytes(const llama_model *model, const SessionParams &params) {
+    const int64_t heads = llama_model_n_head(model);
+    if (heads <= 0 || llama_model_is_recurrent(model)) {
+        return 0;
+    }
+    const auto keyLength = archMetadata(model, "attention.key_length", llama_model_n_embd(model) / heads);
+    const auto valueLength = archMetadata(model, "attention.value_length", keyLength);
+    const int64_t kvHeads = llama_model_n_head_kv(model);
+    const auto rowBytes = ggml_row_size(toGgmlType(params.cacheTypeK), keyLength * kvHeads) +
+                          ggml_row_size(toGgmlType(params.cacheTypeV), valueLength * kvHeads);
+    return static_cast<size_t>(llama_model_n_layer(model)) * rowBytes;
+}
+
+// Cells holding tokens, summed over the sequences
+static size_t kvUsedCells(llama_context *context) {
+    auto *memory = llama_get_memory(context);
+    size_t cells = 0;
+    for (llama_seq_id seqId = 0; seqId < static_cast<llama_seq_id>(llama_n_seq_max(context)); ++seqId) {
+        const auto maxPos = llama_memory_seq_pos_max(memory, seqId);
+        if (maxPos >= 0) {
+            cells += static_cast<size_t>(maxPos - llama_memory_seq_pos_min(memory, seqId) + 1);
+        }
+    }
+    return cells;
+}
+
+// Host RSS plus device memory in use, the difference around an allocation is what it took
+static size_t memoryInUse() {
+    return residentMemoryBytes() + deviceMemoryUsedBytes();
+}
+
+static size_t toMB(const size_t bytes) {
+    return bytes / (1024 * 1024);
+}
+
+static uint64_t prefixCacheKey(const SessionParams &params) {
+    std::error_code error;
+    const auto fileSize = std::filesystem::file_size(params.modelPath, error);
+    // Snapshots only restore into a cache of the same element types and layout, which flash attention changes
+    const auto identity = params.modelPath + ":" + std::to_string(error ? 0 : fileSize) + ":" +
+                          std::to_string(static_cast<int>(params.cacheTypeK)) + ":" +
+                          std::to_string(static_cast<int>(params.cacheTypeV)) + ":" +
+                          std::to_string(params.flashAttention);
+    return hashBytes(reinterpret_cast<const uint8_t *>(identity.data()), identity.size());
+}
+
+// Drops the middle of a prompt that doesn't fit the context, keeping the first `keep` units and as much of
+// the end as fits in half of what is left, so that the response has room too
+static void fitPrompt(PreparedPrompt &prompt, const size_t keep, const llama_pos contextSize) {
+    llama_pos keptPositions = 0;
+    for (size_t i = 0; i < keep; ++i) {
+        keptPositions += prompt.units[i].nPos;
+    }
+    const auto budget = keptPositions + (contextSize - keptPositions) / 2;
+
+    // Walk back from the end for the tail that fits
+    auto tailStart = prompt.units.size();
+    llama_pos tailPositions = 0;
+    while (tailStart > keep && keptPositions + tailPositions + prompt.units[tailStart - 1].nPos <= budget) {
+        tailPositions += prompt.units[--tailStart].nPos;
+    }
+
+    const auto first = prompt.units.begin() + static_cast<std::ptrdiff_t>(keep);
+    const auto last = prompt.units.begin() + static_cast<std::ptrdiff_t>(tailStart);
+    const auto mediaBefore = std::count_if(prompt.units.begin(), first, [](const PromptUnit &u) { return u.isMedia(); });
+    const auto mediaDropped = std::count_if(first, last, [](const PromptUnit &u) { return u.isMedia(); });
+    prompt.mediaChunks.erase(prompt.mediaChunks.begin() + mediaBefore,
+                             prompt.mediaChunks.begin() + mediaBefore + mediaDropped);
+    prompt.units.erase(first, last);
+    prompt.systemPrefix = std::min(prompt.systemPrefix, keep);
+    prompt.sharedPrefix = std::min(prompt.sharedPrefix, keep);
+}
+
+static llama_pos promptPositions(const PreparedPrompt &prompt) {
+    llama_pos positions = 0;
+    for (const auto &unit: prompt.units) {
+        positions += unit.nPos;
     }
-    return {buf.data(), static_cast<size_t>(n)};
+    return positions;
+}
+
+static float millisecondsBetween(const std::chrono::steady_clock::time_point start,
+                                 const std::chrono::steady_clock::time_point end) {
+    return std::chrono::duration<float, std::milli>(end - start).count();
+}
+
+static float millisecondsSince(const std::chrono::steady_clock::time_point start) {
+    return millisecondsBetween(start, std::chrono::steady_clock::now());
+}
+
+static size_t interTokenBucket(const float milliseconds) {
+    return static_cast<size_t>(std::lower_bound(INTER_TOKEN_BUCKETS_MS.begin(), INTER_TOKEN_BUCKETS_MS.end(),
+                                                milliseconds) - INTER_TOKEN_BUCKETS_MS.begin());
+}
+
+static std::vector<llama_token> tokenizeText(const llama_vocab *vocab, const std::string &text, const bool addSpecial) {
+    std::vector<llama_token> tokens(text.size() + 2);
+    auto count = llama_tokenize(vocab, text.data(), static_cast<int32_t>(text.size()), tokens.data(),
+                                static_cast<int32_t>(tokens.size()), addSpecial, true);
+    if (count < 0) {
+        tokens.resize(-count);
+        count = llama_tokenize(vocab, text.data(), static_cast<int32_t>(text.size()), tokens.data(),
+                               static_cast<int32_t>(tokens.size()), addSpecial, true);
+    }
+    tokens.resize(std::max(count, 0));
+    return tokens;
+}
+
+static bool hasImages(const std::vector<MultimodalMessage> &conversation) {
+    for (const auto &message: conversation) {
+        if (!message.images.empty()) {
+            return true;
+        }
+    }
+    return false;
 }
 
 // Error handling implementations
@@ -82,6 +303,15 @@ KLlamaResult<void> SamplingParams::validate() const {
     if (repeatLastN < 0) {
         return KLlamaResult<void>(KLlamaError::InvalidParameters, "repeat_last_n must be non-negative");
     }
+    if (!grammar.empty() && !jsonSchema.empty()) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "Grammar and JSON schema can't be combined");
+    }
+    if (loraAdapter < -1) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "LoRA adapter must be -1 (none) or an index");
+    }
+    if (!std::isfinite(loraScale)) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "LoRA scale must be finite");
+    }
     return {};
 }
 
@@ -103,20 +333,80 @@ KLlamaResult<void> SessionParams::validate() const {
         }
     }
 
+    for (const auto &adapter: loraAdapters) {
+        if (auto adapterCheck = KLlama::checkFileExists(adapter); adapterCheck.isError()) {
+            return adapterCheck;
+        }
+    }
+
     if (contextSize <= 0) {
         return KLlamaResult<void>(KLlamaError::InvalidParameters, "Context size must be positive");
     }
     if (batch <= 0) {
         return KLlamaResult<void>(KLlamaError::InvalidParameters, "Batch size must be positive");
     }
+    if (gpuLayers < -1) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "GPU layers must be -1 (all) or non-negative");
+    }
+    if (mainGpu < 0) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "Main GPU index must be non-negative");
+    }
+    for (const auto &override: tensorOverrides) {
+        if (const auto separator = override.find('='); separator == std::string::npos || separator == 0 ||
+                                                        separator + 1 == override.size()) {
+            return KLlamaResult<void>(KLlamaError::InvalidParameters,
+                                      "Tensor override must be <pattern>=<buffer type>: " + override);
+        }
+    }
+    if (ubatch <= 0) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "Micro-batch size must be positive");
+    }
+    if (isQuantized(cacheTypeV) && !flashAttention) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "Quantized V cache requires flash attention");
+    }
     if (threads <= 0) {
         return KLlamaResult<void>(KLlamaError::InvalidParameters, "Thread count must be positive");
     }
+    if (batchThreads < 0) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "Batch thread count must be non-negative");
+    }
+    if (threadPoll < 0 || threadPoll > 100) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "Thread poll must be between 0 and 100");
+    }
+    if (parallelSequences <= 0) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "Parallel sequences count must be positive");
+    }
+    if (!draftModelPath.empty()) {
+        auto draftCheck = KLlama::checkFileExists(draftModelPath);
+        if (draftCheck.isError()) {
+            return draftCheck;
+        }
+    }
+    if ((!draftModelPath.empty() || ngramDraft) && draftMax <= 0) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "Draft size must be positive");
+    }
+    if (prefixCacheMB < 0 || prefixCacheDiskMB < 0) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "Prefix cache budgets must be non-negative");
+    }
+    if (imageCacheMB < 0) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "Image cache budget must be non-negative");
+    }
+    if (contextKeep < -1) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "Context keep must be -1 (system prompt) or non-negative");
+    }
+    if (prefillChunk < 0) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "Prefill chunk size must be non-negative");
+    }
+    if (embeddings && !mmprojPath.empty()) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "Embeddings sessions don't support images");
+    }
 
     return sampling.validate();
 }
 
 // Constructor and destructor
+KLlama::KLlama() = default;
+
 KLlama::~KLlama() {
     if (initialized) {
         freeMemory();
@@ -124,6 +414,16 @@ KLlama::~KLlama() {
 }
 
 KLlamaResult<void> KLlama::freeMemory() {
+    // Worker threads generate on this session, and the engine thread uses the context, stop them first
+    {
+        const std::lock_guard lock(workerMutex);
+        worker.reset();
+    }
+    batchEngine.reset();
+    samplerCache.reset();
+    imageCache.reset();
+    prefixCache.reset();
+    drafter.reset();
     if (batch.token) {
         llama_batch_free(batch);
         batch = {};
@@ -136,15 +436,25 @@ KLlamaResult<void> KLlama::freeMemory() {
         llama_free(llamaContext);
         llamaContext = nullptr;
     }
-    if (model) {
-        llama_model_free(model);
-        model = nullptr;
-    }
-    if (initialized) {
-        llama_backend_free();
-        initialized = false;
-    }
+    // Only after the context they were applied to, and before the model they belong to
+    for (auto *adapter: loraAdapters) {
+        llama_adapter_lora_free(adapter);
+    }
+    loraAdapters.clear();
+    activeLora = -1;
+    activeLoraScale = 0.0f;
+    // Only after the context that computes on it
+    computePool.reset();
+    // The weights are freed with the last session sharing them
+    model = nullptr;
+    sharedModel.reset();
+    initialized = false;
+    promptBuilder.reset();
     visionContext.reset();
+    kvCache.clear();
+    contextMemoryBytes = 0;
+    visionMemoryBytes = 0;
+    visionOnGpu = false;
 
     setGenerationState(GenerationState::Idle);
 
@@ -157,18 +467,35 @@ KLlamaResult<void> KLlama::initialize(
     const ProgressCallback &progressCallback,
     const CancellationToken *cancellationToken
 ) {
+    return initialize(nullptr, sessionParams, progressCallback, cancellationToken);
+}
+
+KLlamaResult<void> KLlama::initialize(
+    std::shared_ptr<KLlamaModel> existingModel,
+    const SessionParams &sessionParams,
+    const ProgressCallback &progressCallback,
+    const CancellationToken *cancellationToken
+) {
+    TRACE_SCOPE("KLlama::initialize");
     if (initialized) {
         return KLlamaResult<void>(KLlamaError::AlreadyInitialized);
     }
 
+    SessionParams effectiveParams = sessionParams;
+    if (existingModel && effectiveParams.modelPath.empty()) {
+        effectiveParams.modelPath = existingModel->path();
+    }
+
     // Validate parameters
-    auto validation = sessionParams.validate();
+    auto validation = effectiveParams.validate();
     if (validation.isError()) {
         return validation;
     }
 
-    params = sessionParams;
+    params = effectiveParams;
+    sharedModel = std::move(existingModel);
     setGenerationState(GenerationState::Initializing);
+    LlamaLog::setVerbosity(params.verbosity);
 
     if (progressCallback) {
         progressCallback(0.0f, "Initializing backend");
@@ -180,21 +507,71 @@ KLlamaResult<void> KLlama::initialize(
         return KLlamaResult<void>(KLlamaError::OperationCancelled);
     }
 
-    llama_backend_init();
-    batch = llama_batch_init(1, 0, 1);
-
     // Initialize model
     if (auto modelResult = initializeModel(progressCallback, cancellationToken); modelResult.isError()) {
         freeMemory();
         return modelResult;
     }
 
+    // Allocated once, prefill reuses it for every chunk
+    batch = llama_batch_init(static_cast<int32_t>(llama_n_batch(llamaContext)), 0, 1);
+
+    // Adapters only add their own small tensors, the base weights stay shared
+    for (const auto &path: params.loraAdapters) {
+        auto *adapter = llama_adapter_lora_init(model, path.c_str());
+        if (!adapter) {
+            freeMemory();
+            return KLlamaResult<void>(KLlamaError::ModelLoadFailed, "Failed to load LoRA adapter from: " + path);
+        }
+        loraAdapters.push_back(adapter);
+    }
+
+    if (params.prefixCache && !params.embeddings) {
+        prefixCache = std::make_unique<PrefixCache>(params.prefixCacheDir, prefixCacheKey(params),
+                                                    static_cast<size_t>(params.prefixCacheMB) * 1024 * 1024,
+                                                    static_cast<size_t>(params.prefixCacheDiskMB) * 1024 * 1024);
+    }
+
+    // Room for the chain of every batched sequence, plus a few parameter sets. Embeddings don't sample.
+    if (!params.embeddings) {
+        samplerCache = std::make_unique<SamplerCache>(static_cast<size_t>(params.parallelSequences) + 3);
+    }
+
+    // The batch engine has its own decode loop, drafting only applies to a single sequence
+    const bool singleSequence = params.parallelSequences == 1 && !params.embeddings;
+    if (singleSequence && !params.draftModelPath.empty()) {
+        auto drafterResult = ModelDrafter::create(params, model);
+        if (drafterResult.isError()) {
+            freeMemory();
+            return KLlamaResult<void>(drafterResult.error, drafterResult.errorMessage);
+        }
+        drafter = std::move(drafterResult.value);
+    } else if (singleSequence && params.ngramDraft) {
+        drafter = std::make_unique<NgramDrafter>();
+    }
+
     // Initialize vision if needed
     if (!params.mmprojPath.empty()) {
         if (auto visionResult = initializeVision(progressCallback, cancellationToken); visionResult.isError()) {
             freeMemory();
             return visionResult;
         }
+
+        if (params.imageCacheMB > 0) {
+            imageCache = std::make_unique<EmbeddingCache>(static_cast<size_t>(params.imageCacheMB) * 1024 * 1024);
+        }
+    }
+
+    // Keeps the last prompt, which the next one usually extends
+    if (!params.embeddings) {
+        promptBuilder = std::make_unique<PromptBuilder>(model, visionContext.get(),
+                                                        params.batchThreads > 0 ? params.batchThreads : params.threads);
+    }
+
+    if (params.parallelSequences > 1 && !params.embeddings) {
+        const auto prefillBudget = params.timeSlicedPrefill ? prefillChunkSize() : 0;
+        batchEngine = std::make_unique<BatchEngine>(llamaContext, visionContext.get(), params.parallelSequences,
+                                                    prefillBudget, imageCache.get(), computePool.get(), loraAdapters);
     }
 
     initialized = true;
@@ -211,15 +588,26 @@ KLlamaResult<void> KLlama::initializeModel(
     const ProgressCallback &progressCallback,
     const CancellationToken *cancellationToken
 ) {
+    TRACE_SCOPE("loadModel");
     if (progressCallback) {
         progressCallback(0.1f, "Loading model");
     }
 
-    auto modelParams = llama_model_default_params();
-    model = llama_model_load_from_file(params.modelPath.c_str(), modelParams);
-    if (!model) {
-        return KLlamaResult<void>(KLlamaError::ModelLoadFailed, "Failed to load model from: " + params.modelPath);
+    // Sessions on the same model share its weights. Loading itself reports per tensor and can be aborted midway.
+    if (!sharedModel) {
+        ProgressCallback loadProgress;
+        if (progressCallback) {
+            loadProgress = [&progressCallback](const float progress, const std::string &stage) {
+                progressCallback(0.1f + 0.3f * progress, stage);
+            };
+        }
+        auto modelResult = KLlamaModel::acquire(params, loadProgress, cancellationToken);
+        if (modelResult.isError()) {
+            return KLlamaResult<void>(modelResult.error, modelResult.errorMessage);
+        }
+        sharedModel = std::move(modelResult.value);
     }
+    model = sharedModel->get();
 
     if (cancellationToken && cancellationToken->isCancelled()) {
         return KLlamaResult<void>(KLlamaError::OperationCancelled);
@@ -232,13 +620,51 @@ KLlamaResult<void> KLlama::initializeModel(
     llama_context_params contextParams = llama_context_default_params();
     contextParams.n_ctx = params.contextSize;
     contextParams.n_batch = params.batch;
+    contextParams.n_ubatch = std::min(params.ubatch, params.batch);
+    contextParams.n_seq_max = params.parallelSequences;
     contextParams.n_threads = params.threads;
-    contextParams.n_threads_batch = params.threads;
-
+    contextParams.n_threads_batch = params.batchThreads > 0 ? params.batchThreads : params.threads;
+    contextParams.type_k = toGgmlType(params.cacheTypeK);
+    contextParams.type_v = toGgmlType(params.cacheTypeV);
+    contextParams.flash_attn = params.flashAttention;
+    contextParams.offload_kqv = params.offloadKqv;
+    // Decode timings for GenerationStats, llama.cpp only reads the clock around each batch
+    contextParams.no_perf = false;
+    if (params.embeddings) {
+        contextParams.embeddings = true;
+        contextParams.pooling_type = toLlamaPooling(params.pooling);
+        // Non-causal models need each input within one ubatch, the inputs share the context
+        contextParams.n_ubatch = params.batch;
+        contextParams.n_seq_max = params.parallelSequences > 1
+                                      ? params.parallelSequences
+                                      : DEFAULT_EMBEDDING_SEQUENCES;
+        contextParams.kv_unified = true;
+    }
+
+    // A KV cache that stays on the host has to fit in what the system has left
+    const bool hostKv = params.gpuLayers == 0 || !params.offloadKqv || deviceMemory().empty();
+    // Only an estimate, so llama.cpp gets to try: it fails on its own if the allocation does
+    const auto kvBytes = kvCellBytes(model, params) * static_cast<size_t>(params.contextSize);
+    if (const auto available = availableMemoryBytes(); hostKv && available > 0 && kvBytes > available) {
+        LOG_WARN(LOG_TAG, "KV cache needs about %zu MB, only %zu MB available", toMB(kvBytes), toMB(available));
+    }
+
+    const auto memoryBefore = memoryInUse();
     llamaContext = llama_init_from_model(model, contextParams);
     if (!llamaContext) {
         return KLlamaResult<void>(KLlamaError::ContextInitFailed, "Failed to initialize llama context");
     }
+    const auto memoryAfter = memoryInUse();
+    contextMemoryBytes = memoryAfter > memoryBefore ? memoryAfter - memoryBefore : 0;
+
+    auto poolResult = ComputePool::acquire(params);
+    if (poolResult.isError()) {
+        return KLlamaResult<void>(poolResult.error, poolResult.errorMessage);
+    }
+    computePool = std::move(poolResult.value);
+    if (computePool) {
+        llama_attach_threadpool(llamaContext, computePool->decodePool(), computePool->batchPool());
+    }
 
     if (progressCallback) {
         progressCallback(0.6f, "Model loaded successfully");
@@ -251,16 +677,26 @@ KLlamaResult<void> KLlama::initializeVision(
     const ProgressCallback &progressCallback,
     const CancellationToken *cancellationToken
 ) {
+    TRACE_SCOPE("loadVision");
     if (progressCallback) {
         progressCallback(0.7f, "Loading vision model");
     }
 
     auto multimodalContextParams = mtmd_context_params_default();
     multimodalContextParams.use_gpu = params.mmprojUseGpu;
-    multimodalContextParams.n_threads = params.threads;
+    multimodalContextParams.n_threads = params.batchThreads > 0 ? params.batchThreads : params.threads;
     multimodalContextParams.verbosity = params.verbosity > 1 ? GGML_LOG_LEVEL_DEBUG : GGML_LOG_LEVEL_INFO;
 
+    // mtmd quietly falls back to the CPU, say so since encoding then competes with the CPU compute threads
+    visionOnGpu = params.mmprojUseGpu && ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_GPU);
+    if (params.mmprojUseGpu && !visionOnGpu) {
+        LOG_WARN(LOG_TAG, "mmprojUseGpu is set but there is no GPU backend, the projector runs on the CPU");
+    }
+
+    const auto memoryBefore = memoryInUse();
     visionContext.reset(mtmd_init_from_file(params.mmprojPath.c_str(), model, multimodalContextParams));
+    const auto memoryAfter = memoryInUse();
+    visionMemoryBytes = memoryAfter > memoryBefore ? memoryAfter - memoryBefore : 0;
     if (!visionContext) {
         return KLlamaResult<void>(KLlamaError::MmprojLoadFailed,
                                   "Failed to load vision model from: " + params.mmprojPath);
@@ -277,38 +713,34 @@ KLlamaResult<void> KLlama::initializeVision(
     return {};
 }
 
-// Model validation
+// Model validation, from the GGUF metadata alone
 KLlamaResult<ModelInfo> KLlama::validateModel(const std::string &modelPath) {
     if (const auto fileCheck = checkFileExists(modelPath); fileCheck.isError()) {
         return KLlamaResult<ModelInfo>(fileCheck.error, fileCheck.errorMessage);
     }
 
-    // Quick validation by attempting to load model metadata
-    llama_backend_init();
-    const auto modelParams = llama_model_default_params();
-
-    llama_model *tempModel = llama_model_load_from_file(modelPath.c_str(), modelParams);
-    if (!tempModel) {
-        llama_backend_free();
-        return KLlamaResult<ModelInfo>(KLlamaError::ModelInvalid, "Invalid model format");
+    auto metadataResult = GgufMetadata::read(modelPath);
+    if (metadataResult.isError()) {
+        return KLlamaResult<ModelInfo>(metadataResult.error, metadataResult.errorMessage);
     }
+    const auto &metadata = metadataResult.value;
 
-    ModelInfo info;
-
-    // Get model description with proper buffer
-    char desc_buffer[256];
-    if (const int32_t descLen = llama_model_desc(tempModel, desc_buffer, sizeof(desc_buffer)); descLen > 0) {
-        info.name = std::string(desc_buffer, descLen);
-    } else {
-        info.name = "Unknown Model";
+    if (metadata.architecture.empty()) {
+        return KLlamaResult<ModelInfo>(KLlamaError::ModelInvalid, "Model has no architecture in its metadata");
+    }
+    if (metadata.architecture == "clip") {
+        return KLlamaResult<ModelInfo>(KLlamaError::ModelInvalid,
+                                       "File is a multimodal projector, not a language model");
     }
 
-    info.parameterCount = static_cast<int64_t>(llama_model_n_params(tempModel));
-    info.contextSize = llama_model_n_ctx_train(tempModel);
+    ModelInfo info;
+    info.name = metadata.name.empty() ? std::filesystem::path(modelPath).stem().string() : metadata.name;
+    info.architecture = metadata.architecture;
+    info.quantization = metadata.quantization;
+    info.parameterCount = metadata.parameterCount;
+    info.contextSize = metadata.contextLength;
     info.supportsVision = false; // Will be true if mmproj is loaded
-
-    llama_model_free(tempModel);
-    llama_backend_free();
+    info.capabilities.emplace_back("text_generation");
 
     return KLlamaResult(std::move(info));
 }
@@ -319,18 +751,18 @@ KLlamaResult<void> KLlama::validateMmproj(const std::string &mmprojPath) {
         return KLlamaResult<void>(KLlamaError::MmprojNotFound, fileCheck.errorMessage);
     }
 
-    // Quick validation would require loading both model and mmproj
-    // For now, just check file existence and basic format
-    std::ifstream file(mmprojPath, std::ios::binary);
-    if (!file.is_open()) {
-        return KLlamaResult<void>(KLlamaError::MmprojInvalid, "Cannot open mmproj file");
+    const auto metadataResult = GgufMetadata::read(mmprojPath);
+    if (metadataResult.isError()) {
+        return KLlamaResult<void>(KLlamaError::MmprojInvalid, metadataResult.errorMessage);
     }
+    const auto &metadata = metadataResult.value;
 
-    // Basic GGUF header check
-    char header[4];
-    file.read(header, 4);
-    if (std::string(header, 4) != "GGUF") {
-        return KLlamaResult<void>(KLlamaError::MmprojInvalid, "Invalid mmproj format - not a GGUF file");
+    if (metadata.architecture != "clip") {
+        return KLlamaResult<void>(KLlamaError::MmprojInvalid,
+                                  "Not a multimodal projector, architecture is '" + metadata.architecture + "'");
+    }
+    if (!metadata.hasVisionEncoder && !metadata.hasAudioEncoder) {
+        return KLlamaResult<void>(KLlamaError::MmprojInvalid, "Multimodal projector has no vision or audio encoder");
     }
 
     return {};
@@ -352,6 +784,15 @@ KLlamaResult<ModelInfo> KLlama::getModelInfo() const {
         info.name = "Unknown Model";
     }
 
+    char architecture[64];
+    if (llama_model_meta_val_str(model, "general.architecture", architecture, sizeof(architecture)) > 0) {
+        info.architecture = architecture;
+    }
+    // Only the header is read, the weights stay untouched
+    if (const auto metadata = GgufMetadata::read(sharedModel->path()); metadata.isSuccess()) {
+        info.quantization = metadata.value.quantization;
+    }
+
     info.parameterCount = static_cast<int64_t>(llama_model_n_params(model));
     info.contextSize = llama_model_n_ctx_train(model);
     info.supportsVision = (visionContext != nullptr);
@@ -373,11 +814,25 @@ KLlamaResult<MemoryInfo> KLlama::getMemoryInfo() const {
     }
 
     MemoryInfo info{};
-    info.modelMemoryMB = llama_model_size(model) / (1024 * 1024);
+    info.modelMemoryMB = toMB(llama_model_size(model));
+
+    const auto cellBytes = kvCellBytes(model, params);
+    info.kvCacheMB = toMB(cellBytes * llama_n_ctx(llamaContext));
+    info.kvCacheUsedMB = toMB(cellBytes * kvUsedCells(llamaContext));
+    // Pages that were never touched don't show up in the measurement, the KV cache is allocated regardless
+    info.contextMemoryMB = std::max(toMB(contextMemoryBytes), info.kvCacheMB);
+    info.visionMemoryMB = toMB(visionMemoryBytes);
+    info.totalMemoryMB = info.modelMemoryMB + info.contextMemoryMB + info.visionMemoryMB;
 
-    info.contextMemoryMB = llama_state_get_size(llamaContext) / (1024 * 1024);
-    info.totalMemoryMB = info.modelMemoryMB + info.contextMemoryMB;
+    info.residentMemoryMB = toMB(residentMemoryBytes());
+    info.availableMemoryMB = toMB(availableMemoryBytes());
 
+    for (const auto &device: deviceMemory()) {
+        info.devices.push_back({
+            device.name, device.description, toMB(sharedModel->deviceBytes(device.name)), toMB(device.freeBytes),
+            toMB(device.totalBytes)
+        });
+    }
 
     return KLlamaResult(info);
 }
@@ -392,17 +847,34 @@ KLlamaResult<GenerationStats> KLlama::getGenerationStats() const {
 
 // Image validation
 KLlamaResult<std::vector<uint8_t> > KLlama::validateImageData(const ImageData &imageData) {
-    if (imageData.data.empty()) {
-        return KLlamaResult<std::vector<uint8_t> >(KLlamaError::ImageProcessingFailed, "Image data is empty");
+    if (auto check = checkImageData(imageData); check.isError()) {
+        return KLlamaResult<std::vector<uint8_t> >(check.error, check.errorMessage);
+    }
+
+    const auto bytes = imageData.bytes();
+    return KLlamaResult(std::vector<uint8_t>(bytes.begin(), bytes.end()));
+}
+
+KLlamaResult<void> KLlama::checkImageData(const ImageData &imageData) {
+    const auto data = imageData.bytes();
+    if (data.empty()) {
+        return KLlamaResult<void>(KLlamaError::ImageProcessingFailed, "Image data is empty");
+    }
+
+    if (imageData.isRgb()) {
+        if (data.size() != static_cast<size_t>(imageData.width) * imageData.height * 3) {
+            return KLlamaResult<void>(KLlamaError::ImageProcessingFailed,
+                                      "RGB image data size doesn't match its dimensions");
+        }
+        return {};
     }
 
     // Basic format validation
-    if (imageData.data.size() < 8) {
-        return KLlamaResult<std::vector<uint8_t> >(KLlamaError::ImageProcessingFailed, "Image data too small");
+    if (data.size() < 8) {
+        return KLlamaResult<void>(KLlamaError::ImageProcessingFailed, "Image data too small");
     }
 
     // Check for common image headers
-    const auto &data = imageData.data;
     bool validFormat = false;
 
     // PNG header
@@ -419,10 +891,10 @@ KLlamaResult<std::vector<uint8_t> > KLlama::validateImageData(const ImageData &i
     }
 
     if (!validFormat) {
-        return KLlamaResult<std::vector<uint8_t> >(KLlamaError::ImageProcessingFailed, "Unsupported image format");
+        return KLlamaResult<void>(KLlamaError::ImageProcessingFailed, "Unsupported image format");
     }
 
-    return KLlamaResult(imageData.data);
+    return {};
 }
 
 // Sampler configuration
@@ -432,21 +904,93 @@ KLlamaResult<void> KLlama::configureSampler(const SamplingParams &samplingParams
         return validation;
     }
 
-    // Free existing sampler
+    // Keep the previous chain around, the same parameters get it back below without a rebuild
     if (sampler) {
-        llama_sampler_free(sampler);
+        samplerCache->put(samplerParams, sampler);
         sampler = nullptr;
     }
 
-    // Create new sampler chain
-    sampler = llama_sampler_chain_init(llama_sampler_chain_default_params());
-    if (!sampler) {
-        return KLlamaResult<void>(KLlamaError::SamplingFailed, "Failed to create sampler chain");
+    auto chainResult = acquireSampler(samplingParams);
+    if (chainResult.isError()) {
+        return KLlamaResult<void>(chainResult.error, chainResult.errorMessage);
+    }
+    sampler = chainResult.value;
+    samplerParams = samplingParams;
+
+    return {};
+}
+
+KLlamaResult<void> KLlama::checkLoraAdapter(const SamplingParams &samplingParams) const {
+    if (samplingParams.loraAdapter >= static_cast<int32_t>(loraAdapters.size())) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters,
+                                  "LoRA adapter " + std::to_string(samplingParams.loraAdapter) + " is not loaded, " +
+                                  std::to_string(loraAdapters.size()) + " are");
+    }
+    return {};
+}
+
+KLlamaResult<void> KLlama::applyLoraAdapter(const SamplingParams &samplingParams) {
+    if (auto check = checkLoraAdapter(samplingParams); check.isError()) {
+        return check;
+    }
+    const auto index = samplingParams.loraAdapter;
+    const auto scale = index >= 0 ? samplingParams.loraScale : 0.0f;
+    if (index == activeLora && scale == activeLoraScale) {
+        return {};
+    }
+
+    // Switching is cheap, the adapter's tensors stay loaded. What the KV cache holds was computed without it.
+    llama_clear_adapter_lora(llamaContext);
+    llama_memory_seq_rm(llama_get_memory(llamaContext), 0, -1, -1);
+    kvCache.clear();
+    activeLora = -1;
+    activeLoraScale = 0.0f;
+    if (index >= 0 && llama_set_adapter_lora(llamaContext, loraAdapters[index], scale) != 0) {
+        return KLlamaResult<void>(KLlamaError::ContextInitFailed,
+                                  "Failed to apply LoRA adapter " + params.loraAdapters[index]);
+    }
+    activeLora = index;
+    activeLoraScale = scale;
+    LOG_DEBUG(LOG_TAG, "LoRA adapter %d applied at scale %.2f", index, scale);
+    return {};
+}
+
+KLlamaResult<llama_sampler *> KLlama::acquireSampler(const SamplingParams &samplingParams) const {
+    auto *chain = samplerCache->take(samplingParams);
+    if (!chain) {
+        auto chainResult = createSamplerChain(samplingParams);
+        if (chainResult.isError()) {
+            return chainResult;
+        }
+        chain = chainResult.value;
+    }
+    // The counters cover one generation
+    llama_perf_sampler_reset(chain);
+    return KLlamaResult(chain);
+}
+
+KLlamaResult<llama_sampler *> KLlama::createSamplerChain(const SamplingParams &samplingParams) const {
+    auto chainParams = llama_sampler_chain_default_params();
+    chainParams.no_perf = false;
+    auto *chain = llama_sampler_chain_init(chainParams);
+    if (!chain) {
+        return KLlamaResult<llama_sampler *>(KLlamaError::SamplingFailed, "Failed to create sampler chain");
+    }
+
+    // The grammar goes first, so that nothing after it can pick a token it rules out
+    if (!samplingParams.grammar.empty() || !samplingParams.jsonSchema.empty()) {
+        auto grammarResult = createGrammarSampler(llama_model_get_vocab(model), samplingParams.grammar,
+                                                  samplingParams.jsonSchema);
+        if (grammarResult.isError()) {
+            llama_sampler_free(chain);
+            return grammarResult;
+        }
+        llama_sampler_chain_add(chain, grammarResult.value);
     }
 
     // Add penalty samplers first (if repeat penalty is enabled)
     if (samplingParams.repeatPenalty != 1.0f) {
-        llama_sampler_chain_add(sampler, llama_sampler_init_penalties(
+        llama_sampler_chain_add(chain, llama_sampler_init_penalties(
                                     samplingParams.repeatLastN,
                                     samplingParams.repeatPenalty,
                                     samplingParams.frequencyPenalty,
@@ -454,39 +998,40 @@ KLlamaResult<void> KLlama::configureSampler(const SamplingParams &samplingParams
                                 ));
     }
 
-    // If temperature is very low, use greedy sampling only
-    if (samplingParams.temperature <= 0.01f) {
-        llama_sampler_chain_add(sampler, llama_sampler_init_greedy());
-        return {};
+    // If temperature is very low, or only the top token is kept anyway, use greedy sampling only
+    if (samplingParams.temperature <= 0.01f || samplingParams.topK == 1) {
+        llama_sampler_chain_add(chain, llama_sampler_init_greedy());
+        return KLlamaResult(chain);
     }
 
-    // Add top-k sampling (if enabled)
+    // Add top-k sampling (if enabled). It partially sorts only the top k candidates and leaves them
+    // sorted, so the samplers after it never sort the whole vocabulary.
     if (samplingParams.topK > 0) {
-        llama_sampler_chain_add(sampler, llama_sampler_init_top_k(samplingParams.topK));
+        llama_sampler_chain_add(chain, llama_sampler_init_top_k(samplingParams.topK));
     }
 
     // Add typical sampling (if enabled)
     if (samplingParams.typicalP < 1.0f && samplingParams.typicalP > 0.0f) {
-        llama_sampler_chain_add(sampler, llama_sampler_init_typical(samplingParams.typicalP, 1));
+        llama_sampler_chain_add(chain, llama_sampler_init_typical(samplingParams.typicalP, 1));
     }
 
     // Add top-p sampling (if enabled)
     if (samplingParams.topP < 1.0f && samplingParams.topP > 0.0f) {
-        llama_sampler_chain_add(sampler, llama_sampler_init_top_p(samplingParams.topP, 1));
+        llama_sampler_chain_add(chain, llama_sampler_init_top_p(samplingParams.topP, 1));
     }
 
     // Add min-p sampling (if enabled)
     if (samplingParams.minP > 0.0f) {
-        llama_sampler_chain_add(sampler, llama_sampler_init_min_p(samplingParams.minP, 1));
+        llama_sampler_chain_add(chain, llama_sampler_init_min_p(samplingParams.minP, 1));
     }
 
     // Add temperature sampling
-    llama_sampler_chain_add(sampler, llama_sampler_init_temp(samplingParams.temperature));
+    llama_sampler_chain_add(chain, llama_sampler_init_temp(samplingParams.temperature));
 
     // Add the final multinomial sampler
-    llama_sampler_chain_add(sampler, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    llama_sampler_chain_add(chain, llama_sampler_init_dist(samplingParams.seed));
 
-    return {};
+    return KLlamaResult(chain);
 }
 
 // Generation methods
@@ -509,6 +1054,16 @@ KLlamaResult<std::string> KLlama::generateResponse(
     return generateResponseInternal(conversation, samplingOverride, tokenCallback, progressCallback, cancellationToken);
 }
 
+std::shared_ptr<GenerationJob> KLlama::submit(GenerationRequest request) {
+    const std::lock_guard lock(workerMutex);
+    if (!worker) {
+        // Waiting on a slow consumer would hold up every sequence of the batch engine
+        const bool singleSequence = params.parallelSequences <= 1;
+        worker = std::make_unique<GenerationWorker>(*this, std::max(params.parallelSequences, 1), singleSequence);
+    }
+    return worker->submit(std::move(request));
+}
+
 KLlamaResult<std::string> KLlama::generateResponseInternal(
     const std::vector<MultimodalMessage> &conversation,
     const SamplingParams &samplingParams,
@@ -516,12 +1071,13 @@ KLlamaResult<std::string> KLlama::generateResponseInternal(
     const ProgressCallback &progressCallback,
     CancellationToken *cancellationToken
 ) {
+    TRACE_SCOPE("generateResponse");
     if (auto initCheck = checkInitialized(); initCheck.isError()) {
         return KLlamaResult<std::string>(initCheck.error, initCheck.errorMessage);
     }
-
-    if (generationState != GenerationState::Idle) {
-        return KLlamaResult<std::string>(KLlamaError::InvalidParameters, "Generation already in progress");
+    if (params.embeddings) {
+        return KLlamaResult<std::string>(KLlamaError::InvalidParameters,
+                                         "Session was initialized for embeddings, it can't generate");
     }
 
     // Validate conversation
@@ -529,18 +1085,12 @@ KLlamaResult<std::string> KLlama::generateResponseInternal(
         return KLlamaResult<std::string>(KLlamaError::InvalidParameters, "Conversation cannot be empty");
     }
 
-    // Validate images if present
-    std::vector<ImageData> allImages = extractAllImages(conversation);
-    for (const auto &image: allImages) {
-        if (auto imageValidation = validateImageData(image); imageValidation.isError()) {
-            return KLlamaResult<std::string>(imageValidation.error, imageValidation.errorMessage);
-        }
+    if (batchEngine) {
+        return generateBatched(conversation, samplingParams, tokenCallback, progressCallback, cancellationToken);
     }
 
-    // Check if vision is needed but not available
-    if (!allImages.empty() && !visionContext) {
-        return KLlamaResult<std::string>(KLlamaError::InvalidParameters,
-                                         "Images provided but multimodal projector not loaded");
+    if (isGenerationActive(generationState)) {
+        return KLlamaResult<std::string>(KLlamaError::InvalidParameters, "Generation already in progress");
     }
 
     // Configure sampler
@@ -548,206 +1098,98 @@ KLlamaResult<std::string> KLlama::generateResponseInternal(
     if (samplerResult.isError()) {
         return KLlamaResult<std::string>(samplerResult.error, samplerResult.errorMessage);
     }
+    if (auto loraResult = applyLoraAdapter(samplingParams); loraResult.isError()) {
+        return KLlamaResult<std::string>(loraResult.error, loraResult.errorMessage);
+    }
 
     // Initialize generation state
     setGenerationState(GenerationState::Initializing);
     currentStats = {};
     currentStats.sampling = samplingParams;
-    generationStartTime = std::chrono::high_resolution_clock::now();
+    generationStartTime = std::chrono::steady_clock::now();
+    llama_perf_context_reset(llamaContext);
 
-    // Reset context
-    if (auto resetResult = reset(); resetResult.isError()) {
-        setGenerationState(GenerationState::Error);
-        return KLlamaResult<std::string>(resetResult.error, resetResult.errorMessage);
-    }
-
-    // 1. Convert our MultimodalMessage to llama_chat_message
-    std::vector<llama_chat_message> chatMessages;
-    chatMessages.reserve(conversation.size());
-    for (const auto &msg: conversation) {
-        const char *role_str;
-        switch (msg.role) {
-            case MessageRole::User:
-                role_str = "user";
-                break;
-            case MessageRole::Assistant:
-                role_str = "assistant";
-                break;
-            case MessageRole::System:
-                role_str = "system";
-                break;
-            default: // Should not happen
-                role_str = "user";
-                break;
+    try {
+        // Check cancellation
+        if (cancellationToken && cancellationToken->isCancelled()) {
+            setGenerationState(GenerationState::Cancelled);
+            return KLlamaResult<std::string>(KLlamaError::OperationCancelled);
         }
-        chatMessages.push_back({role_str, msg.content.c_str()});
-    }
-
-    // 2. Apply the chat template from the model
-    std::vector<char> promptBuffer(params.contextSize);
 
-    const int32_t prompt_len = llama_chat_apply_template(
-        nullptr, // Use template from model
-        chatMessages.data(),
-        chatMessages.size(),
-        true, // Add generation prompt for assistant
-        promptBuffer.data(),
-        static_cast<int32_t>(promptBuffer.size())
-    );
+        setGenerationState(hasImages(conversation) ? GenerationState::ProcessingImages
+                                                   : GenerationState::TokenizingPrompt);
 
-    if (prompt_len < 0) {
-        return KLlamaResult<std::string>(KLlamaError::TokenizationFailed,
-                                         "Failed to apply chat template. Prompt may be too long or template invalid.");
-    }
-
-    std::string fullPrompt(promptBuffer.data(), prompt_len);
+        auto promptResult = preparePrompt(conversation, progressCallback);
+        if (promptResult.isError()) {
+            setGenerationState(GenerationState::Error);
+            return KLlamaResult<std::string>(promptResult.error, promptResult.errorMessage);
+        }
+        auto &prompt = promptResult.value;
+        currentStats.templateMs = prompt.templateMs;
+        currentStats.tokenizeMs = prompt.tokenizeMs;
 
-    try {
-        llama_pos past = 0;
         // Check cancellation
         if (cancellationToken && cancellationToken->isCancelled()) {
             setGenerationState(GenerationState::Cancelled);
             return KLlamaResult<std::string>(KLlamaError::OperationCancelled);
         }
 
-        if (!allImages.empty()) {
-            // Multimodal processing
-            setGenerationState(GenerationState::ProcessingImages);
-            if (progressCallback) {
-                progressCallback(0.1f, "Processing images");
-            }
-
-            // Prepend image markers to prompt
-            std::string imageMarkers;
-            for (size_t i = 0; i < allImages.size(); ++i) {
-                imageMarkers += mtmd_default_marker();
-            }
-            fullPrompt = imageMarkers + "\n" + fullPrompt;
-
-            // Create bitmaps
-            mtmd::bitmaps bitmaps;
-            for (const auto &imageData: allImages) {
-                mtmd::bitmap bmp(mtmd_helper_bitmap_init_from_buf(
-                    visionContext.get(),
-                    imageData.data.data(),
-                    imageData.data.size()
-                ));
-                if (!bmp.ptr) {
-                    setGenerationState(GenerationState::Error);
-                    return KLlamaResult<std::string>(KLlamaError::ImageProcessingFailed,
-                                                     "Failed to create bitmap from image data");
-                }
-                bitmaps.entries.push_back(std::move(bmp));
-            }
-
-            setGenerationState(GenerationState::TokenizingPrompt);
-            if (progressCallback) {
-                progressCallback(0.3f, "Tokenizing multimodal prompt");
+        // What context shifting never drops, at least the BOS token
+        const auto contextSize = static_cast<llama_pos>(llama_n_ctx(llamaContext));
+        const auto keep = std::min(params.contextKeep >= 0
+                                       ? static_cast<size_t>(params.contextKeep)
+                                       : std::max<size_t>(prompt.systemPrefix, 1),
+                                   prompt.units.size());
+        if (const auto positions = promptPositions(prompt); positions >= contextSize) {
+            if (!params.contextShift) {
+                setGenerationState(GenerationState::Error);
+                return KLlamaResult<std::string>(KLlamaError::InvalidParameters,
+                                                 "Prompt needs " + std::to_string(positions) +
+                                                 " positions, the context holds " + std::to_string(contextSize));
             }
+            fitPrompt(prompt, keep, contextSize);
+            LOG_DEBUG(LOG_TAG, "Prompt of %d positions cut to %d to fit the context", positions,
+                      promptPositions(prompt));
+        }
 
-            mtmd_input_text textInput;
-            textInput.text = fullPrompt.c_str();
-            textInput.add_special = true;
-            textInput.parse_special = true;
-
-            const mtmd::input_chunks chunks(mtmd_input_chunks_init());
-            auto bitmapsCPointer = bitmaps.c_ptr();
-            const auto tokenizationResult = mtmd_tokenize(
-                visionContext.get(),
-                chunks.ptr.get(),
-                &textInput,
-                bitmapsCPointer.data(),
-                bitmapsCPointer.size()
-            );
-
-            if (tokenizationResult != 0) {
-                setGenerationState(GenerationState::Error);
-                return KLlamaResult<std::string>(KLlamaError::TokenizationFailed,
-                                                 "Failed to tokenize multimodal input");
+        // Prefix snapshots are taken on the base model alone
+        const bool usePrefixCache = prefixCache && activeLora < 0;
+        auto reused = syncKvCache(prompt.units);
+        if (usePrefixCache && prompt.sharedPrefix > reused) {
+            reused = restorePrefix(prompt, reused);
+        }
+        currentStats.cachedPromptTokens = kvCache.nPast();
+        currentStats.promptTokens = promptPositions(prompt) - currentStats.cachedPromptTokens;
+
+        const auto promptStart = std::chrono::steady_clock::now();
+        auto evaluationResult = KLlamaResult<void>();
+        if (usePrefixCache && prompt.sharedPrefix > reused) {
+            // Not cached yet: stop after the shared prefix to snapshot it on the way
+            evaluationResult = evaluatePrompt(prompt, prompt.sharedPrefix, progressCallback, cancellationToken);
+            if (evaluationResult.isSuccess()) {
+                prefixCache->store(llamaContext, 0, sharedPrefixTokens(prompt));
             }
+        }
+        if (evaluationResult.isSuccess()) {
+            evaluationResult = evaluatePrompt(prompt, prompt.units.size(), progressCallback, cancellationToken);
+        }
 
-            // Check cancellation
-            if (cancellationToken && cancellationToken->isCancelled()) {
+        if (evaluationResult.isError()) {
+            // What was decoded before the cancellation stays cached for the next attempt
+            if (evaluationResult.error == KLlamaError::OperationCancelled) {
                 setGenerationState(GenerationState::Cancelled);
                 return KLlamaResult<std::string>(KLlamaError::OperationCancelled);
             }
-
-            if (progressCallback) {
-                progressCallback(0.5f, "Evaluating multimodal prompt");
-            }
-
-            llama_pos newPast = 0;
-            if (mtmd_helper_eval_chunks(
-                visionContext.get(),
-                llamaContext,
-                chunks.ptr.get(),
-                past,
-                0,
-                params.batch,
-                true,
-                &newPast
-            )) {
-                setGenerationState(GenerationState::Error);
-                return KLlamaResult<std::string>(KLlamaError::EvaluationFailed,
-                                                 "Failed to evaluate multimodal prompt");
-            }
-            past = newPast;
-        } else {
-            // Text-only processing
-            setGenerationState(GenerationState::TokenizingPrompt);
-            if (progressCallback) {
-                progressCallback(0.2f, "Tokenizing text prompt");
-            }
-
-            std::vector<llama_token> prompt_tokens;
-            prompt_tokens.resize(fullPrompt.length() + 2);
-
-            const auto *vocab = llama_model_get_vocab(model);
-            const auto tokensNumber = llama_tokenize(
-                vocab,
-                fullPrompt.c_str(),
-                static_cast<int32_t>(fullPrompt.length()),
-                prompt_tokens.data(),
-                static_cast<int32_t>(prompt_tokens.size()),
-                false, // Do not add BOS token, template should handle it
-                true // Parse special tokens from the template
-            );
-
-            if (tokensNumber < 0) {
-                setGenerationState(GenerationState::Error);
-                return KLlamaResult<std::string>(KLlamaError::TokenizationFailed,
-                                                 "Failed to tokenize text prompt: prompt too long");
-            }
-
-            prompt_tokens.resize(tokensNumber);
-
-            if (progressCallback) {
-                progressCallback(0.4f, "Evaluating text prompt");
-            }
-
-            auto textBatch = llama_batch_init(tokensNumber, 0, 1);
-            textBatch.n_tokens = tokensNumber;
-
-            for (int i = 0; i < tokensNumber; ++i) {
-                textBatch.token[i] = prompt_tokens[i];
-                textBatch.pos[i] = past + i;
-                textBatch.n_seq_id[i] = 1;
-                textBatch.seq_id[i][0] = 0;
-                textBatch.logits[i] = false;
-            }
-            textBatch.logits[textBatch.n_tokens - 1] = true;
-
-            if (llama_decode(llamaContext, textBatch)) {
-                llama_batch_free(textBatch);
-                setGenerationState(GenerationState::Error);
-                return KLlamaResult<std::string>(KLlamaError::EvaluationFailed,
-                                                 "Failed to evaluate text prompt");
-            }
-
-            past += tokensNumber;
-            llama_batch_free(textBatch);
+            reset();
+            setGenerationState(GenerationState::Error);
+            return KLlamaResult<std::string>(evaluationResult.error, evaluationResult.errorMessage);
         }
 
+        // The sampler waits for the last batch anyway, waiting here keeps its time in the prompt
+        llama_synchronize(llamaContext);
+        currentStats.promptMs = millisecondsSince(promptStart) - currentStats.imageEncodeMs;
+        const auto promptPerf = llama_perf_context(llamaContext);
+
         // Check cancellation before generation
         if (cancellationToken && cancellationToken->isCancelled()) {
             setGenerationState(GenerationState::Cancelled);
@@ -760,9 +1202,26 @@ KLlamaResult<std::string> KLlama::generateResponseInternal(
             progressCallback(0.6f, "Generating response");
         }
 
+        const auto *vocab = llama_model_get_vocab(model);
         std::string response_text;
+        std::string piece; // Reused for every token
         int32_t tokenCount = 0;
-        int32_t maxTokens = samplingParams.nPredict > 0 ? samplingParams.nPredict : 4096;
+        // With context shifting, generation runs until the end of the turn
+        int32_t maxTokens = samplingParams.nPredict > 0
+                                ? samplingParams.nPredict
+                                : params.contextShift
+                                      ? std::numeric_limits<int32_t>::max()
+                                      : DEFAULT_MAX_TOKENS;
+
+        // Drafted tokens decoded after the last sampled one. Each is kept only if the sampler,
+        // run on the logits in front of it, picks that very token, so the output doesn't change.
+        std::vector<llama_token> draft;
+        std::vector<llama_token> history;
+        int32_t draftedCount = 0;
+        int32_t acceptedCount = 0;
+        bool finished = false;
+        StopMatcher stopMatcher(samplingParams.stopSequences);
+        std::chrono::steady_clock::time_point lastTokenTime;
 
         while (generationState == GenerationState::Generating && tokenCount < maxTokens) {
             // Check cancellation
@@ -771,47 +1230,121 @@ KLlamaResult<std::string> KLlama::generateResponseInternal(
                 return KLlamaResult<std::string>(KLlamaError::OperationCancelled);
             }
 
-            const auto id = llama_sampler_sample(sampler, llamaContext, -1);
+            llama_token id = LLAMA_TOKEN_NULL;
+            size_t accepted = 0;
+            for (size_t i = 0; i <= draft.size(); ++i) {
+                {
+                    TRACE_SCOPE("sample");
+                    id = llama_sampler_sample(sampler, llamaContext, draft.empty() ? -1 : static_cast<int32_t>(i));
+                }
 
-            if (id == LLAMA_TOKEN_NULL) {
-                setGenerationState(GenerationState::Error);
-                return KLlamaResult<std::string>(KLlamaError::SamplingFailed,
-                                                 "Sampler returned null token");
-            }
+                if (id == LLAMA_TOKEN_NULL) {
+                    setGenerationState(GenerationState::Error);
+                    return KLlamaResult<std::string>(KLlamaError::SamplingFailed,
+                                                     "Sampler returned null token");
+                }
 
-            llama_sampler_accept(sampler, id);
+                if (llama_vocab_is_eog(vocab, id)) {
+                    finished = true;
+                    break;
+                }
 
-            if (llama_vocab_is_eog(llama_model_get_vocab(model), id)) {
-                break;
+                // One clock read per token serves the statistics and the latency histogram
+                const auto tokenTime = std::chrono::steady_clock::now();
+                if (tokenCount == 0) {
+                    currentStats.timeToFirstTokenMs = millisecondsBetween(generationStartTime, tokenTime);
+                } else {
+                    ++currentStats.interTokenHistogram[interTokenBucket(millisecondsBetween(lastTokenTime, tokenTime))];
+                }
+                lastTokenTime = tokenTime;
+
+                tokenToPiece(vocab, id, piece);
+                stopMatcher.push(piece);
+                if (!piece.empty()) {
+                    response_text += piece;
+                    if (tokenCallback) {
+                        TRACE_SCOPE("tokenCallback");
+                        tokenCallback(piece);
+                        currentStats.callbackMs += millisecondsSince(tokenTime);
+                    }
+                }
+
+                // Update statistics
+                tokenCount++;
+                currentStats.tokensGenerated = tokenCount;
+                updateGenerationStats(tokenTime);
+
+                if (tokenCount >= maxTokens || stopMatcher.matched()) {
+                    finished = true;
+                    break;
+                }
+                if (i == draft.size() || id != draft[i]) {
+                    break;
+                }
+                ++accepted;
             }
 
-            std::string token_str = tokenToString(model, id);
-            response_text += token_str;
+            // Drop the rejected part of the draft from the KV cache
+            if (accepted < draft.size()) {
+                kvCache.truncate(kvCache.size() - (draft.size() - accepted));
+                llama_memory_seq_rm(llama_get_memory(llamaContext), 0, kvCache.nPast(), -1);
+            }
+            acceptedCount += static_cast<int32_t>(accepted);
 
-            if (tokenCallback) {
-                tokenCallback(token_str);
+            if (finished) {
+                break;
             }
 
-            // Update statistics
-            currentStats.tokensGenerated = tokenCount + 1;
-            updateGenerationStats();
+            draft.clear();
+            if (drafter) {
+                history.clear();
+                for (const auto &unit: kvCache.entries()) {
+                    history.push_back(unit.token);
+                }
+                history.push_back(id);
+
+                // Drafts only use the room the context has left, a full context is decided by the sampled token
+                const auto draftLimit = std::min({
+                    params.draftMax,
+                    maxTokens - tokenCount - 1,
+                    static_cast<int32_t>(llama_n_batch(llamaContext)) - 1,
+                    static_cast<int32_t>(contextSize - kvCache.nPast() - 1)
+                });
+                if (draftLimit > 0) {
+                    TRACE_SCOPE("draft");
+                    drafter->propose(history, draftLimit, draft);
+                }
+                draftedCount += static_cast<int32_t>(draft.size());
+            }
 
-            // Prepare batch for the next token
-            batch.n_tokens = 1;
-            batch.token[0] = id;
-            batch.pos[0] = past;
-            batch.n_seq_id[0] = 1;
-            batch.seq_id[0][0] = 0;
-            batch.logits[0] = true;
+            // A full context either shifts or ends the response
+            if (const auto needed = static_cast<llama_pos>(draft.size() + 1);
+                kvCache.nPast() + needed > contextSize &&
+                (!params.contextShift || !shiftContext(keep, needed))) {
+                LOG_WARN(LOG_TAG, "Context is full, stopping generation after %d tokens", tokenCount);
+                break;
+            }
 
-            past++;
-            tokenCount++;
+            // Prepare batch for the next token, followed by the draft to verify
+            const auto startPos = kvCache.nPast();
+            batch.n_tokens = static_cast<int32_t>(draft.size() + 1);
+            for (int32_t i = 0; i < batch.n_tokens; ++i) {
+                batch.token[i] = i == 0 ? id : draft[i - 1];
+                batch.pos[i] = startPos + i;
+                batch.n_seq_id[i] = 1;
+                batch.seq_id[i][0] = 0;
+                batch.logits[i] = true;
+            }
 
-            if (llama_decode(llamaContext, batch)) {
+            if (decode(batch)) {
+                reset();
                 setGenerationState(GenerationState::Error);
                 return KLlamaResult<std::string>(KLlamaError::EvaluationFailed,
                                                  "Failed to decode token");
             }
+            for (int32_t i = 0; i < batch.n_tokens; ++i) {
+                kvCache.appendToken(batch.token[i]);
+            }
 
             // Progress update
             if (progressCallback && samplingParams.nPredict > 0) {
@@ -820,6 +1353,25 @@ KLlamaResult<std::string> KLlama::generateResponseInternal(
             }
         }
 
+        if (drafter && draftedCount > 0) {
+            LOG_DEBUG(LOG_TAG, "Accepted %d of %d drafted tokens", acceptedCount, draftedCount);
+        }
+
+        // llama.cpp counts single tokens and batches apart, the draft verification batches land in the latter
+        const auto perf = llama_perf_context(llamaContext);
+        currentStats.decodeTokens = perf.n_p_eval + perf.n_eval - promptPerf.n_p_eval - promptPerf.n_eval;
+        currentStats.decodeMs = static_cast<float>(perf.t_p_eval_ms + perf.t_eval_ms -
+                                                   promptPerf.t_p_eval_ms - promptPerf.t_eval_ms);
+
+        // What was held back as a possible stop sequence start
+        stopMatcher.flush(piece);
+        if (!piece.empty()) {
+            response_text += piece;
+            if (tokenCallback) {
+                tokenCallback(piece);
+            }
+        }
+
         setGenerationState(GenerationState::Finished);
         if (progressCallback) {
             progressCallback(1.0f, "Generation complete");
@@ -832,25 +1384,596 @@ KLlamaResult<std::string> KLlama::generateResponseInternal(
     }
 }
 
+KLlamaResult<std::string> KLlama::generateBatched(
+    const std::vector<MultimodalMessage> &conversation,
+    const SamplingParams &samplingParams,
+    const TokenCallback &tokenCallback,
+    const ProgressCallback &progressCallback,
+    CancellationToken *cancellationToken
+) {
+    if (auto validation = samplingParams.validate(); validation.isError()) {
+        return KLlamaResult<std::string>(validation.error, validation.errorMessage);
+    }
+    if (auto loraCheck = checkLoraAdapter(samplingParams); loraCheck.isError()) {
+        return KLlamaResult<std::string>(loraCheck.error, loraCheck.errorMessage);
+    }
+
+    try {
+        BatchRequest request;
+        {
+            // Templating and media preprocessing share the vision context
+            std::lock_guard lock(promptMutex);
+            auto promptResult = preparePrompt(conversation, progressCallback);
+            if (promptResult.isError()) {
+                return KLlamaResult<std::string>(promptResult.error, promptResult.errorMessage);
+            }
+            request.prompt = std::move(promptResult.value);
+        }
+
+        // Each sequence holds its share of the context, the prompt fits in it or is cut as the single path does
+        auto &prompt = request.prompt;
+        const auto contextSize = batchEngine->sequenceContext();
+        if (const auto positions = promptPositions(prompt); positions >= contextSize) {
+            if (!params.contextShift) {
+                return KLlamaResult<std::string>(KLlamaError::InvalidParameters,
+                                                 "Prompt needs " + std::to_string(positions) +
+                                                 " positions, a sequence holds " + std::to_string(contextSize));
+            }
+            const auto keep = std::min(params.contextKeep >= 0
+                                           ? static_cast<size_t>(params.contextKeep)
+                                           : std::max<size_t>(prompt.systemPrefix, 1),
+                                       prompt.units.size());
+            fitPrompt(prompt, keep, contextSize);
+            LOG_DEBUG(LOG_TAG, "Prompt of %d positions cut to %d to fit the sequence", positions,
+                      promptPositions(prompt));
+        }
+
+        // Every sequence samples with its own chain, which goes back to the cache when it is done
+        auto chainResult = acquireSampler(samplingParams);
+        if (chainResult.isError()) {
+            return KLlamaResult<std::string>(chainResult.error, chainResult.errorMessage);
+        }
+        request.sampler = chainResult.value;
+        request.samplerCache = samplerCache.get();
+        request.sampling = samplingParams;
+        request.loraAdapter = samplingParams.loraAdapter;
+        request.loraScale = samplingParams.loraAdapter >= 0 ? samplingParams.loraScale : 0.0f;
+        request.maxTokens = samplingParams.nPredict > 0 ? samplingParams.nPredict : DEFAULT_MAX_TOKENS;
+        request.tokenCallback = tokenCallback;
+        request.progressCallback = progressCallback;
+        request.cancellationToken = cancellationToken;
+
+        auto result = batchEngine->generate(std::move(request));
+
+        if (progressCallback && result.isSuccess()) {
+            progressCallback(1.0f, "Generation complete");
+        }
+
+        return result;
+    } catch (const std::exception &e) {
+        return KLlamaResult<std::string>(KLlamaError::UnknownError, e.what());
+    }
+}
+
+KLlamaResult<PreparedPrompt> KLlama::preparePrompt(
+    const std::vector<MultimodalMessage> &conversation,
+    const ProgressCallback &progressCallback
+) const {
+    TRACE_SCOPE("preparePrompt");
+    // Validate images if present
+    const auto allImages = extractAllImages(conversation);
+    for (const auto *image: allImages) {
+        if (auto imageValidation = checkImageData(*image); imageValidation.isError()) {
+            return KLlamaResult<PreparedPrompt>(imageValidation.error, imageValidation.errorMessage);
+        }
+    }
+
+    // Check if vision is needed but not available
+    if (!allImages.empty() && !visionContext) {
+        return KLlamaResult<PreparedPrompt>(KLlamaError::InvalidParameters,
+                                            "Images provided but multimodal projector not loaded");
+    }
+
+    auto promptResult = promptBuilder->build(conversation, progressCallback);
+    if (promptResult.isError()) {
+        return promptResult;
+    }
+    auto &prompt = promptResult.value;
+
+    if (prefixCache || params.contextShift) {
+        // The system prompt rendered alone tokenizes the same as the start of the full prompt
+        const auto systemStart = std::chrono::steady_clock::now();
+        const auto systemTokens = promptBuilder->systemPrefix(conversation, !allImages.empty());
+        prompt.tokenizeMs += millisecondsSince(systemStart);
+        size_t shared = 0;
+        while (shared < systemTokens.size() && shared < prompt.units.size() &&
+               !prompt.units[shared].isMedia() && prompt.units[shared].token == systemTokens[shared]) {
+            ++shared;
+        }
+        prompt.systemPrefix = shared;
+        prompt.sharedPrefix = prefixCache && shared >= MIN_SHARED_PREFIX ? shared : 0;
+    }
+
+    return promptResult;
+}
+
+KLlamaResult<void> KLlama::evaluatePrompt(
+    const PreparedPrompt &prompt,
+    const size_t end,
+    const ProgressCallback &progressCallback,
+    const CancellationToken *cancellationToken
+) {
+    TRACE_SCOPE("evaluatePrompt");
+    const auto stage = prompt.hasMedia() ? "Evaluating multimodal prompt" : "Evaluating text prompt";
+    const auto begin = kvCache.size();
+
+    const auto reportProgress = [&] {
+        if (progressCallback && !prompt.units.empty()) {
+            const auto done = static_cast<float>(kvCache.size()) / static_cast<float>(prompt.units.size());
+            progressCallback(0.4f + 0.2f * done, stage);
+        }
+    };
+    const auto onChunk = [&](int32_t) {
+        reportProgress();
+        return !(cancellationToken && cancellationToken->isCancelled());
+    };
+
+    reportProgress();
+
+    // With pipelining, the images to evaluate are encoded ahead on the encoder's thread. An image ending the
+    // prompt needs logits, which decoding precomputed embeddings doesn't give, so it takes the regular path.
+    const auto pipelined = [&](const size_t i, const mtmd_input_chunk *chunk) {
+        return params.imagePipelining && i >= begin && i + 1 < prompt.units.size() &&
+               mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_IMAGE;
+    };
+    std::unique_ptr<ImageEncoder> encoder;
+    if (params.imagePipelining && visionContext) {
+        std::vector<ImageEncoder::Item> items;
+        size_t chunkIndex = 0;
+        for (size_t i = 0; i < end; ++i) {
+            if (prompt.units[i].isMedia()) {
+                if (const auto *chunk = prompt.mediaChunks[chunkIndex++]; pipelined(i, chunk)) {
+                    items.push_back({chunk, prompt.units[i].mediaHash});
+                }
+            }
+        }
+        // A single image has nothing to overlap with
+        if (items.size() > 1) {
+            encoder = std::make_unique<ImageEncoder>(visionContext.get(), model, std::move(items), imageCache.get(),
+                                                     visionOnGpu ? nullptr : computePool.get());
+        }
+    }
+
+    // Text runs are decoded in batches, media chunks go through mtmd one at a time
+    std::vector<llama_token> pendingTokens;
+    size_t mediaIndex = 0;
+
+    for (size_t i = 0; i < end; ++i) {
+        const auto &unit = prompt.units[i];
+        if (!unit.isMedia()) {
+            if (i >= begin) {
+                pendingTokens.push_back(unit.token);
+            }
+            continue;
+        }
+
+        const auto *chunk = prompt.mediaChunks[mediaIndex++];
+        if (i < begin) {
+            continue;
+        }
+
+        if (auto decodeResult = decodePromptTokens(
+            pendingTokens.data(),
+            static_cast<int32_t>(pendingTokens.size()),
+            false,
+            onChunk
+        ); decodeResult.isError()) {
+            return decodeResult;
+        }
+        pendingTokens.clear();
+
+        llama_pos newPast = 0;
+        const bool logitsLast = i + 1 == prompt.units.size();
+        int32_t mediaResult = -1;
+        const auto encodeStart = std::chrono::steady_clock::now();
+        if (encoder && pipelined(i, chunk)) {
+            if (const auto embedding = encoder->next()) {
+                const auto computeLock = lockCompute();
+                TRACE_SCOPE("decodeImageEmbeddings");
+                mediaResult = mtmd_helper_decode_image_chunk(visionContext.get(), llamaContext, chunk,
+                                                             embedding->data(), kvCache.nPast(), 0, params.batch,
+                                                             &newPast);
+            }
+        } else {
+            const auto computeLock = lockCompute();
+            TRACE_SCOPE("encodeImage");
+            mediaResult = imageCache
+                              ? imageCache->evaluate(visionContext.get(), llamaContext, chunk, unit.mediaHash,
+                                                     kvCache.nPast(), 0, params.batch, logitsLast, &newPast)
+                              : mtmd_helper_eval_chunk_single(visionContext.get(), llamaContext, chunk,
+                                                              kvCache.nPast(), 0, params.batch, logitsLast,
+                                                              &newPast);
+        }
+        currentStats.imageEncodeMs += millisecondsSince(encodeStart);
+        if (mediaResult) {
+            return KLlamaResult<void>(KLlamaError::EvaluationFailed, "Failed to evaluate multimodal prompt");
+        }
+        kvCache.append(unit);
+
+        if (!onChunk(1)) {
+            return KLlamaResult<void>(KLlamaError::OperationCancelled);
+        }
+    }
+
+    return decodePromptTokens(pendingTokens.data(), static_cast<int32_t>(pendingTokens.size()),
+                              end == prompt.units.size(), onChunk);
+}
+
+size_t KLlama::restorePrefix(const PreparedPrompt &prompt, const size_t reused) {
+    const auto prefix = sharedPrefixTokens(prompt);
+    if (!prefixCache->contains(prefix)) {
+        return reused;
+    }
+
+    // A restore replaces what the sequence holds, llama.cpp drops it before reading the snapshot
+    const bool restored = prefixCache->restore(llamaContext, 0, prefix);
+    kvCache.clear();
+    if (!restored) {
+        return 0;
+    }
+    for (const auto token: prefix) {
+        kvCache.appendToken(token);
+    }
+
+    return syncKvCache(prompt.units);
+}
+
 // Helper methods
-std::vector<ImageData> KLlama::extractAllImages(const std::vector<MultimodalMessage> &conversation) {
-    std::vector<ImageData> allImages;
+std::vector<const ImageData *> KLlama::extractAllImages(const std::vector<MultimodalMessage> &conversation) {
+    std::vector<const ImageData *> allImages;
 
     for (const auto &message: conversation) {
         for (const auto &image: message.images) {
-            allImages.push_back(image);
+            allImages.push_back(&image);
         }
     }
 
     return allImages;
 }
 
-KLlamaResult<void> KLlama::reset() const {
+KLlamaResult<void> KLlama::reset() {
     if (auto initCheck = checkInitialized(); initCheck.isError()) {
         return initCheck;
     }
 
     llama_memory_seq_rm(llama_get_memory(llamaContext), 0, -1, -1);
+    kvCache.clear();
+    return {};
+}
+
+KLlamaResult<void> KLlama::checkSnapshotAllowed() const {
+    if (auto initCheck = checkInitialized(); initCheck.isError()) {
+        return initCheck;
+    }
+    if (batchEngine || params.embeddings) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters,
+                                  "State snapshots are not supported with parallel sequences or embeddings");
+    }
+    if (generationState == GenerationState::TokenizingPrompt ||
+        generationState == GenerationState::ProcessingImages ||
+        generationState == GenerationState::Generating) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "Generation is in progress");
+    }
+    return {};
+}
+
+KLlamaResult<std::vector<uint8_t> > KLlama::saveState() const {
+    if (auto check = checkSnapshotAllowed(); check.isError()) {
+        return KLlamaResult<std::vector<uint8_t> >(check.error, check.errorMessage);
+    }
+    return SessionSnapshot::save(llamaContext, 0, snapshotKey(), kvCache);
+}
+
+KLlamaResult<void> KLlama::saveStateFile(const std::string &path) const {
+    if (auto check = checkSnapshotAllowed(); check.isError()) {
+        return check;
+    }
+    return SessionSnapshot::saveFile(llamaContext, 0, snapshotKey(), kvCache, path);
+}
+
+KLlamaResult<void> KLlama::restoreState(const std::span<const uint8_t> data) {
+    if (auto check = checkSnapshotAllowed(); check.isError()) {
+        return check;
+    }
+    return SessionSnapshot::restore(llamaContext, 0, snapshotKey(), data, kvCache);
+}
+
+KLlamaResult<void> KLlama::restoreStateFile(const std::string &path) {
+    if (auto check = checkSnapshotAllowed(); check.isError()) {
+        return check;
+    }
+    return SessionSnapshot::restoreFile(llamaContext, 0, snapshotKey(), path, kvCache);
+}
+
+uint64_t KLlama::snapshotKey() const {
+    if (activeLora < 0) {
+        return prefixCacheKey(params);
+    }
+    const auto identity = params.loraAdapters[activeLora] + ":" + std::to_string(activeLoraScale);
+    return prefixCacheKey(params) ^ hashBytes(reinterpret_cast<const uint8_t *>(identity.data()), identity.size());
+}
+
+KLlamaResult<void> KLlama::checkEmbeddings() const {
+    if (auto initCheck = checkInitialized(); initCheck.isError()) {
+        return initCheck;
+    }
+    if (!params.embeddings) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters,
+                                  "Embeddings need a session initialized with SessionParams::embeddings");
+    }
+    return {};
+}
+
+int32_t KLlama::embeddingSize() const {
+    return model ? llama_model_n_embd(model) : 0;
+}
+
+KLlamaResult<std::vector<float> > KLlama::embed(const std::vector<std::string> &texts) {
+    TRACE_SCOPE("embed");
+    if (auto check = checkEmbeddings(); check.isError()) {
+        return KLlamaResult<std::vector<float> >(check.error, check.errorMessage);
+    }
+    const auto pooling = llama_pooling_type(llamaContext);
+    if (pooling == LLAMA_POOLING_TYPE_NONE) {
+        return KLlamaResult<std::vector<float> >(KLlamaError::InvalidParameters,
+                                                 "The model doesn't pool its embeddings, set SessionParams::pooling");
+    }
+    if (pooling == LLAMA_POOLING_TYPE_RANK) {
+        return KLlamaResult<std::vector<float> >(KLlamaError::InvalidParameters,
+                                                 "Reranking models score documents with rerank");
+    }
+
+    const auto *vocab = llama_model_get_vocab(model);
+    std::vector<std::vector<llama_token> > inputs;
+    inputs.reserve(texts.size());
+    for (const auto &text: texts) {
+        inputs.push_back(tokenizeText(vocab, text, true));
+    }
+
+    const auto size = static_cast<size_t>(embeddingSize());
+    auto result = poolInputs(inputs, size);
+    if (result.isError()) {
+        return result;
+    }
+
+    // Unit length, so that the dot product of two vectors is their cosine similarity
+    for (size_t i = 0; i < texts.size(); ++i) {
+        auto *vector = result.value.data() + i * size;
+        double sum = 0.0;
+        for (size_t j = 0; j < size; ++j) {
+            sum += static_cast<double>(vector[j]) * vector[j];
+        }
+        if (sum > 0.0) {
+            const auto scale = static_cast<float>(1.0 / std::sqrt(sum));
+            for (size_t j = 0; j < size; ++j) {
+                vector[j] *= scale;
+            }
+        }
+    }
+    return result;
+}
+
+KLlamaResult<std::vector<float> > KLlama::rerank(const std::string &query, const std::vector<std::string> &documents) {
+    TRACE_SCOPE("rerank");
+    if (auto check = checkEmbeddings(); check.isError()) {
+        return KLlamaResult<std::vector<float> >(check.error, check.errorMessage);
+    }
+    if (llama_pooling_type(llamaContext) != LLAMA_POOLING_TYPE_RANK) {
+        return KLlamaResult<std::vector<float> >(KLlamaError::InvalidParameters,
+                                                 "Reranking needs a reranking model or PoolingType::Rank");
+    }
+
+    // The pair layout llama.cpp's server uses: BOS query EOS SEP document EOS, as the vocabulary asks for them
+    const auto *vocab = llama_model_get_vocab(model);
+    const auto queryTokens = tokenizeText(vocab, query, false);
+    std::vector<std::vector<llama_token> > inputs;
+    inputs.reserve(documents.size());
+    for (const auto &document: documents) {
+        const auto documentTokens = tokenizeText(vocab, document, false);
+        auto &input = inputs.emplace_back();
+        input.reserve(queryTokens.size() + documentTokens.size() + 4);
+        if (llama_vocab_get_add_bos(vocab)) {
+            input.push_back(llama_vocab_bos(vocab));
+        }
+        input.insert(input.end(), queryTokens.begin(), queryTokens.end());
+        if (llama_vocab_get_add_eos(vocab)) {
+            input.push_back(llama_vocab_eos(vocab));
+        }
+        if (llama_vocab_get_add_sep(vocab)) {
+            input.push_back(llama_vocab_sep(vocab));
+        }
+        input.insert(input.end(), documentTokens.begin(), documentTokens.end());
+        if (llama_vocab_get_add_eos(vocab)) {
+            input.push_back(llama_vocab_eos(vocab));
+        }
+    }
+
+    // Models with several classifier outputs put the relevance first
+    return poolInputs(inputs, 1);
+}
+
+KLlamaResult<std::vector<float> > KLlama::poolInputs(const std::vector<std::vector<llama_token> > &inputs,
+                                                      const size_t outputSize) {
+    const std::lock_guard lock(embeddingMutex);
+    const auto batchSize = static_cast<size_t>(std::min(llama_n_batch(llamaContext), llama_n_ctx(llamaContext)));
+    const auto maxSequences = static_cast<size_t>(llama_n_seq_max(llamaContext));
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (inputs[i].empty() || inputs[i].size() > batchSize) {
+            return KLlamaResult<std::vector<float> >(KLlamaError::InvalidParameters,
+                                                     "Input " + std::to_string(i) + " has " +
+                                                     std::to_string(inputs[i].size()) + " tokens, between 1 and " +
+                                                     std::to_string(batchSize) + " fit");
+        }
+    }
+
+    // Encoder-only models such as BERT go through llama_encode
+    const bool encoderOnly = llama_model_has_encoder(model) && !llama_model_has_decoder(model);
+    auto *memory = llama_get_memory(llamaContext);
+    std::vector<float> output(inputs.size() * outputSize);
+
+    size_t first = 0;
+    while (first < inputs.size()) {
+        batch.n_tokens = 0;
+        auto last = first;
+        while (last < inputs.size() && last - first < maxSequences &&
+               static_cast<size_t>(batch.n_tokens) + inputs[last].size() <= batchSize) {
+            const auto seqId = static_cast<llama_seq_id>(last - first);
+            const auto &input = inputs[last];
+            for (size_t i = 0; i < input.size(); ++i) {
+                const auto n = batch.n_tokens++;
+                batch.token[n] = input[i];
+                batch.pos[n] = static_cast<llama_pos>(i);
+                batch.n_seq_id[n] = 1;
+                batch.seq_id[n][0] = seqId;
+                batch.logits[n] = true;
+            }
+            ++last;
+        }
+
+        int32_t decodeResult;
+        {
+            const auto computeLock = lockCompute();
+            TRACE_SCOPE("llama_decode");
+            decodeResult = encoderOnly ? llama_encode(llamaContext, batch) : llama_decode(llamaContext, batch);
+        }
+        if (decodeResult != 0) {
+            if (memory) {
+                llama_memory_clear(memory, true);
+            }
+            return KLlamaResult<std::vector<float> >(KLlamaError::EvaluationFailed, "Failed to compute embeddings");
+        }
+
+        for (auto i = first; i < last; ++i) {
+            const auto *pooled = llama_get_embeddings_seq(llamaContext, static_cast<llama_seq_id>(i - first));
+            if (!pooled) {
+                if (memory) {
+                    llama_memory_clear(memory, true);
+                }
+                return KLlamaResult<std::vector<float> >(KLlamaError::EvaluationFailed,
+                                                         "No pooled embedding for input " + std::to_string(i));
+            }
+            std::copy_n(pooled, outputSize, output.begin() + static_cast<std::ptrdiff_t>(i * outputSize));
+        }
+
+        // Causal embedding models keep the inputs in the KV cache, the next batch reuses the sequence ids
+        if (memory) {
+            llama_memory_clear(memory, true);
+        }
+        first = last;
+    }
+
+    return KLlamaResult(std::move(output));
+}
+
+size_t KLlama::syncKvCache(const std::vector<PromptUnit> &prompt) {
+    auto reused = kvCache.commonPrefix(prompt);
+
+    // The last prompt token is always re-evaluated, so that there are fresh logits to sample from
+    if (reused > 0 && reused == prompt.size()) {
+        --reused;
+    }
+
+    auto *memory = llama_get_memory(llamaContext);
+    if (!llama_memory_seq_rm(memory, 0, kvCache.positionAt(reused), -1)) {
+        // Partial removal is not supported by this memory type (e.g. recurrent models)
+        llama_memory_seq_rm(memory, 0, -1, -1);
+        reused = 0;
+    }
+    kvCache.truncate(reused);
+
+    LOG_DEBUG(LOG_TAG, "Reusing %zu of %zu prompt units from the KV cache", reused, prompt.size());
+
+    return reused;
+}
+
+int32_t KLlama::prefillChunkSize() const {
+    // llama_decode can't take more than n_batch tokens at once
+    const auto batchSize = static_cast<int32_t>(llama_n_batch(llamaContext));
+    return params.prefillChunk > 0 ? std::min(params.prefillChunk, batchSize) : batchSize;
+}
+
+bool KLlama::shiftContext(const size_t keep, const llama_pos needed) {
+    auto *memory = llama_get_memory(llamaContext);
+    if (!llama_memory_can_shift(memory) || kvCache.size() <= keep + 1) {
+        return false;
+    }
+
+    // Half of what follows the kept prefix, or more when that still doesn't make enough room
+    const auto contextSize = static_cast<llama_pos>(llama_n_ctx(llamaContext));
+    auto discard = (kvCache.size() - keep) / 2;
+    while (keep + discard < kvCache.size() &&
+           kvCache.nPast() - (kvCache.positionAt(keep + discard) - kvCache.positionAt(keep)) + needed > contextSize) {
+        ++discard;
+    }
+
+    const auto p0 = kvCache.positionAt(keep);
+    const auto p1 = kvCache.positionAt(keep + discard);
+    if (!llama_memory_seq_rm(memory, 0, p0, p1)) {
+        return false;
+    }
+    llama_memory_seq_add(memory, 0, p1, -1, p0 - p1);
+    kvCache.erase(keep, discard);
+
+    LOG_DEBUG(LOG_TAG, "Context shifted: dropped %zu units after the first %zu", discard, keep);
+    return true;
+}
+
+int32_t KLlama::decode(const llama_batch &tokens) {
+    const auto computeLock = lockCompute();
+    TRACE_SCOPE("llama_decode");
+    return llama_decode(llamaContext, tokens);
+}
+
+std::unique_lock<std::mutex> KLlama::lockCompute() const {
+    return computePool ? computePool->lock() : std::unique_lock<std::mutex>();
+}
+
+KLlamaResult<void> KLlama::decodePromptTokens(
+    const llama_token *tokens,
+    const int32_t count,
+    const bool logitsLast,
+    const std::function<bool(int32_t)> &onChunk
+) {
+    const auto chunkLimit = prefillChunkSize();
+
+    for (int32_t start = 0; start < count; start += chunkLimit) {
+        const auto chunkSize = std::min(chunkLimit, count - start);
+        const auto startPos = kvCache.nPast();
+
+        batch.n_tokens = chunkSize;
+        for (int32_t i = 0; i < chunkSize; ++i) {
+            batch.token[i] = tokens[start + i];
+            batch.pos[i] = startPos + i;
+            batch.n_seq_id[i] = 1;
+            batch.seq_id[i][0] = 0;
+            batch.logits[i] = false;
+        }
+        batch.logits[chunkSize - 1] = logitsLast && start + chunkSize == count;
+
+        if (decode(batch)) {
+            return KLlamaResult<void>(KLlamaError::EvaluationFailed, "Failed to decode prompt tokens");
+        }
+
+        for (int32_t i = 0; i < chunkSize; ++i) {
+            kvCache.appendToken(tokens[start + i]);
+        }
+
+        // Cancelling between chunks leaves the KV cache consistent with kvCache
+        if (onChunk && !onChunk(chunkSize)) {
+            return KLlamaResult<void>(KLlamaError::OperationCancelled);
+        }
+    }
+
     return {};
 }
 
@@ -859,13 +1982,18 @@ void KLlama::setGenerationState(GenerationState state) {
     currentStats.state = state;
 }
 
-void KLlama::updateGenerationStats() const {
-    const auto now = std::chrono::high_resolution_clock::now();
-    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - generationStartTime);
-
-    currentStats.timeElapsed = static_cast<float>(elapsed.count()) / 1000.0f;
+void KLlama::updateGenerationStats(const std::chrono::steady_clock::time_point now) const {
+    currentStats.timeElapsed = millisecondsBetween(generationStartTime, now) / 1000.0f;
     if (currentStats.timeElapsed > 0.0f) {
         currentStats.tokensPerSecond = static_cast<int32_t>(
             static_cast<float>(currentStats.tokensGenerated) / currentStats.timeElapsed);
     }
+
+    if (sampler) {
+        const auto perf = llama_perf_sampler(sampler);
+        currentStats.samplingMs = static_cast<float>(perf.t_sample_ms);
+        currentStats.samplingMsPerToken = perf.n_sample > 0
+                                              ? static_cast<float>(perf.t_sample_ms) / static_cast<float>(perf.n_sample)
+                                              : 0.0f;
+    }
 }
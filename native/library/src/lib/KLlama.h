@@ -1,6 +1,7 @@
 #ifndef KLLAMA_H
 #define KLLAMA_H
 
+#include <array>
 #include <functional>
 #include <memory>
 #include <string>
@@ -8,10 +9,27 @@
 #include <vector>
 #include <atomic>
 #include <chrono>
+#include <mutex>
+#include <span>
 
 #include "llama.h"
 #include "mtmd.h"
 
+#include "PreparedPrompt.h"
+#include "SequenceCache.h"
+
+class BatchEngine;
+class ComputePool;
+class KLlamaModel;
+class PrefixCache;
+class PromptBuilder;
+class SamplerCache;
+class Drafter;
+class EmbeddingCache;
+class GenerationJob;
+class GenerationWorker;
+struct GenerationRequest;
+
 enum class KLlamaError {
     None = 0,
     ModelNotFound = 1,
@@ -84,18 +102,33 @@ struct CancellationToken {
 struct ModelInfo {
     std::string name;
     std::string architecture;
+    std::string quantization; // Type holding most of the weights, e.g. "q4_K"
     int64_t parameterCount;
     int32_t contextSize;
     bool supportsVision;
     std::vector<std::string> capabilities;
 };
 
-// Memory usage information
+// Memory of one GPU or accelerator
+struct DeviceMemoryInfo {
+    std::string name;
+    std::string description;
+    size_t modelMemoryMB; // Weights of this session's model placed on the device
+    size_t freeMemoryMB;
+    size_t totalMemoryMB;
+};
+
+// Memory usage information, cheap enough to poll
 struct MemoryInfo {
     size_t modelMemoryMB;
-    size_t contextMemoryMB;
-    size_t totalMemoryMB;
-    size_t availableMemoryMB;
+    size_t contextMemoryMB; // KV cache, compute and output buffers, measured when the context was created
+    size_t kvCacheMB; // Estimated for the whole context at the configured cache types
+    size_t kvCacheUsedMB; // Part of it holding tokens
+    size_t visionMemoryMB; // Projector weights and buffers, measured when loaded
+    size_t totalMemoryMB; // Model, context and vision
+    size_t residentMemoryMB; // Resident set of the whole process
+    size_t availableMemoryMB; // What the system can still hand out without swapping
+    std::vector<DeviceMemoryInfo> devices;
 };
 
 // Generation state
@@ -110,8 +143,32 @@ enum class GenerationState {
     Error
 };
 
+// An image, either encoded (PNG, JPEG, BMP) or as pre-decoded RGB pixels (width * height * 3 bytes)
+// which skips decoding entirely. The bytes are owned in `data` or borrowed through `view`.
 struct ImageData {
     std::vector<uint8_t> data;
+    // Borrowed bytes, used instead of `data` when set. Must stay valid until the generation returns.
+    std::span<const uint8_t> view;
+    // Set for pre-decoded RGB pixels
+    uint32_t width = 0;
+    uint32_t height = 0;
+
+    [[nodiscard]] std::span<const uint8_t> bytes() const { return view.empty() ? std::span(data) : view; }
+    [[nodiscard]] bool isRgb() const { return width > 0 && height > 0; }
+
+    // Copies borrowed bytes into `data`, for an image that outlives what it borrows from
+    void own() {
+        if (!view.empty()) {
+            data.assign(view.begin(), view.end());
+            view = {};
+        }
+    }
+
+    static ImageData borrowed(const std::span<const uint8_t> bytes) { return {{}, bytes, 0, 0}; }
+
+    static ImageData rgb(const std::span<const uint8_t> pixels, const uint32_t width, const uint32_t height) {
+        return {{}, pixels, width, height};
+    }
 };
 
 // UPDATED: Role is now a type-safe enum
@@ -138,29 +195,150 @@ struct SamplingParams {
     float frequencyPenalty = 0.0f;
     float presencePenalty = 0.0f;
     int32_t nPredict = -1; // -1 = unlimited
+    uint32_t seed = LLAMA_DEFAULT_SEED; // LLAMA_DEFAULT_SEED draws a new one for every generation
+    std::vector<std::string> stopSequences; // Generation ends before any of these, which are not returned
+
+    // Constrained output, at most one of the two
+    std::string grammar; // GBNF, starting at the "root" rule
+    std::string jsonSchema;
+
+    // Index into SessionParams::loraAdapters, -1 = the base model alone. Switching adapters drops the KV cache,
+    // and batched requests on different adapters take turns, since the adapters apply to the whole context.
+    int32_t loraAdapter = -1;
+    float loraScale = 1.0f;
 
     // Validation
     [[nodiscard]] KLlamaResult<void> validate() const;
 };
 
 // Generation statistics
+// Upper bounds of the inter-token latency histogram buckets, in milliseconds. One more bucket counts the slower tokens.
+inline constexpr std::array<float, 12> INTER_TOKEN_BUCKETS_MS{5, 10, 20, 30, 50, 75, 100, 150, 200, 300, 500, 1000};
+
+// What the last generation spent its time on. Phase times are in milliseconds.
 struct GenerationStats {
     int32_t tokensGenerated{};
     int32_t tokensPerSecond{};
-    float timeElapsed{};
+    float timeElapsed{}; // Seconds since the generation started, template application included
+    float samplingMs{}; // Time spent in the sampler chain
+    float samplingMsPerToken{};
+    float templateMs{}; // Chat template application
+    float tokenizeMs{}; // Tokenization, with image decoding and preprocessing
+    float imageEncodeMs{}; // Vision encoder, with the decoding of its embeddings
+    int32_t promptTokens{}; // Prompt positions evaluated
+    int32_t cachedPromptTokens{}; // Prompt positions reused from the KV cache or the prefix cache
+    float promptMs{}; // Prompt evaluation, without the images
+    int32_t decodeTokens{}; // Positions decoded while generating, drafted tokens included
+    float decodeMs{}; // Time inside llama_decode while generating
+    float callbackMs{}; // Time spent in the token callback
+    float timeToFirstTokenMs{};
+    // Counts of the gaps between emitted tokens, bucketed by INTER_TOKEN_BUCKETS_MS
+    std::array<int32_t, INTER_TOKEN_BUCKETS_MS.size() + 1> interTokenHistogram{};
     GenerationState state;
     SamplingParams sampling;
 };
 
+// How the model is spread across several GPUs
+enum class SplitMode {
+    None, // Everything on mainGpu
+    Layer, // Whole layers per GPU
+    Row, // Rows of each tensor across GPUs
+};
+
+// Element type of the KV cache. The quantized types need a fraction of the f16 memory.
+enum class KvCacheType {
+    F32,
+    F16,
+    BF16,
+    Q8_0,
+    Q4_0,
+    Q4_1,
+    Q5_0,
+    Q5_1,
+};
+
+// How the token embeddings of an input are pooled into one vector
+enum class PoolingType {
+    Model, // Whatever the model's metadata asks for
+    Mean,
+    Cls, // The first token
+    Last, // The last token, for causal embedding models
+    Rank, // A relevance score, for reranking models
+};
+
 struct SessionParams {
     std::string modelPath;
     std::string mmprojPath;
     int contextSize = 16000;
     int batch = 4096;
+    // Tokens per compute pass within a batch, caps the size of the compute buffers
+    int ubatch = 512;
+    // Layers offloaded to the GPU, -1 = all
     int gpuLayers = 0;
+    int mainGpu = 0;
+    SplitMode splitMode = SplitMode::Layer;
+    bool useMmap = true;
+    // Locks the weights in RAM so that they are never paged out
+    bool useMlock = false;
+    // "<tensor name regex>=<buffer type>" pairs, as in llama.cpp's --override-tensor.
+    // E.g. "exps=CPU" keeps mixture-of-experts weights on the CPU while the rest is offloaded.
+    std::vector<std::string> tensorOverrides;
+    // LoRA adapter files loaded once along with the model, picked per request by SamplingParams::loraAdapter
+    std::vector<std::string> loraAdapters;
     bool mmprojUseGpu = false;
+    // Encodes the next image of a prompt while the embeddings of the previous one are decoded. Overlaps best with
+    // mmprojUseGpu, otherwise the encoder competes with decoding for the CPU. Single sequence only.
+    bool imagePipelining = false;
+    // Decode threads
     int threads = 6;
+    // Prefill and vision encoder threads, 0 = threads
+    int batchThreads = 0;
+    // CPUs the compute threads may run on, empty = any
+    std::vector<int> cpuAffinity;
+    // Keeps the compute threads off the efficiency cores of big.LITTLE CPUs, ignored with cpuAffinity
+    bool performanceCoresOnly = false;
+    // How long idle compute threads spin before sleeping, 0-100. Higher trades CPU time for decode latency.
+    int threadPoll = 50;
+    // Sessions with the same thread settings share one set of compute threads and take turns on it
+    bool sharedThreadPool = false;
+    // What llama.cpp logs: 0 warnings and errors, 1 adds info, 2 adds debug. Process-wide, the last session sets it.
     int verbosity = 1;
+    KvCacheType cacheTypeK = KvCacheType::F16;
+    // A quantized V cache requires flash attention
+    KvCacheType cacheTypeV = KvCacheType::F16;
+    bool flashAttention = false;
+    // Keeps the KV cache and attention on the GPU along with the offloaded layers
+    bool offloadKqv = true;
+    // Number of generations served concurrently from one context, > 1 enables continuous batching
+    int parallelSequences = 1;
+    // Prompt tokens per prefill llama_decode, 0 = batch
+    int prefillChunk = 0;
+    // With continuous batching, caps prefill to one prefillChunk per step so running generations keep streaming
+    bool timeSlicedPrefill = false;
+    // Keeps KV snapshots of the system prompt and restores them instead of re-prefilling it
+    bool prefixCache = false;
+    // Directory where those snapshots persist across restarts, empty = memory only
+    std::string prefixCacheDir;
+    // Budgets of the snapshots in memory and in prefixCacheDir, the least recently used go first
+    int prefixCacheMB = 512;
+    int prefixCacheDiskMB = 2048;
+    // Speculative decoding: a small model sharing the vocabulary drafts tokens for this one to verify
+    std::string draftModelPath;
+    // Drafts by prompt lookup (n-gram matches in the context) when there is no draft model
+    bool ngramDraft = false;
+    // Tokens drafted per step
+    int draftMax = 8;
+    // When the context fills up, keeps the first contextKeep prompt units and drops the oldest half of the rest
+    // from the KV cache instead of failing, so that long conversations degrade smoothly. Single sequence only.
+    bool contextShift = false;
+    // Units kept at the start of the context when shifting, -1 = the system prompt
+    int contextKeep = -1;
+    // Memory budget of the image embedding cache, which lets repeated images skip the vision encoder. 0 = off
+    int imageCacheMB = 0;
+    // An embeddings-only context for embed and rerank. It can't generate, and it packs up to parallelSequences inputs
+    // into one batch, 64 when parallelSequences is 1.
+    bool embeddings = false;
+    PoolingType pooling = PoolingType::Model;
     SamplingParams sampling;
 
     [[nodiscard]] KLlamaResult<void> validate() const;
@@ -168,7 +346,7 @@ struct SessionParams {
 
 class KLlama {
 public:
-    KLlama() = default;
+    KLlama();
 
     ~KLlama();
 
@@ -179,6 +357,15 @@ public:
         const CancellationToken *cancellationToken = nullptr
     );
 
+    // Creates a session on an already loaded model, so that several sessions share its weights.
+    // sessionParams.modelPath may be left empty.
+    KLlamaResult<void> initialize(
+        std::shared_ptr<KLlamaModel> sharedModel,
+        const SessionParams &sessionParams,
+        const ProgressCallback &progressCallback = nullptr,
+        const CancellationToken *cancellationToken = nullptr
+    );
+
     // Model validation (lightweight check before full initialization)
     static KLlamaResult<ModelInfo> validateModel(const std::string &modelPath);
 
@@ -191,9 +378,13 @@ public:
 
     static KLlamaResult<std::vector<uint8_t> > validateImageData(const ImageData &imageData);
 
+    // Same checks as validateImageData, without copying the image
+    static KLlamaResult<void> checkImageData(const ImageData &imageData);
+
     // State queries
     bool isInitialized() const { return initialized; }
     GenerationState getGenerationState() const { return generationState; }
+    std::shared_ptr<KLlamaModel> getSharedModel() const { return sharedModel; }
 
     KLlamaResult<ModelInfo> getModelInfo() const;
 
@@ -217,10 +408,36 @@ public:
         CancellationToken *cancellationToken = nullptr
     );
 
+    // Queues a generation on the session's worker threads and returns at once, the job is polled for its text
+    // and its result. Jobs still queued or running when the session is freed end as cancelled.
+    std::shared_ptr<GenerationJob> submit(GenerationRequest request);
+
     // Memory management
     KLlamaResult<void> freeMemory();
 
-    KLlamaResult<void> reset() const;
+    // Drops everything held in the KV cache, forcing the next generation to re-prefill the whole prompt
+    KLlamaResult<void> reset();
+
+    // Conversation snapshots: the KV cache together with what it holds. After a restore, which may happen in
+    // another process with the same model and cache types, generateResponse only prefills what is new.
+    KLlamaResult<std::vector<uint8_t> > saveState() const;
+
+    KLlamaResult<void> saveStateFile(const std::string &path) const;
+
+    KLlamaResult<void> restoreState(std::span<const uint8_t> data);
+
+    // The file is memory-mapped, so that even long conversations resume in milliseconds
+    KLlamaResult<void> restoreStateFile(const std::string &path);
+
+    // Embeddings, on a session initialized with embeddings. Each text is pooled into embeddingSize() floats,
+    // normalized to unit length, and the vectors follow each other in one buffer.
+    KLlamaResult<std::vector<float> > embed(const std::vector<std::string> &texts);
+
+    // Relevance of each document to the query, higher is more relevant. Needs a reranking model.
+    KLlamaResult<std::vector<float> > rerank(const std::string &query, const std::vector<std::string> &documents);
+
+    // Length of the vectors embed returns, 0 before initialization
+    int32_t embeddingSize() const;
 
 private:
     // Core state
@@ -230,14 +447,52 @@ private:
 
     // llama.cpp objects
     mtmd::context_ptr visionContext;
-    llama_model *model = nullptr;
+    std::shared_ptr<KLlamaModel> sharedModel;
+    llama_model *model = nullptr; // Owned by sharedModel
     llama_context *llamaContext = nullptr;
     llama_sampler *sampler = nullptr;
-    llama_batch batch{};
+    SamplingParams samplerParams; // What sampler was built from
+    std::unique_ptr<SamplerCache> samplerCache;
+    llama_batch batch{}; // Sized for n_batch, shared by prefill and decoding
+    std::shared_ptr<ComputePool> computePool; // Explicit compute threads, null = llama.cpp's own
+    size_t contextMemoryBytes = 0; // Measured around context and mtmd creation
+    size_t visionMemoryBytes = 0;
+    bool visionOnGpu = false; // mmprojUseGpu, and there was a GPU to put the projector on
+
+    // Loaded from params.loraAdapters, and the one applied to the context with its scale
+    std::vector<llama_adapter_lora *> loraAdapters;
+    int32_t activeLora = -1;
+    float activeLoraScale = 0.0f;
+
+    // Contents of the KV cache (sequence 0), reused across generations
+    SequenceCache kvCache;
+
+    // System prompt snapshots, only when params.prefixCache is set
+    std::unique_ptr<PrefixCache> prefixCache;
+
+    // Templates and tokenizes conversations, reusing what the last one had in common
+    std::unique_ptr<PromptBuilder> promptBuilder;
+
+    // Encoded images, only when params.imageCacheMB > 0
+    std::unique_ptr<EmbeddingCache> imageCache;
+
+    // Speculative decoding on the single-sequence path
+    std::unique_ptr<Drafter> drafter;
+
+    // Continuous batching, only when params.parallelSequences > 1
+    std::unique_ptr<BatchEngine> batchEngine;
+    std::mutex promptMutex;
+
+    // embed and rerank calls take turns on the context
+    std::mutex embeddingMutex;
+
+    // Runs submitted generations, started with the first submit
+    std::unique_ptr<GenerationWorker> worker;
+    std::mutex workerMutex;
 
     // Generation statistics
     mutable GenerationStats currentStats{};
-    std::chrono::high_resolution_clock::time_point generationStartTime;
+    std::chrono::steady_clock::time_point generationStartTime;
 
     // Helper methods
     KLlamaResult<void> initializeModel(const ProgressCallback &progressCallback,
@@ -248,6 +503,19 @@ private:
 
     KLlamaResult<void> configureSampler(const SamplingParams &samplingParams);
 
+    [[nodiscard]] KLlamaResult<llama_sampler *> createSamplerChain(const SamplingParams &samplingParams) const;
+
+    // A cached chain for samplingParams when there is one, a new one otherwise
+    [[nodiscard]] KLlamaResult<llama_sampler *> acquireSampler(const SamplingParams &samplingParams) const;
+
+    [[nodiscard]] KLlamaResult<void> checkLoraAdapter(const SamplingParams &samplingParams) const;
+
+    // Applies the request's adapter to the context, dropping the KV cache computed without it
+    KLlamaResult<void> applyLoraAdapter(const SamplingParams &samplingParams);
+
+    // Identifies the KV layout of snapshots, which depends on the applied adapter
+    [[nodiscard]] uint64_t snapshotKey() const;
+
     KLlamaResult<std::string> generateResponseInternal(
         const std::vector<MultimodalMessage> &conversation,
         const SamplingParams &samplingParams,
@@ -256,17 +524,64 @@ private:
         CancellationToken *cancellationToken
     );
 
+    KLlamaResult<std::string> generateBatched(
+        const std::vector<MultimodalMessage> &conversation,
+        const SamplingParams &samplingParams,
+        const TokenCallback &tokenCallback,
+        const ProgressCallback &progressCallback,
+        CancellationToken *cancellationToken
+    );
+
+    // Applies the chat template and tokenizes the conversation, including its images
+    KLlamaResult<PreparedPrompt> preparePrompt(const std::vector<MultimodalMessage> &conversation,
+                                               const ProgressCallback &progressCallback) const;
+
+    // Evaluates the prompt units [kvCache.size(), end) chunk by chunk
+    KLlamaResult<void> evaluatePrompt(const PreparedPrompt &prompt, size_t end,
+                                      const ProgressCallback &progressCallback,
+                                      const CancellationToken *cancellationToken);
+
+    // Restores the shared prefix from the prefix cache, returns the number of reused prompt units
+    size_t restorePrefix(const PreparedPrompt &prompt, size_t reused);
+
+    // Drops the part of the KV cache that diverges from the prompt, returns the number of reused prompt units
+    size_t syncKvCache(const std::vector<PromptUnit> &prompt);
+
+    // llama_decode, serialized with the other sessions on a shared compute pool
+    int32_t decode(const llama_batch &tokens);
+
+    [[nodiscard]] std::unique_lock<std::mutex> lockCompute() const;
+
+    // onChunk is called with the number of tokens decoded by each chunk, returning false stops the prefill
+    KLlamaResult<void> decodePromptTokens(const llama_token *tokens, int32_t count, bool logitsLast,
+                                          const std::function<bool(int32_t)> &onChunk);
+
+    [[nodiscard]] int32_t prefillChunkSize() const;
+
+    // Makes room for `needed` more positions by dropping the oldest units after the first `keep`
+    bool shiftContext(size_t keep, llama_pos needed);
+
     // REMOVED: This is no longer needed.
     // static std::string buildConversationPrompt(const std::vector<MultimodalMessage> &conversation);
 
-    static std::vector<ImageData> extractAllImages(const std::vector<MultimodalMessage> &conversation);
+    static std::vector<const ImageData *> extractAllImages(const std::vector<MultimodalMessage> &conversation);
 
-    void updateGenerationStats() const;
+    void updateGenerationStats(std::chrono::steady_clock::time_point now) const;
 
     void setGenerationState(GenerationState state);
 
     // Error handling helpers
     KLlamaResult<void> checkInitialized() const;
+
+    // Snapshots only cover the single-sequence KV cache, taken between generations
+    KLlamaResult<void> checkSnapshotAllowed() const;
+
+    KLlamaResult<void> checkEmbeddings() const;
+
+    // Decodes the inputs packed as sequences of as few batches as possible, and reads the first
+    // outputSize floats of each pooled sequence embedding
+    KLlamaResult<std::vector<float> > poolInputs(const std::vector<std::vector<llama_token> > &inputs,
+                                                  size_t outputSize);
 };
 
 #endif
\ No newline at end of file
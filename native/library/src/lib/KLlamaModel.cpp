@@ -0,0 +1,239 @@
+#include "KLlamaModel.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include "ggml-backend.h"
+
+#include "Backends.h"
+#include "SystemMemory.h"
+
+#include "logging/logging.h"
+
+#define LOG_TAG "KLlamaModel"
+
+// Offloads every layer, llama.cpp clamps it to the model's layer count
+static constexpr int32_t MAX_GPU_LAYERS = 999;
+
+static constexpr auto CANCELLATION_POLL = std::chrono::milliseconds(50);
+
+static std::mutex backendMutex;
+static size_t backendRefs = 0;
+
+BackendRef::BackendRef() {
+    std::lock_guard lock(backendMutex);
+    if (backendRefs++ == 0) {
+        // Installs the log callbacks first, so that backend loading is logged too
+        Backends::load();
+        llama_backend_init();
+    }
+}
+
+BackendRef::~BackendRef() {
+    std::lock_guard lock(backendMutex);
+    if (--backendRefs == 0) {
+        llama_backend_free();
+    }
+}
+
+// Loaded models by path and loading parameters, kept weak so that the last session frees the weights
+static std::mutex registryMutex;
+static std::map<std::string, std::weak_ptr<KLlamaModel> > registry;
+// Keys being loaded right now. Loads run outside the lock, a second acquire of the same key waits for the first.
+static std::set<std::string> loading;
+static std::condition_variable loadFinished;
+
+struct LoadProgress {
+    const ProgressCallback *callback;
+    const CancellationToken *cancellationToken;
+};
+
+// Called by llama.cpp per loaded tensor, returning false aborts the load
+static bool onLoadProgress(const float progress, void *userData) {
+    const auto *state = static_cast<LoadProgress *>(userData);
+    if (state->cancellationToken && state->cancellationToken->isCancelled()) {
+        return false;
+    }
+    if (*state->callback) {
+        (*state->callback)(progress, "Loading model");
+    }
+    return true;
+}
+
+// The same file loaded with different placement is a different model
+std::string KLlamaModel::registryKey(const SessionParams &params) {
+    auto key = params.modelPath;
+    key += '|' + std::to_string(params.gpuLayers);
+    key += '|' + std::to_string(params.mainGpu);
+    key += '|' + std::to_string(static_cast<int>(params.splitMode));
+    key += params.useMmap ? "|mmap" : "|nommap";
+    key += params.useMlock ? "|mlock" : "";
+    for (const auto &override: params.tensorOverrides) {
+        key += '|' + override;
+    }
+    return key;
+}
+
+static ggml_backend_buffer_type_t findBufferType(const std::string &name) {
+    for (size_t i = 0; i < ggml_backend_dev_count(); ++i) {
+        auto *bufferType = ggml_backend_dev_buffer_type(ggml_backend_dev_get(i));
+        if (bufferType && name == ggml_backend_buft_name(bufferType)) {
+            return bufferType;
+        }
+    }
+    return nullptr;
+}
+
+static llama_split_mode toLlamaSplitMode(const SplitMode mode) {
+    switch (mode) {
+        case SplitMode::None:
+            return LLAMA_SPLIT_MODE_NONE;
+        case SplitMode::Row:
+            return LLAMA_SPLIT_MODE_ROW;
+        case SplitMode::Layer:
+        default:
+            return LLAMA_SPLIT_MODE_LAYER;
+    }
+}
+
+KLlamaModel::KLlamaModel(std::string modelPath, llama_model *model, std::map<std::string, size_t> weightsByDevice)
+    : modelPath(std::move(modelPath)), model(model), weightsByDevice(std::move(weightsByDevice)) {
+}
+
+size_t KLlamaModel::deviceBytes(const std::string &deviceName) const {
+    const auto it = weightsByDevice.find(deviceName);
+    return it != weightsByDevice.end() ? it->second : 0;
+}
+
+KLlamaModel::~KLlamaModel() {
+    if (model) {
+        llama_model_free(model);
+        model = nullptr;
+    }
+    LOG_DEBUG(LOG_TAG, "Model unloaded: %s", modelPath.c_str());
+}
+
+KLlamaResult<std::shared_ptr<KLlamaModel> > KLlamaModel::acquire(
+    const SessionParams &params,
+    const ProgressCallback &progressCallback,
+    const CancellationToken *cancellationToken
+) {
+    using Result = KLlamaResult<std::shared_ptr<KLlamaModel> >;
+    std::unique_lock lock(registryMutex);
+
+    const auto key = registryKey(params);
+    // Cancellation is an atomic that nothing signals, so waiting for another load checks it now and then
+    while (loading.contains(key)) {
+        if (cancellationToken && cancellationToken->isCancelled()) {
+            return Result(KLlamaError::OperationCancelled);
+        }
+        loadFinished.wait_for(lock, CANCELLATION_POLL);
+    }
+    if (const auto it = registry.find(key); it != registry.end()) {
+        if (auto existing = it->second.lock()) {
+            LOG_DEBUG(LOG_TAG, "Reusing loaded model: %s", params.modelPath.c_str());
+            return KLlamaResult(std::move(existing));
+        }
+        registry.erase(it);
+    }
+
+    if (cancellationToken && cancellationToken->isCancelled()) {
+        return Result(KLlamaError::OperationCancelled);
+    }
+
+    loading.insert(key);
+    lock.unlock();
+    auto result = load(params, progressCallback, cancellationToken);
+    lock.lock();
+    loading.erase(key);
+    if (result.isSuccess()) {
+        registry[key] = result.value;
+    }
+    lock.unlock();
+    loadFinished.notify_all();
+
+    return result;
+}
+
+KLlamaResult<std::shared_ptr<KLlamaModel> > KLlamaModel::load(
+    const SessionParams &params,
+    const ProgressCallback &progressCallback,
+    const CancellationToken *cancellationToken
+) {
+    using Result = KLlamaResult<std::shared_ptr<KLlamaModel> >;
+
+    // The backend must be up before loading, the model keeps its own reference afterwards
+    BackendRef backend;
+
+    auto modelParams = llama_model_default_params();
+    modelParams.n_gpu_layers = params.gpuLayers < 0 ? MAX_GPU_LAYERS : params.gpuLayers;
+    modelParams.main_gpu = params.mainGpu;
+    modelParams.split_mode = toLlamaSplitMode(params.splitMode);
+    modelParams.use_mmap = params.useMmap;
+    modelParams.use_mlock = params.useMlock;
+
+    // Patterns must outlive the load (reserved so that c_str() stays put), the list ends with an empty entry
+    std::vector<std::string> patterns;
+    std::vector<llama_model_tensor_buft_override> overrides;
+    patterns.reserve(params.tensorOverrides.size());
+    for (const auto &override: params.tensorOverrides) {
+        const auto separator = override.find('=');
+        const auto bufferTypeName = override.substr(separator + 1);
+        auto *bufferType = findBufferType(bufferTypeName);
+        if (!bufferType) {
+            return Result(KLlamaError::InvalidParameters, "Unknown buffer type in tensor override: " + override);
+        }
+        patterns.push_back(override.substr(0, separator));
+        overrides.push_back({patterns.back().c_str(), bufferType});
+    }
+    if (!overrides.empty()) {
+        overrides.push_back({nullptr, nullptr});
+        modelParams.tensor_buft_overrides = overrides.data();
+    }
+
+    LoadProgress progress{&progressCallback, cancellationToken};
+    modelParams.progress_callback = onLoadProgress;
+    modelParams.progress_callback_user_data = &progress;
+
+    const auto devicesBefore = deviceMemory();
+    auto *loaded = llama_model_load_from_file(params.modelPath.c_str(), modelParams);
+    if (!loaded) {
+        if (cancellationToken && cancellationToken->isCancelled()) {
+            return Result(KLlamaError::OperationCancelled, "Model loading cancelled");
+        }
+        return Result(KLlamaError::ModelLoadFailed, "Failed to load model from: " + params.modelPath);
+    }
+
+    // llama.cpp doesn't report where the weights went, what each device lost during the load is close enough
+    std::map<std::string, size_t> weightsByDevice;
+    const auto devicesAfter = deviceMemory();
+    for (size_t i = 0; i < devicesAfter.size() && i < devicesBefore.size(); ++i) {
+        if (devicesBefore[i].freeBytes > devicesAfter[i].freeBytes) {
+            weightsByDevice[devicesAfter[i].name] = devicesBefore[i].freeBytes - devicesAfter[i].freeBytes;
+        }
+    }
+
+    // Can't use make_shared with the private constructor
+    std::shared_ptr<KLlamaModel> sharedModel(new KLlamaModel(params.modelPath, loaded, std::move(weightsByDevice)));
+
+    LOG_DEBUG(LOG_TAG, "Model loaded: %s (gpu layers: %d, mmap: %d, mlock: %d, tensor overrides: %zu)",
+              params.modelPath.c_str(), params.gpuLayers, params.useMmap, params.useMlock,
+              params.tensorOverrides.size());
+
+    return KLlamaResult(std::move(sharedModel));
+}
+
+size_t KLlamaModel::loadedCount() {
+    std::lock_guard lock(registryMutex);
+    size_t count = 0;
+    for (const auto &[path, model]: registry) {
+        if (!model.expired()) {
+            ++count;
+        }
+    }
+    return count;
+}
@@ -0,0 +1,69 @@
+#ifndef KLLAMA_MODEL_H
+#define KLLAMA_MODEL_H
+
+#include <map>
+#include <memory>
+#include <string>
+
+#include "llama.h"
+
+#include "KLlama.h"
+
+// Process-wide reference to the llama backend, which stays initialized while any reference is alive
+class BackendRef {
+public:
+    BackendRef();
+
+    ~BackendRef();
+
+    BackendRef(const BackendRef &) = delete;
+
+    BackendRef &operator=(const BackendRef &) = delete;
+};
+
+// A loaded model shared between KLlama sessions. The weights are loaded (and mmapped)
+// once per process and freed when the last session using them is gone.
+class KLlamaModel {
+public:
+    ~KLlamaModel();
+
+    KLlamaModel(const KLlamaModel &) = delete;
+
+    KLlamaModel &operator=(const KLlamaModel &) = delete;
+
+    // Returns the already loaded model for these parameters or loads it. progressCallback gets the
+    // load fraction per tensor, and a cancelled token aborts the load in between tensors.
+    static KLlamaResult<std::shared_ptr<KLlamaModel> > acquire(
+        const SessionParams &params,
+        const ProgressCallback &progressCallback = nullptr,
+        const CancellationToken *cancellationToken = nullptr
+    );
+
+    [[nodiscard]] llama_model *get() const { return model; }
+    [[nodiscard]] const std::string &path() const { return modelPath; }
+
+    // Weights placed on a backend device, measured while loading. 0 for the host and unknown devices.
+    [[nodiscard]] size_t deviceBytes(const std::string &deviceName) const;
+
+    // Number of distinct models currently loaded in the process
+    static size_t loadedCount();
+
+    // Identifies the weights as loaded: the file and how its tensors are placed
+    static std::string registryKey(const SessionParams &params);
+
+private:
+    static KLlamaResult<std::shared_ptr<KLlamaModel> > load(
+        const SessionParams &params,
+        const ProgressCallback &progressCallback,
+        const CancellationToken *cancellationToken
+    );
+
+    KLlamaModel(std::string modelPath, llama_model *model, std::map<std::string, size_t> weightsByDevice);
+
+    BackendRef backend;
+    std::string modelPath;
+    llama_model *model;
+    std::map<std::string, size_t> weightsByDevice;
+};
+
+#endif
@@ -0,0 +1,70 @@
+#include "LlamaLog.h"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+#include "llama.h"
+#include "mtmd-helper.h"
+
+#include "logging/logging.h"
+
+#define LOG_TAG "KLlamaNative"
+
+static std::atomic<int> minLevel{GGML_LOG_LEVEL_INFO};
+
+static int toLogLevel(const ggml_log_level level) {
+    switch (level) {
+        case GGML_LOG_LEVEL_DEBUG:
+            return LOG_LEVEL_DEBUG;
+        case GGML_LOG_LEVEL_WARN:
+            return LOG_LEVEL_WARN;
+        case GGML_LOG_LEVEL_ERROR:
+            return LOG_LEVEL_ERROR;
+        default:
+            return LOG_LEVEL_INFO;
+    }
+}
+
+// llama.cpp writes some lines in pieces, continued with GGML_LOG_LEVEL_CONT. A message ends at a line break.
+static void onNativeLog(const ggml_log_level level, const char *text, void *) {
+    thread_local std::string line;
+    thread_local ggml_log_level lineLevel = GGML_LOG_LEVEL_INFO;
+
+    if (level != GGML_LOG_LEVEL_CONT) {
+        if (!line.empty()) {
+            LOG_WRITE(toLogLevel(lineLevel), LOG_TAG, line.c_str());
+            line.clear();
+        }
+        lineLevel = level == GGML_LOG_LEVEL_NONE ? GGML_LOG_LEVEL_INFO : level;
+    }
+    if (lineLevel < minLevel.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    line += text;
+    size_t start = 0;
+    for (auto end = line.find('\n'); end != std::string::npos; end = line.find('\n', start)) {
+        if (end > start) {
+            LOG_WRITE(toLogLevel(lineLevel), LOG_TAG, line.substr(start, end - start).c_str());
+        }
+        start = end + 1;
+    }
+    line.erase(0, start);
+}
+
+void LlamaLog::install() {
+    static std::once_flag installed;
+    std::call_once(installed, [] {
+        llama_log_set(onNativeLog, nullptr);
+        mtmd_helper_log_set(onNativeLog, nullptr);
+    });
+}
+
+void LlamaLog::setVerbosity(const int verbosity) {
+    minLevel.store(verbosity <= 0
+                       ? GGML_LOG_LEVEL_WARN
+                       : verbosity == 1
+                             ? GGML_LOG_LEVEL_INFO
+                             : GGML_LOG_LEVEL_DEBUG, std::memory_order_relaxed);
+}
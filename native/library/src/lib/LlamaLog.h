@@ -0,0 +1,16 @@
+#ifndef KLLAMA_LLAMA_LOG_H
+#define KLLAMA_LLAMA_LOG_H
+
+// Routes what llama.cpp, ggml and mtmd log into the logging module, below the threshold set from
+// SessionParams::verbosity. llama.cpp has one log callback per process, so the threshold is
+// process-wide as well: the session initialized last sets it.
+class LlamaLog {
+public:
+    // Installs the callbacks, once
+    static void install();
+
+    // 0 keeps warnings and errors, 1 adds info, 2 and up add debug
+    static void setVerbosity(int verbosity);
+};
+
+#endif
@@ -0,0 +1,86 @@
+#include "MappedFile.h"
+
+#include <fstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define KLLAMA_HAS_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+MappedFile::MappedFile(MappedFile &&other) noexcept
+    : mapped(other.mapped), mappedSize(other.mappedSize), buffer(std::move(other.buffer)) {
+    other.mapped = nullptr;
+    other.mappedSize = 0;
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&other) noexcept {
+    if (this != &other) {
+        close();
+        mapped = other.mapped;
+        mappedSize = other.mappedSize;
+        buffer = std::move(other.buffer);
+        other.mapped = nullptr;
+        other.mappedSize = 0;
+    }
+    return *this;
+}
+
+bool MappedFile::open(const std::string &path) {
+    close();
+
+#ifdef KLLAMA_HAS_MMAP
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        ::close(fd);
+        return false;
+    }
+
+    void *address = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping stays valid after the descriptor is closed
+    ::close(fd);
+    if (address == MAP_FAILED) {
+        return false;
+    }
+
+    mapped = static_cast<const uint8_t *>(address);
+    mappedSize = static_cast<size_t>(st.st_size);
+    return true;
+#else
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        return false;
+    }
+
+    const auto size = static_cast<size_t>(file.tellg());
+    buffer.resize(size);
+    file.seekg(0);
+    if (!file.read(reinterpret_cast<char *>(buffer.data()), static_cast<std::streamsize>(size))) {
+        buffer.clear();
+        return false;
+    }
+    return !buffer.empty();
+#endif
+}
+
+void MappedFile::close() {
+#ifdef KLLAMA_HAS_MMAP
+    if (mapped) {
+        munmap(const_cast<uint8_t *>(mapped), mappedSize);
+    }
+#endif
+    mapped = nullptr;
+    mappedSize = 0;
+    buffer.clear();
+}
@@ -0,0 +1,38 @@
+#ifndef KLLAMA_MAPPED_FILE_H
+#define KLLAMA_MAPPED_FILE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Read-only view of a whole file, memory-mapped where the platform supports it
+// and read into memory otherwise.
+class MappedFile {
+public:
+    MappedFile() = default;
+
+    ~MappedFile();
+
+    MappedFile(MappedFile &&other) noexcept;
+
+    MappedFile &operator=(MappedFile &&other) noexcept;
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool open(const std::string &path);
+
+    void close();
+
+    [[nodiscard]] const uint8_t *data() const { return mapped ? mapped : buffer.data(); }
+    [[nodiscard]] size_t size() const { return mapped ? mappedSize : buffer.size(); }
+    [[nodiscard]] bool isOpen() const { return mapped || !buffer.empty(); }
+
+private:
+    const uint8_t *mapped = nullptr;
+    size_t mappedSize = 0;
+    std::vector<uint8_t> buffer; // Fallback when mmap is unavailable
+};
+
+#endif
@@ -0,0 +1,177 @@
+#include "ModelPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+
+#include "logging/logging.h"
+
+#define LOG_TAG "KLlamaModelPool"
+
+namespace {
+    struct PoolEntry {
+        std::string modelPath;
+        std::shared_ptr<CancellationToken> cancellation;
+        std::shared_future<ModelLoadResult> result;
+
+        [[nodiscard]] bool isReady() const {
+            return result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }
+    };
+
+    struct PoolState {
+        std::mutex mutex;
+        std::map<std::string, PoolEntry> entries; // By KLlamaModel::registryKey
+    };
+
+    // Never destroyed: a background load may still be running while the process exits
+    PoolState &state() {
+        static auto *pool = new PoolState();
+        return *pool;
+    }
+
+    // Pending loads are aborted, the entries are dropped outside the lock because that waits for the load thread
+    void release(std::vector<PoolEntry> entries) {
+        for (const auto &entry: entries) {
+            entry.cancellation->cancel();
+        }
+        entries.clear();
+    }
+}
+
+std::shared_future<ModelLoadResult> ModelPool::preload(const SessionParams &params,
+                                                       ProgressCallback progressCallback) {
+    auto &pool = state();
+    std::lock_guard lock(pool.mutex);
+
+    const auto key = KLlamaModel::registryKey(params);
+    if (const auto it = pool.entries.find(key); it != pool.entries.end()) {
+        // A failed load is retried, anything else is shared
+        if (!it->second.isReady() || it->second.result.get().isSuccess()) {
+            return it->second.result;
+        }
+        pool.entries.erase(it);
+    }
+
+    auto cancellation = std::make_shared<CancellationToken>();
+    auto result = std::async(std::launch::async,
+                             [params, progressCallback = std::move(progressCallback), cancellation] {
+                                 auto loaded = KLlamaModel::acquire(params, progressCallback, cancellation.get());
+                                 if (loaded.isError()) {
+                                     LOG_WARN(LOG_TAG, "Preloading %s failed: %s", params.modelPath.c_str(),
+                                              loaded.errorMessage.c_str());
+                                 }
+                                 return loaded;
+                             }).share();
+
+    pool.entries[key] = {params.modelPath, std::move(cancellation), result};
+    LOG_DEBUG(LOG_TAG, "Preloading model: %s", params.modelPath.c_str());
+
+    return result;
+}
+
+ModelLoadResult ModelPool::load(const SessionParams &params, const ProgressCallback &progressCallback,
+                                const CancellationToken *cancellationToken) {
+    auto &pool = state();
+
+    const auto key = KLlamaModel::registryKey(params);
+    std::shared_future<ModelLoadResult> pending;
+    {
+        std::lock_guard lock(pool.mutex);
+        if (const auto it = pool.entries.find(key); it != pool.entries.end()) {
+            pending = it->second.result;
+        }
+    }
+
+    // Join a load that is already running, still honoring this caller's token
+    if (pending.valid()) {
+        while (pending.wait_for(std::chrono::milliseconds(50)) != std::future_status::ready) {
+            if (cancellationToken && cancellationToken->isCancelled()) {
+                return ModelLoadResult(KLlamaError::OperationCancelled);
+            }
+        }
+        if (pending.get().isSuccess()) {
+            return pending.get();
+        }
+    }
+
+    auto result = KLlamaModel::acquire(params, progressCallback, cancellationToken);
+    if (result.isError()) {
+        return result;
+    }
+
+    std::promise<ModelLoadResult> loaded;
+    loaded.set_value(result);
+    std::lock_guard lock(pool.mutex);
+    pool.entries[key] = {params.modelPath, std::make_shared<CancellationToken>(), loaded.get_future().share()};
+
+    return result;
+}
+
+std::shared_ptr<KLlamaModel> ModelPool::get(const std::string &modelPath) {
+    auto &pool = state();
+    std::lock_guard lock(pool.mutex);
+
+    for (const auto &[key, entry]: pool.entries) {
+        if (entry.modelPath != modelPath || !entry.isReady()) {
+            continue;
+        }
+        if (const auto &result = entry.result.get(); result.isSuccess()) {
+            return result.value;
+        }
+    }
+    return nullptr;
+}
+
+bool ModelPool::evict(const std::string &modelPath) {
+    auto &pool = state();
+    std::vector<PoolEntry> evicted;
+    {
+        std::lock_guard lock(pool.mutex);
+        for (auto it = pool.entries.begin(); it != pool.entries.end();) {
+            if (it->second.modelPath == modelPath) {
+                evicted.push_back(std::move(it->second));
+                it = pool.entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (evicted.empty()) {
+            return false;
+        }
+    }
+
+    release(std::move(evicted));
+    LOG_DEBUG(LOG_TAG, "Evicted model: %s", modelPath.c_str());
+    return true;
+}
+
+void ModelPool::clear() {
+    auto &pool = state();
+    std::vector<PoolEntry> evicted;
+    {
+        std::lock_guard lock(pool.mutex);
+        for (auto &[key, entry]: pool.entries) {
+            evicted.push_back(std::move(entry));
+        }
+        pool.entries.clear();
+    }
+
+    release(std::move(evicted));
+}
+
+std::vector<std::string> ModelPool::paths() {
+    auto &pool = state();
+    std::lock_guard lock(pool.mutex);
+
+    // Once per path, however many layouts of it are pooled
+    std::vector<std::string> paths;
+    paths.reserve(pool.entries.size());
+    for (const auto &[key, entry]: pool.entries) {
+        if (std::ranges::find(paths, entry.modelPath) == paths.end()) {
+            paths.push_back(entry.modelPath);
+        }
+    }
+    return paths;
+}
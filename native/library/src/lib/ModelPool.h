@@ -0,0 +1,40 @@
+#ifndef KLLAMA_MODEL_POOL_H
+#define KLLAMA_MODEL_POOL_H
+
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "KLlama.h"
+#include "KLlamaModel.h"
+
+using ModelLoadResult = KLlamaResult<std::shared_ptr<KLlamaModel> >;
+
+// Warm standby models, keyed by path and layout as KLlamaModel is. Pooled models stay loaded with no session using them, so a
+// session created on them later (or after a crash) starts without a cold load: KLlama::initialize
+// finds the weights through KLlamaModel::acquire.
+class ModelPool {
+public:
+    // Starts loading on a background thread and returns right away. Preloading a model that is
+    // already pooled with the same layout returns the pending or finished load.
+    static std::shared_future<ModelLoadResult> preload(const SessionParams &params,
+                                                       ProgressCallback progressCallback = nullptr);
+
+    // Loads on the calling thread and pools the model
+    static ModelLoadResult load(const SessionParams &params, const ProgressCallback &progressCallback = nullptr,
+                                const CancellationToken *cancellationToken = nullptr);
+
+    // A pooled model of that path, whatever its layout, when it has finished loading, null otherwise
+    static std::shared_ptr<KLlamaModel> get(const std::string &modelPath);
+
+    // Aborts the pending loads or releases the pool's references of every layout of the path.
+    // Sessions keep the weights they use.
+    static bool evict(const std::string &modelPath);
+
+    static void clear();
+
+    static std::vector<std::string> paths();
+};
+
+#endif
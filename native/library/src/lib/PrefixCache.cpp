@@ -0,0 +1,286 @@
+#include "PrefixCache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#include "Utils.h"
+#include "logging/logging.h"
+
+#define LOG_TAG "KLlamaPrefixCache"
+
+static constexpr const char *FILE_EXTENSION = ".kvprefix";
+static constexpr uint32_t FILE_MAGIC = 0x43504C4B; // "KLPC"
+static constexpr uint32_t FILE_VERSION = 1;
+
+namespace {
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t modelKey;
+        uint64_t tokenCount;
+        uint64_t stateSize;
+    };
+}
+
+PrefixCache::PrefixCache(std::string directory, const uint64_t modelKey, const size_t memoryBudget,
+                         const size_t diskBudget)
+    : directory(std::move(directory)), modelKey(modelKey), memoryBudget(memoryBudget), diskBudget(diskBudget) {
+    if (!this->directory.empty()) {
+        std::error_code error;
+        std::filesystem::create_directories(this->directory, error);
+        if (error) {
+            LOG_WARN(LOG_TAG, "Can't create prefix cache directory %s: %s", this->directory.c_str(),
+                     error.message().c_str());
+            this->directory.clear();
+        }
+    }
+}
+
+PrefixCache::~PrefixCache() {
+    {
+        std::lock_guard lock(writeMutex);
+        stopping = true;
+    }
+    writeQueued.notify_all();
+    if (writer.joinable()) {
+        writer.join();
+    }
+}
+
+bool PrefixCache::restore(llama_context *context, const llama_seq_id seqId, const std::vector<llama_token> &prefix) {
+    const auto *entry = find(prefix);
+    if (!entry) {
+        return false;
+    }
+
+    if (llama_state_seq_set_data(context, entry->stateData(), entry->stateSize, seqId) == 0) {
+        LOG_WARN(LOG_TAG, "Failed to restore a %zu token prefix, dropping it", prefix.size());
+        llama_memory_seq_rm(llama_get_memory(context), seqId, -1, -1);
+        // find() moved it to the front. Dropped, so that the next store() replaces it.
+        drop(entries.begin());
+        return false;
+    }
+
+    LOG_DEBUG(LOG_TAG, "Restored a %zu token prefix (%zu bytes)", prefix.size(), entry->stateSize);
+    return true;
+}
+
+bool PrefixCache::store(llama_context *context, const llama_seq_id seqId, const std::vector<llama_token> &prefix) {
+    if (find(prefix)) {
+        return true;
+    }
+
+    auto state = std::make_shared<std::vector<uint8_t> >(llama_state_seq_get_size(context, seqId));
+    const auto stateSize = llama_state_seq_get_data(context, state->data(), state->size(), seqId);
+    if (stateSize == 0) {
+        LOG_WARN(LOG_TAG, "Failed to snapshot a %zu token prefix", prefix.size());
+        return false;
+    }
+    state->resize(stateSize);
+
+    Entry entry;
+    entry.key = keyOf(prefix);
+    entry.tokens = prefix;
+    entry.state = state;
+    entry.stateSize = stateSize;
+
+    if (!directory.empty()) {
+        {
+            std::lock_guard lock(writeMutex);
+            writes.push_back({entry.key, prefix, state});
+            if (!writer.joinable()) {
+                writer = std::thread(&PrefixCache::writeFiles, this);
+            }
+        }
+        writeQueued.notify_one();
+    }
+    insert(std::move(entry));
+
+    LOG_DEBUG(LOG_TAG, "Stored a %zu token prefix", prefix.size());
+    return true;
+}
+
+bool PrefixCache::contains(const std::vector<llama_token> &prefix) {
+    return find(prefix) != nullptr;
+}
+
+PrefixCache::Entry *PrefixCache::find(const std::vector<llama_token> &prefix) {
+    const auto key = keyOf(prefix);
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        if (it->key == key && it->tokens == prefix) {
+            entries.splice(entries.begin(), entries, it);
+            return &entries.front();
+        }
+    }
+    return loadFromDisk(key, prefix);
+}
+
+PrefixCache::Entry *PrefixCache::loadFromDisk(const uint64_t key, const std::vector<llama_token> &prefix) {
+    if (directory.empty()) {
+        return nullptr;
+    }
+
+    const auto path = pathOf(key);
+    if (!std::filesystem::exists(path)) {
+        return nullptr;
+    }
+
+    Entry entry;
+    entry.key = key;
+    if (!entry.file.open(path)) {
+        return nullptr;
+    }
+
+    FileHeader header{};
+    const auto tokensSize = prefix.size() * sizeof(llama_token);
+    if (entry.file.size() < sizeof(header)) {
+        return nullptr;
+    }
+    std::memcpy(&header, entry.file.data(), sizeof(header));
+    if (header.magic != FILE_MAGIC || header.version != FILE_VERSION || header.modelKey != modelKey ||
+        header.tokenCount != prefix.size() || entry.file.size() != sizeof(header) + tokensSize + header.stateSize) {
+        LOG_DEBUG(LOG_TAG, "Ignoring stale prefix cache file %s", path.c_str());
+        return nullptr;
+    }
+
+    // The key is a hash, the tokens themselves decide
+    entry.tokens.resize(prefix.size());
+    std::memcpy(entry.tokens.data(), entry.file.data() + sizeof(header), tokensSize);
+    if (entry.tokens != prefix) {
+        return nullptr;
+    }
+    entry.stateOffset = sizeof(header) + tokensSize;
+    entry.stateSize = header.stateSize;
+
+    // The modification time orders the files for trimDisk, using one counts as writing it
+    std::error_code error;
+    std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), error);
+
+    LOG_DEBUG(LOG_TAG, "Loaded a %zu token prefix from %s", prefix.size(), path.c_str());
+    return &insert(std::move(entry));
+}
+
+void PrefixCache::writeFiles() {
+    std::unique_lock lock(writeMutex);
+    while (true) {
+        writeQueued.wait(lock, [this] { return stopping || !writes.empty(); });
+        // Pending writes still go out when stopping, so that the snapshots survive the session
+        if (writes.empty()) {
+            return;
+        }
+        const auto write = std::move(writes.front());
+        writes.pop_front();
+        lock.unlock();
+        writeToDisk(write);
+        trimDisk();
+        lock.lock();
+    }
+}
+
+void PrefixCache::writeToDisk(const PendingWrite &write) const {
+    const auto path = pathOf(write.key);
+    // Written aside and renamed, so that other sessions never map a partial file
+    const auto tempPath = path + "." + std::to_string(reinterpret_cast<uintptr_t>(this)) + ".tmp";
+
+    const FileHeader header{
+        FILE_MAGIC,
+        FILE_VERSION,
+        modelKey,
+        write.tokens.size(),
+        write.state->size()
+    };
+
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char *>(write.tokens.data()),
+                   static_cast<std::streamsize>(write.tokens.size() * sizeof(llama_token)));
+        file.write(reinterpret_cast<const char *>(write.state->data()),
+                   static_cast<std::streamsize>(write.state->size()));
+        if (!file) {
+            LOG_WARN(LOG_TAG, "Failed to write prefix cache file %s", tempPath.c_str());
+            file.close();
+            std::filesystem::remove(tempPath);
+            return;
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::rename(tempPath, path, error);
+    if (error) {
+        LOG_WARN(LOG_TAG, "Failed to write prefix cache file %s: %s", path.c_str(), error.message().c_str());
+        std::filesystem::remove(tempPath, error);
+    }
+}
+
+void PrefixCache::trimDisk() const {
+    struct CacheFile {
+        std::filesystem::path path;
+        std::filesystem::file_time_type lastUsed;
+        uintmax_t size;
+    };
+
+    // Including the files of other sessions sharing the directory
+    std::error_code error;
+    std::vector<CacheFile> files;
+    uintmax_t total = 0;
+    for (const auto &item: std::filesystem::directory_iterator(directory, error)) {
+        if (item.path().extension() != FILE_EXTENSION || !item.is_regular_file(error)) {
+            continue;
+        }
+        const auto size = item.file_size(error);
+        const auto lastUsed = item.last_write_time(error);
+        if (!error) {
+            files.push_back({item.path(), lastUsed, size});
+            total += size;
+        }
+    }
+
+    std::ranges::sort(files, {}, &CacheFile::lastUsed);
+    for (const auto &file: files) {
+        if (total <= diskBudget) {
+            break;
+        }
+        // Sessions that have the file mapped keep reading it
+        if (std::filesystem::remove(file.path, error)) {
+            LOG_DEBUG(LOG_TAG, "Deleted prefix cache file %s to stay within the disk budget", file.path.string().c_str());
+        }
+        total -= file.size;
+    }
+}
+
+PrefixCache::Entry &PrefixCache::insert(Entry entry) {
+    memoryUsed += entry.stateSize;
+    entries.push_front(std::move(entry));
+    while (memoryUsed > memoryBudget && entries.size() > 1) {
+        memoryUsed -= entries.back().stateSize;
+        entries.pop_back();
+    }
+    return entries.front();
+}
+
+void PrefixCache::drop(const std::list<Entry>::iterator entry) {
+    if (!directory.empty()) {
+        {
+            std::lock_guard lock(writeMutex);
+            std::erase_if(writes, [&](const PendingWrite &write) { return write.key == entry->key; });
+        }
+        std::error_code error;
+        std::filesystem::remove(pathOf(entry->key), error);
+    }
+    memoryUsed -= entry->stateSize;
+    entries.erase(entry);
+}
+
+uint64_t PrefixCache::keyOf(const std::vector<llama_token> &prefix) const {
+    return hashBytes(reinterpret_cast<const uint8_t *>(prefix.data()), prefix.size() * sizeof(llama_token)) ^ modelKey;
+}
+
+std::string PrefixCache::pathOf(const uint64_t key) const {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx%s", static_cast<unsigned long long>(key), FILE_EXTENSION);
+    return (std::filesystem::path(directory) / name).string();
+}
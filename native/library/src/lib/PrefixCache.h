@@ -0,0 +1,100 @@
+#ifndef KLLAMA_PREFIX_CACHE_H
+#define KLLAMA_PREFIX_CACHE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "llama.h"
+
+#include "MappedFile.h"
+
+// KV state snapshots of shared prompt prefixes (typically the system prompt), keyed by
+// a hash of their tokens and restored into a sequence instead of being re-prefilled.
+// Snapshots are kept in memory and, when a directory is given, in files that survive
+// process restarts and are memory-mapped back on load. Both are held to a byte budget, in least
+// recently used order; the files are written on a thread of their own, off the generation path.
+class PrefixCache {
+public:
+    // modelKey identifies the model and KV layout the snapshots were taken with
+    PrefixCache(std::string directory, uint64_t modelKey, size_t memoryBudget, size_t diskBudget);
+
+    // Finishes the pending file writes
+    ~PrefixCache();
+
+    PrefixCache(const PrefixCache &) = delete;
+
+    PrefixCache &operator=(const PrefixCache &) = delete;
+
+    // Restores the snapshot of `prefix` in place of what seqId holds. Returns false on a miss, and drops
+    // a snapshot that fails to restore, leaving seqId empty.
+    bool restore(llama_context *context, llama_seq_id seqId, const std::vector<llama_token> &prefix);
+
+    // Snapshots seqId, which must hold exactly `prefix`
+    bool store(llama_context *context, llama_seq_id seqId, const std::vector<llama_token> &prefix);
+
+    [[nodiscard]] bool contains(const std::vector<llama_token> &prefix);
+
+private:
+    struct Entry {
+        uint64_t key = 0;
+        std::vector<llama_token> tokens;
+        std::shared_ptr<const std::vector<uint8_t> > state; // Either the state itself, shared with its pending write...
+        MappedFile file; // ...or the file it was loaded from
+        size_t stateOffset = 0;
+        size_t stateSize = 0;
+
+        [[nodiscard]] const uint8_t *stateData() const {
+            return file.isOpen() ? file.data() + stateOffset : state->data();
+        }
+    };
+
+    struct PendingWrite {
+        uint64_t key = 0;
+        std::vector<llama_token> tokens;
+        std::shared_ptr<const std::vector<uint8_t> > state;
+    };
+
+    Entry *find(const std::vector<llama_token> &prefix);
+
+    Entry *loadFromDisk(uint64_t key, const std::vector<llama_token> &prefix);
+
+    // Runs on the writer thread
+    void writeFiles();
+
+    void writeToDisk(const PendingWrite &write) const;
+
+    // Deletes the least recently used files until the directory fits the disk budget
+    void trimDisk() const;
+
+    // Makes room within the memory budget, keeping the new entry whatever its size
+    Entry &insert(Entry entry);
+
+    // Removes the entry and its file
+    void drop(std::list<Entry>::iterator entry);
+
+    [[nodiscard]] uint64_t keyOf(const std::vector<llama_token> &prefix) const;
+
+    [[nodiscard]] std::string pathOf(uint64_t key) const;
+
+    std::string directory;
+    uint64_t modelKey;
+    size_t memoryBudget;
+    size_t diskBudget;
+    std::list<Entry> entries; // Most recently used first
+    size_t memoryUsed = 0;
+
+    std::mutex writeMutex;
+    std::condition_variable writeQueued;
+    std::deque<PendingWrite> writes;
+    bool stopping = false;
+    std::thread writer; // Started with the first write
+};
+
+#endif
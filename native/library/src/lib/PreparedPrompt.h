@@ -0,0 +1,29 @@
+#ifndef KLLAMA_PREPARED_PROMPT_H
+#define KLLAMA_PREPARED_PROMPT_H
+
+#include <memory>
+#include <vector>
+
+#include "mtmd.h"
+
+#include "SequenceCache.h"
+
+// A templated and tokenized conversation, laid out the way it ends up in the KV cache
+struct PreparedPrompt {
+    std::vector<PromptUnit> units;
+    // Media chunks referenced by the media units, in order. Owned by `chunks`.
+    std::vector<const mtmd_input_chunk *> mediaChunks;
+    // Own the media chunks, shared with the prompt builder's cache
+    std::vector<std::shared_ptr<mtmd_input_chunks> > chunks;
+    // Leading text units rendered from the system messages alone
+    size_t systemPrefix = 0;
+    // The system prefix when it is long enough to be worth caching, shared by conversations with the same system prompt
+    size_t sharedPrefix = 0;
+    // How long applying the chat template and tokenizing took
+    float templateMs = 0;
+    float tokenizeMs = 0;
+
+    [[nodiscard]] bool hasMedia() const { return !mediaChunks.empty(); }
+};
+
+#endif
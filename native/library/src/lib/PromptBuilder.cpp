@@ -0,0 +1,395 @@
+#include "PromptBuilder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string_view>
+
+#include "mtmd-helper.h"
+
+#include "Tracing.h"
+#include "Utils.h"
+#include "logging/logging.h"
+
+#define LOG_TAG "KLlamaPromptBuilder"
+
+static const char *roleName(const MessageRole role) {
+    switch (role) {
+        case MessageRole::Assistant:
+            return "assistant";
+        case MessageRole::System:
+            return "system";
+        case MessageRole::User:
+        default:
+            return "user";
+    }
+}
+
+static float millisecondsSince(const std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static uint64_t imageHash(const ImageData &image) {
+    const auto bytes = image.bytes();
+    return hashBytes(bytes.data(), bytes.size()) ^ image.width ^ static_cast<uint64_t>(image.height) << 32;
+}
+
+PromptBuilder::PromptBuilder(const llama_model *model, mtmd_context *visionContext, const int32_t threads)
+    : model(model),
+      vocab(llama_model_get_vocab(model)),
+      visionContext(visionContext),
+      workers(std::make_unique<WorkerPool>(static_cast<size_t>(std::max(threads, 1)))) {
+}
+
+KLlamaResult<PreparedPrompt> PromptBuilder::build(
+    const std::vector<MultimodalMessage> &conversation,
+    const ProgressCallback &progressCallback
+) {
+    const std::lock_guard lock(mutex);
+    const auto templateStart = std::chrono::steady_clock::now();
+
+    std::vector<const ImageData *> conversationImages;
+    for (const auto &message: conversation) {
+        for (const auto &image: message.images) {
+            conversationImages.push_back(&image);
+        }
+    }
+    const bool media = !conversationImages.empty();
+
+    std::string previousText = std::move(text);
+    {
+        TRACE_SCOPE("applyTemplate");
+        if (auto renderResult = render(conversation, conversation.size(), true, text); renderResult.isError()) {
+            clear();
+            return KLlamaResult<PreparedPrompt>(renderResult.error, renderResult.errorMessage);
+        }
+    }
+
+    PreparedPrompt prompt;
+    const auto tokenizeStart = std::chrono::steady_clock::now();
+    prompt.templateMs = std::chrono::duration<float, std::milli>(tokenizeStart - templateStart).count();
+
+    // The last special token or marker the previous text has complete in common with this one. mtmd tokenizes
+    // the first piece with BOS, plain text without, so a conversation gaining its first image starts over.
+    size_t common = 0;
+    if (addSpecial == media) {
+        const auto limit = std::min(previousText.size(), text.size());
+        while (common < limit && previousText[common] == text[common]) {
+            ++common;
+        }
+    }
+    RestartPoint restart;
+    while (!restartPoints.empty()) {
+        if (restartPoints.back().end <= common) {
+            restart = restartPoints.back();
+            restartPoints.pop_back();
+            break;
+        }
+        restartPoints.pop_back();
+    }
+    if (restart.offset == 0) {
+        restartPoints.clear();
+    }
+    units.resize(restart.units);
+    mediaChunks.resize(restart.mediaChunks);
+    // Images past the restart point keep their chunks when they come back
+    auto previousImages = std::move(images);
+    images.assign(previousImages.begin(), previousImages.begin() + static_cast<std::ptrdiff_t>(restart.images));
+    addSpecial = media;
+
+    if (progressCallback) {
+        progressCallback(media ? 0.1f : 0.2f, media ? "Processing images" : "Tokenizing text prompt");
+    }
+    std::vector<uint64_t> imageHashes(conversationImages.size());
+    for (auto i = restart.images; i < conversationImages.size(); ++i) {
+        imageHashes[i] = imageHash(*conversationImages[i]);
+    }
+    if (auto preprocessResult = preprocessAll(conversationImages, imageHashes, restart.images, previousImages);
+        preprocessResult.isError()) {
+        clear();
+        return KLlamaResult<PreparedPrompt>(preprocessResult.error, preprocessResult.errorMessage);
+    }
+
+    const std::string_view marker = mtmd_default_marker();
+    auto imageIndex = restart.images;
+    auto position = restart.offset;
+    while (true) {
+        const auto next = media ? text.find(marker, position) : std::string::npos;
+        const auto end = next == std::string::npos ? text.size() : next;
+        if (end > position || position == 0) {
+            if (auto tokenizeResult = tokenizeText(text.data() + position, end - position, position,
+                                                   position == 0 && media); tokenizeResult.isError()) {
+                clear();
+                return KLlamaResult<PreparedPrompt>(tokenizeResult.error, tokenizeResult.errorMessage);
+            }
+        }
+        if (next == std::string::npos) {
+            break;
+        }
+
+        if (imageIndex >= conversationImages.size()) {
+            clear();
+            return KLlamaResult<PreparedPrompt>(KLlamaError::InvalidParameters,
+                                                "The conversation has more media markers than images");
+        }
+        restartPoints.push_back({next, next + marker.size(), units.size(), mediaChunks.size(), images.size()});
+        const auto hash = imageHashes[imageIndex];
+        if (auto imageResult = tokenizeImage(*conversationImages[imageIndex++], hash, previousImages);
+            imageResult.isError()) {
+            clear();
+            return KLlamaResult<PreparedPrompt>(imageResult.error, imageResult.errorMessage);
+        }
+        position = next + marker.size();
+    }
+
+    LOG_DEBUG(LOG_TAG, "Reused %zu of %zu prompt units, tokenized %zu of %zu bytes", restart.units, units.size(),
+              text.size() - restart.offset, text.size());
+
+    prompt.units = units;
+    prompt.mediaChunks = mediaChunks;
+    prompt.chunks.reserve(images.size());
+    for (const auto &image: images) {
+        prompt.chunks.push_back(image.chunks);
+    }
+    prompt.tokenizeMs = millisecondsSince(tokenizeStart);
+    return KLlamaResult(std::move(prompt));
+}
+
+void PromptBuilder::clear() {
+    text.clear();
+    units.clear();
+    mediaChunks.clear();
+    images.clear();
+    restartPoints.clear();
+}
+
+std::vector<llama_token> PromptBuilder::systemPrefix(const std::vector<MultimodalMessage> &conversation,
+                                                     const bool withSpecial) {
+    const std::lock_guard lock(mutex);
+    size_t systemCount = 0;
+    while (systemCount < conversation.size() && conversation[systemCount].role == MessageRole::System) {
+        ++systemCount;
+    }
+    if (systemCount == 0) {
+        return {};
+    }
+
+    std::string rendered;
+    if (render(conversation, systemCount, false, rendered).isError()) {
+        return {};
+    }
+    if (rendered == systemText && withSpecial == systemAddSpecial) {
+        return systemTokens;
+    }
+
+    std::vector<llama_token> tokens(rendered.size() + 2);
+    const auto count = llama_tokenize(vocab, rendered.data(), static_cast<int32_t>(rendered.size()), tokens.data(),
+                                      static_cast<int32_t>(tokens.size()), withSpecial, true);
+    if (count < 0) {
+        return {};
+    }
+    tokens.resize(count);
+
+    systemText = std::move(rendered);
+    systemAddSpecial = withSpecial;
+    systemTokens = tokens;
+    return tokens;
+}
+
+KLlamaResult<void> PromptBuilder::render(
+    const std::vector<MultimodalMessage> &conversation,
+    const size_t count,
+    const bool addAssistant,
+    std::string &rendered
+) {
+    // Image markers go at the start of the message the images belong to
+    const std::string_view marker = mtmd_default_marker();
+    contents.resize(count);
+    size_t estimate = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const auto &message = conversation[i];
+        contents[i].clear();
+        if (!message.images.empty()) {
+            for (size_t j = 0; j < message.images.size(); ++j) {
+                contents[i] += marker;
+            }
+            contents[i] += '\n';
+            contents[i] += message.content;
+        }
+        estimate += message.content.size() + contents[i].size() + 64;
+    }
+
+    chatMessages.clear();
+    for (size_t i = 0; i < count; ++i) {
+        const auto &message = conversation[i];
+        chatMessages.push_back({
+            roleName(message.role), message.images.empty() ? message.content.c_str() : contents[i].c_str()
+        });
+    }
+
+    if (buffer.size() < estimate) {
+        buffer.resize(estimate);
+    }
+    auto length = llama_chat_apply_template(nullptr, chatMessages.data(), chatMessages.size(), addAssistant,
+                                            buffer.data(), static_cast<int32_t>(buffer.size()));
+    // The result is the full length even when it didn't fit
+    if (length > static_cast<int32_t>(buffer.size())) {
+        buffer.resize(length);
+        length = llama_chat_apply_template(nullptr, chatMessages.data(), chatMessages.size(), addAssistant,
+                                           buffer.data(), static_cast<int32_t>(buffer.size()));
+    }
+    if (length < 0) {
+        return KLlamaResult<void>(KLlamaError::TokenizationFailed,
+                                  "Failed to apply chat template. Prompt may be too long or template invalid.");
+    }
+
+    rendered.assign(buffer.data(), length);
+    return {};
+}
+
+KLlamaResult<void> PromptBuilder::tokenizeText(const char *piece, const size_t length, const size_t offset,
+                                               const bool withSpecial) {
+    TRACE_SCOPE("llama_tokenize");
+    std::vector<llama_token> tokens(length + 2);
+    auto count = llama_tokenize(vocab, piece, static_cast<int32_t>(length), tokens.data(),
+                                static_cast<int32_t>(tokens.size()), withSpecial, true);
+    if (count < 0) {
+        tokens.resize(-count);
+        count = llama_tokenize(vocab, piece, static_cast<int32_t>(length), tokens.data(),
+                               static_cast<int32_t>(tokens.size()), withSpecial, true);
+    }
+    if (count < 0) {
+        return KLlamaResult<void>(KLlamaError::TokenizationFailed, "Failed to tokenize text prompt");
+    }
+
+    // Special tokens appear in the text as they are, in order. The BOS added for withSpecial doesn't.
+    const std::string_view view(piece, length);
+    size_t cursor = 0;
+    bool located = true;
+    std::string special;
+    units.reserve(units.size() + count);
+    for (int32_t i = 0; i < count; ++i) {
+        const auto token = tokens[i];
+        const bool added = withSpecial && i == 0 && token == llama_vocab_bos(vocab);
+        if (located && !added &&
+            llama_vocab_get_attr(vocab, token) & (LLAMA_TOKEN_ATTR_CONTROL | LLAMA_TOKEN_ATTR_USER_DEFINED)) {
+            tokenToPiece(vocab, token, special);
+            const auto found = special.empty() ? std::string_view::npos : view.find(special, cursor);
+            if (found == std::string_view::npos) {
+                // Lost track of where the tokens are, the rest of this piece can't be restarted from
+                located = false;
+            } else {
+                restartPoints.push_back({
+                    offset + found, offset + found + special.size(), units.size(), mediaChunks.size(), images.size()
+                });
+                cursor = found + special.size();
+            }
+        }
+        units.push_back(PromptUnit::text(token));
+    }
+    return {};
+}
+
+KLlamaResult<void> PromptBuilder::tokenizeImage(const ImageData &image, const uint64_t hash,
+                                                const std::vector<Image> &previous) {
+    std::shared_ptr<mtmd_input_chunks> chunks;
+    for (const auto &entry: previous) {
+        if (entry.hash == hash) {
+            chunks = entry.chunks;
+            break;
+        }
+    }
+
+    if (!chunks) {
+        auto preprocessResult = preprocess(image);
+        if (preprocessResult.isError()) {
+            return KLlamaResult<void>(preprocessResult.error, preprocessResult.errorMessage);
+        }
+        chunks = std::move(preprocessResult.value);
+    }
+
+    uint64_t mediaIndex = 0;
+    const auto chunksCount = mtmd_input_chunks_size(chunks.get());
+    for (size_t i = 0; i < chunksCount; ++i) {
+        const auto *chunk = mtmd_input_chunks_get(chunks.get(), i);
+        if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+            size_t tokensCount = 0;
+            const auto *tokens = mtmd_input_chunk_get_tokens_text(chunk, &tokensCount);
+            for (size_t j = 0; j < tokensCount; ++j) {
+                units.push_back(PromptUnit::text(tokens[j]));
+            }
+        } else {
+            // Images preprocessed into several chunks tell them apart by their index
+            units.push_back(PromptUnit::media(hash + mediaIndex++, mtmd_input_chunk_get_n_pos(chunk)));
+            mediaChunks.push_back(chunk);
+        }
+    }
+    images.push_back({hash, std::move(chunks)});
+    return {};
+}
+
+KLlamaResult<std::shared_ptr<mtmd_input_chunks> > PromptBuilder::preprocess(const ImageData &image) const {
+    using Result = KLlamaResult<std::shared_ptr<mtmd_input_chunks> >;
+    mtmd::bitmap bitmap;
+    {
+        TRACE_SCOPE("decodeImage");
+        // Pre-decoded pixels go straight into the bitmap, encoded images are decoded by mtmd
+        const auto bytes = image.bytes();
+        bitmap.ptr.reset(image.isRgb()
+                             ? mtmd_bitmap_init(image.width, image.height, bytes.data())
+                             : mtmd_helper_bitmap_init_from_buf(visionContext, bytes.data(), bytes.size()));
+    }
+    if (!bitmap.ptr) {
+        return Result(KLlamaError::ImageProcessingFailed, "Failed to create bitmap from image data");
+    }
+
+    // The marker alone, which comes out as the image's chunks with whatever text the model wraps them in
+    mtmd_input_text input;
+    input.text = mtmd_default_marker();
+    input.add_special = false;
+    input.parse_special = true;
+
+    std::shared_ptr<mtmd_input_chunks> chunks(mtmd_input_chunks_init(), mtmd_input_chunks_free);
+    const mtmd_bitmap *bitmapPointer = bitmap.ptr.get();
+    TRACE_SCOPE("mtmd_tokenize");
+    if (mtmd_tokenize(visionContext, chunks.get(), &input, &bitmapPointer, 1) != 0) {
+        return Result(KLlamaError::TokenizationFailed, "Failed to tokenize multimodal input");
+    }
+    return Result(std::move(chunks));
+}
+
+KLlamaResult<void> PromptBuilder::preprocessAll(
+    const std::vector<const ImageData *> &conversationImages,
+    const std::vector<uint64_t> &imageHashes,
+    const size_t first,
+    std::vector<Image> &cached
+) const {
+    std::vector<const ImageData *> pending;
+    std::vector<uint64_t> hashes;
+    for (size_t i = first; i < conversationImages.size(); ++i) {
+        const auto hash = imageHashes[i];
+        const auto known = [hash](const Image &image) { return image.hash == hash; };
+        if (std::ranges::none_of(cached, known) && std::ranges::find(hashes, hash) == hashes.end()) {
+            pending.push_back(conversationImages[i]);
+            hashes.push_back(hash);
+        }
+    }
+    // One image is left to tokenizeImage, on this thread
+    if (pending.size() < 2 || workers->size() < 2) {
+        return {};
+    }
+
+    // mtmd only reads its context while tokenizing, so the images can take one thread each
+    using Chunks = KLlamaResult<std::shared_ptr<mtmd_input_chunks> >;
+    std::vector<Chunks> results(pending.size(), Chunks(KLlamaError::UnknownError));
+    workers->run(pending.size(), [&](const size_t i) { results[i] = preprocess(*pending[i]); });
+
+    LOG_DEBUG(LOG_TAG, "Preprocessed %zu images on up to %zu threads", pending.size(),
+              std::min(pending.size(), workers->size()));
+    for (size_t i = 0; i < pending.size(); ++i) {
+        if (results[i].isError()) {
+            return KLlamaResult<void>(results[i].error, results[i].errorMessage);
+        }
+        cached.push_back({hashes[i], std::move(results[i].value)});
+    }
+    return {};
+}
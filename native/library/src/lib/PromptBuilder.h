@@ -0,0 +1,96 @@
+#ifndef KLLAMA_PROMPT_BUILDER_H
+#define KLLAMA_PROMPT_BUILDER_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "llama.h"
+#include "mtmd.h"
+
+#include "KLlama.h"
+#include "PreparedPrompt.h"
+#include "WorkerPool.h"
+
+// Templates and tokenizes conversations into PreparedPrompts. The previous prompt is kept, so that
+// the next one, which usually extends it by a turn or two, only tokenizes the text after the last
+// special token the two share, and only preprocesses the images it adds.
+//
+// Tokenizing from a special token on gives the same tokens as tokenizing the whole text, since
+// llama.cpp splits the text at special tokens and tokenizes the pieces in between independently.
+// mtmd splits at media markers the same way, so each image is tokenized on its own as well, and
+// images keep the chunks they were preprocessed into for as long as they stay in the conversation.
+// The images a conversation adds are decoded and preprocessed in parallel, on a pool of up to `threads` threads.
+class PromptBuilder {
+public:
+    PromptBuilder(const llama_model *model, mtmd_context *visionContext, int32_t threads = 1);
+
+    // Safe to call from several threads, the calls take turns
+    KLlamaResult<PreparedPrompt> build(const std::vector<MultimodalMessage> &conversation,
+                                       const ProgressCallback &progressCallback);
+
+    // Tokens of the leading system messages rendered alone, empty when there are none
+    std::vector<llama_token> systemPrefix(const std::vector<MultimodalMessage> &conversation, bool withSpecial);
+
+private:
+    // Where tokenization can start over: a special token or a media marker spanning [offset, end) of the text
+    struct RestartPoint {
+        size_t offset = 0;
+        size_t end = 0;
+        size_t units = 0; // Prompt units before it
+        size_t mediaChunks = 0;
+        size_t images = 0;
+    };
+
+    struct Image {
+        uint64_t hash = 0;
+        std::shared_ptr<mtmd_input_chunks> chunks; // What the image's marker tokenized into
+    };
+
+    // The chat template applied to the first `count` messages, with the markers of their images
+    KLlamaResult<void> render(const std::vector<MultimodalMessage> &conversation, size_t count, bool addAssistant,
+                              std::string &rendered);
+
+    // Tokenizes a piece of text without media markers, which starts at `offset` in the text
+    KLlamaResult<void> tokenizeText(const char *piece, size_t length, size_t offset, bool withSpecial);
+
+    KLlamaResult<void> tokenizeImage(const ImageData &image, uint64_t hash, const std::vector<Image> &previous);
+
+    // Decodes the image and tokenizes its marker alone, which resizes and slices it for the projector
+    KLlamaResult<std::shared_ptr<mtmd_input_chunks> > preprocess(const ImageData &image) const;
+
+    // Preprocesses the images from `first` on that aren't in `cached` in parallel, and adds them to it
+    KLlamaResult<void> preprocessAll(const std::vector<const ImageData *> &conversationImages,
+                                     const std::vector<uint64_t> &imageHashes, size_t first,
+                                     std::vector<Image> &cached) const;
+
+    // Forgets the last prompt, after a failure left it half built
+    void clear();
+
+    std::mutex mutex;
+    const llama_model *model;
+    const llama_vocab *vocab;
+    mtmd_context *visionContext;
+    std::unique_ptr<WorkerPool> workers; // Preprocesses images, kept across builds
+
+    // Reused by every render
+    std::vector<llama_chat_message> chatMessages;
+    std::vector<std::string> contents;
+    std::vector<char> buffer;
+
+    // The last prompt, extended in place by the next
+    std::string text;
+    bool addSpecial = false; // Whether the first piece of text was tokenized with BOS
+    std::vector<PromptUnit> units;
+    std::vector<const mtmd_input_chunk *> mediaChunks;
+    std::vector<Image> images;
+    std::vector<RestartPoint> restartPoints;
+
+    // The system prefix of the last conversation that had one
+    std::string systemText;
+    bool systemAddSpecial = false;
+    std::vector<llama_token> systemTokens;
+};
+
+#endif
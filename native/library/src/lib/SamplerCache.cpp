@@ -0,0 +1,47 @@
+#include "SamplerCache.h"
+
+// Whether chains built from a and b behave the same, nPredict and stop sequences aren't part of the chain
+static bool sameChain(const SamplingParams &a, const SamplingParams &b) {
+    return a.temperature == b.temperature && a.topP == b.topP && a.topK == b.topK && a.minP == b.minP &&
+           a.typicalP == b.typicalP && a.repeatPenalty == b.repeatPenalty && a.repeatLastN == b.repeatLastN &&
+           a.frequencyPenalty == b.frequencyPenalty && a.presencePenalty == b.presencePenalty &&
+           a.seed == b.seed && a.grammar == b.grammar && a.jsonSchema == b.jsonSchema;
+}
+
+SamplerCache::SamplerCache(const size_t capacity) : capacity(capacity) {
+}
+
+SamplerCache::~SamplerCache() {
+    clear();
+}
+
+llama_sampler *SamplerCache::take(const SamplingParams &params) {
+    std::lock_guard lock(mutex);
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        if (sameChain(it->params, params)) {
+            auto *chain = it->chain;
+            entries.erase(it);
+            // Clears penalty history and grammar state, and reseeds
+            llama_sampler_reset(chain);
+            return chain;
+        }
+    }
+    return nullptr;
+}
+
+void SamplerCache::put(const SamplingParams &params, llama_sampler *chain) {
+    std::lock_guard lock(mutex);
+    entries.push_front({params, chain});
+    while (entries.size() > capacity) {
+        llama_sampler_free(entries.back().chain);
+        entries.pop_back();
+    }
+}
+
+void SamplerCache::clear() {
+    std::lock_guard lock(mutex);
+    for (const auto &entry: entries) {
+        llama_sampler_free(entry.chain);
+    }
+    entries.clear();
+}
@@ -0,0 +1,43 @@
+#ifndef KLLAMA_SAMPLER_CACHE_H
+#define KLLAMA_SAMPLER_CACHE_H
+
+#include <list>
+#include <mutex>
+
+#include "llama.h"
+
+#include "KLlama.h"
+
+// Idle sampler chains, kept by the sampling parameters they were built from, so that requests
+// with the same parameters don't rebuild the chain (and its grammar) every time. A chain is
+// only ever used by one generation: take hands it out, put returns it once the generation is over.
+class SamplerCache {
+public:
+    explicit SamplerCache(size_t capacity);
+
+    ~SamplerCache();
+
+    SamplerCache(const SamplerCache &) = delete;
+
+    SamplerCache &operator=(const SamplerCache &) = delete;
+
+    // A chain built from equivalent parameters, reset for a new generation. Null on a miss.
+    llama_sampler *take(const SamplingParams &params);
+
+    // Frees the least recently used chain when the cache is full
+    void put(const SamplingParams &params, llama_sampler *chain);
+
+    void clear();
+
+private:
+    struct Entry {
+        SamplingParams params;
+        llama_sampler *chain;
+    };
+
+    size_t capacity;
+    std::mutex mutex;
+    std::list<Entry> entries; // Most recently used first
+};
+
+#endif
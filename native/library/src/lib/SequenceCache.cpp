@@ -0,0 +1,52 @@
+#include "SequenceCache.h"
+
+#include <algorithm>
+
+size_t SequenceCache::commonPrefix(const std::vector<PromptUnit> &prompt) const {
+    const auto limit = std::min(units.size(), prompt.size());
+    size_t count = 0;
+    while (count < limit && units[count] == prompt[count]) {
+        ++count;
+    }
+    return count;
+}
+
+llama_pos SequenceCache::positionAt(const size_t count) const {
+    if (count == 0 || positions.empty()) {
+        return 0;
+    }
+    return positions[std::min(count, positions.size()) - 1];
+}
+
+void SequenceCache::append(const PromptUnit &unit) {
+    const auto start = positions.empty() ? 0 : positions.back();
+    units.push_back(unit);
+    positions.push_back(start + unit.nPos);
+}
+
+void SequenceCache::truncate(const size_t count) {
+    if (count < units.size()) {
+        units.resize(count);
+        positions.resize(count);
+    }
+}
+
+void SequenceCache::erase(const size_t first, const size_t count) {
+    if (first >= units.size() || count == 0) {
+        return;
+    }
+    const auto last = std::min(first + count, units.size());
+    const auto shift = positionAt(last) - positionAt(first);
+
+    units.erase(units.begin() + static_cast<std::ptrdiff_t>(first), units.begin() + static_cast<std::ptrdiff_t>(last));
+    positions.erase(positions.begin() + static_cast<std::ptrdiff_t>(first),
+                    positions.begin() + static_cast<std::ptrdiff_t>(last));
+    for (auto i = first; i < positions.size(); ++i) {
+        positions[i] -= shift;
+    }
+}
+
+void SequenceCache::clear() {
+    units.clear();
+    positions.clear();
+}
@@ -0,0 +1,59 @@
+#ifndef KLLAMA_SEQUENCE_CACHE_H
+#define KLLAMA_SEQUENCE_CACHE_H
+
+#include <cstdint>
+#include <vector>
+
+#include "llama.h"
+
+// One unit of prompt input as it is laid out in the KV cache: either a single
+// text token or a whole media chunk (which is only ever reused or dropped as a unit).
+struct PromptUnit {
+    llama_token token = LLAMA_TOKEN_NULL; // LLAMA_TOKEN_NULL for media chunks
+    uint64_t mediaHash = 0; // Content hash of the media chunk, 0 for text tokens
+    llama_pos nPos = 1; // Number of positions the unit occupies
+
+    [[nodiscard]] bool isMedia() const { return token == LLAMA_TOKEN_NULL; }
+
+    bool operator==(const PromptUnit &other) const {
+        return token == other.token && mediaHash == other.mediaHash && nPos == other.nPos;
+    }
+
+    static PromptUnit text(const llama_token token) { return {token, 0, 1}; }
+    static PromptUnit media(const uint64_t hash, const llama_pos nPos) { return {LLAMA_TOKEN_NULL, hash, nPos}; }
+};
+
+// Mirrors the contents of one KV cache sequence, so that a new prompt can be
+// matched against what has already been decoded instead of being re-prefilled.
+class SequenceCache {
+public:
+    // Number of leading units of `prompt` that are already in the cache.
+    [[nodiscard]] size_t commonPrefix(const std::vector<PromptUnit> &prompt) const;
+
+    // KV position right after the first `count` cached units.
+    [[nodiscard]] llama_pos positionAt(size_t count) const;
+
+    [[nodiscard]] llama_pos nPast() const { return positionAt(units.size()); }
+    [[nodiscard]] size_t size() const { return units.size(); }
+    [[nodiscard]] bool empty() const { return units.empty(); }
+    [[nodiscard]] const std::vector<PromptUnit> &entries() const { return units; }
+
+    void append(const PromptUnit &unit);
+
+    void appendToken(const llama_token token) { append(PromptUnit::text(token)); }
+
+    // Drops every unit after the first `count`.
+    void truncate(size_t count);
+
+    // Drops `count` units starting at `first`, moving the ones after them back by the positions they occupied.
+    void erase(size_t first, size_t count);
+
+    void clear();
+
+private:
+    std::vector<PromptUnit> units;
+    // positions[i] is the KV position right after units[i]
+    std::vector<llama_pos> positions;
+};
+
+#endif
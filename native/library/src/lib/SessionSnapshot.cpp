@@ -0,0 +1,141 @@
+#include "SessionSnapshot.h"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#include "MappedFile.h"
+#include "logging/logging.h"
+
+#define LOG_TAG "KLlamaSessionSnapshot"
+
+static constexpr uint32_t SNAPSHOT_MAGIC = 0x53534C4B; // "KLSS"
+static constexpr uint32_t SNAPSHOT_VERSION = 1;
+
+namespace {
+    struct SnapshotHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t modelKey;
+        uint64_t unitCount;
+        uint64_t stateSize;
+    };
+
+    // PromptUnit as it is stored, without padding
+    struct StoredUnit {
+        int32_t token;
+        int32_t nPos;
+        uint64_t mediaHash;
+    };
+}
+
+KLlamaResult<std::vector<uint8_t> > SessionSnapshot::save(llama_context *context, const llama_seq_id seqId,
+                                                          const uint64_t modelKey, const SequenceCache &cache) {
+    const auto &units = cache.entries();
+    const auto unitsSize = units.size() * sizeof(StoredUnit);
+    const auto stateOffset = sizeof(SnapshotHeader) + unitsSize;
+
+    // The state is written straight into the snapshot, without an intermediate copy
+    std::vector<uint8_t> data(stateOffset + llama_state_seq_get_size(context, seqId));
+    const auto stateSize = llama_state_seq_get_data(context, data.data() + stateOffset, data.size() - stateOffset,
+                                                    seqId);
+    if (stateSize == 0) {
+        return KLlamaResult<std::vector<uint8_t> >(KLlamaError::EvaluationFailed, "Failed to read the KV state");
+    }
+    data.resize(stateOffset + stateSize);
+
+    const SnapshotHeader header{SNAPSHOT_MAGIC, SNAPSHOT_VERSION, modelKey, units.size(), stateSize};
+    std::memcpy(data.data(), &header, sizeof(header));
+
+    auto *stored = data.data() + sizeof(header);
+    for (const auto &unit: units) {
+        const StoredUnit entry{unit.token, unit.nPos, unit.mediaHash};
+        std::memcpy(stored, &entry, sizeof(entry));
+        stored += sizeof(entry);
+    }
+
+    LOG_DEBUG(LOG_TAG, "Saved %zu units of sequence %d (%zu bytes)", units.size(), seqId, data.size());
+    return KLlamaResult(std::move(data));
+}
+
+KLlamaResult<void> SessionSnapshot::saveFile(llama_context *context, const llama_seq_id seqId,
+                                             const uint64_t modelKey, const SequenceCache &cache,
+                                             const std::string &path) {
+    auto snapshot = save(context, seqId, modelKey, cache);
+    if (snapshot.isError()) {
+        return KLlamaResult<void>(snapshot.error, snapshot.errorMessage);
+    }
+
+    const auto tempPath = path + ".tmp";
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char *>(snapshot.value.data()),
+                   static_cast<std::streamsize>(snapshot.value.size()));
+        if (!file) {
+            file.close();
+            std::error_code error;
+            std::filesystem::remove(tempPath, error);
+            return KLlamaResult<void>(KLlamaError::UnknownError, "Failed to write session snapshot " + tempPath);
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::rename(tempPath, path, error);
+    if (error) {
+        std::filesystem::remove(tempPath, error);
+        return KLlamaResult<void>(KLlamaError::UnknownError, "Failed to write session snapshot " + path);
+    }
+    return {};
+}
+
+KLlamaResult<void> SessionSnapshot::restore(llama_context *context, const llama_seq_id seqId,
+                                            const uint64_t modelKey, const std::span<const uint8_t> data,
+                                            SequenceCache &cache) {
+    SnapshotHeader header{};
+    if (data.size() < sizeof(header)) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "Session snapshot is truncated");
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+    if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "Not a session snapshot");
+    }
+    if (header.modelKey != modelKey) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters,
+                                  "Session snapshot was taken with a different model or KV cache types");
+    }
+    if (header.unitCount > (data.size() - sizeof(header)) / sizeof(StoredUnit) ||
+        header.stateSize != data.size() - sizeof(header) - header.unitCount * sizeof(StoredUnit)) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "Session snapshot is truncated");
+    }
+    const auto stateOffset = sizeof(header) + header.unitCount * sizeof(StoredUnit);
+
+    llama_memory_seq_rm(llama_get_memory(context), seqId, -1, -1);
+    cache.clear();
+
+    if (llama_state_seq_set_data(context, data.data() + stateOffset, header.stateSize, seqId) == 0) {
+        llama_memory_seq_rm(llama_get_memory(context), seqId, -1, -1);
+        return KLlamaResult<void>(KLlamaError::EvaluationFailed,
+                                  "Failed to restore the KV state, the context may be too small");
+    }
+
+    const auto *stored = data.data() + sizeof(header);
+    for (uint64_t i = 0; i < header.unitCount; ++i) {
+        StoredUnit entry{};
+        std::memcpy(&entry, stored, sizeof(entry));
+        stored += sizeof(entry);
+        cache.append({entry.token, entry.mediaHash, entry.nPos});
+    }
+
+    LOG_DEBUG(LOG_TAG, "Restored %zu units into sequence %d", cache.size(), seqId);
+    return {};
+}
+
+KLlamaResult<void> SessionSnapshot::restoreFile(llama_context *context, const llama_seq_id seqId,
+                                                const uint64_t modelKey, const std::string &path,
+                                                SequenceCache &cache) {
+    MappedFile file;
+    if (!file.open(path)) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "Can't open session snapshot " + path);
+    }
+    return restore(context, seqId, modelKey, std::span(file.data(), file.size()), cache);
+}
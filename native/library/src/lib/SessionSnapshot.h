@@ -0,0 +1,35 @@
+#ifndef KLLAMA_SESSION_SNAPSHOT_H
+#define KLLAMA_SESSION_SNAPSHOT_H
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "llama.h"
+
+#include "KLlama.h"
+#include "SequenceCache.h"
+
+// KV state of one sequence together with the prompt units it holds, so that a conversation
+// resumes where it left off instead of being prefilled again. A snapshot only restores into
+// a context of the same model and KV cache types, which modelKey identifies.
+class SessionSnapshot {
+public:
+    static KLlamaResult<std::vector<uint8_t> > save(llama_context *context, llama_seq_id seqId, uint64_t modelKey,
+                                                    const SequenceCache &cache);
+
+    // Written aside and renamed, so that a crash never leaves a partial snapshot behind
+    static KLlamaResult<void> saveFile(llama_context *context, llama_seq_id seqId, uint64_t modelKey,
+                                       const SequenceCache &cache, const std::string &path);
+
+    // Replaces the contents of seqId and `cache` with the snapshot; both are left empty on failure
+    static KLlamaResult<void> restore(llama_context *context, llama_seq_id seqId, uint64_t modelKey,
+                                      std::span<const uint8_t> data, SequenceCache &cache);
+
+    // Same as restore, with the file memory-mapped instead of read
+    static KLlamaResult<void> restoreFile(llama_context *context, llama_seq_id seqId, uint64_t modelKey,
+                                          const std::string &path, SequenceCache &cache);
+};
+
+#endif
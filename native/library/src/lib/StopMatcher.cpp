@@ -0,0 +1,52 @@
+#include "StopMatcher.h"
+
+#include <algorithm>
+#include <utility>
+
+StopMatcher::StopMatcher(std::vector<std::string> stopSequences) : stopSequences(std::move(stopSequences)) {
+    std::erase_if(this->stopSequences, [](const std::string &stop) { return stop.empty(); });
+}
+
+void StopMatcher::push(std::string &piece) {
+    if (stopSequences.empty()) {
+        return;
+    }
+    if (stopped) {
+        piece.clear();
+        return;
+    }
+    pending += piece;
+
+    // The earliest complete match wins
+    auto matchPos = std::string::npos;
+    for (const auto &stop: stopSequences) {
+        matchPos = std::min(matchPos, pending.find(stop));
+    }
+    if (matchPos != std::string::npos) {
+        stopped = true;
+        piece.assign(pending, 0, matchPos);
+        pending.clear();
+        return;
+    }
+
+    // Hold back the longest tail that is the start of some stop sequence
+    size_t held = 0;
+    for (const auto &stop: stopSequences) {
+        for (auto length = std::min(stop.size() - 1, pending.size()); length > held; --length) {
+            if (pending.compare(pending.size() - length, length, stop, 0, length) == 0) {
+                held = length;
+                break;
+            }
+        }
+    }
+
+    piece.assign(pending, 0, pending.size() - held);
+    pending.erase(0, pending.size() - held);
+}
+
+void StopMatcher::flush(std::string &text) {
+    text.clear();
+    if (!stopped) {
+        text.swap(pending);
+    }
+}
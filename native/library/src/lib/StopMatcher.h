@@ -0,0 +1,31 @@
+#ifndef KLLAMA_STOP_MATCHER_H
+#define KLLAMA_STOP_MATCHER_H
+
+#include <string>
+#include <vector>
+
+// Finds stop sequences in the generated text as it is decoded piece by piece. Text that
+// could still turn out to be the start of a stop sequence split across tokens is held
+// back, so that a stop sequence never reaches the caller.
+class StopMatcher {
+public:
+    StopMatcher() = default;
+
+    explicit StopMatcher(std::vector<std::string> stopSequences);
+
+    // Takes a decoded piece and replaces it with the text that is now safe to emit. After a match
+    // that is the text before the stop sequence, and matched() is set.
+    void push(std::string &piece);
+
+    // Replaces `text` with what was held back, when generation ends without a match
+    void flush(std::string &text);
+
+    [[nodiscard]] bool matched() const { return stopped; }
+
+private:
+    std::vector<std::string> stopSequences;
+    std::string pending; // Possible start of a stop sequence
+    bool stopped = false;
+};
+
+#endif
@@ -0,0 +1,159 @@
+#include "SystemMemory.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include "ggml-backend.h"
+
+#include "Backends.h"
+
+#if defined(__linux__)
+#include <unistd.h>
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+#elif defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#endif
+
+size_t residentMemoryBytes() {
+#if defined(__linux__)
+    // statm is a single short line, much cheaper than parsing status
+    FILE *file = std::fopen("/proc/self/statm", "r");
+    if (!file) {
+        return 0;
+    }
+    long pages = 0;
+    long resident = 0;
+    const auto read = std::fscanf(file, "%ld %ld", &pages, &resident);
+    std::fclose(file);
+    return read == 2 ? static_cast<size_t>(resident) * static_cast<size_t>(sysconf(_SC_PAGESIZE)) : 0;
+#elif defined(__APPLE__)
+    mach_task_basic_info_data_t info{};
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, reinterpret_cast<task_info_t>(&info), &count) !=
+        KERN_SUCCESS) {
+        return 0;
+    }
+    return info.resident_size;
+#elif defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters{};
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return counters.WorkingSetSize;
+#else
+    return 0;
+#endif
+}
+
+size_t peakResidentMemoryBytes() {
+#if defined(__linux__)
+    FILE *file = std::fopen("/proc/self/status", "r");
+    if (!file) {
+        return 0;
+    }
+    char line[128];
+    size_t peakKb = 0;
+    while (std::fgets(line, sizeof(line), file)) {
+        if (std::strncmp(line, "VmHWM:", 6) == 0) {
+            std::sscanf(line + 6, "%zu", &peakKb);
+            break;
+        }
+    }
+    std::fclose(file);
+    return peakKb * 1024;
+#elif defined(__APPLE__)
+    mach_task_basic_info_data_t info{};
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, reinterpret_cast<task_info_t>(&info), &count) !=
+        KERN_SUCCESS) {
+        return 0;
+    }
+    return info.resident_size_max;
+#elif defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters{};
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return counters.PeakWorkingSetSize;
+#else
+    return 0;
+#endif
+}
+
+bool resetPeakResidentMemory() {
+#if defined(__linux__)
+    // "5" resets VmHWM to the current RSS
+    FILE *file = std::fopen("/proc/self/clear_refs", "w");
+    if (!file) {
+        return false;
+    }
+    const bool written = std::fputs("5", file) >= 0;
+    return std::fclose(file) == 0 && written;
+#else
+    return false;
+#endif
+}
+
+size_t availableMemoryBytes() {
+#if defined(__linux__)
+    FILE *file = std::fopen("/proc/meminfo", "r");
+    if (!file) {
+        return 0;
+    }
+    char line[128];
+    size_t availableKb = 0;
+    while (std::fgets(line, sizeof(line), file)) {
+        if (std::strncmp(line, "MemAvailable:", 13) == 0) {
+            std::sscanf(line + 13, "%zu", &availableKb);
+            break;
+        }
+    }
+    std::fclose(file);
+    return availableKb * 1024;
+#elif defined(__APPLE__)
+    vm_statistics64_data_t stats{};
+    mach_msg_type_number_t count = HOST_VM_INFO64_COUNT;
+    if (host_statistics64(mach_host_self(), HOST_VM_INFO64, reinterpret_cast<host_info64_t>(&stats), &count) !=
+        KERN_SUCCESS) {
+        return 0;
+    }
+    // Inactive and purgeable pages are reclaimed before the system starts compressing
+    return static_cast<size_t>(stats.free_count + stats.inactive_count + stats.purgeable_count) * vm_page_size;
+#elif defined(_WIN32)
+    MEMORYSTATUSEX status{};
+    status.dwLength = sizeof(status);
+    if (!GlobalMemoryStatusEx(&status)) {
+        return 0;
+    }
+    return static_cast<size_t>(status.ullAvailPhys);
+#else
+    return 0;
+#endif
+}
+
+std::vector<DeviceMemory> deviceMemory() {
+    std::vector<DeviceMemory> devices;
+    Backends::load();
+    for (size_t i = 0; i < ggml_backend_dev_count(); ++i) {
+        auto *device = ggml_backend_dev_get(i);
+        if (ggml_backend_dev_type(device) == GGML_BACKEND_DEVICE_TYPE_CPU) {
+            continue;
+        }
+        size_t free = 0;
+        size_t total = 0;
+        ggml_backend_dev_memory(device, &free, &total);
+        devices.push_back({ggml_backend_dev_name(device), ggml_backend_dev_description(device), free, total});
+    }
+    return devices;
+}
+
+size_t deviceMemoryUsedBytes() {
+    size_t used = 0;
+    for (const auto &device: deviceMemory()) {
+        used += device.totalBytes - device.freeBytes;
+    }
+    return used;
+}
@@ -0,0 +1,33 @@
+#ifndef KLLAMA_SYSTEM_MEMORY_H
+#define KLLAMA_SYSTEM_MEMORY_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+struct DeviceMemory {
+    std::string name;
+    std::string description;
+    size_t freeBytes;
+    size_t totalBytes;
+};
+
+// Resident set size of this process, 0 when the platform doesn't report it
+size_t residentMemoryBytes();
+
+// Highest resident set size of this process so far, 0 when the platform doesn't report it
+size_t peakResidentMemoryBytes();
+
+// Starts peakResidentMemoryBytes over from the current size. Only Linux supports it, false elsewhere.
+bool resetPeakResidentMemory();
+
+// Memory the system can hand out without swapping (MemAvailable on Linux), 0 when unknown
+size_t availableMemoryBytes();
+
+// Free and total memory of every non-CPU backend device
+std::vector<DeviceMemory> deviceMemory();
+
+// Bytes in use on all non-CPU backend devices, for measuring what an allocation took
+size_t deviceMemoryUsedBytes();
+
+#endif
@@ -0,0 +1,188 @@
+#include "Tracing.h"
+
+#if defined(KLLAMA_TRACING) && KLLAMA_TRACING
+
+#if defined(ANDROID)
+
+#include <android/trace.h>
+
+TraceSpan::TraceSpan(const char *name) : active(ATrace_isEnabled()) {
+    if (active) {
+        ATrace_beginSection(name);
+    }
+}
+
+TraceSpan::~TraceSpan() {
+    if (active) {
+        ATrace_endSection();
+    }
+}
+
+#elif defined(__APPLE__) && defined(__MACH__)
+
+static os_log_t traceLog() {
+    static const os_log_t log = os_log_create("io.actinis.kllama_cpp", OS_LOG_CATEGORY_POINTS_OF_INTEREST);
+    return log;
+}
+
+TraceSpan::TraceSpan(const char *name) {
+    // Signpost names have to be literals, the span name goes in the message instead
+    if (os_signpost_enabled(traceLog())) {
+        id = os_signpost_id_generate(traceLog());
+        os_signpost_interval_begin(traceLog(), id, "KLlama", "%{public}s", name);
+    }
+}
+
+TraceSpan::~TraceSpan() {
+    if (id != OS_SIGNPOST_ID_NULL) {
+        os_signpost_interval_end(traceLog(), id, "KLlama");
+    }
+}
+
+#else
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+    struct TraceEvent {
+        const char *name;
+        int64_t startUs;
+        int64_t durationUs;
+    };
+
+    // Each thread appends to its own buffer, the lock is only ever contended by stop()
+    struct ThreadEvents {
+        std::mutex mutex;
+        uint32_t threadId = 0;
+        bool exited = false; // Guarded by registryMutex
+        std::vector<TraceEvent> events;
+    };
+
+    std::atomic<bool> recording{false};
+    std::mutex registryMutex;
+    // Those of exited threads are kept while a trace records, until stop() has written their events
+    std::vector<std::unique_ptr<ThreadEvents> > threadBuffers;
+    uint32_t nextThreadId = 0;
+    std::string tracePath;
+    int64_t traceStartUs = 0;
+
+    // Must be called with registryMutex held
+    void removeExitedBuffers() {
+        std::erase_if(threadBuffers, [](const std::unique_ptr<ThreadEvents> &buffer) { return buffer->exited; });
+    }
+
+    // Registers the buffer of a thread and lets go of it when the thread exits
+    struct ThreadBuffer {
+        ThreadEvents *events;
+
+        ThreadBuffer() {
+            const std::lock_guard lock(registryMutex);
+            events = threadBuffers.emplace_back(std::make_unique<ThreadEvents>()).get();
+            events->threadId = ++nextThreadId;
+        }
+
+        ~ThreadBuffer() {
+            const std::lock_guard lock(registryMutex);
+            events->exited = true;
+            if (!recording.load()) {
+                removeExitedBuffers();
+            }
+        }
+    };
+
+    int64_t nowUs() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    ThreadEvents &threadEvents() {
+        thread_local ThreadBuffer buffer;
+        return *buffer.events;
+    }
+}
+
+TraceSpan::TraceSpan(const char *name) : name(name) {
+    if (recording.load(std::memory_order_relaxed)) {
+        startUs = nowUs();
+    }
+}
+
+TraceSpan::~TraceSpan() {
+    if (startUs < 0 || !recording.load(std::memory_order_relaxed)) {
+        return;
+    }
+    const auto endUs = nowUs();
+    auto &buffer = threadEvents();
+    const std::lock_guard lock(buffer.mutex);
+    buffer.events.push_back({name, startUs, endUs - startUs});
+}
+
+KLlamaResult<void> Tracing::start(const std::string &path) {
+    const std::lock_guard lock(registryMutex);
+    if (recording.load()) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "A trace is already recording");
+    }
+    for (const auto &buffer: threadBuffers) {
+        const std::lock_guard bufferLock(buffer->mutex);
+        buffer->events.clear();
+    }
+    tracePath = path;
+    traceStartUs = nowUs();
+    recording.store(true);
+    return {};
+}
+
+KLlamaResult<void> Tracing::stop() {
+    const std::lock_guard lock(registryMutex);
+    if (!recording.exchange(false)) {
+        return KLlamaResult<void>(KLlamaError::InvalidParameters, "No trace is recording");
+    }
+
+    std::ofstream file(tracePath, std::ios::trunc);
+    file << R"({"displayTimeUnit":"ms","traceEvents":[)";
+    bool first = true;
+    for (const auto &buffer: threadBuffers) {
+        const std::lock_guard bufferLock(buffer->mutex);
+        for (const auto &event: buffer->events) {
+            // Spans that began before start() have no place on the timeline
+            if (event.startUs < traceStartUs) {
+                continue;
+            }
+            file << (first ? "" : ",") << R"({"name":")" << event.name << R"(","ph":"X","pid":1,"tid":)"
+                    << buffer->threadId << R"(,"ts":)" << event.startUs - traceStartUs
+                    << R"(,"dur":)" << event.durationUs << "}";
+            first = false;
+        }
+        buffer->events.clear();
+    }
+    file << "]}\n";
+    removeExitedBuffers();
+
+    if (!file) {
+        return KLlamaResult<void>(KLlamaError::UnknownError, "Failed to write trace " + tracePath);
+    }
+    return {};
+}
+
+#endif
+
+#endif
+
+#if !defined(KLLAMA_TRACING) || !KLLAMA_TRACING || defined(ANDROID) || (defined(__APPLE__) && defined(__MACH__))
+
+KLlamaResult<void> Tracing::start(const std::string &) {
+    return KLlamaResult<void>(KLlamaError::InvalidParameters,
+                              "Trace files are only written by desktop builds with KLLAMA_TRACING");
+}
+
+KLlamaResult<void> Tracing::stop() {
+    return KLlamaResult<void>(KLlamaError::InvalidParameters,
+                              "Trace files are only written by desktop builds with KLLAMA_TRACING");
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef KLLAMA_TRACING_H
+#define KLLAMA_TRACING_H
+
+#include <cstdint>
+#include <string>
+
+#include "KLlama.h"
+
+// Scoped spans around the stages of the pipeline, compiled in with KLLAMA_TRACING. On Android they
+// go to ATrace, which Perfetto and systrace record, on Apple platforms to os_signpost, which
+// Instruments shows as points of interest, and elsewhere to a Chrome trace JSON file written
+// between Tracing::start and Tracing::stop. Without KLLAMA_TRACING, TRACE_SCOPE expands to nothing.
+//
+// Span names must be string literals, the file backend keeps them by pointer.
+
+#if defined(KLLAMA_TRACING) && KLLAMA_TRACING
+
+#if defined(__APPLE__) && defined(__MACH__)
+#include <os/signpost.h>
+#endif
+
+class TraceSpan {
+public:
+    explicit TraceSpan(const char *name);
+
+    ~TraceSpan();
+
+    TraceSpan(const TraceSpan &) = delete;
+
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+#if defined(ANDROID)
+    bool active = false;
+#elif defined(__APPLE__) && defined(__MACH__)
+    os_signpost_id_t id = OS_SIGNPOST_ID_NULL;
+#else
+    const char *name;
+    int64_t startUs = -1; // -1 when no trace was recording as the span began
+#endif
+};
+
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+#define TRACE_SCOPE(name) const TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name)
+
+#else
+
+#define TRACE_SCOPE(name) static_cast<void>(0)
+
+#endif
+
+class Tracing {
+public:
+    // Starts recording spans for the Chrome trace file at `path`. The system tracers on Android
+    // and Apple platforms record without it, so there it's an error, as in builds without tracing.
+    static KLlamaResult<void> start(const std::string &path);
+
+    // Writes what was recorded since start, to be opened in chrome://tracing or ui.perfetto.dev
+    static KLlamaResult<void> stop();
+};
+
+#endif
@@ -0,0 +1,43 @@
+#include "Utils.h"
+
+#include <algorithm>
+
+std::string tokenToString(const llama_vocab *vocab, const llama_token token) {
+    std::string piece;
+    tokenToPiece(vocab, token, piece);
+    return piece;
+}
+
+void tokenToPiece(const llama_vocab *vocab, const llama_token token, std::string &piece) {
+    // Most pieces are a few bytes, the capacity left from earlier tokens is usually enough
+    piece.resize(std::max<size_t>(piece.capacity(), 32));
+    auto n = llama_token_to_piece(vocab, token, piece.data(), static_cast<int32_t>(piece.size()), 0, true);
+    if (n < 0) {
+        piece.resize(static_cast<size_t>(-n));
+        n = llama_token_to_piece(vocab, token, piece.data(), static_cast<int32_t>(piece.size()), 0, true);
+    }
+    piece.resize(static_cast<size_t>(std::max(n, 0)));
+}
+
+uint64_t hashBytes(const uint8_t *data, const size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+size_t completeUtf8Length(const std::string &text) {
+    // Finds the lead byte of the last character, which is at most 4 bytes long
+    const auto end = text.size();
+    for (size_t back = 1; back <= std::min<size_t>(end, 4); ++back) {
+        const auto byte = static_cast<unsigned char>(text[end - back]);
+        if ((byte & 0xC0) == 0x80) {
+            continue;
+        }
+        const size_t length = byte < 0x80 ? 1 : (byte & 0xE0) == 0xC0 ? 2 : (byte & 0xF0) == 0xE0 ? 3 : 4;
+        return back >= length ? end : end - back;
+    }
+    return end;
+}
@@ -0,0 +1,20 @@
+#ifndef KLLAMA_UTILS_H
+#define KLLAMA_UTILS_H
+
+#include <cstdint>
+#include <string>
+
+#include "llama.h"
+
+std::string tokenToString(const llama_vocab *vocab, llama_token token);
+
+// Writes the piece of `token` into `piece`, reusing its capacity
+void tokenToPiece(const llama_vocab *vocab, llama_token token, std::string &piece);
+
+// FNV-1a, used to identify media content in the KV cache
+uint64_t hashBytes(const uint8_t *data, size_t size);
+
+// Length of the longest prefix of `text` that doesn't end in the middle of a UTF-8 character
+size_t completeUtf8Length(const std::string &text);
+
+#endif
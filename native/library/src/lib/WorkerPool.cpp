@@ -0,0 +1,67 @@
+#include "WorkerPool.h"
+
+#include <algorithm>
+
+WorkerPool::WorkerPool(const size_t threads) : threadCount(std::max<size_t>(threads, 1)) {
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+    for (auto &thread: threads) {
+        thread.join();
+    }
+}
+
+void WorkerPool::run(const size_t loopCount, const std::function<void(size_t)> &loopTask) {
+    if (loopCount == 0) {
+        return;
+    }
+
+    const std::lock_guard runLock(runMutex);
+    std::unique_lock lock(mutex);
+    // Only as many threads as the largest loop so far could use
+    while (threads.size() + 1 < std::min(threadCount, loopCount)) {
+        // Joins from the loop about to start
+        threads.emplace_back(&WorkerPool::work, this, generation);
+    }
+
+    task = &loopTask;
+    count = loopCount;
+    next = 0;
+    done = 0;
+    ++generation;
+    wakeUp.notify_all();
+
+    drain(lock);
+    finished.wait(lock, [this] { return done == count; });
+    task = nullptr;
+}
+
+void WorkerPool::work(size_t joined) {
+    std::unique_lock lock(mutex);
+    while (true) {
+        wakeUp.wait(lock, [&] { return stopping || generation != joined; });
+        if (stopping) {
+            return;
+        }
+        joined = generation;
+        drain(lock);
+    }
+}
+
+void WorkerPool::drain(std::unique_lock<std::mutex> &lock) {
+    while (next < count) {
+        const auto index = next++;
+        const auto *loopTask = task;
+        lock.unlock();
+        (*loopTask)(index);
+        lock.lock();
+        if (++done == count) {
+            finished.notify_all();
+        }
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef KLLAMA_WORKER_POOL_H
+#define KLLAMA_WORKER_POOL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads kept around for short parallel loops, started with the first loop that needs them.
+// One loop runs at a time, the calling thread takes part in it.
+class WorkerPool {
+public:
+    explicit WorkerPool(size_t threads);
+
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool &) = delete;
+
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    // Calls task(i) for every i < count across the pool and the calling thread, returns when all are done
+    void run(size_t count, const std::function<void(size_t)> &task);
+
+    [[nodiscard]] size_t size() const { return threadCount; }
+
+private:
+    // `joined` is the last loop the thread is not to take part in
+    void work(size_t joined);
+
+    // Takes loop indices until there are none left, with the lock held on entry and exit
+    void drain(std::unique_lock<std::mutex> &lock);
+
+    size_t threadCount; // Including the calling thread
+
+    std::mutex runMutex; // Loops take turns
+    std::mutex mutex;
+    std::condition_variable wakeUp;
+    std::condition_variable finished;
+    const std::function<void(size_t)> *task = nullptr;
+    size_t count = 0;
+    size_t next = 0;
+    size_t done = 0;
+    size_t generation = 0; // Counts loops, so that workers join each one once
+    bool stopping = false;
+    std::vector<std::thread> threads;
+};
+
+#endif
@@ -11,12 +11,15 @@
 #define LOG_LEVEL_WARN 2
 #define LOG_LEVEL_ERROR 3
 
-// Choose the minimum log level here
-// #if defined(IS_RELEASE_BUILD) && IS_RELEASE_BUILD
-// #define LOG_LEVEL_MIN LOG_LEVEL_INFO
-// #else
+// Levels below the minimum compile away, arguments included. The build can set it with the
+// LOGGING_LEVEL_MIN CMake cache variable, release builds default to INFO.
+#ifndef LOG_LEVEL_MIN
+#if defined(IS_RELEASE_BUILD) && IS_RELEASE_BUILD
+#define LOG_LEVEL_MIN LOG_LEVEL_INFO
+#else
 #define LOG_LEVEL_MIN LOG_LEVEL_DEBUG
-// #endif
+#endif
+#endif
 
 #if defined(ANDROID)
 #include <android/log.h>
@@ -32,9 +35,63 @@
 #include <vector>
 #endif
 
+// With LOG_ASYNC (the LOGGING_ASYNC CMake option), messages are formatted into a lock-free ring
+// buffer and written by a background thread, so the logging thread never waits on I/O. os_log
+// already defers the formatting and the writing, Apple platforms always log directly. Tags are
+// kept by pointer until the message is written, they have to be string literals.
+#if defined(LOG_ASYNC) && LOG_ASYNC && !(defined(__APPLE__) && defined(__MACH__))
+#define LOG_USE_ASYNC 1
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#endif
+
+#ifndef LOG_ASYNC_CAPACITY
+#define LOG_ASYNC_CAPACITY 1024 // Messages in flight, more are dropped and counted
+#endif
+#ifndef LOG_ASYNC_MESSAGE_SIZE
+#define LOG_ASYNC_MESSAGE_SIZE 512 // Longer messages are truncated
+#endif
+
+// Helper functions
+#ifdef ANDROID
+inline android_LogPriority android_log_priority(const int level) {
+    switch (level) {
+        case LOG_LEVEL_DEBUG: return ANDROID_LOG_DEBUG;
+        case LOG_LEVEL_INFO: return ANDROID_LOG_INFO;
+        case LOG_LEVEL_WARN: return ANDROID_LOG_WARN;
+        case LOG_LEVEL_ERROR: return ANDROID_LOG_ERROR;
+        default: return ANDROID_LOG_DEFAULT;
+    }
+}
+#elif defined(__APPLE__) && defined(__MACH__)
+inline os_log_type_t apple_log_type(const int level) {
+    switch (level) {
+        case LOG_LEVEL_DEBUG: return OS_LOG_TYPE_INFO; // Otherwise it won't log
+        case LOG_LEVEL_INFO: return OS_LOG_TYPE_INFO;
+        case LOG_LEVEL_WARN: return OS_LOG_TYPE_DEFAULT;
+        case LOG_LEVEL_ERROR: return OS_LOG_TYPE_ERROR;
+        default: return OS_LOG_TYPE_DEFAULT;
+    }
+}
+#else
+inline spdlog::level::level_enum spdlog_level(const int level) {
+    switch (level) {
+        case LOG_LEVEL_DEBUG: return spdlog::level::debug;
+        case LOG_LEVEL_INFO: return spdlog::level::info;
+        case LOG_LEVEL_WARN: return spdlog::level::warn;
+        case LOG_LEVEL_ERROR: return spdlog::level::err;
+        default: return spdlog::level::info;
+    }
+}
+#endif
+
 // Platform-specific initialization
 #if !defined(ANDROID) && !(defined(__APPLE__) && defined(__MACH__))
-namespace {
+namespace logging {
     class LoggerManager {
     public:
         static std::shared_ptr<spdlog::logger> &get_logger() {
@@ -70,59 +127,210 @@ namespace {
 }
 #endif
 
+namespace logging {
+    // Writes an already formatted message
+    inline void write_log(const int level, const char *tag, const char *message) {
+#if defined(ANDROID)
+        __android_log_write(android_log_priority(level), tag, message);
+#elif defined(__APPLE__) && defined(__MACH__)
+        os_log_with_type(OS_LOG_DEFAULT, apple_log_type(level), "[%{public}s] %{public}s", tag, message);
+#else
+        LoggerManager::get_logger()->log(spdlog_level(level), "[{}] {}", tag, message);
+#endif
+    }
+
+#if defined(LOG_USE_ASYNC)
+    // Bounded multi-producer queue after Dmitry Vyukov, drained by a single writer thread. A slot's
+    // sequence tells whose turn it is: producers claim a slot by moving enqueuePos past it, the writer
+    // hands it back a lap later. A full buffer drops the message instead of waiting.
+    class AsyncLog {
+    public:
+        static AsyncLog &instance() {
+            static AsyncLog log;
+            return log;
+        }
+
+        // Formats the message like printf, also when there are no arguments, as the synchronous loggers do
+        template<typename... Args>
+        void push(const int level, const char *tag, const char *fmt, Args... args) {
+            size_t pos;
+            auto *record = claim(pos);
+            if (!record) {
+                return;
+            }
+            record->level = level;
+            record->tag = tag;
+            snprintf(record->message, LOG_ASYNC_MESSAGE_SIZE, fmt, args...);
+            publish(*record, pos);
+        }
+
+        // Queues an already formatted message as it is
+        void write(const int level, const char *tag, const char *message) {
+            size_t pos;
+            auto *record = claim(pos);
+            if (!record) {
+                return;
+            }
+            record->level = level;
+            record->tag = tag;
+            std::strncpy(record->message, message, LOG_ASYNC_MESSAGE_SIZE - 1);
+            record->message[LOG_ASYNC_MESSAGE_SIZE - 1] = '\0';
+            publish(*record, pos);
+        }
+
+        AsyncLog(const AsyncLog &) = delete;
+
+        AsyncLog &operator=(const AsyncLog &) = delete;
+
+    private:
+        struct Record {
+            std::atomic<size_t> sequence;
+            int level;
+            const char *tag;
+            char message[LOG_ASYNC_MESSAGE_SIZE];
+        };
+
+        Record records[LOG_ASYNC_CAPACITY];
+        std::atomic<size_t> enqueuePos{0};
+        size_t dequeuePos = 0; // Only touched by the writer
+        std::atomic<size_t> dropped{0};
+        std::atomic<bool> writerWaiting{false};
+        std::atomic<uint32_t> wakeups{0};
+        std::atomic<bool> stopping{false};
+        std::thread writer;
+
+        // The slot for the next message, null when the buffer is full
+        Record *claim(size_t &pos) {
+            pos = enqueuePos.load(std::memory_order_relaxed);
+            for (;;) {
+                auto *record = &records[pos % LOG_ASYNC_CAPACITY];
+                const auto sequence = record->sequence.load(std::memory_order_acquire);
+                const auto lag = static_cast<std::ptrdiff_t>(sequence - pos);
+                if (lag == 0) {
+                    if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        return record;
+                    }
+                } else if (lag < 0) {
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                    return nullptr;
+                } else {
+                    pos = enqueuePos.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // Hands a filled slot to the writer
+        void publish(Record &record, const size_t pos) {
+            record.sequence.store(pos + 1, std::memory_order_release);
+
+            // Pairs with the writer announcing that it is about to sleep
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (writerWaiting.load(std::memory_order_relaxed)) {
+                wakeups.fetch_add(1, std::memory_order_relaxed);
+                wakeups.notify_one();
+            }
+        }
+
+        AsyncLog() {
+            for (size_t i = 0; i < LOG_ASYNC_CAPACITY; ++i) {
+                records[i].sequence.store(i, std::memory_order_relaxed);
+            }
+#if !defined(ANDROID)
+            // Constructed first, so that it outlives the final drain at exit
+            LoggerManager::get_logger();
+#endif
+            writer = std::thread([this] { run(); });
+        }
+
+        ~AsyncLog() {
+            stopping.store(true);
+            wakeups.fetch_add(1);
+            wakeups.notify_one();
+            writer.join();
+        }
+
+        bool drain() {
+            bool wrote = false;
+            for (;;) {
+                auto &record = records[dequeuePos % LOG_ASYNC_CAPACITY];
+                if (record.sequence.load(std::memory_order_acquire) != dequeuePos + 1) {
+                    break;
+                }
+                write_log(record.level, record.tag, record.message);
+                record.sequence.store(dequeuePos + LOG_ASYNC_CAPACITY, std::memory_order_release);
+                ++dequeuePos;
+                wrote = true;
+            }
+            if (const auto lost = dropped.exchange(0, std::memory_order_relaxed)) {
+                char message[64];
+                snprintf(message, sizeof(message), "%zu log messages dropped, the buffer was full", lost);
+                write_log(LOG_LEVEL_WARN, "ActinisLogging", message);
+            }
+            return wrote;
+        }
+
+        void run() {
+            for (;;) {
+                const auto wrote = drain();
+                if (stopping.load()) {
+                    drain();
+                    return;
+                }
+                if (wrote) {
+                    continue;
+                }
+
+                const auto seen = wakeups.load();
+                writerWaiting.store(true);
+                const auto claimed = enqueuePos.load();
+                if (claimed == dequeuePos && !stopping.load()) {
+                    wakeups.wait(seen);
+                } else if (claimed != dequeuePos) {
+                    std::this_thread::yield(); // Claimed but not written yet
+                }
+                writerWaiting.store(false);
+            }
+        }
+    };
+#endif
+}
+
 // Main logging macro
 #define LOG_PRINT(level, tag, fmt, ...) \
     do { \
-        if (level >= LOG_LEVEL_MIN) { \
+        if constexpr (level >= LOG_LEVEL_MIN) { \
             _LOG_PRINT_IMPL(level, tag, fmt, ##__VA_ARGS__); \
         } \
     } while(0)
 
+// Writes a message formatted elsewhere, at a level only known at runtime
+#define LOG_WRITE(level, tag, message) \
+    do { \
+        if ((level) >= LOG_LEVEL_MIN) { \
+            _LOG_WRITE_IMPL(level, tag, message); \
+        } \
+    } while(0)
+
 // Platform-specific implementation
-#if defined(ANDROID)
+#if defined(LOG_USE_ASYNC)
+#define _LOG_PRINT_IMPL(level, tag, fmt, ...) \
+        logging::AsyncLog::instance().push(level, tag, fmt, ##__VA_ARGS__)
+#define _LOG_WRITE_IMPL(level, tag, message) \
+        logging::AsyncLog::instance().write(level, tag, message)
+#elif defined(ANDROID)
 #define _LOG_PRINT_IMPL(level, tag, fmt, ...) \
         __android_log_print(android_log_priority(level), tag, fmt, ##__VA_ARGS__)
 #elif defined(__APPLE__) && defined(__MACH__)
-inline os_log_type_t apple_log_type(const int level) {
-    switch (level) {
-        case LOG_LEVEL_DEBUG: return OS_LOG_TYPE_INFO; // Otherwise it won't log
-        case LOG_LEVEL_INFO: return OS_LOG_TYPE_INFO;
-        case LOG_LEVEL_WARN: return OS_LOG_TYPE_DEFAULT;
-        case LOG_LEVEL_ERROR: return OS_LOG_TYPE_ERROR;
-        default: return OS_LOG_TYPE_DEFAULT;
-    }
-}
-
 #define _LOG_PRINT_IMPL(level, tag, fmt, ...) \
 os_log_with_type(OS_LOG_DEFAULT, apple_log_type(level), "[%s] " fmt, tag, ##__VA_ARGS__)
 #else
 #define _LOG_PRINT_IMPL(level, tag, fmt, ...) \
-        LoggerManager::get_logger()->log(spdlog_level(level), "[{}] {}", tag, format_log_message(fmt, ##__VA_ARGS__))
+        logging::LoggerManager::get_logger()->log(spdlog_level(level), "[{}] {}", tag, \
+                                                  logging::format_log_message(fmt, ##__VA_ARGS__))
 #endif
 
-// Helper functions
-#ifdef ANDROID
-inline android_LogPriority android_log_priority(const int level) {
-    switch (level) {
-        case LOG_LEVEL_DEBUG: return ANDROID_LOG_DEBUG;
-        case LOG_LEVEL_INFO: return ANDROID_LOG_INFO;
-        case LOG_LEVEL_WARN: return ANDROID_LOG_WARN;
-        case LOG_LEVEL_ERROR: return ANDROID_LOG_ERROR;
-        default: return ANDROID_LOG_DEFAULT;
-    }
-}
-#elif defined(__APPLE__) && defined(__MACH__)
-
-#else
-inline spdlog::level::level_enum spdlog_level(const int level) {
-    switch (level) {
-        case LOG_LEVEL_DEBUG: return spdlog::level::debug;
-        case LOG_LEVEL_INFO: return spdlog::level::info;
-        case LOG_LEVEL_WARN: return spdlog::level::warn;
-        case LOG_LEVEL_ERROR: return spdlog::level::err;
-        default: return spdlog::level::info;
-    }
-}
+#if !defined(LOG_USE_ASYNC)
+#define _LOG_WRITE_IMPL(level, tag, message) logging::write_log(level, tag, message)
 #endif
 
 // Convenience macros for different log levels